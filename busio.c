@@ -13,8 +13,10 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
-#include <sys/mman.h>
+#include <time.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static int verbosity = 0;
 
@@ -44,126 +46,120 @@ uint32_t parse_value(const char *s)
 // Bus access
 //
 
-static uint32_t pagenum;
+/**
+ * Access devices through their UIO nodes (-u)
+ * instead of /dev/mem.
+ */
+static int use_uio = 0;
 
-static
-uint32_t get_alignment(uint32_t base)
-{
-	return base % getpagesize();
-}
+/**
+ * Device to be accessed. The base and high come either from the
+ * device-tree or the base is given directly (high is 0 then).
+ * Only a window around the accessed range is mapped, it is moved
+ * by bus_map() on demand (a bus or memory node can span gigabytes).
+ * With UIO, the first region of the device is mapped instead.
+ * Accesses go to bus_off() of the map.
+ */
+struct bus_dev {
+	const char *name;
+	dtree_addr_t base;
+	dtree_addr_t high;
+	uint32_t win; // offset of the window from the base
+	struct dtree_map_t *map;
+	dtree_uio_t *uio;
+};
 
-void *bus_devmem_access(uint32_t base, uint32_t mlen, int *fd)
+/**
+ * Offset of the device relative to the mapped window.
+ */
+static inline
+uint32_t bus_off(const struct bus_dev *bd, uint32_t off)
 {
-	*fd = open("/dev/mem", O_RDWR);
-	if(*fd == -1) {
-		perror("open(/dev/mem)");
-		return NULL;
-	}
-
-	uint32_t aligned_base = base - get_alignment(base);
-
-	// Get number of pages for mmap
-	pagenum = mlen / getpagesize();
-	pagenum += (mlen % getpagesize() == 0) ? 0: 1;
-    
-	void *m = mmap(NULL, pagenum * getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, aligned_base);
-	if(m == NULL) {
-		perror("mmap(NULL, pagenum * getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, aligned_base)");
-		close(*fd);
-		return NULL;
-	}
-
-	return m;
+	return off - bd->win;
 }
 
-void bus_devmem_forget(void *m, int fd)
+static
+void bus_release(struct bus_dev *bd)
 {
-	munmap(m, pagenum * getpagesize());
-	close(fd);
+	dtree_map_free(bd->map);
+	bd->map = NULL;
+
+	dtree_uio_close(bd->uio);
+	bd->uio = NULL;
 }
 
 static
-uint32_t bus_devmem_offset(uint32_t base, uint32_t off)
+int bus_map(struct bus_dev *bd, uint32_t off, size_t len)
 {
-	return off + get_alignment(base);
-}
+	if(bd->high > bd->base && off + len - 1 > bd->high - bd->base) {
+		verbosity_printf(1, "Address is out of range of the device: 0x%08X (high: 0x%08X)", bd->base + off, bd->high);
+		return 2;
+	}
 
-static int memfd;
+	if(bd->uio != NULL && off + len > bd->map->len) {
+		verbosity_printf(1, "Address is out of the UIO region: 0x%08X (size: 0x%zX)", bd->base + off, bd->map->len);
+		return 2;
+	}
 
-void *bus_access(uint32_t base, uint32_t mlen)
-{
-	return bus_devmem_access(base, mlen, &memfd);
-}
+	if(bd->uio == NULL && (bd->map == NULL || off < bd->win
+	|| (size_t) off + len > bd->win + bd->map->len)) {
+		const size_t page = getpagesize();
+		const uint32_t win = off / page * page;
 
-void bus_forget(void *mapping)
-{
-	bus_devmem_forget(mapping, memfd);
-}
+		dtree_map_free(bd->map);
+		bd->win = win;
+		bd->map = dtree_addr_map(bd->base + win, ((size_t) off + len - win + page - 1) / page * page);
+	}
 
-void bus_write(uint32_t base, uint32_t off, uint32_t value, int len)
-{
-	void *m = bus_access(base, off + len);
-	if(m == NULL)
-		return;
+	if(bd->map == NULL) {
+		fprintf(stderr, "Can not map 0x%08X: %s\n", bd->base + bd->win, dtree_errstr());
+		return 1;
+	}
 
-	uint8_t *cdata = (uint8_t *) m;
-	uint8_t *wdata  = cdata + bus_devmem_offset(base, off);
+	return 0;
+}
 
+void bus_write(struct bus_dev *bd, uint32_t off, uint32_t value, int len)
+{
 	switch(len) {
 	case 1:
-		verbosity_printf(2, "Writing at 0x%08X value 0x%02X (1)", base + off, value & 0x000000FF);
-		*(uint8_t *)  wdata = (uint8_t)  (value & 0x000000FF);
+		verbosity_printf(2, "Writing at 0x%08X value 0x%02X (1)", bd->base + off, value & 0x000000FF);
+		dtree_map_write8(bd->map, bus_off(bd, off), (uint8_t) (value & 0x000000FF));
 		break;
-		
+
 	case 2:
-		verbosity_printf(2, "Writing at 0x%08X value 0x%04X (2)", base + off, value & 0x0000FFFF);
-		*(uint16_t *) wdata = (uint16_t) (value & 0x0000FFFF);
+		verbosity_printf(2, "Writing at 0x%08X value 0x%04X (2)", bd->base + off, value & 0x0000FFFF);
+		dtree_map_write16(bd->map, bus_off(bd, off), (uint16_t) (value & 0x0000FFFF));
 		break;
 
 	case 4:
-		verbosity_printf(2, "Writing at 0x%08X value 0x%08X (4)", base + off, value & 0xFFFFFFFF);
-		*(uint32_t *) wdata = (uint32_t) (value & 0xFFFFFFFF);
+		verbosity_printf(2, "Writing at 0x%08X value 0x%08X (4)", bd->base + off, value);
+		dtree_map_write32(bd->map, bus_off(bd, off), value);
 		break;
 
 	default:
 		verbosity_printf(1, "BUG? Invalid data length passed to bus_write(): %d", len);
 		abort();
 	}
-
-	bus_forget(m);
 }
 
-uint32_t bus_read(uint32_t base, uint32_t off, int len)
+uint32_t bus_read(struct bus_dev *bd, uint32_t off, int len)
 {
-	void *m = bus_access(base, off + 4);
-	if(m == NULL)
-		return 0xFFFFFFFE;
-
-	verbosity_printf(2, "Reading from address '0x%08X'", base + off);
-
-	uint8_t  *cdata = (uint8_t  *) m;
-	uint32_t *rdata = (uint32_t *) (cdata + bus_devmem_offset(base, off));
-	uint32_t value  = *rdata;
+	uint32_t value;
 
-	verbosity_printf(2, "Raw value: 0x%08X", value);
-
-	if(value == 0xFFFFFFFE)
-		verbosity_printf(1, "WARN: Possible error when accessing the bus");
+	verbosity_printf(2, "Reading from address '0x%08X'", bd->base + off);
 
 	switch(len) {
 	case 1:
-		value &= 0x000000FF;
-		verbosity_printf(2, "Masking out %d bytes: 0x%08X", 4 - len, value);
+		value = dtree_map_read8(bd->map, bus_off(bd, off));
 		break;
 
 	case 2:
-		value &= 0x0000FFFF;
-		verbosity_printf(2, "Masking out %d bytes: 0x%08X", 4 - len, value);
+		value = dtree_map_read16(bd->map, bus_off(bd, off));
 		break;
 
 	case 4:
-		value &= 0xFFFFFFFF;
-		verbosity_printf(2, "Masking out %d bytes: 0x%08X", 4 - len, value);
+		value = dtree_map_read32(bd->map, bus_off(bd, off));
 		break;
 
 	default:
@@ -171,10 +167,90 @@ uint32_t bus_read(uint32_t base, uint32_t off, int len)
 		abort();
 	}
 
-	bus_forget(m);
+	verbosity_printf(2, "Raw value: 0x%08X (%d)", value, len);
+
+	if(len == 4 && value == 0xFFFFFFFE)
+		verbosity_printf(1, "WARN: Possible error when accessing the bus");
+
 	return value;
 }
 
+/**
+ * Milliseconds elapsed since the start.
+ */
+static
+double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Default timeout of a wait in milliseconds.
+ */
+#define BUS_WAIT_TIMEOUT 1000
+
+/**
+ * Reads of a wait before it starts to sleep.
+ */
+#define BUS_WAIT_SPINS 10000
+
+/**
+ * Longest sleep between reads of a wait in microseconds (-B).
+ */
+static unsigned long wait_backoff = 50;
+
+/**
+ * Waits until (value & mask) == data at the offset. The result
+ * is reported at the verbosity level.
+ */
+int bus_wait(struct bus_dev *bd, uint32_t off, int len, uint32_t mask, uint32_t value,
+		unsigned long timeout_ms, int level)
+{
+	struct dtree_wait_t w = {
+		.timeout_us = timeout_ms * 1000,
+		.spins      = BUS_WAIT_SPINS,
+		.backoff_us = wait_backoff,
+	};
+
+	verbosity_printf(2, "Waiting at 0x%08X for 0x%08X (mask 0x%08X)", bd->base + off, value, mask);
+
+	const int timedout = dtree_map_wait(bd->map, bus_off(bd, off), len, mask, value, &w);
+
+	verbosity_printf(level, "%s at 0x%08X after %lu reads in %.3f us (last 0x%08X)",
+			timedout? "Timed out" : "Matched", bd->base + off,
+			w.iterations, w.waited_ns / 1e3, w.last);
+	return timedout;
+}
+
+/**
+ * Waits for an interrupt of the device (UIO only).
+ */
+int bus_wait_irq(struct bus_dev *bd, int timeout_ms, int level)
+{
+	struct timespec start;
+	uint32_t events = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const int rc = dtree_uio_wait(bd->uio, timeout_ms, &events);
+
+	if(rc < 0) {
+		perror("dtree_uio_wait");
+		return 1;
+	}
+
+	const double us = elapsed_ms(&start) * 1e3;
+
+	if(rc)
+		verbosity_printf(level, "Timed out waiting for an interrupt of '%s' in %.3f us", bd->name, us);
+	else
+		verbosity_printf(level, "Interrupt of '%s' after %.3f us (%u events)", bd->name, us, events);
+
+	return rc;
+}
+
 void bus_list(void)
 {
 	struct dtree_dev_t *dev;
@@ -209,6 +285,26 @@ int perform_list(void)
 	return 0;
 }
 
+int perform_find(dtree_addr_t addr)
+{
+	verbosity_printf(1, "Action: find, address: '0x%08X'", addr);
+
+	struct dtree_dev_t *dev = dtree_byaddr(addr);
+	if(dev == NULL) {
+		if(dtree_iserror())
+			fprintf(stderr, "Error: %s\n", dtree_errstr());
+		else
+			fprintf(stderr, "No device found at address 0x%08X\n", addr);
+		return 1;
+	}
+
+	printf("%s at 0x%X..0x%X offset 0x%X\n", dtree_dev_name(dev),
+			dtree_dev_base(dev), dtree_dev_high(dev), addr - dtree_dev_base(dev));
+
+	dtree_dev_free(dev);
+	return 0;
+}
+
 static
 int dev_as_baseaddr(const char *dev, dtree_addr_t *base)
 {
@@ -224,57 +320,159 @@ int dev_as_baseaddr(const char *dev, dtree_addr_t *base)
 	return 0;
 }
 
+/**
+ * The device is given by a name or by a full path
+ * (when it contains '/').
+ */
 static
-int dev_to_base(const char *dev, dtree_addr_t *base, dtree_addr_t addr, int len)
+struct dtree_dev_t *dev_lookup(const char *dev)
 {
-	struct dtree_dev_t *d = dtree_byname(dev);
+	if(strchr(dev, '/') != NULL)
+		return dtree_bypath(dev);
+
+	// a script looks up more devices in any order
+	if(dtree_reset())
+		return NULL;
+
+	return dtree_byname(dev);
+}
+
+/**
+ * Opens the UIO node of the device and maps its first
+ * region. The device is free'd.
+ */
+static
+int bus_resolve_uio(struct dtree_dev_t *d, struct bus_dev *bd)
+{
+	bd->uio = dtree_uio_open(d);
+	dtree_dev_free(d);
+
+	if(bd->uio == NULL) {
+		fprintf(stderr, "No UIO device of '%s': %s\n", bd->name, dtree_errstr());
+		return 1;
+	}
+
+	bd->map = dtree_uio_map(bd->uio, 0);
+	if(bd->map == NULL) {
+		perror("dtree_uio_map");
+		bus_release(bd);
+		return 1;
+	}
+
+	verbosity_printf(1, "Accessing '%s' through UIO (fd %d)", bd->name, dtree_uio_fd(bd->uio));
+	return 0;
+}
+
+static
+int bus_resolve(const char *dev, struct bus_dev *bd)
+{
+	bd->name = dev;
+	bd->base = 0;
+	bd->high = 0;
+	bd->win  = 0;
+	bd->map  = NULL;
+	bd->uio  = NULL;
+
+	struct dtree_dev_t *d = dev_lookup(dev);
 	if(d == NULL) {
-		if(dev_as_baseaddr(dev, base)) {
+		if(dtree_iserror()) {
+			fprintf(stderr, "Error: %s\n", dtree_errstr());
+			return 1;
+		}
+
+		if(use_uio) {
+			fprintf(stderr, "No device '%s' found (UIO needs a device of the device-tree)\n", dev);
+			return 1;
+		}
+
+		if(dev_as_baseaddr(dev, &bd->base)) {
 			fprintf(stderr, "No device '%s' found\n", dev);
 			fprintf(stderr, "Nor the device '%s' represents a base address\n", dev);
 			return 1;
 		}
 
-		verbosity_printf(1, "Accessing base address 0x%08X", *base);
+		verbosity_printf(1, "Accessing base address 0x%08X", bd->base);
 		return 0;
 	}
 
-	*base = dtree_dev_base(d);
-	dtree_addr_t high = dtree_dev_high(d);
+	bd->base = dtree_dev_base(d);
+	bd->high = dtree_dev_high(d);
 
-	if(*base < high) {
-		if(*base + addr + len > high) {
-			verbosity_printf(1, "Address is out of range of the device: 0x%08X (high: 0x%08X)", *base + addr, high);
-			return 2;
-		}
-	}
+	if(use_uio)
+		return bus_resolve_uio(d, bd);
 
 	dtree_dev_free(d);
+
 	return 0;
 }
 
 int perform_read(const char *dev, uint32_t addr, int len)
 {
-	dtree_addr_t base;
-	if(dev_to_base(dev, &base, addr, len))
+	struct bus_dev bd;
+	if(bus_resolve(dev, &bd))
 		return 1;
 
+	if(bus_map(&bd, addr, len)) {
+		bus_release(&bd);
+		return 1;
+	}
+
 	verbosity_printf(1, "Action: read, device: '%s', offset: '0x%08X', len: '%d'", dev, addr, len);
 
-	uint32_t value = bus_read(base, addr, len);
+	uint32_t value = bus_read(&bd, addr, len);
 	printf("0x%08X\n", value);
+
+	bus_release(&bd);
 	return 0;
 }
 
+int perform_wait(const char *dev, uint32_t addr, int len, uint32_t mask, uint32_t value,
+		unsigned long timeout_ms)
+{
+	struct bus_dev bd;
+	if(bus_resolve(dev, &bd))
+		return 1;
+
+	if(bus_map(&bd, addr, len)) {
+		bus_release(&bd);
+		return 1;
+	}
+
+	verbosity_printf(1, "Action: wait, device: '%s', offset: '0x%08X', mask: '0x%08X', data: '0x%08X', len: '%d'", dev, addr, mask, value, len);
+
+	const int err = bus_wait(&bd, addr, len, mask, value, timeout_ms, 0);
+	bus_release(&bd);
+	return err;
+}
+
+int perform_wait_irq(const char *dev, int timeout_ms)
+{
+	struct bus_dev bd;
+	if(bus_resolve(dev, &bd))
+		return 1;
+
+	verbosity_printf(1, "Action: interrupt, device: '%s', timeout: '%d'", dev, timeout_ms);
+
+	const int err = bus_wait_irq(&bd, timeout_ms, 0);
+	bus_release(&bd);
+	return err;
+}
+
 int perform_write(const char *dev, uint32_t addr, uint32_t len, uint32_t value)
 {
-	dtree_addr_t base;
-	if(dev_to_base(dev, &base, addr, len))
+	struct bus_dev bd;
+	if(bus_resolve(dev, &bd))
 		return 1;
 
+	if(bus_map(&bd, addr, len)) {
+		bus_release(&bd);
+		return 1;
+	}
+
 	verbosity_printf(1, "Action: write, device: '%s', offset: '0x%08X', data: '0x%08X', len: '%d'", dev, addr, value, len);
 
-	bus_write(base, addr, value, len);
+	bus_write(&bd, addr, value, len);
+	bus_release(&bd);
 	return 0;
 }
 
@@ -294,42 +492,377 @@ int perform_file_write(const char *dev, uint32_t addr, uint32_t len, FILE *f)
 {
 	char s_value [S_BUFFSIZE];
 	uint32_t value;
+	int err = 0;
 
 	assert(f != NULL);
 
-	dtree_addr_t base;
-	if(dev_to_base(dev, &base, addr, len))
+	struct bus_dev bd;
+	if(bus_resolve(dev, &bd)) {
+		fclose(f);
 		return 1;
+	}
 
 	while (fgets(s_value, S_BUFFSIZE, f) != NULL) {
 		size_t s_len = strlen(s_value);
 
-		if (s_value[s_len - 1] == '\n') {
+		if (s_len > 0 && s_value[s_len - 1] == '\n') {
 			s_value[s_len - 1] = '\0';
+			s_len -= 1;
 		}
 
 		value = parse_hex(s_value, s_len);
 
+		if(bus_map(&bd, addr, len)) {
+			err = 1;
+			break;
+		}
+
 		verbosity_printf(1, "Action: write, device: '%s', offset: '0x%08X', data: '0x%08X', len: '%d'", dev, addr, value, len);
 
-		bus_write(base, addr, value, len);
+		bus_write(&bd, addr, value, len);
 		addr += len;
 	}
 
+	bus_release(&bd);
 	fclose(f);
+	return err;
+}
+
+static
+void report_throughput(const char *act, size_t bytes, double ms)
+{
+	const double mibs = ms > 0? bytes / (ms / 1e3) / (1024 * 1024) : 0;
+	fprintf(stderr, "%s %zu bytes in %.3f ms (%.2f MiB/s)\n", act, bytes, ms, mibs);
+}
+
+/**
+ * Copies the file (its first size bytes when size is not 0) into
+ * the device at addr. In the fifo mode, all accesses go to the
+ * register at addr and are len bytes wide, otherwise the addresses
+ * increment and the widest aligned accesses are used.
+ */
+int perform_block_write(const char *dev, uint32_t addr, int len, const char *path,
+		size_t size, int fifo)
+{
+	struct bus_dev bd;
+	struct stat st;
+	void *data = MAP_FAILED;
+	int err = 1;
+
+	const int fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		goto clean_and_exit;
+	}
+
+	if(size == 0 || size > (size_t) st.st_size)
+		size = st.st_size;
+
+	if(size == 0) {
+		fprintf(stderr, "Nothing to write from '%s'\n", path);
+		goto clean_and_exit;
+	}
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED) {
+		perror("mmap");
+		goto clean_and_exit;
+	}
+
+	if(bus_resolve(dev, &bd))
+		goto clean_and_exit;
+
+	if(bus_map(&bd, addr, fifo? (size_t) len : size) == 0) {
+		verbosity_printf(1, "Action: block write, device: '%s', offset: '0x%08X', file: '%s', size: '%zu'%s",
+				dev, addr, path, size, fifo? " (fifo)" : "");
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		const size_t done = fifo? dtree_map_write_fifo(bd.map, bus_off(&bd, addr), data, size, len)
+		                        : dtree_map_write_block(bd.map, bus_off(&bd, addr), data, size);
+
+		report_throughput("Written", done, elapsed_ms(&start));
+		err = 0;
+	}
+
+	bus_release(&bd);
+
+clean_and_exit:
+	if(data != MAP_FAILED)
+		munmap(data, size);
+	if(fd >= 0)
+		close(fd);
+
+	return err;
+}
+
+/**
+ * Copies size bytes from the device at addr into the file
+ * (see perform_block_write()). The file is truncated.
+ */
+int perform_block_read(const char *dev, uint32_t addr, int len, const char *path,
+		size_t size, int fifo)
+{
+	struct bus_dev bd;
+	void *data = MAP_FAILED;
+	int fd = -1;
+	int err = 1;
+
+	// the file is not touched unless the device is accessible
+	if(bus_resolve(dev, &bd))
+		return 1;
+
+	if(bus_map(&bd, addr, fifo? (size_t) len : size))
+		goto clean_and_exit;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		perror(path);
+		goto clean_and_exit;
+	}
+
+	if(ftruncate(fd, size)) {
+		perror("ftruncate");
+		goto clean_and_exit;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(data == MAP_FAILED) {
+		perror("mmap");
+		goto clean_and_exit;
+	}
+
+	verbosity_printf(1, "Action: block read, device: '%s', offset: '0x%08X', file: '%s', size: '%zu'%s",
+			dev, addr, path, size, fifo? " (fifo)" : "");
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	const size_t done = fifo? dtree_map_read_fifo(bd.map, bus_off(&bd, addr), data, size, len)
+	                        : dtree_map_read_block(bd.map, bus_off(&bd, addr), data, size);
+
+	report_throughput("Read", done, elapsed_ms(&start));
+	err = ftruncate(fd, done) != 0;
+
+clean_and_exit:
+	if(data != MAP_FAILED)
+		munmap(data, size);
+	if(fd >= 0)
+		close(fd);
+
+	bus_release(&bd);
+	return err;
+}
+
+//
+// Script
+//
+
+/**
+ * Devices of a script, each one is resolved and mapped
+ * by its first use and kept until the script ends.
+ */
+struct bus_cache {
+	struct bus_dev *devs;
+	size_t count;
+};
+
+static
+struct bus_dev *bus_cache_get(struct bus_cache *c, const char *dev)
+{
+	for(size_t i = 0; i < c->count; ++i) {
+		if(!strcmp(c->devs[i].name, dev))
+			return &c->devs[i];
+	}
+
+	struct bus_dev *devs = realloc(c->devs, (c->count + 1) * sizeof(*devs));
+	if(devs == NULL) {
+		perror("realloc");
+		return NULL;
+	}
+
+	c->devs = devs;
+
+	char *name = strdup(dev);
+	if(name == NULL) {
+		perror("strdup");
+		return NULL;
+	}
+
+	if(bus_resolve(name, &devs[c->count])) {
+		free(name);
+		return NULL;
+	}
+
+	return &devs[c->count++];
+}
+
+static
+void bus_cache_free(struct bus_cache *c)
+{
+	for(size_t i = 0; i < c->count; ++i) {
+		bus_release(&c->devs[i]);
+		free((char *) c->devs[i].name);
+	}
+
+	free(c->devs);
+}
+
+/**
+ * Maximal number of words of a script line.
+ */
+#define SCRIPT_WORDS 7
+
+static
+int script_error(const char *path, size_t lineno, const char *msg)
+{
+	fflush(stdout);
+	fprintf(stderr, "%s:%zu: %s\n", path, lineno, msg);
+	return 1;
+}
+
+/**
+ * Performs one line of a script. The words are:
+ *
+ *   r[1|2|4] <dev> <addr>
+ *   w[1|2|4] <dev> <addr> <data>
+ *   p[1|2|4] <dev> <addr> <mask> <data> [<timeout>]
+ *   i <dev> [<timeout>]
+ *
+ * The width defaults to len, the timeout of a poll or of an
+ * interrupt (UIO only) is given in (decimal) milliseconds.
+ */
+static
+int script_line(struct bus_cache *c, char **word, size_t n, int len,
+		const char *path, size_t lineno)
+{
+	const char op = word[0][0];
+
+	if(word[0][1] != '\0') {
+		if(word[0][2] != '\0' || !strchr("124", word[0][1]))
+			return script_error(path, lineno, "Invalid width of the operation");
+
+		len = word[0][1] - '0';
+	}
+
+	if((op == 'r' && n != 3) || (op == 'w' && n != 4)
+	|| (op == 'p' && n != 5 && n != 6) || (op == 'i' && n != 2 && n != 3))
+		return script_error(path, lineno, "Invalid number of arguments");
+	if(op != 'r' && op != 'w' && op != 'p' && op != 'i')
+		return script_error(path, lineno, "Unknown operation");
+
+	struct bus_dev *bd = bus_cache_get(c, word[1]);
+	if(bd == NULL)
+		return script_error(path, lineno, "Can not access the device");
+
+	if(op == 'i') {
+		if(bd->uio == NULL)
+			return script_error(path, lineno, "Interrupts need UIO (-u)");
+
+		const int timeout = n == 3? (int) strtol(word[2], NULL, 10) : -1;
+		if(bus_wait_irq(bd, timeout, 1))
+			return script_error(path, lineno, "Interrupt has not come");
+
+		return 0;
+	}
+
+	const uint32_t addr = parse_addr(word[2]);
+	if(bus_map(bd, addr, len))
+		return script_error(path, lineno, "Can not access the address");
+
+	switch(op) {
+	case 'r':
+		printf("0x%08X\n", bus_read(bd, addr, len));
+		break;
+
+	case 'w':
+		bus_write(bd, addr, parse_value(word[3]), len);
+		break;
+
+	case 'p': {
+		const unsigned long timeout = n == 6? strtoul(word[5], NULL, 10) : BUS_WAIT_TIMEOUT;
+
+		if(bus_wait(bd, addr, len, parse_value(word[3]), parse_value(word[4]), timeout, 1))
+			return script_error(path, lineno, "Poll has timed out");
+		break;
+	}
+	}
+
 	return 0;
 }
 
+/**
+ * Performs operations of the script (stdin when path is "-"),
+ * one per line. Empty lines and lines starting by '#' are
+ * skipped. Stops on the first failed operation.
+ */
+int perform_script(const char *path, int len)
+{
+	static char obuf[64 * 1024];
+	struct bus_cache cache = {NULL, 0};
+	char *line = NULL;
+	size_t linecap = 0;
+	size_t lineno = 0;
+	int err = 0;
+
+	verbosity_printf(1, "Action: script, path: '%s'", path);
+
+	FILE *f = strcmp(path, "-")? fopen(path, "r") : stdin;
+	if(f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	// results are written at once
+	setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+	while(getline(&line, &linecap, f) != -1) {
+		char *word[SCRIPT_WORDS];
+		char *save = NULL;
+		size_t n = 0;
+
+		lineno += 1;
+
+		for(char *w = strtok_r(line, " \t\r\n", &save); w != NULL;
+				w = strtok_r(NULL, " \t\r\n", &save)) {
+			if(n == SCRIPT_WORDS)
+				break;
+			word[n++] = w;
+		}
+
+		if(n == 0 || word[0][0] == '#')
+			continue;
+
+		if(n == SCRIPT_WORDS) {
+			err = script_error(path, lineno, "Too many arguments");
+			break;
+		}
+
+		if((err = script_line(&cache, word, n, len, path, lineno)))
+			break;
+	}
+
+	fflush(stdout);
+
+	free(line);
+	bus_cache_free(&cache);
+	if(f != stdin)
+		fclose(f);
+
+	return err;
+}
+
 //
 // Main
 //
 
-#define GETOPT_STR "hlr:w:t:a:d:124vVi"
+#define GETOPT_STR "hlr:w:p:e:f:s:t:c:m:a:d:b:n:FM:T:B:u124vVi"
 #define DTREE_PATH "/proc/device-tree"
 
 int print_help(const char *prog)
 {
-	fprintf(stderr, "Usage: %s [ -V | -h | -l | -i | -r <dev> | -w <dev> ] [ -t <path> ] [ -a <addr> ] [ -d <data> ] [ -1 | -2 | -4 ]\n", prog);
+	fprintf(stderr, "Usage: %s [ -V | -h | -l | -i | -r <dev> | -w <dev> | -p <dev> | -e <dev> | -f <addr> | -s <script> ] [ -u ] [ -t <path> ] [ -c <cache> ] [ -m <memdev> ] [ -a <addr> ] [ -d <data> | -b <file> [ -n <size> ] [ -F ] ] [ -M <mask> ] [ -T <ms> ] [ -B <us> ] [ -1 | -2 | -4 ]\n", prog);
 	fprintf(stderr, "All numbers are treated as hexadecimals with two possible formats, eg.:\n");
 	fprintf(stderr, "* 0xDEEDBEAF\n");
 	fprintf(stderr, "* DEEDBEAF (=> '0x' is optional)\n");
@@ -338,16 +871,45 @@ int print_help(const char *prog)
 	fprintf(stderr, "  $ %s -l\n", prog);
 	fprintf(stderr, "* List all devices in device-tree: test/device-tree\n");
 	fprintf(stderr, "  $ %s -l -t test/device-tree\n", prog);
+	fprintf(stderr, "* List all devices in flattened device-tree: test/device-tree.dtb\n");
+	fprintf(stderr, "  $ %s -l -t test/device-tree.dtb\n", prog);
 	fprintf(stderr, "* Read a word (4) from peripheral named 'plb' from offset 0x00\n");
 	fprintf(stderr, "  $ %s -r plb -a 0x00\n", prog);
 	fprintf(stderr, "* Write a word 0x000000FF to peripheral named 'plb' to offset 0x00\n");
 	fprintf(stderr, "  $ %s -w plb -a 0x00 -d 0xFF\n", prog);
+	fprintf(stderr, "* Read a word (4) from peripheral at path '/plb@0/serial@84000000' from offset 0x00\n");
+	fprintf(stderr, "  $ %s -r /plb@0/serial@84000000 -a 0x00\n", prog);
 	fprintf(stderr, "* Read a byte from peripheral named 'timer' from offset 0x04\n");
 	fprintf(stderr, "  $ %s -r timer -a 0x04 -1\n", prog);
 	fprintf(stderr, "* Write 0x00FF to peripheral named 'timer' to offset 0x08\n");
 	fprintf(stderr, "  $ %s -w timer -a 0x08 -d 0xFF -2\n", prog);
 	fprintf(stderr, "* Write words (4) from stdin (1 hexadecimal per line) to peripheral named 'timer' to offset 0x08\n");
 	fprintf(stderr, "  $ %s -w timer -a 0x08\n", prog);
+	fprintf(stderr, "* Wait up to 20 ms until bit 0x80 at offset 0x04 of peripheral named 'dma' is set,\n");
+	fprintf(stderr, "  spin first, then sleep up to 10 us between reads (-T and -B are decimal, -B 0 only spins)\n");
+	fprintf(stderr, "  $ %s -p dma -a 0x04 -M 0x80 -d 0x80 -T 20 -B 10\n", prog);
+	fprintf(stderr, "* Read a word (4) from peripheral named 'timer' through its UIO node (/dev/uioN) instead of /dev/mem\n");
+	fprintf(stderr, "  $ %s -u -r timer -a 0x00\n", prog);
+	fprintf(stderr, "* Sleep until the peripheral named 'dma' raises an interrupt (UIO), at most 100 ms\n");
+	fprintf(stderr, "  $ %s -e dma -T 100\n", prog);
+	fprintf(stderr, "* Perform operations of a script (- for stdin), devices are resolved and mapped once:\n");
+	fprintf(stderr, "    r[1|2|4] <dev> <addr>                          read (printed)\n");
+	fprintf(stderr, "    w[1|2|4] <dev> <addr> <data>                   write\n");
+	fprintf(stderr, "    p[1|2|4] <dev> <addr> <mask> <data> [<ms>]     wait until (read & mask) == data\n");
+	fprintf(stderr, "    i <dev> [<ms>]                                 wait for an interrupt (-u)\n");
+	fprintf(stderr, "  $ printf 'w timer 0x08 0xFF\\nr1 timer 0x04\\n' | %s -s -\n", prog);
+	fprintf(stderr, "* Write a binary image to peripheral named 'bram' from offset 0x00 (words where aligned)\n");
+	fprintf(stderr, "  $ %s -w bram -a 0x00 -b image.bin\n", prog);
+	fprintf(stderr, "* Read 0x40000 bytes from peripheral named 'bram' into a file\n");
+	fprintf(stderr, "  $ %s -r bram -a 0x00 -b dump.bin -n 0x40000\n", prog);
+	fprintf(stderr, "* Write a binary file into the FIFO register at offset 0x10 of peripheral 'fifo' by halfwords\n");
+	fprintf(stderr, "  $ %s -w fifo -a 0x10 -b data.bin -F -2\n", prog);
+	fprintf(stderr, "* Find the peripheral that owns the address 0x84000010\n");
+	fprintf(stderr, "  $ %s -f 0x84000010\n", prog);
+	fprintf(stderr, "* Read a word (4) from peripheral named 'plb', the device-tree is read once and cached\n");
+	fprintf(stderr, "  $ %s -c /var/tmp/busio.cache -r plb -a 0x00\n", prog);
+	fprintf(stderr, "* Read a word (4) from peripheral named 'timer' in a memory image (instead of /dev/mem)\n");
+	fprintf(stderr, "  $ %s -m mem.img -r timer -a 0x00\n", prog);
 	fprintf(stderr, "* Write a word 0x000000FF to peripheral at 0xC0000000 0x00 (ignore device-tree)\n");
 	fprintf(stderr, "  $ %s -w 0xC0000000 -i -a 0x00 -d 0xFF\n", prog);
 	return 0;
@@ -384,6 +946,25 @@ int main(int argc, char **argv)
 	// used device-tree to get address
 	const char *dtree = DTREE_PATH;
 
+	// cache of the device-tree (not used by default)
+	const char *cache = NULL;
+
+	// mask and timeout of a wait (-p, -e)
+	uint32_t mask = 0xFFFFFFFF;
+	unsigned long timeout = BUS_WAIT_TIMEOUT;
+	int timeout_valid = 0;
+
+	// binary file of a block transfer, its size and mode
+	const char *block = NULL;
+	size_t size = 0;
+	int fifo = 0;
+
+	// script of operations for -s
+	const char *script = NULL;
+
+	// memory device to map (/dev/mem by default)
+	const char *memdev = NULL;
+
 	// name of the device to access
 	const char *dev   = NULL;
 
@@ -411,14 +992,33 @@ int main(int argc, char **argv)
 
 		case 'r':
 		case 'w':
+		case 'p':
 			dev = optarg;
 			act = opt;
 			break;
 
+		case 'f':
+			addr = parse_addr(optarg);
+			act = opt;
+			break;
+
+		case 's':
+			script = optarg;
+			act = opt;
+			break;
+
 		case 't':
 			dtree = optarg;
 			break;
 
+		case 'c':
+			cache = optarg;
+			break;
+
+		case 'm':
+			memdev = optarg;
+			break;
+
 		case 'i':
 			dtree = NULL;
 			break;
@@ -433,6 +1033,41 @@ int main(int argc, char **argv)
 			value_valid = 1;
 			break;
 
+		case 'b':
+			block = optarg;
+			break;
+
+		case 'n':
+			size = parse_value(optarg);
+			break;
+
+		case 'F':
+			fifo = 1;
+			break;
+
+		case 'M':
+			mask = parse_value(optarg);
+			break;
+
+		case 'T':
+			timeout = strtoul(optarg, NULL, 10);
+			timeout_valid = 1;
+			break;
+
+		case 'u':
+			use_uio = 1;
+			break;
+
+		case 'e':
+			dev = optarg;
+			act = opt;
+			use_uio = 1;
+			break;
+
+		case 'B':
+			wait_backoff = strtoul(optarg, NULL, 10);
+			break;
+
 		case '1':
 		case '2':
 		case '3':
@@ -446,6 +1081,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if(cache != NULL) {
+		verbosity_printf(1, "Using cache '%s'", cache);
+		dtree_set_cache(cache);
+	}
+
+	if(memdev != NULL) {
+		verbosity_printf(1, "Using memory device '%s'", memdev);
+		dtree_set_memdev(memdev);
+	}
+
 	verbosity_printf(1, "Attempt to open device-tree '%s'", dtree);
 	if(dtree != NULL && dtree_open(dtree) != 0) {
 		fprintf(stderr, "dtree_open(%s): %s\n", dtree, dtree_errstr());
@@ -461,15 +1106,56 @@ int main(int argc, char **argv)
 		err = perform_list();
 		goto exit;
 
+	case 'f':
+		if(dtree == NULL) {
+			fprintf(stderr, "Can not find a device without device-tree (-i)\n");
+			err = 1;
+			goto exit;
+		}
+
+		err = perform_find(addr);
+		goto exit;
+
+	case 's':
+		assert(script != NULL);
+		err = perform_script(script, len);
+		goto exit;
+
 	case 'r':
 		assert(dev != NULL);
-		if(addr_valid) {
+		if(addr_valid && block != NULL) {
+			if(size == 0) {
+				fprintf(stderr, "Size option (-n) is missing\n");
+				err = 1;
+				goto exit;
+			}
+
+			err = perform_block_read(dev, addr, len, block, size, fifo);
+			goto exit;
+		}
+		else if(addr_valid) {
 			err = perform_read(dev, addr, len);
 			goto exit;
 		}
 
 		break;
 
+	case 'e':
+		assert(dev != NULL);
+
+		// no timeout by default
+		err = perform_wait_irq(dev, timeout_valid? (int) timeout : -1);
+		goto exit;
+
+	case 'p':
+		assert(dev != NULL);
+		if(addr_valid && value_valid) {
+			err = perform_wait(dev, addr, len, mask, value, timeout);
+			goto exit;
+		}
+
+		break;
+
 	case 'w':
 		assert(dev != NULL);
 
@@ -480,6 +1166,10 @@ int main(int argc, char **argv)
 			err = perform_write(dev, addr, len, value);
 			goto exit;
 		}
+		else if(block != NULL) {
+			err = perform_block_write(dev, addr, len, block, size, fifo);
+			goto exit;
+		}
 		else {
 			verbosity_printf(1, "Reading from <stdin>");
 			err = perform_file_write(dev, addr, len, finput);
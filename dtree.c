@@ -1,54 +1,605 @@
 #include "dtree.h"
 #include "dtree_error.h"
 #include "dtree_procfs.h"
+#include "dtree_fdt.h"
+#include "dtree_snap.h"
+#include "dtree_cache.h"
+#include "dtree_filter.h"
+#include "dtree_watch.h"
+#include "dtree_shared.h"
+#include "dtree_map.h"
+#include "dtree_uio.h"
+#include "dtree_backend.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
 
-int dtree_open(const char *rootd)
+/**
+ * Device tree context. The impl is NULL when
+ * the context is not opened.
+ */
+struct dtree_ctx {
+	struct dtree_impl *impl;
+	struct dtree_error *err;
+	struct dtree_error own_err;
+	unsigned threads; // for DTREE_OPEN_PARALLEL, 0 is auto
+	const char *cache; // path of the cache file or NULL
+	const char *overlays; // for DTREE_OPEN_WATCH, NULL is the default
+	struct dtree_watch *watch; // when opened with DTREE_OPEN_WATCH
+	const char *memdev; // for mappings, NULL is /dev/mem
+	const char *uio_class; // for UIO devices, NULL is /sys/class/uio
+	const char *uio_dev;   // NULL is /dev
+
+	// pinned version when opened by dtree_ctx_open_shared()
+	struct dtree_shared *shared;
+	struct dtree_shared_pin *pin;
+
+	// device that did not fit into the buffer of dtree_ctx_next_into(),
+	// it is returned by the next iteration
+	struct dtree_dev_t *pending;
+};
+
+/**
+ * Context of the non-reentrant API. Its error state
+ * is the one reported by dtree_ctx_iserror(ctx).
+ */
+static struct dtree_ctx g_ctx;
+
+static
+struct dtree_ctx *default_ctx(void)
+{
+	if(g_ctx.err == NULL)
+		g_ctx.err = dtree_default_error();
+
+	return &g_ctx;
+}
+
+dtree_ctx_t *dtree_ctx_new(void)
+{
+	struct dtree_ctx *ctx = calloc(1, sizeof(*ctx));
+	if(ctx == NULL)
+		return NULL;
+
+	ctx->err = &ctx->own_err;
+	return ctx;
+}
+
+void dtree_ctx_set_threads(dtree_ctx_t *ctx, unsigned threads)
 {
-	int err = dtree_procfs_open(rootd);
+	ctx->threads = threads;
+}
+
+void dtree_ctx_set_cache(dtree_ctx_t *ctx, const char *path)
+{
+	ctx->cache = path;
+}
+
+void dtree_ctx_set_overlays(dtree_ctx_t *ctx, const char *path)
+{
+	ctx->overlays = path;
+}
+
+void dtree_ctx_set_memdev(dtree_ctx_t *ctx, const char *path)
+{
+	ctx->memdev = path;
+}
+
+void dtree_ctx_set_uio(dtree_ctx_t *ctx, const char *classd, const char *devd)
+{
+	ctx->uio_class = classd;
+	ctx->uio_dev = devd;
+}
+
+/**
+ * Number of threads of the parallel scan.
+ */
+static
+unsigned ctx_threads(const struct dtree_ctx *ctx)
+{
+	if(ctx->threads > 0)
+		return ctx->threads;
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0? (unsigned) cpus : 1;
+}
+
+void dtree_ctx_free(dtree_ctx_t *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	dtree_ctx_close(ctx);
+	free(ctx);
+}
+
+/**
+ * Applies flags to an opened directory tree. A snapshot
+ * reads all properties anyway, it is never lazy.
+ */
+static
+struct dtree_impl *procfs_flags(struct dtree_impl *impl, int flags)
+{
+	if(impl != NULL && (flags & DTREE_OPEN_LAZY)
+	&& !(flags & (DTREE_OPEN_SNAPSHOT | DTREE_OPEN_PARALLEL)))
+		dtree_procfs_set_lazy(impl);
+
+	return impl;
+}
+
+/**
+ * A regular file is considered to be a flattened
+ * device tree blob, anything else is left for procfs.
+ */
+static
+struct dtree_impl *open_path(const char *rootd, int flags, struct dtree_error *err)
+{
+	struct stat st;
+
+	if(rootd != NULL && stat(rootd, &st) == 0 && S_ISREG(st.st_mode))
+		return dtree_fdt_open(rootd, err);
+
+	return procfs_flags(dtree_procfs_open(rootd, err), flags);
+}
+
+/**
+ * Copies all devices of the opened implementation
+ * into the snapshot one by one.
+ */
+static
+int snapshot_drain(struct dtree_ctx *ctx, struct dtree_impl *snap)
+{
+	struct dtree_dev_t *dev;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		int err = dtree_snap_add(snap, dev);
+		dtree_ctx_dev_free(ctx, dev);
+
+		if(err)
+			return -1;
+	}
+
+	return dtree_error_isset(ctx->err)? -1 : 0;
+}
+
+/**
+ * Reads all devices from the opened implementation into
+ * a snapshot. On success the implementation is closed
+ * and replaced by the snapshot.
+ */
+static
+int snapshot_load(struct dtree_ctx *ctx, int flags)
+{
+	const struct dtree_backend *backend = ctx->impl->backend;
+	struct dtree_impl *snap = dtree_snap_new(ctx->err);
+	int err;
+
+	if(snap == NULL)
+		return -1;
+
+	if(backend->scan != NULL)
+		err = backend->scan(ctx->impl, (flags & DTREE_OPEN_PARALLEL)? ctx_threads(ctx) : 1, snap);
+	else
+		err = snapshot_drain(ctx, snap);
+
+	if(err || dtree_snap_finish(snap)) {
+		dtree_snap_close(snap);
+		return -1;
+	}
+
+	backend->close(ctx->impl);
+	ctx->impl = snap;
+	return 0;
+}
+
+/**
+ * Finishes opening of the context by the given implementation.
+ */
+static
+int open_finish(struct dtree_ctx *ctx, struct dtree_impl *impl, int flags)
+{
+	if(impl == NULL)
+		return -1;
+
+	dtree_error_clear(ctx->err);
+	ctx->impl = impl;
+
+	if((flags & (DTREE_OPEN_SNAPSHOT | DTREE_OPEN_PARALLEL))
+	&& snapshot_load(ctx, flags)) {
+		dtree_ctx_close(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Clears the error state, fails when the context is opened.
+ */
+static
+int open_begin(struct dtree_ctx *ctx)
+{
+	dtree_error_clear(ctx->err);
+
+	if(ctx->impl != NULL) {
+		dtree_errno_set(ctx->err, EBUSY); // call close first
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Opens the context by the cache file when it is valid
+ * for the root (rootd or dirfd when rootd is NULL).
+ * Otherwise, the tree is loaded into a snapshot
+ * and saved as the new cache.
+ */
+static
+int open_cached(struct dtree_ctx *ctx, const char *rootd, int dirfd, int flags)
+{
+	struct dtree_snap_stamp stamp;
+	struct dtree_impl *impl;
+
+	// the stamp is taken before reading, a change
+	// during the load makes the cache stale
+	int fd = rootd != NULL? open(rootd, O_RDONLY | O_CLOEXEC) : dirfd;
+	if(fd == -1) {
+		dtree_error_from_errno(ctx->err);
+		return -1;
+	}
+
+	int err = dtree_cache_stamp(fd, &stamp, ctx->err);
+	if(rootd != NULL)
+		close(fd);
+	if(err)
+		return -1;
+
+	impl = dtree_cache_open(ctx->cache, &stamp, ctx->err);
+	if(impl != NULL)
+		return open_finish(ctx, impl, 0);
+	if(dtree_error_isset(ctx->err))
+		return -1;
+
+	impl = rootd != NULL? open_path(rootd, 0, ctx->err) : dtree_procfs_openat(dirfd, ctx->err);
+	if(open_finish(ctx, impl, flags | DTREE_OPEN_SNAPSHOT))
+		return -1;
+
+	// the cache is an optimization only, the tree
+	// is usable even when it can not be written
+	if(dtree_cache_save(ctx->cache, &stamp, ctx->impl))
+		dtree_error_clear(ctx->err);
+
+	return 0;
+}
+
+/**
+ * Opens the context by a snapshot of the watched tree
+ * (rootd or dirfd when rootd is NULL).
+ */
+static
+int open_watched(struct dtree_ctx *ctx, const char *rootd, int dirfd)
+{
+	struct dtree_watch *w = dtree_watch_open(rootd, dirfd, ctx->overlays, ctx->err);
+	if(w == NULL)
+		return -1;
+
+	if(open_finish(ctx, dtree_watch_snapshot(w), 0)) {
+		dtree_watch_close(w);
+		return -1;
+	}
+
+	ctx->watch = w;
+	return 0;
+}
+
+int dtree_ctx_open(dtree_ctx_t *ctx, const char *rootd, int flags)
+{
+	if(open_begin(ctx))
+		return -1;
+
+	if(flags & DTREE_OPEN_WATCH)
+		return open_watched(ctx, rootd, -1);
+
+	if(ctx->cache != NULL && rootd != NULL)
+		return open_cached(ctx, rootd, -1, flags);
+
+	return open_finish(ctx, open_path(rootd, flags, ctx->err), flags);
+}
+
+int dtree_ctx_openat(dtree_ctx_t *ctx, int dirfd, int flags)
+{
+	if(open_begin(ctx))
+		return -1;
+
+	if(flags & DTREE_OPEN_WATCH)
+		return open_watched(ctx, NULL, dirfd);
+
+	if(ctx->cache != NULL)
+		return open_cached(ctx, NULL, dirfd, flags);
 
-	if(err == 0) {
-		dtree_error_clear();
+	return open_finish(ctx, procfs_flags(dtree_procfs_openat(dirfd, ctx->err), flags), flags);
+}
+
+/**
+ * Frees a device of any implementation, the tree can be
+ * closed already. Only lazy handles are not a single block.
+ */
+static
+void dev_free(struct dtree_dev_t *dev)
+{
+	assert(dev != NULL);
+
+	if(!dev_is_block(dev))
+		dtree_procfs_dev_free(dev);
+	else
+		free(dev);
+}
+
+/**
+ * Drops the device pending for dtree_ctx_next_into().
+ */
+static
+void drop_pending(struct dtree_ctx *ctx)
+{
+	if(ctx->pending == NULL)
+		return;
+
+	dev_free(ctx->pending);
+	ctx->pending = NULL;
+}
+
+void dtree_ctx_close(dtree_ctx_t *ctx)
+{
+	if(ctx->impl == NULL)
+		return;
+
+	drop_pending(ctx);
+	ctx->impl->backend->close(ctx->impl);
+	ctx->impl = NULL;
+
+	if(ctx->watch != NULL) {
+		dtree_watch_close(ctx->watch);
+		ctx->watch = NULL;
+	}
+
+	if(ctx->shared != NULL) {
+		dtree_shared_unpin(ctx->shared, ctx->pin);
+		ctx->shared = NULL;
+		ctx->pin = NULL;
+	}
+}
+
+/**
+ * Moves the pin of a shared context to the current version.
+ * The old version is held until the new one is pinned.
+ */
+static
+int refresh_shared(struct dtree_ctx *ctx)
+{
+	struct dtree_shared_pin *pin;
+
+	if(dtree_shared_current(ctx->shared, ctx->pin))
 		return 0;
+
+	struct dtree_impl *view = dtree_shared_pin(ctx->shared, &pin, ctx->err);
+	if(view == NULL)
+		return -1;
+
+	drop_pending(ctx);
+	ctx->impl->backend->close(ctx->impl);
+	dtree_shared_unpin(ctx->shared, ctx->pin);
+
+	ctx->impl = view;
+	ctx->pin = pin;
+	return 0;
+}
+
+int dtree_ctx_refresh(dtree_ctx_t *ctx)
+{
+	if(ctx->shared != NULL)
+		return refresh_shared(ctx);
+
+	if(ctx->watch == NULL) {
+		dtree_errno_set(ctx->err, EINVAL); // not watched nor shared
+		return -1;
 	}
 
-	dtree_procfs_close();
-	return err;
+	int changed = dtree_watch_update(ctx->watch);
+	if(changed <= 0)
+		return changed;
+
+	// the current snapshot serves queries until the new one is complete
+	struct dtree_impl *snap = dtree_watch_snapshot(ctx->watch);
+	if(snap == NULL)
+		return -1;
+
+	drop_pending(ctx);
+	ctx->impl->backend->close(ctx->impl);
+	ctx->impl = snap;
+	return 0;
 }
 
-void dtree_close(void)
+int dtree_ctx_refresh_fd(const dtree_ctx_t *ctx)
 {
-	dtree_procfs_close();
+	return ctx->watch == NULL? -1 : dtree_watch_fd(ctx->watch);
 }
 
-struct dtree_dev_t *dtree_next(void)
+int dtree_ctx_open_shared(dtree_ctx_t *ctx, dtree_shared_t *sh)
 {
-	return dtree_procfs_next();
+	struct dtree_shared_pin *pin;
+
+	if(open_begin(ctx))
+		return -1;
+
+	if(open_finish(ctx, dtree_shared_pin(sh, &pin, ctx->err), 0))
+		return -1;
+
+	ctx->shared = sh;
+	ctx->pin = pin;
+	return 0;
 }
 
-void dtree_dev_free(struct dtree_dev_t *dev)
+int dtree_shared_publish(dtree_shared_t *sh, dtree_ctx_t *ctx)
 {
-	dtree_procfs_dev_free(dev);
+	if(ctx->impl == NULL || !dtree_snap_owned(ctx->impl)) {
+		dtree_errno_set(ctx->err, EINVAL); // not a snapshot
+		return -1;
+	}
+
+	drop_pending(ctx);
+
+	if(dtree_shared_swap(sh, ctx->impl, ctx->err))
+		return -1;
+
+	ctx->impl = NULL;
+
+	if(ctx->watch != NULL) {
+		dtree_watch_close(ctx->watch);
+		ctx->watch = NULL;
+	}
+
+	return 0;
 }
 
-int dtree_reset(void)
+struct dtree_dev_t *dtree_ctx_next(dtree_ctx_t *ctx)
 {
-	return dtree_procfs_reset();
+	if(ctx->impl == NULL)
+		return NULL;
+
+	if(ctx->pending != NULL) {
+		struct dtree_dev_t *dev = ctx->pending;
+		ctx->pending = NULL;
+		return dev;
+	}
+
+	return ctx->impl->backend->next(ctx->impl);
 }
 
-struct dtree_dev_t *dtree_byname(const char *name)
+/**
+ * Copies the device into the caller's buffer:
+ * compat array, name and compat strings.
+ *
+ * Returns the required length of the buffer.
+ */
+static
+size_t dev_copy_into(struct dtree_dev_t *dev, const struct dtree_dev_t *src, void *buf, size_t len)
+{
+	const char **src_compat = dtree_dev_compat(src);
+	size_t entries = 0;
+	size_t extra = strlen(dtree_dev_name(src)) + 1;
+	size_t need;
+
+	for(; src_compat[entries] != NULL; ++entries)
+		extra += strlen(src_compat[entries]) + 1;
+
+	const char **compat = dev_buf_array(buf, len, entries, extra, &need);
+	if(compat == NULL)
+		return need;
+
+	char *p = (char *) (compat + entries + 1);
+	const size_t namelen = strlen(dtree_dev_name(src)) + 1;
+
+	memcpy(p, dtree_dev_name(src), namelen);
+	dev->name = p;
+	p += namelen;
+
+	for(size_t i = 0; i < entries; ++i) {
+		const size_t clen = strlen(src_compat[i]) + 1;
+
+		memcpy(p, src_compat[i], clen);
+		compat[i] = p;
+		p += clen;
+	}
+
+	compat[entries] = NULL;
+
+	dev->base   = dtree_dev_base(src);
+	dev->high   = dtree_dev_high(src);
+	dev->compat = compat;
+	return need;
+}
+
+size_t dtree_ctx_next_into(dtree_ctx_t *ctx, struct dtree_dev_t *dev, void *buf, size_t len)
+{
+	if(ctx->impl == NULL)
+		return 0;
+
+	if(ctx->impl->backend->next_into != NULL)
+		return ctx->impl->backend->next_into(ctx->impl, dev, buf, len);
+
+	// the device is kept for the next call when it does not fit
+	struct dtree_dev_t *curr = dtree_ctx_next(ctx);
+	if(curr == NULL)
+		return 0;
+
+	const size_t need = dev_copy_into(dev, curr, buf, len);
+	if(need > len)
+		ctx->pending = curr;
+	else
+		dtree_ctx_dev_free(ctx, curr);
+
+	return need;
+}
+
+void dtree_ctx_dev_free(dtree_ctx_t *ctx, struct dtree_dev_t *dev)
+{
+	(void) ctx; // devices do not depend on the opened tree
+	dev_free(dev);
+}
+
+int dtree_ctx_reset(dtree_ctx_t *ctx)
+{
+	if(ctx->impl == NULL)
+		return 1;
+
+	drop_pending(ctx);
+
+	return ctx->impl->backend->reset(ctx->impl);
+}
+
+void dtree_dev_load(const struct dtree_dev_t *dev)
+{
+	// only lazy handles of directory trees are not loaded
+	if(dev->compat == dtree_dev_unloaded)
+		dtree_procfs_dev_load((struct dtree_dev_t *) dev);
+}
+
+int dtree_ctx_iserror(const dtree_ctx_t *ctx)
+{
+	return dtree_error_isset(ctx->err);
+}
+
+const char *dtree_ctx_errstr(const dtree_ctx_t *ctx)
+{
+	return dtree_error_str(ctx->err);
+}
+
+struct dtree_dev_t *dtree_ctx_byname(dtree_ctx_t *ctx, const char *name)
 {
 	struct dtree_dev_t *curr = NULL;
 
-	if(name == NULL || strlen(name) == 0)
+	if(name == NULL || strlen(name) == 0 || ctx->impl == NULL)
 		return NULL;
 
-	while((curr = dtree_next()) != NULL) {
+	if(ctx->impl->backend->byname != NULL) {
+		// the pending device is the next one of the iterator
+		if(ctx->pending != NULL && !strcmp(name, ctx->pending->name))
+			return dtree_ctx_next(ctx);
+
+		drop_pending(ctx);
+		return ctx->impl->backend->byname(ctx->impl, name);
+	}
+
+	while((curr = dtree_ctx_next(ctx)) != NULL) {
 		if(!strcmp(name, curr->name))
 			break;
 
-		dtree_dev_free(curr);
+		dtree_ctx_dev_free(ctx, curr);
 	}
 
 	return curr;
@@ -67,19 +618,509 @@ int is_compatible(const struct dtree_dev_t *dev, const char *compat)
 	return 0;
 }
 
-struct dtree_dev_t *dtree_bycompat(const char *compat)
+struct dtree_dev_t *dtree_ctx_bycompat(dtree_ctx_t *ctx, const char *compat)
 {
 	struct dtree_dev_t *curr = NULL;
 
-	if(compat == NULL || strlen(compat) == 0)
+	if(compat == NULL || strlen(compat) == 0 || ctx->impl == NULL)
 		return NULL;
 
-	while((curr = dtree_next()) != NULL) {
+	if(ctx->impl->backend->bycompat != NULL)
+		return ctx->impl->backend->bycompat(ctx->impl, compat);
+
+	while((curr = dtree_ctx_next(ctx)) != NULL) {
 		if(is_compatible(curr, compat))
 			break;
 
-		dtree_dev_free(curr);
+		dtree_ctx_dev_free(ctx, curr);
+	}
+
+	return curr;
+}
+
+struct dtree_dev_t **dtree_ctx_bycompat_all(dtree_ctx_t *ctx, const char *compat)
+{
+	if(compat == NULL || strlen(compat) == 0 || ctx->impl == NULL)
+		return NULL;
+
+	if(ctx->impl->backend->bycompat_all != NULL)
+		return ctx->impl->backend->bycompat_all(ctx->impl, compat);
+
+	if(dtree_ctx_reset(ctx))
+		return NULL;
+
+	struct dtree_dev_t **devs = NULL;
+	size_t count = 0;
+	struct dtree_dev_t *curr;
+
+	while((curr = dtree_ctx_bycompat(ctx, compat)) != NULL) {
+		struct dtree_dev_t **bigger = realloc(devs, (count + 2) * sizeof(*devs));
+		if(bigger == NULL) {
+			dtree_error_from_errno(ctx->err);
+			dtree_ctx_dev_free(ctx, curr);
+			goto clean_and_exit;
+		}
+
+		devs = bigger;
+		devs[count++] = curr;
+		devs[count] = NULL;
+	}
+
+	if(dtree_ctx_iserror(ctx))
+		goto clean_and_exit;
+
+	dtree_ctx_reset(ctx);
+	return devs;
+
+clean_and_exit:
+	if(devs != NULL)
+		dtree_ctx_devs_free(ctx, devs);
+	return NULL;
+}
+
+/**
+ * Highest address of the device. When the high is not
+ * valid, the device occupies just the base.
+ */
+static inline
+dtree_addr_t dev_high(const struct dtree_dev_t *dev)
+{
+	dtree_addr_t base = dtree_dev_base(dev);
+	dtree_addr_t high = dtree_dev_high(dev);
+
+	return high > base? high : base;
+}
+
+struct dtree_dev_t *dtree_ctx_byaddr(dtree_ctx_t *ctx, dtree_addr_t addr)
+{
+	if(ctx->impl == NULL)
+		return NULL;
+
+	if(ctx->impl->backend->byaddr != NULL)
+		return ctx->impl->backend->byaddr(ctx->impl, addr);
+
+	if(dtree_ctx_reset(ctx))
+		return NULL;
+
+	struct dtree_dev_t *best = NULL;
+	struct dtree_dev_t *curr;
+
+	while((curr = dtree_ctx_next(ctx)) != NULL) {
+		if(dtree_dev_base(curr) > addr || dev_high(curr) < addr) {
+			dtree_ctx_dev_free(ctx, curr);
+			continue;
+		}
+
+		// prefer the smaller range, then the later (deeper) device
+		if(best == NULL || dev_high(curr) - dtree_dev_base(curr)
+		                <= dev_high(best) - dtree_dev_base(best)) {
+			if(best != NULL)
+				dtree_ctx_dev_free(ctx, best);
+			best = curr;
+		}
+		else {
+			dtree_ctx_dev_free(ctx, curr);
+		}
+	}
+
+	if(dtree_ctx_iserror(ctx) && best != NULL) {
+		dtree_ctx_dev_free(ctx, best);
+		return NULL;
+	}
+
+	dtree_ctx_reset(ctx);
+	return best;
+}
+
+static
+int dev_cmp_addr(const void *a, const void *b)
+{
+	const struct dtree_dev_t *x = *(const struct dtree_dev_t **) a;
+	const struct dtree_dev_t *y = *(const struct dtree_dev_t **) b;
+
+	if(dtree_dev_base(x) != dtree_dev_base(y))
+		return dtree_dev_base(x) < dtree_dev_base(y)? -1 : 1;
+	if(dev_high(x) != dev_high(y))
+		return dev_high(x) < dev_high(y)? -1 : 1;
+
+	return 0;
+}
+
+struct dtree_dev_t **dtree_ctx_byrange(dtree_ctx_t *ctx, dtree_addr_t base, dtree_addr_t high)
+{
+	if(base > high || ctx->impl == NULL)
+		return NULL;
+
+	if(ctx->impl->backend->byrange != NULL)
+		return ctx->impl->backend->byrange(ctx->impl, base, high);
+
+	if(dtree_ctx_reset(ctx))
+		return NULL;
+
+	struct dtree_dev_t **devs = NULL;
+	size_t count = 0;
+	struct dtree_dev_t *curr;
+
+	while((curr = dtree_ctx_next(ctx)) != NULL) {
+		if(dtree_dev_base(curr) > high || dev_high(curr) < base) {
+			dtree_ctx_dev_free(ctx, curr);
+			continue;
+		}
+
+		struct dtree_dev_t **bigger = realloc(devs, (count + 2) * sizeof(*devs));
+		if(bigger == NULL) {
+			dtree_error_from_errno(ctx->err);
+			dtree_ctx_dev_free(ctx, curr);
+			goto clean_and_exit;
+		}
+
+		devs = bigger;
+		devs[count++] = curr;
+		devs[count] = NULL;
+	}
+
+	if(dtree_ctx_iserror(ctx))
+		goto clean_and_exit;
+
+	if(devs != NULL) // stable order as with the index
+		qsort(devs, count, sizeof(*devs), dev_cmp_addr);
+
+	dtree_ctx_reset(ctx);
+	return devs;
+
+clean_and_exit:
+	if(devs != NULL)
+		dtree_ctx_devs_free(ctx, devs);
+	return NULL;
+}
+
+struct dtree_dev_t *dtree_ctx_find(dtree_ctx_t *ctx, const struct dtree_filter *filter)
+{
+	struct dtree_dev_t *curr = NULL;
+
+	if(filter == NULL || ctx->impl == NULL)
+		return NULL;
+
+	// the pending device is the next one of the iterator,
+	// its status is not known any more
+	if(ctx->pending != NULL && dtree_filter_dev(filter, ctx->pending))
+		return dtree_ctx_next(ctx);
+
+	drop_pending(ctx);
+
+	if(ctx->impl->backend->find != NULL)
+		return ctx->impl->backend->find(ctx->impl, filter);
+
+	if(filter->flags & DTREE_FIND_OKAY) {
+		dtree_errno_set(ctx->err, ENOTSUP);
+		return NULL;
+	}
+
+	while((curr = dtree_ctx_next(ctx)) != NULL) {
+		if(dtree_filter_dev(filter, curr))
+			break;
+
+		dtree_ctx_dev_free(ctx, curr);
 	}
 
 	return curr;
 }
+
+/**
+ * Tests that the path does not leave the tree
+ * (no "." or ".." components).
+ */
+static
+int path_valid(const char *path)
+{
+	for(const char *c = path; *c != '\0'; c += strcspn(c, "/")) {
+		c += strspn(c, "/");
+
+		const size_t len = strcspn(c, "/");
+		if((len == 1 && c[0] == '.') || (len == 2 && c[0] == '.' && c[1] == '.'))
+			return 0;
+	}
+
+	return 1;
+}
+
+struct dtree_dev_t *dtree_ctx_bypath(dtree_ctx_t *ctx, const char *path)
+{
+	if(path == NULL || ctx->impl == NULL)
+		return NULL;
+
+	if(!path_valid(path)) {
+		dtree_errno_set(ctx->err, EINVAL);
+		return NULL;
+	}
+
+	if(ctx->impl->backend->bypath == NULL) {
+		dtree_errno_set(ctx->err, ENOTSUP); // no hierarchy is kept
+		return NULL;
+	}
+
+	return ctx->impl->backend->bypath(ctx->impl, path + strspn(path, "/"));
+}
+
+struct dtree_dev_t *dtree_ctx_byphandle(dtree_ctx_t *ctx, uint32_t phandle)
+{
+	struct dtree_dev_t *dev = NULL;
+
+	if(phandle == 0 || ctx->impl == NULL)
+		return NULL;
+
+	if(ctx->impl->backend->byphandle == NULL) {
+		dtree_errno_set(ctx->err, ENOTSUP); // no phandles are kept
+		return NULL;
+	}
+
+	if(ctx->impl->backend->byphandle(ctx->impl, phandle, NULL, NULL, &dev) <= 0)
+		return NULL;
+
+	return dev;
+}
+
+static inline
+uint32_t be32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+	     | ((uint32_t) p[2] << 8)  |  (uint32_t) p[3];
+}
+
+size_t dtree_ctx_byrefs(dtree_ctx_t *ctx, const void *refs, size_t len, const char *cells,
+		struct dtree_dev_t **devs, size_t n)
+{
+	const unsigned char *list = refs;
+	size_t count = 0;
+
+	if(refs == NULL || ctx->impl == NULL)
+		return 0;
+
+	if(ctx->impl->backend->byphandle == NULL) {
+		dtree_errno_set(ctx->err, ENOTSUP);
+		return 0;
+	}
+
+	if(len % 4 != 0) {
+		dtree_errno_set(ctx->err, EINVAL);
+		return 0;
+	}
+
+	for(size_t off = 0; off < len; count += 1) {
+		const uint32_t phandle = be32(list + off);
+		struct dtree_dev_t *dev = NULL;
+		uint32_t ncells = 0;
+
+		off += 4;
+
+		if(phandle != 0) {
+			const int found = ctx->impl->backend->byphandle(ctx->impl, phandle,
+					cells, cells == NULL? NULL : &ncells, &dev);
+			if(found == 0)
+				dtree_errno_set(ctx->err, ENOENT);
+			if(found <= 0)
+				goto clean_and_exit;
+
+			// the arguments must be within the list
+			if(ncells > (len - off) / 4) {
+				if(dev != NULL)
+					dtree_ctx_dev_free(ctx, dev);
+
+				dtree_errno_set(ctx->err, EINVAL);
+				goto clean_and_exit;
+			}
+		}
+
+		if(count < n)
+			devs[count] = dev;
+		else if(dev != NULL)
+			dtree_ctx_dev_free(ctx, dev);
+
+		off += 4 * (size_t) ncells;
+	}
+
+	return count;
+
+clean_and_exit:
+	for(size_t i = 0; i < count && i < n; ++i) {
+		if(devs[i] != NULL)
+			dtree_ctx_dev_free(ctx, devs[i]);
+	}
+
+	return 0;
+}
+
+void dtree_ctx_devs_free(dtree_ctx_t *ctx, struct dtree_dev_t **devs)
+{
+	assert(devs != NULL);
+
+	for(size_t i = 0; devs[i] != NULL; ++i)
+		dtree_ctx_dev_free(ctx, devs[i]);
+
+	free(devs);
+}
+
+struct dtree_map_t *dtree_ctx_dev_map(dtree_ctx_t *ctx, const struct dtree_dev_t *dev)
+{
+	const dtree_addr_t base = dtree_dev_base(dev);
+	const dtree_addr_t high = dtree_dev_high(dev);
+
+	if(high <= base) {
+		dtree_errno_set(ctx->err, EINVAL); // no valid size
+		return NULL;
+	}
+
+	// the range can span the whole address space
+	return dtree_map_open(ctx->memdev, base, (size_t) high - base + 1, ctx->err);
+}
+
+struct dtree_map_t *dtree_ctx_addr_map(dtree_ctx_t *ctx, dtree_addr_t base, size_t len)
+{
+	return dtree_map_open(ctx->memdev, base, len, ctx->err);
+}
+
+dtree_uio_t *dtree_ctx_uio_open(dtree_ctx_t *ctx, const struct dtree_dev_t *dev)
+{
+	return dtree_uio_find(ctx->uio_class, ctx->uio_dev, dev, ctx->err);
+}
+
+
+//
+// Non-reentrant API over the default context
+//
+
+int dtree_open_flags(const char *rootd, int flags)
+{
+	return dtree_ctx_open(default_ctx(), rootd, flags);
+}
+
+int dtree_open(const char *rootd)
+{
+	return dtree_open_flags(rootd, 0);
+}
+
+void dtree_set_cache(const char *path)
+{
+	dtree_ctx_set_cache(default_ctx(), path);
+}
+
+void dtree_set_overlays(const char *path)
+{
+	dtree_ctx_set_overlays(default_ctx(), path);
+}
+
+void dtree_set_memdev(const char *path)
+{
+	dtree_ctx_set_memdev(default_ctx(), path);
+}
+
+void dtree_set_uio(const char *classd, const char *devd)
+{
+	dtree_ctx_set_uio(default_ctx(), classd, devd);
+}
+
+int dtree_refresh(void)
+{
+	return dtree_ctx_refresh(default_ctx());
+}
+
+int dtree_refresh_fd(void)
+{
+	return dtree_ctx_refresh_fd(default_ctx());
+}
+
+int dtree_openat(int dirfd)
+{
+	return dtree_ctx_openat(default_ctx(), dirfd, 0);
+}
+
+void dtree_close(void)
+{
+	dtree_ctx_close(default_ctx());
+}
+
+struct dtree_dev_t *dtree_next(void)
+{
+	return dtree_ctx_next(default_ctx());
+}
+
+size_t dtree_next_into(struct dtree_dev_t *dev, void *buf, size_t len)
+{
+	return dtree_ctx_next_into(default_ctx(), dev, buf, len);
+}
+
+void dtree_dev_free(struct dtree_dev_t *dev)
+{
+	dtree_ctx_dev_free(default_ctx(), dev);
+}
+
+void dtree_devs_free(struct dtree_dev_t **devs)
+{
+	dtree_ctx_devs_free(default_ctx(), devs);
+}
+
+int dtree_reset(void)
+{
+	return dtree_ctx_reset(default_ctx());
+}
+
+struct dtree_dev_t *dtree_byname(const char *name)
+{
+	return dtree_ctx_byname(default_ctx(), name);
+}
+
+struct dtree_dev_t *dtree_bycompat(const char *compat)
+{
+	return dtree_ctx_bycompat(default_ctx(), compat);
+}
+
+struct dtree_dev_t **dtree_bycompat_all(const char *compat)
+{
+	return dtree_ctx_bycompat_all(default_ctx(), compat);
+}
+
+struct dtree_dev_t *dtree_byaddr(dtree_addr_t addr)
+{
+	return dtree_ctx_byaddr(default_ctx(), addr);
+}
+
+struct dtree_dev_t **dtree_byrange(dtree_addr_t base, dtree_addr_t high)
+{
+	return dtree_ctx_byrange(default_ctx(), base, high);
+}
+
+struct dtree_dev_t *dtree_find(const struct dtree_filter *filter)
+{
+	return dtree_ctx_find(default_ctx(), filter);
+}
+
+struct dtree_dev_t *dtree_bypath(const char *path)
+{
+	return dtree_ctx_bypath(default_ctx(), path);
+}
+
+struct dtree_dev_t *dtree_byphandle(uint32_t phandle)
+{
+	return dtree_ctx_byphandle(default_ctx(), phandle);
+}
+
+size_t dtree_byrefs(const void *refs, size_t len, const char *cells,
+		struct dtree_dev_t **devs, size_t n)
+{
+	return dtree_ctx_byrefs(default_ctx(), refs, len, cells, devs, n);
+}
+
+struct dtree_map_t *dtree_dev_map(const struct dtree_dev_t *dev)
+{
+	return dtree_ctx_dev_map(default_ctx(), dev);
+}
+
+struct dtree_map_t *dtree_addr_map(dtree_addr_t base, size_t len)
+{
+	return dtree_ctx_addr_map(default_ctx(), base, len);
+}
+
+dtree_uio_t *dtree_uio_open(const struct dtree_dev_t *dev)
+{
+	return dtree_ctx_uio_open(default_ctx(), dev);
+}
@@ -6,12 +6,17 @@
  * The main principle if to be able to iterate
  * over all devices or search among them.
  *
- * The library is not reentrant nor thread safe.
+ * The dtree_* functions operate on a single default
+ * context and are not reentrant nor thread safe.
+ * The dtree_ctx_* functions are equivalents operating
+ * on an explicit context. Distinct contexts can be
+ * used independently (eg. one per thread).
  */
 
 #ifndef DTREE_H
 #define DTREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 //
@@ -23,6 +28,11 @@
  * (typically /proc/device-tree). Setups internal
  * structures. Clears error state.
  *
+ * When rootd is a regular file it is treated as
+ * a flattened device tree blob (typically
+ * /sys/firmware/fdt or a *.dtb file). The blob
+ * is mmaped and parsed in place.
+ *
  * It is safe to call dtree_reset() after dtree_open()
  * but it has no effect.
  * It is an error to call dtree_open() twice (without
@@ -32,10 +42,120 @@
  */
 int dtree_open(const char *rootd);
 
+/**
+ * Opens device tree like dtree_open() using an already
+ * opened root directory (eg. opened relative to another
+ * directory or inherited). The descriptor is duplicated,
+ * the caller remains its owner.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_openat(int dirfd);
+
+/**
+ * Flags for dtree_open_flags().
+ *
+ * DTREE_OPEN_SNAPSHOT - reads all devices at once during open
+ *                       into a compact in-memory snapshot,
+ *                       further iteration (and dtree_reset())
+ *                       performs no I/O. Devices are indexed
+ *                       by name, compatible type and address
+ *                       for dtree_byname(), dtree_bycompat*(),
+ *                       dtree_byaddr() and dtree_byrange().
+ *
+ * DTREE_OPEN_PARALLEL - like DTREE_OPEN_SNAPSHOT but the tree is
+ *                       read by a pool of threads (one per CPU
+ *                       by default, see dtree_ctx_set_threads()).
+ *                       The order of devices is the same as when
+ *                       read serially. Only directory trees are
+ *                       read in parallel.
+ *
+ * DTREE_OPEN_LAZY     - devices of a directory tree are returned
+ *                       as handles with the name only, other
+ *                       properties are read when a getter needs
+ *                       them first (fields must not be accessed
+ *                       directly). The handles share a descriptor
+ *                       of the root until they are loaded or
+ *                       free'd. Ignored with DTREE_OPEN_SNAPSHOT
+ *                       or _PARALLEL.
+ *
+ * DTREE_OPEN_WATCH    - reads a directory tree into a snapshot
+ *                       (like DTREE_OPEN_SNAPSHOT) and watches
+ *                       it by inotify, see dtree_refresh(). Other
+ *                       flags and the cache are ignored, blobs
+ *                       are not supported.
+ */
+#define DTREE_OPEN_SNAPSHOT 0x0001
+#define DTREE_OPEN_PARALLEL 0x0002
+#define DTREE_OPEN_LAZY     0x0004
+#define DTREE_OPEN_WATCH    0x0008
+
+/**
+ * Opens device tree like dtree_open() but the behaviour
+ * can be tuned by flags (see DTREE_OPEN_*). Passing zero
+ * is equal to dtree_open().
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_open_flags(const char *rootd, int flags);
+
+/**
+ * Sets a cache file for the next opens (NULL disables it,
+ * default). The path is not copied.
+ *
+ * When the cache is valid for the opened tree, it is mapped
+ * and queried in place (like DTREE_OPEN_SNAPSHOT) and the tree
+ * is not read at all. Otherwise, the tree is read into a snapshot
+ * and the cache is rewritten. Failing to write the cache is not
+ * an error.
+ *
+ * A directory tree is validated by mtime of its root only
+ * (changes deeper in the tree are not detected), a blob by
+ * its size and hash of its contents.
+ */
+void dtree_set_cache(const char *path);
+
+/**
+ * Sets the overlays directory of configfs watched by the next
+ * opens with DTREE_OPEN_WATCH (NULL means the default one,
+ * /sys/kernel/config/device-tree/overlays). The path is not
+ * copied. It is watched only when it exists.
+ *
+ * Kernel trees do not notify about changes made by overlays.
+ * When an overlay is added or removed, the whole tree is read
+ * again: new nodes are added and properties of existing nodes
+ * are re-read, as an overlay can change them too.
+ */
+void dtree_set_overlays(const char *path);
+
+/**
+ * Applies changes of a tree opened with DTREE_OPEN_WATCH
+ * (or moves a reader of a shared snapshot to the current
+ * version, see dtree_ctx_open_shared()).
+ * Only the nodes reported as changed are read again, then
+ * a new snapshot is published and the iteration starts over.
+ * Until then (or when the refresh fails) queries are served
+ * by the previous snapshot. Devices returned before stay
+ * valid, strings of dtree_next_into() do not.
+ *
+ * It does not block. Call it eg. when dtree_refresh_fd()
+ * becomes readable.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_refresh(void);
+
+/**
+ * Descriptor that becomes readable when there are changes
+ * to be applied by dtree_refresh(). Returns -1 when the tree
+ * is not opened with DTREE_OPEN_WATCH.
+ */
+int dtree_refresh_fd(void);
+
 /**
  * Free's resources of the module.
- * It is an error to call it when dtree_open()
- * has failed or to call it twice.
+ * It has no effect when dtree_open() has failed
+ * or when called twice.
  */
 void dtree_close(void);
 
@@ -64,6 +184,21 @@ struct dtree_dev_t {
 
 #define DTREE_GETTER static inline
 
+/**
+ * The compat of a lazy handle that is not loaded yet (empty).
+ * Owned by the library, recognized by its address.
+ */
+extern const char *dtree_dev_unloaded[1];
+
+/**
+ * Reads properties of a device returned by a tree opened
+ * with DTREE_OPEN_LAZY (only once). It is called by the
+ * getters, there is no need to call it directly. Errors
+ * are reported into the error state of the tree (when it
+ * is not closed already).
+ */
+void dtree_dev_load(const struct dtree_dev_t *d);
+
 /**
  * Get name of the device.
  */
@@ -79,6 +214,9 @@ const char *dtree_dev_name(const struct dtree_dev_t *d)
 DTREE_GETTER
 dtree_addr_t dtree_dev_base(const struct dtree_dev_t *d)
 {
+	if(d->compat == dtree_dev_unloaded)
+		dtree_dev_load(d);
+
 	return d->base;
 }
 
@@ -94,6 +232,9 @@ dtree_addr_t dtree_dev_base(const struct dtree_dev_t *d)
 DTREE_GETTER
 dtree_addr_t dtree_dev_high(const struct dtree_dev_t *d)
 {
+	if(d->compat == dtree_dev_unloaded)
+		dtree_dev_load(d);
+
 	return d->high;
 }
 
@@ -104,6 +245,9 @@ dtree_addr_t dtree_dev_high(const struct dtree_dev_t *d)
 DTREE_GETTER
 const char **dtree_dev_compat(const struct dtree_dev_t *d)
 {
+	if(d->compat == dtree_dev_unloaded)
+		dtree_dev_load(d);
+
 	return d->compat;
 }
 
@@ -124,6 +268,27 @@ const char **dtree_dev_compat(const struct dtree_dev_t *d)
  */
 struct dtree_dev_t *dtree_next(void);
 
+/**
+ * Like dtree_next() but the device is stored into dev and
+ * buf provided by the caller. The device must not be free'd,
+ * its name and compat point into buf or into the opened tree
+ * and are valid until buf is reused or dtree_close().
+ *
+ * Returns the length of buf needed by the device. When it is
+ * greater than len, nothing is stored and the iterator is not
+ * moved (the same device is returned by the next call with
+ * a big enough buffer). The buf should be aligned for pointers,
+ * otherwise up to sizeof(void *) - 1 more bytes are needed.
+ *
+ * When opened with DTREE_OPEN_SNAPSHOT (or from a cache) or from
+ * a blob, no memory is allocated. A directory tree is read into
+ * temporary buffers and the device is copied into buf.
+ *
+ * When no more entries are available or an error occurs
+ * returns 0. On error sets error state.
+ */
+size_t dtree_next_into(struct dtree_dev_t *dev, void *buf, size_t len);
+
 /**
  * Look up for device by name. Returns the first occurence
  * of device with the given name.
@@ -132,6 +297,11 @@ struct dtree_dev_t *dtree_next(void);
  * Uses shared internal iterator.
  * To search from beginning call dtree_reset().
  *
+ * When opened with DTREE_OPEN_SNAPSHOT, the device is found
+ * by a hash index in constant time and the shared iterator
+ * is not affected (the first occurence in the tree is always
+ * returned).
+ *
  * Returns NULL when not found or on error.
  * On error sets error state.
  */
@@ -144,11 +314,163 @@ struct dtree_dev_t *dtree_byname(const char *name);
  * Uses shared internal iterator.
  * To search from beginning call dtree_reset().
  *
+ * When opened with DTREE_OPEN_SNAPSHOT, the next device is
+ * found by an index without visiting the others.
+ *
  * Returns NULL when not found or on error.
  * On error sets error state.
  */
 struct dtree_dev_t *dtree_bycompat(const char *compat);
 
+/**
+ * Looks up for all devices compatible with the given type.
+ * The result is a NULL-terminated array that should be
+ * free'd by dtree_devs_free().
+ *
+ * When opened with DTREE_OPEN_SNAPSHOT, the devices are found
+ * by an index and the shared iterator is not affected.
+ * Otherwise, the tree is scanned once and the shared
+ * iterator is reset.
+ *
+ * Returns NULL when not found or on error.
+ * On error sets error state.
+ */
+struct dtree_dev_t **dtree_bycompat_all(const char *compat);
+
+/**
+ * Looks up for device whose address range (base..high) contains
+ * the given address. When more devices contain the address (eg.
+ * a bus and its device) the one with the smallest range is returned.
+ * The entry should be free'd by dtree_dev_free().
+ *
+ * When opened with DTREE_OPEN_SNAPSHOT, the device is found
+ * by an interval index in logarithmic time and the shared
+ * iterator is not affected. Otherwise, the tree is scanned
+ * once and the shared iterator is reset.
+ *
+ * Returns NULL when not found or on error.
+ * On error sets error state.
+ */
+struct dtree_dev_t *dtree_byaddr(dtree_addr_t addr);
+
+/**
+ * Looks up for all devices whose address range overlaps
+ * the range [base, high]. The result is a NULL-terminated
+ * array ordered by addresses that should be free'd
+ * by dtree_devs_free().
+ *
+ * Uses the same index (or scan) as dtree_byaddr().
+ *
+ * Returns NULL when not found or on error.
+ * On error sets error state.
+ */
+struct dtree_dev_t **dtree_byrange(dtree_addr_t base, dtree_addr_t high);
+
+/**
+ * Looks up the device by its full path from the root,
+ * eg. "/plb@0/serial@84000000" (the leading '/' is optional).
+ * The entry should be free'd by dtree_dev_free().
+ *
+ * Only the nodes on the path are visited, the cost depends
+ * on the depth of the node, not on the size of the tree.
+ * The shared iterator is not affected. Snapshots (opened
+ * with DTREE_OPEN_SNAPSHOT or from a cache) keep no paths,
+ * the lookup fails (ENOTSUP).
+ *
+ * Returns NULL when not found (or the node is not a device)
+ * or on error. On error sets error state.
+ */
+struct dtree_dev_t *dtree_bypath(const char *path);
+
+/**
+ * Looks up the device whose node has the given phandle
+ * (property phandle or linux,phandle), eg. a value of
+ * the interrupt-parent property of another device.
+ * The entry should be free'd by dtree_dev_free().
+ *
+ * The phandles of the whole tree are indexed by the first
+ * lookup (one pass), every other lookup takes constant time.
+ * The shared iterator is not affected. Snapshots keep no
+ * phandles, the lookup fails (ENOTSUP).
+ *
+ * Returns NULL when not found (or the node is not a device)
+ * or on error. On error sets error state.
+ */
+struct dtree_dev_t *dtree_byphandle(uint32_t phandle);
+
+/**
+ * Resolves all references of the list at once. The refs is
+ * a value of a property (as read from the tree, big-endian
+ * cells) like clocks or gpios: a phandle followed by arguments.
+ * The number of the arguments is given by the property cells
+ * (eg. "#clock-cells") of the referenced node. When cells is
+ * NULL the list holds phandles only (eg. interrupt-parent).
+ * A zero phandle is an empty entry without arguments.
+ *
+ * The referenced devices are stored into devs in the order of
+ * the list, NULL for an empty entry or a node that is not
+ * a device. At most n devices are stored, each should be
+ * free'd by dtree_dev_free().
+ *
+ * Returns the number of references in the list (even when
+ * greater than n). On error (malformed list or an unknown
+ * phandle) returns 0 and sets error state, nothing is stored.
+ */
+size_t dtree_byrefs(const void *refs, size_t len, const char *cells,
+		struct dtree_dev_t **devs, size_t n);
+
+/**
+ * Filter of dtree_find(). Members that are NULL (or not
+ * enabled by flags) match any device, all the others must
+ * match.
+ *
+ * The prune callback (optional) is called for every node
+ * below the root (depth 1) before any of its properties
+ * is read. Returning non-zero skips the node together with
+ * its whole subtree (eg. a bus without interesting devices).
+ * It is an optimization only: snapshots (DTREE_OPEN_SNAPSHOT
+ * or a cache) keep no hierarchy and never call it.
+ */
+struct dtree_filter {
+	const char *name;     // eg. "serial@84000000"
+	const char *basename; // name without the unit address, eg. "serial"
+	const char *compat;   // one of the compatible entries
+	dtree_addr_t base;    // overlapping base..high (DTREE_FIND_RANGE)
+	dtree_addr_t high;
+	int flags;
+
+	int (*prune)(const char *name, unsigned depth, void *arg);
+	void *arg;
+};
+
+/**
+ * Flags of struct dtree_filter.
+ *
+ * DTREE_FIND_RANGE - the address range must overlap base..high
+ *
+ * DTREE_FIND_OKAY  - the status property must be "okay" (or "ok")
+ *                    or missing. Snapshots do not keep status,
+ *                    searching them fails (ENOTSUP).
+ */
+#define DTREE_FIND_RANGE 0x0001
+#define DTREE_FIND_OKAY  0x0002
+
+/**
+ * Looks up the next device matching the filter.
+ * The entry should be free'd by dtree_dev_free().
+ *
+ * Uses shared internal iterator.
+ * To search from beginning call dtree_reset().
+ *
+ * The conditions are tested as soon as possible: a directory
+ * tree tests names before reading anything, then reads the
+ * compatible (when filtered), the status and the reg last.
+ *
+ * Returns NULL when not found or on error.
+ * On error sets error state.
+ */
+struct dtree_dev_t *dtree_find(const struct dtree_filter *filter);
+
 /**
  * Resets the iteration over devices.
  * Eg. after this call dtree_next() will return the first
@@ -166,10 +488,17 @@ int dtree_reset(void);
 /**
  * Frees the given device entry (returned mostly by iterators).
  * It is recommended to free every dev instance before next
- * iterator call (or as soon as possible).
+ * iterator call (or as soon as possible). A device can be
+ * free'd after the tree is closed.
  */
 void dtree_dev_free(struct dtree_dev_t *dev);
 
+/**
+ * Frees the given NULL-terminated array of devices
+ * together with all the devices.
+ */
+void dtree_devs_free(struct dtree_dev_t **devs);
+
 /**
  * Tests whether the module is in an error state.
  * When it is in an error state the behaviour of all
@@ -192,4 +521,372 @@ int dtree_iserror(void);
  */
 const char *dtree_errstr(void);
 
+
+//
+// Memory mapping
+//
+
+/**
+ * Memory window of a device mapped by dtree_dev_map().
+ * The base points to the byte at the physical address addr,
+ * the window is len bytes long. The fields must not be modified.
+ */
+struct dtree_map_t {
+	volatile void *base;
+	dtree_addr_t   addr;
+	size_t         len;
+
+	// the whole mapping (page aligned)
+	void  *pages;
+	size_t pages_len;
+};
+
+/**
+ * Sets the memory device mapped by the next calls of
+ * dtree_dev_map() and dtree_addr_map(). The default
+ * is /dev/mem (NULL). The path is not copied.
+ */
+void dtree_set_memdev(const char *path);
+
+/**
+ * Maps the address range of the device (base..high) once.
+ * Accesses by dtree_map_read*() and dtree_map_write*() are
+ * plain loads and stores until the window is released by
+ * dtree_map_free(). The device can be free'd meanwhile.
+ *
+ * Returns NULL on error (EINVAL when the device has no valid
+ * high address) and sets error state.
+ */
+struct dtree_map_t *dtree_dev_map(const struct dtree_dev_t *dev);
+
+/**
+ * Maps len bytes from the physical address base like
+ * dtree_dev_map() (eg. when there is no device tree).
+ */
+struct dtree_map_t *dtree_addr_map(dtree_addr_t base, size_t len);
+
+/**
+ * Unmaps the window and free's it.
+ */
+void dtree_map_free(struct dtree_map_t *m);
+
+/**
+ * Accesses of the mapped window. The offset is relative
+ * to the base of the window, it must be aligned to the size
+ * of the access and the access must fit into the window
+ * (it is not checked).
+ */
+static inline
+uint8_t dtree_map_read8(const struct dtree_map_t *m, size_t off)
+{
+	return *((volatile const uint8_t *) m->base + off);
+}
+
+static inline
+uint16_t dtree_map_read16(const struct dtree_map_t *m, size_t off)
+{
+	return *(volatile const uint16_t *) ((volatile const uint8_t *) m->base + off);
+}
+
+static inline
+uint32_t dtree_map_read32(const struct dtree_map_t *m, size_t off)
+{
+	return *(volatile const uint32_t *) ((volatile const uint8_t *) m->base + off);
+}
+
+static inline
+void dtree_map_write8(const struct dtree_map_t *m, size_t off, uint8_t value)
+{
+	*((volatile uint8_t *) m->base + off) = value;
+}
+
+static inline
+void dtree_map_write16(const struct dtree_map_t *m, size_t off, uint16_t value)
+{
+	*(volatile uint16_t *) ((volatile uint8_t *) m->base + off) = value;
+}
+
+static inline
+void dtree_map_write32(const struct dtree_map_t *m, size_t off, uint32_t value)
+{
+	*(volatile uint32_t *) ((volatile uint8_t *) m->base + off) = value;
+}
+
+/**
+ * Copies len bytes from buf into the window at off (the addresses
+ * increment). Accesses are the widest aligned ones up to 32 bits,
+ * only an unaligned head and tail are accessed by bytes or halfwords.
+ * The range must fit into the window (it is not checked).
+ *
+ * Returns the number of bytes copied (len).
+ */
+size_t dtree_map_write_block(const struct dtree_map_t *m, size_t off,
+		const void *buf, size_t len);
+
+/**
+ * Copies len bytes from the window at off into buf
+ * (see dtree_map_write_block()).
+ */
+size_t dtree_map_read_block(const struct dtree_map_t *m, size_t off,
+		void *buf, size_t len);
+
+/**
+ * Writes len bytes from buf into the register (FIFO) at off,
+ * all accesses are width (1, 2 or 4) bytes wide and go to
+ * the same address.
+ *
+ * Returns the number of bytes written (len rounded down
+ * to the width).
+ */
+size_t dtree_map_write_fifo(const struct dtree_map_t *m, size_t off,
+		const void *buf, size_t len, int width);
+
+/**
+ * Reads len bytes from the register (FIFO) at off into buf
+ * (see dtree_map_write_fifo()).
+ */
+size_t dtree_map_read_fifo(const struct dtree_map_t *m, size_t off,
+		void *buf, size_t len, int width);
+
+/**
+ * Waiting of dtree_map_wait(). The first part is set by the caller,
+ * the rest is filled by the wait.
+ */
+struct dtree_wait_t {
+	unsigned long timeout_us; // 0 reads just once
+	unsigned long spins;      // reads before the first sleep
+	unsigned long backoff_us; // longest sleep between reads, 0 never sleeps
+
+	unsigned long iterations; // reads performed
+	uint64_t waited_ns;       // time spent waiting
+	uint32_t last;            // last value read
+};
+
+/**
+ * Reads the register at off (width of 1, 2 or 4 bytes) until
+ * (register & mask) == value or until the timeout expires. The
+ * first spins reads are done back to back, then the sleeps between
+ * reads are doubled from 1 us up to backoff_us.
+ *
+ * Returns 0 when the value was matched, 1 on timeout.
+ */
+int dtree_map_wait(const struct dtree_map_t *m, size_t off, int width,
+		uint32_t mask, uint32_t value, struct dtree_wait_t *w);
+
+
+//
+// UIO devices
+//
+
+/**
+ * Device bound to a UIO driver (eg. uio_pdrv_genirq). Its memory
+ * regions are mapped through /dev/uioN instead of /dev/mem and its
+ * interrupt is awaited by blocking on that descriptor.
+ */
+typedef struct dtree_uio dtree_uio_t;
+
+/**
+ * Sets the directories searched by dtree_uio_open(), the class
+ * directory of UIO devices (/sys/class/uio) and the directory
+ * of their nodes (/dev). NULL means the default one. The paths
+ * are not copied.
+ */
+void dtree_set_uio(const char *classd, const char *devd);
+
+/**
+ * Opens the UIO device of the device. The UIO device matches
+ * when its name is the name of the device (with or without the
+ * unit address) or when its node is compatible with the device,
+ * and its first region starts at the base of the device.
+ *
+ * Returns NULL on error (ENOENT when there is no such UIO device)
+ * and sets error state.
+ */
+dtree_uio_t *dtree_uio_open(const struct dtree_dev_t *dev);
+
+/**
+ * Closes the UIO device. Its mapped regions stay valid.
+ */
+void dtree_uio_close(dtree_uio_t *uio);
+
+/**
+ * Maps the region of the given index. The window is released
+ * by dtree_map_free().
+ *
+ * Returns NULL on error (errno is set).
+ */
+struct dtree_map_t *dtree_uio_map(dtree_uio_t *uio, unsigned index);
+
+/**
+ * Enables (re-arms) the interrupt and sleeps until it comes or
+ * until timeout_ms (negative is infinite) expires. The number of
+ * interrupts since the previous wait is stored to events (when not
+ * NULL), more than one means that some were missed.
+ *
+ * Returns 0 on interrupt, 1 on timeout and -1 on error (errno
+ * is set).
+ */
+int dtree_uio_wait(dtree_uio_t *uio, int timeout_ms, uint32_t *events);
+
+/**
+ * Descriptor of the UIO device (readable on interrupt) for
+ * waiting on more devices at once. An interrupt is delivered
+ * only when enabled by dtree_uio_wait() or by writing 1 (int32_t)
+ * to the descriptor.
+ */
+int dtree_uio_fd(const dtree_uio_t *uio);
+
+
+//
+// Reentrant API
+//
+
+/**
+ * Device tree context. Holds an opened device tree,
+ * its iterator and error state.
+ */
+typedef struct dtree_ctx dtree_ctx_t;
+
+/**
+ * Allocates a new (not opened) context.
+ * Returns NULL when out of memory.
+ */
+dtree_ctx_t *dtree_ctx_new(void);
+
+/**
+ * Closes the context (when opened) and free's it.
+ */
+void dtree_ctx_free(dtree_ctx_t *ctx);
+
+/**
+ * Sets number of threads used to open the context
+ * with DTREE_OPEN_PARALLEL. Zero (default) means
+ * the number of online CPUs.
+ */
+void dtree_ctx_set_threads(dtree_ctx_t *ctx, unsigned threads);
+
+/**
+ * Sets a cache file of the context (see dtree_set_cache()).
+ */
+void dtree_ctx_set_cache(dtree_ctx_t *ctx, const char *path);
+
+/**
+ * Sets the overlays directory of the context (see dtree_set_overlays()).
+ */
+void dtree_ctx_set_overlays(dtree_ctx_t *ctx, const char *path);
+
+/**
+ * Sets the memory device of the context (see dtree_set_memdev()).
+ */
+void dtree_ctx_set_memdev(dtree_ctx_t *ctx, const char *path);
+
+/**
+ * Sets the UIO directories of the context (see dtree_set_uio()).
+ */
+void dtree_ctx_set_uio(dtree_ctx_t *ctx, const char *classd, const char *devd);
+
+/**
+ * Opens device tree in the context like dtree_open_flags().
+ * It is an error (EBUSY) to open an already opened context.
+ *
+ * Returns 0 on success. On error sets error state of ctx.
+ */
+int dtree_ctx_open(dtree_ctx_t *ctx, const char *rootd, int flags);
+
+/**
+ * Opens device tree in the context like dtree_openat().
+ * Accepts the same flags as dtree_ctx_open().
+ */
+int dtree_ctx_openat(dtree_ctx_t *ctx, int dirfd, int flags);
+
+/**
+ * Closes device tree of the context. The context
+ * can be opened again.
+ */
+void dtree_ctx_close(dtree_ctx_t *ctx);
+
+/**
+ * Equivalents of the functions above operating on the context.
+ * Devices must be free'd by the context they were returned by.
+ */
+struct dtree_dev_t *dtree_ctx_next(dtree_ctx_t *ctx);
+size_t dtree_ctx_next_into(dtree_ctx_t *ctx, struct dtree_dev_t *dev, void *buf, size_t len);
+struct dtree_dev_t *dtree_ctx_byname(dtree_ctx_t *ctx, const char *name);
+struct dtree_dev_t *dtree_ctx_bycompat(dtree_ctx_t *ctx, const char *compat);
+struct dtree_dev_t **dtree_ctx_bycompat_all(dtree_ctx_t *ctx, const char *compat);
+struct dtree_dev_t *dtree_ctx_byaddr(dtree_ctx_t *ctx, dtree_addr_t addr);
+struct dtree_dev_t **dtree_ctx_byrange(dtree_ctx_t *ctx,
+		dtree_addr_t base, dtree_addr_t high);
+struct dtree_dev_t *dtree_ctx_find(dtree_ctx_t *ctx, const struct dtree_filter *filter);
+struct dtree_dev_t *dtree_ctx_bypath(dtree_ctx_t *ctx, const char *path);
+struct dtree_dev_t *dtree_ctx_byphandle(dtree_ctx_t *ctx, uint32_t phandle);
+size_t dtree_ctx_byrefs(dtree_ctx_t *ctx, const void *refs, size_t len, const char *cells,
+		struct dtree_dev_t **devs, size_t n);
+int dtree_ctx_reset(dtree_ctx_t *ctx);
+int dtree_ctx_refresh(dtree_ctx_t *ctx);
+int dtree_ctx_refresh_fd(const dtree_ctx_t *ctx);
+struct dtree_map_t *dtree_ctx_dev_map(dtree_ctx_t *ctx, const struct dtree_dev_t *dev);
+struct dtree_map_t *dtree_ctx_addr_map(dtree_ctx_t *ctx, dtree_addr_t base, size_t len);
+dtree_uio_t *dtree_ctx_uio_open(dtree_ctx_t *ctx, const struct dtree_dev_t *dev);
+void dtree_ctx_dev_free(dtree_ctx_t *ctx, struct dtree_dev_t *dev);
+void dtree_ctx_devs_free(dtree_ctx_t *ctx, struct dtree_dev_t **devs);
+
+/**
+ * Error state of the context (see dtree_iserror()
+ * and dtree_errstr()).
+ */
+int dtree_ctx_iserror(const dtree_ctx_t *ctx);
+const char *dtree_ctx_errstr(const dtree_ctx_t *ctx);
+
+
+//
+// Shared snapshot
+//
+
+/**
+ * Snapshot shared by threads. One thread (the writer) loads
+ * the tree and publishes it, other threads (readers) query it
+ * through their own contexts.
+ *
+ * Readers do not lock nor write any shared memory while querying.
+ * Each reader pins the version it has opened (by a hazard pointer)
+ * and keeps it until dtree_ctx_refresh() or close. A published
+ * version is never modified, the old one is free'd when no reader
+ * pins it anymore.
+ */
+typedef struct dtree_shared dtree_shared_t;
+
+/**
+ * Allocates an empty shared snapshot.
+ * Returns NULL when out of memory.
+ */
+dtree_shared_t *dtree_shared_new(void);
+
+/**
+ * Free's the shared snapshot. All contexts opened
+ * by dtree_ctx_open_shared() must be closed before.
+ */
+void dtree_shared_free(dtree_shared_t *sh);
+
+/**
+ * Publishes the snapshot of the context (opened with
+ * DTREE_OPEN_SNAPSHOT, _PARALLEL, _WATCH or from a cache)
+ * as the current version. Readers opening or refreshing
+ * their contexts from now on get this version. On success,
+ * the context is closed (its snapshot is taken).
+ *
+ * Returns 0 on success. On error sets error state of ctx.
+ */
+int dtree_shared_publish(dtree_shared_t *sh, dtree_ctx_t *ctx);
+
+/**
+ * Opens the context as a reader of the current version
+ * of the shared snapshot (ENOENT when nothing is published).
+ * dtree_ctx_refresh() moves it to the latest version.
+ * Devices are valid after the version is left.
+ *
+ * Returns 0 on success. On error sets error state of ctx.
+ */
+int dtree_ctx_open_shared(dtree_ctx_t *ctx, dtree_shared_t *sh);
+
 #endif
@@ -0,0 +1,96 @@
+/**
+ * Internal interface of device tree implementations.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ */
+
+#ifndef DTREE_BACKEND
+#define DTREE_BACKEND
+
+#include "dtree.h"
+#include "dtree_error.h"
+#include <stddef.h>
+
+struct dtree_impl;
+
+/**
+ * Operations of an implementation. Each opened
+ * implementation is represented by its state
+ * starting with struct dtree_impl.
+ *
+ * Devices are free'd without the implementation (it can be
+ * closed already), each device must be a single block with
+ * the compat array right after the dev (see dev_is_block()).
+ * Only lazy handles of procfs are not (see dtree_procfs_dev_free()).
+ */
+struct dtree_backend {
+	void (*close)(struct dtree_impl *impl);
+	struct dtree_dev_t *(*next)(struct dtree_impl *impl);
+	int (*reset)(struct dtree_impl *impl);
+
+	// optional indexed lookups
+	struct dtree_dev_t *(*byname)(struct dtree_impl *impl, const char *name);
+	struct dtree_dev_t *(*bycompat)(struct dtree_impl *impl, const char *compat);
+	struct dtree_dev_t **(*bycompat_all)(struct dtree_impl *impl, const char *compat);
+	struct dtree_dev_t *(*byaddr)(struct dtree_impl *impl, dtree_addr_t addr);
+	struct dtree_dev_t **(*byrange)(struct dtree_impl *impl, dtree_addr_t base, dtree_addr_t high);
+	struct dtree_dev_t *(*find)(struct dtree_impl *impl, const struct dtree_filter *f);
+
+	// optional lookup by a path (validated, relative to the root),
+	// must not affect the iterator
+	struct dtree_dev_t *(*bypath)(struct dtree_impl *impl, const char *path);
+
+	// optional lookup by a phandle: stores the device (NULL when the node
+	// is not a device) and the value of the property cells of the node
+	// (UINT32_MAX when missing) when cells is not NULL, must not affect
+	// the iterator; returns 1 when found, 0 for unknown phandle, -1 on error
+	int (*byphandle)(struct dtree_impl *impl, uint32_t phandle, const char *cells,
+			uint32_t *ncells, struct dtree_dev_t **dev);
+
+	// optional iteration into a caller's buffer (see dtree_next_into()),
+	// must not move the iterator when the buffer is too small
+	size_t (*next_into)(struct dtree_impl *impl, struct dtree_dev_t *dev, void *buf, size_t len);
+
+	// optional parallel load of all devices into a snapshot
+	int (*scan)(struct dtree_impl *impl, unsigned threads, struct dtree_impl *snap);
+};
+
+/**
+ * Common part of the state of every implementation.
+ * Errors are reported into err (owned by the context).
+ */
+struct dtree_impl {
+	const struct dtree_backend *backend;
+	struct dtree_error *err;
+};
+
+/**
+ * Tests whether the device is a single block (its compat
+ * array follows the dev) to be released by free().
+ */
+static inline
+int dev_is_block(const struct dtree_dev_t *dev)
+{
+	return dev->compat == (const char **) (dev + 1);
+}
+
+/**
+ * Places the NULL-terminated compat array of entries pointers
+ * followed by extra bytes into the caller's buffer (aligned
+ * for pointers). Stores the required length into need.
+ *
+ * Returns the array or NULL when the buffer is too small.
+ */
+static inline
+const char **dev_buf_array(void *buf, size_t len, size_t entries, size_t extra, size_t *need)
+{
+	const size_t pad = -(uintptr_t) buf & (sizeof(char *) - 1);
+
+	*need = pad + (entries + 1) * sizeof(char *) + extra;
+	if(*need > len)
+		return NULL;
+
+	return (const char **) ((char *) buf + pad);
+}
+
+#endif
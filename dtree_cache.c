@@ -0,0 +1,145 @@
+/**
+ * dtree_cache.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree_cache.h"
+#include "dtree_error.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * FNV-1a (64 b) hash of the whole file.
+ */
+static
+int file_hash(int fd, uint64_t *hash)
+{
+	char buf[4096];
+	off_t off = 0;
+	uint64_t h = 14695981039346656037ull;
+
+	for(;;) {
+		ssize_t rlen = pread(fd, buf, sizeof(buf), off);
+		if(rlen < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if(rlen == 0)
+			break;
+
+		for(ssize_t i = 0; i < rlen; ++i) {
+			h ^= (uint8_t) buf[i];
+			h *= 1099511628211ull;
+		}
+
+		off += rlen;
+	}
+
+	*hash = h;
+	return 0;
+}
+
+int dtree_cache_stamp(int fd, struct dtree_snap_stamp *stamp, struct dtree_error *err)
+{
+	struct stat st;
+
+	memset(stamp, 0, sizeof(*stamp));
+
+	if(fstat(fd, &st))
+		goto clean_and_exit;
+
+	if(S_ISREG(st.st_mode)) {
+		// a copy of the same blob is the same tree
+		stamp->size = st.st_size;
+		if(file_hash(fd, &stamp->hash))
+			goto clean_and_exit;
+
+		return 0;
+	}
+
+	stamp->dev   = st.st_dev;
+	stamp->ino   = st.st_ino;
+	stamp->mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000u + st.st_mtim.tv_nsec;
+	return 0;
+
+clean_and_exit:
+	dtree_error_from_errno(err);
+	return -1;
+}
+
+struct dtree_impl *dtree_cache_open(const char *path, const struct dtree_snap_stamp *stamp,
+		struct dtree_error *err)
+{
+	struct stat st;
+
+	// any unreadable cache is just rebuilt
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return NULL;
+
+	struct dtree_impl *snap = NULL;
+
+	// do not trust a file planted by somebody else (eg. in /tmp)
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	&& (st.st_uid == geteuid() || st.st_uid == 0))
+		snap = dtree_snap_map(fd, stamp, err);
+
+	close(fd); // the mapping stays valid
+	return snap;
+}
+
+int dtree_cache_save(const char *path, const struct dtree_snap_stamp *stamp,
+		struct dtree_impl *snap)
+{
+	const size_t tmplen = strlen(path) + sizeof(".XXXXXX");
+	char *tmp = malloc(tmplen);
+	int fd = -1;
+
+	if(tmp == NULL) {
+		dtree_error_from_errno(snap->err);
+		return -1;
+	}
+
+	snprintf(tmp, tmplen, "%s.XXXXXX", path);
+
+	// written aside and renamed, readers see the old or the new one
+	fd = mkstemp(tmp);
+	if(fd == -1) {
+		dtree_error_from_errno(snap->err);
+		free(tmp);
+		return -1;
+	}
+
+	if(fchmod(fd, 0644) || dtree_snap_save(snap, fd, stamp))
+		goto clean_and_exit;
+
+	if(close(fd)) {
+		fd = -1;
+		goto clean_and_exit;
+	}
+
+	fd = -1;
+	if(rename(tmp, path))
+		goto clean_and_exit;
+
+	free(tmp);
+	return 0;
+
+clean_and_exit:
+	if(!dtree_error_isset(snap->err))
+		dtree_error_from_errno(snap->err);
+	if(fd != -1)
+		close(fd);
+
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
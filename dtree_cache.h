@@ -0,0 +1,45 @@
+/**
+ * Internal persistent cache of snapshots.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * The cache is a snapshot saved into a file together
+ * with a stamp of the tree it was read from. A directory
+ * tree is stamped by the device, inode and mtime of its
+ * root (changes deeper in the tree are not detected),
+ * a blob by its size and hash of its contents.
+ */
+
+#ifndef DTREE_CACHE
+#define DTREE_CACHE
+
+#include "dtree_backend.h"
+#include "dtree_snap.h"
+
+/**
+ * Computes the stamp of the opened root (a directory
+ * or a blob).
+ *
+ * Returns 0 on success. On error sets err.
+ */
+int dtree_cache_stamp(int fd, struct dtree_snap_stamp *stamp, struct dtree_error *err);
+
+/**
+ * Maps the cache file when it is valid for the stamp.
+ * The file must be owned by the user or root.
+ *
+ * Returns NULL when the cache is missing or stale (err
+ * is untouched) or on error (sets err).
+ */
+struct dtree_impl *dtree_cache_open(const char *path, const struct dtree_snap_stamp *stamp,
+		struct dtree_error *err);
+
+/**
+ * Replaces the cache file atomically by the snapshot.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_cache_save(const char *path, const struct dtree_snap_stamp *stamp,
+		struct dtree_impl *snap);
+
+#endif
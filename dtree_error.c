@@ -6,61 +6,70 @@
 #include <assert.h>
 
 /**
- * Error state.
+ * Error state of the default context.
  */
-static int error = 0;
-
-/**
- * Holds errno. It is valid when error
- * is less then zero.
- */
-static int xerrno = 0;
+static struct dtree_error g_error;
 
 #define ERRSTR_COUNT ((int) (sizeof(errstr)/sizeof(char *)))
 static const char *errstr[] = {
 	[0]                       = "Successful",
-	[DTREE_ECANT_READ_ROOT]   = "Can not read the root dir"
+	[DTREE_ECANT_READ_ROOT]   = "Can not read the root dir",
+	[DTREE_EBAD_FDT]          = "Invalid flattened device tree blob"
 };
 
-void dtree_error_clear(void)
+struct dtree_error *dtree_default_error(void)
+{
+	return &g_error;
+}
+
+void dtree_error_clear(struct dtree_error *err)
 {
-	error  = 0;
-	xerrno = 0;
+	err->error  = 0;
+	err->xerrno = 0;
 }
 
-void dtree_error_set(int e)
+void dtree_error_set(struct dtree_error *err, int e)
 {
 	assert(e != 0);
 
-	error  = e;
-	xerrno = errno;
+	err->error  = e;
+	err->xerrno = errno;
 }
 
-void dtree_errno_set(int e)
+void dtree_errno_set(struct dtree_error *err, int e)
 {
-	error  = -1;
-	xerrno = e;
+	err->error  = -1;
+	err->xerrno = e;
 }
 
-void dtree_error_from_errno(void)
+void dtree_error_from_errno(struct dtree_error *err)
 {
 	if(errno != 0)
-		dtree_errno_set(errno);
+		dtree_errno_set(err, errno);
 }
 
-int dtree_iserror(void)
+int dtree_error_isset(const struct dtree_error *err)
 {
-	return error != 0;
+	return err->error != 0;
 }
 
-const char *dtree_errstr(void)
+const char *dtree_error_str(const struct dtree_error *err)
 {
-	if(error >= 0 && error < ERRSTR_COUNT)
-		return errstr[error];
+	if(err->error >= 0 && err->error < ERRSTR_COUNT)
+		return errstr[err->error];
 
-	if(error < 0)
-		return strerror(xerrno);
+	if(err->error < 0)
+		return strerror(err->xerrno);
 
 	return "Unknown error occured";
 }
 
+int dtree_iserror(void)
+{
+	return dtree_error_isset(&g_error);
+}
+
+const char *dtree_errstr(void)
+{
+	return dtree_error_str(&g_error);
+}
@@ -8,11 +8,30 @@
 #define DTREE_ERROR
 
 #define DTREE_ECANT_READ_ROOT   1
+#define DTREE_EBAD_FDT          2
+
+/**
+ * Error state (one per context).
+ */
+struct dtree_error {
+	/**
+	 * Error code. When negative, xerrno
+	 * holds the errno.
+	 */
+	int error;
+	int xerrno;
+};
+
+/**
+ * Error state of the default context
+ * (used by the non-reentrant API).
+ */
+struct dtree_error *dtree_default_error(void);
 
 /**
  * Clears current error state.
  */
-void dtree_error_clear(void);
+void dtree_error_clear(struct dtree_error *err);
 
 /**
  * Sets error state. When negative it assumes that
@@ -20,19 +39,28 @@ void dtree_error_clear(void);
  * internal error code.
  * Passing zero is an error.
  */
-void dtree_error_set(int e);
+void dtree_error_set(struct dtree_error *err, int e);
 
 /**
  * Sets error state to negative and internal errno
  * to the given value.
  */
-void dtree_errno_set(int e);
+void dtree_errno_set(struct dtree_error *err, int e);
 
 /**
  * Tests errno and if it describes and error
  * it sets the error state.
  */
-void dtree_error_from_errno(void);
+void dtree_error_from_errno(struct dtree_error *err);
 
-#endif
+/**
+ * Tests whether the error state is set.
+ */
+int dtree_error_isset(const struct dtree_error *err);
+
+/**
+ * Description of the error state.
+ */
+const char *dtree_error_str(const struct dtree_error *err);
 
+#endif
@@ -0,0 +1,869 @@
+/**
+ * dtree_fdt.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "dtree_error.h"
+#include "dtree_fdt.h"
+#include "dtree_filter.h"
+#include "dtree_phandle.h"
+#include "dtree_backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FDT_MAGIC       0xD00DFEED
+#define FDT_HEADER_LEN  40
+#define FDT_MIN_VERSION 16
+
+#define FDT_BEGIN_NODE  0x1
+#define FDT_END_NODE    0x2
+#define FDT_PROP        0x3
+#define FDT_NOP         0x4
+#define FDT_END         0x9
+
+/**
+ * State of an opened blob.
+ */
+struct dtree_fdt {
+	struct dtree_impl impl;
+
+	/**
+	 * The whole blob (mmaped or read into memory).
+	 */
+	const char *blob;
+	size_t blob_len;
+	int blob_mapped;
+
+	/**
+	 * Location of the structure and strings blocks
+	 * inside of the blob.
+	 */
+	const char *structs;
+	uint32_t struct_len;
+	const char *strings;
+	uint32_t strings_len;
+
+	/**
+	 * Iterator: offset of the next token in the structure block.
+	 */
+	uint32_t pos;
+	uint32_t depth;
+
+	/**
+	 * Index of phandles to offsets of their FDT_BEGIN_NODE
+	 * tokens, built by the first lookup.
+	 */
+	struct dtree_phandles phandles;
+	uint32_t root_off;
+	int ph_indexed;
+};
+
+static const struct dtree_backend fdt_backend;
+static const struct dtree_filter fdt_any;
+
+static inline
+uint32_t fdt32(const char *p)
+{
+	const uint8_t *u = (const uint8_t *) p;
+	return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16)
+	     | ((uint32_t) u[2] << 8)  |  (uint32_t) u[3];
+}
+
+static inline
+uint32_t fdt_align(uint32_t off)
+{
+	return (off + 3) & ~((uint32_t) 3);
+}
+
+static
+void *fdt_read_file(int fd, size_t *flen)
+{
+	size_t cap = 4096;
+	size_t len = 0;
+	char *m = malloc(cap);
+	if(m == NULL)
+		return NULL;
+
+	ssize_t rlen;
+	while((rlen = read(fd, m + len, cap - len)) > 0) {
+		len += rlen;
+		if(len < cap)
+			continue;
+
+		char *bigger = realloc(m, cap * 2);
+		if(bigger == NULL) {
+			free(m);
+			return NULL;
+		}
+
+		m = bigger;
+		cap *= 2;
+	}
+
+	if(rlen < 0) {
+		free(m);
+		return NULL;
+	}
+
+	*flen = len;
+	return m;
+}
+
+/**
+ * Maps the file into memory. Some files (eg. /sys/firmware/fdt)
+ * can not be mmaped, they are read into a buffer instead.
+ */
+static
+int fdt_map_file(struct dtree_fdt *f, const char *fdtf)
+{
+	int fd = open(fdtf, O_RDONLY);
+	if(fd == -1)
+		return 1;
+
+	struct stat st;
+	if(fstat(fd, &st)) {
+		close(fd);
+		return 1;
+	}
+
+	if(st.st_size > 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(m != MAP_FAILED) {
+			f->blob = m;
+			f->blob_len = st.st_size;
+			f->blob_mapped = 1;
+			close(fd);
+			return 0;
+		}
+	}
+
+	f->blob = fdt_read_file(fd, &f->blob_len);
+	f->blob_mapped = 0;
+	close(fd);
+
+	return f->blob == NULL;
+}
+
+static
+void fdt_unmap_file(struct dtree_fdt *f)
+{
+	if(f->blob == NULL)
+		return;
+
+	if(f->blob_mapped)
+		munmap((void *) f->blob, f->blob_len);
+	else
+		free((void *) f->blob);
+
+	f->blob = NULL;
+	f->blob_len = 0;
+	f->blob_mapped = 0;
+}
+
+static
+int fdt_check_header(struct dtree_fdt *f)
+{
+	if(f->blob_len < FDT_HEADER_LEN)
+		return 1;
+
+	if(fdt32(f->blob) != FDT_MAGIC)
+		return 1;
+
+	const uint32_t totalsize   = fdt32(f->blob + 4);
+	const uint32_t off_struct  = fdt32(f->blob + 8);
+	const uint32_t off_strings = fdt32(f->blob + 12);
+	const uint32_t version     = fdt32(f->blob + 20);
+
+	if(totalsize > f->blob_len || version < FDT_MIN_VERSION)
+		return 1;
+
+	if(off_struct % 4 || off_struct > totalsize || off_strings > totalsize)
+		return 1;
+
+	// sizes of blocks are not present in version 16
+	uint32_t size_strings = totalsize - off_strings;
+	uint32_t size_struct  = totalsize - off_struct;
+
+	if(version >= 17) {
+		size_strings = fdt32(f->blob + 32);
+		size_struct  = fdt32(f->blob + 36);
+	}
+
+	if(size_strings > totalsize - off_strings || size_struct > totalsize - off_struct)
+		return 1;
+
+	f->structs     = f->blob + off_struct;
+	f->struct_len  = size_struct;
+	f->strings     = f->blob + off_strings;
+	f->strings_len = size_strings;
+	return 0;
+}
+
+struct dtree_impl *dtree_fdt_open(const char *fdtf, struct dtree_error *err)
+{
+	if(fdtf == NULL) {
+		dtree_errno_set(err, EINVAL);
+		return NULL;
+	}
+
+	struct dtree_fdt *f = calloc(1, sizeof(*f));
+	if(f == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	f->impl.backend = &fdt_backend;
+	f->impl.err = err;
+
+	errno = 0;
+	if(fdt_map_file(f, fdtf)) {
+		dtree_error_from_errno(err);
+		free(f);
+		return NULL;
+	}
+
+	if(fdt_check_header(f)) {
+		dtree_error_set(err, DTREE_EBAD_FDT);
+		fdt_unmap_file(f);
+		free(f);
+		return NULL;
+	}
+
+	return &f->impl;
+}
+
+void dtree_fdt_close(struct dtree_impl *impl)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+
+	fdt_unmap_file(f);
+	dtree_phandles_free(&f->phandles);
+	free(f);
+}
+
+int dtree_fdt_reset(struct dtree_impl *impl)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+
+	f->pos = 0;
+	f->depth = 0;
+	return 0;
+}
+
+/**
+ * Returns the token at the given offset or 0 when
+ * it is out of the structure block.
+ */
+static
+uint32_t fdt_token(const struct dtree_fdt *f, uint32_t pos)
+{
+	if(pos > f->struct_len || f->struct_len - pos < 4)
+		return 0;
+
+	return fdt32(f->structs + pos);
+}
+
+/**
+ * Returns length of the zero-terminated string at
+ * the given offset in a block of length len or -1
+ * when it is not terminated inside the block.
+ */
+static
+ssize_t fdt_strlen(const char *block, uint32_t len, uint32_t off)
+{
+	if(off >= len)
+		return -1;
+
+	const char *end = memchr(block + off, '\0', len - off);
+	if(end == NULL)
+		return -1;
+
+	return end - (block + off);
+}
+
+/**
+ * Skips a property at pos (pointing to FDT_PROP token).
+ * Optionally returns its name and value.
+ * Returns offset of the next token or 0 when the
+ * property is malformed.
+ */
+static
+uint32_t fdt_prop(const struct dtree_fdt *f, uint32_t pos, const char **name, const char **value, uint32_t *vlen)
+{
+	if(f->struct_len - pos < 12)
+		return 0;
+
+	const uint32_t len     = fdt32(f->structs + pos + 4);
+	const uint32_t nameoff = fdt32(f->structs + pos + 8);
+
+	if(len > f->struct_len - pos - 12)
+		return 0;
+
+	if(name != NULL) {
+		if(fdt_strlen(f->strings, f->strings_len, nameoff) < 0)
+			return 0;
+
+		*name  = f->strings + nameoff;
+		*value = f->structs + pos + 12;
+		*vlen  = len;
+	}
+
+	return fdt_align(pos + 12 + len);
+}
+
+static
+const char **convert_compat(const char *compat, uint32_t len, void *mem)
+{
+	const char **array = (const char **) mem;
+	int entries = 0;
+
+	for(uint32_t off = 0; off < len; off += strlen(compat + off) + 1)
+		array[entries++] = compat + off;
+
+	array[entries] = NULL;
+	return array;
+}
+
+static
+int compat_count(const char *compat, uint32_t len)
+{
+	int entries = 0;
+
+	// each '\0' is end of an entry
+	for(uint32_t i = 0; i < len; ++i) {
+		if(compat[i] == '\0')
+			entries += 1;
+	}
+
+	return entries;
+}
+
+/**
+ * Properties of a device node.
+ */
+struct fdt_node {
+	const char *name;
+	const char *reg;
+	const char *compat;
+	uint32_t compatlen;
+	const char *status; // NULL when missing
+	uint32_t statuslen;
+};
+
+/**
+ * Parses properties of the node at f->pos (the first token
+ * after FDT_BEGIN_NODE). Leaves f->pos at the first token
+ * that is not a property (subnode or end of node).
+ *
+ * Returns 1 for a device, 0 when the node is not a device
+ * (no valid reg) and -1 on error.
+ */
+static
+int node_props(struct dtree_fdt *f, struct fdt_node *node)
+{
+	uint32_t reglen = 0;
+
+	node->reg = NULL;
+	node->compat = NULL;
+	node->compatlen = 0;
+	node->status = NULL;
+	node->statuslen = 0;
+
+	uint32_t token;
+	while((token = fdt_token(f, f->pos)) == FDT_PROP || token == FDT_NOP) {
+		if(token == FDT_NOP) {
+			f->pos += 4;
+			continue;
+		}
+
+		const char *pname;
+		const char *value;
+		uint32_t vlen;
+
+		f->pos = fdt_prop(f, f->pos, &pname, &value, &vlen);
+		if(f->pos == 0) {
+			dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+			return -1;
+		}
+
+		if(!strcmp(pname, "reg")) {
+			node->reg = value;
+			reglen = vlen;
+		}
+		else if(!strcmp(pname, "compatible")) {
+			node->compat = value;
+			node->compatlen = vlen;
+		}
+		else if(!strcmp(pname, "status")) {
+			node->status = value;
+			node->statuslen = vlen;
+		}
+	}
+
+	if(node->reg == NULL || reglen != 8)
+		return 0;
+
+	if(node->compatlen > 0 && node->compat[node->compatlen - 1] != '\0') {
+		dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ * Skips the rest of the node just entered (f->depth
+ * includes it) together with its subnodes.
+ *
+ * Returns 0 on success and -1 when the blob is malformed.
+ */
+static
+int fdt_skip_node(struct dtree_fdt *f)
+{
+	const uint32_t depth = f->depth - 1;
+
+	while(f->depth > depth) {
+		const uint32_t token = fdt_token(f, f->pos);
+		ssize_t namelen;
+
+		switch(token) {
+		case FDT_BEGIN_NODE:
+			namelen = fdt_strlen(f->structs, f->struct_len, f->pos + 4);
+			if(namelen < 0)
+				return -1;
+
+			f->pos = fdt_align(f->pos + 4 + namelen + 1);
+			f->depth += 1;
+			break;
+
+		case FDT_END_NODE:
+			f->depth -= 1;
+			f->pos += 4;
+			break;
+
+		case FDT_PROP:
+			f->pos = fdt_prop(f, f->pos, NULL, NULL, NULL);
+			if(f->pos == 0)
+				return -1;
+			break;
+
+		case FDT_NOP:
+			f->pos += 4;
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Moves to the next device node. Nodes pruned by
+ * the filter are skipped with their subnodes.
+ *
+ * Returns 1 when found, 0 at the end and -1 on error.
+ */
+static
+int fdt_next_node(struct dtree_fdt *f, struct fdt_node *node, const struct dtree_filter *filter)
+{
+	while(1) {
+		const uint32_t token = fdt_token(f, f->pos);
+		ssize_t namelen;
+		int found;
+
+		switch(token) {
+		case FDT_BEGIN_NODE:
+			namelen = fdt_strlen(f->structs, f->struct_len, f->pos + 4);
+			if(namelen < 0)
+				goto bad_fdt;
+
+			node->name = f->structs + f->pos + 4;
+			f->pos = fdt_align(f->pos + 4 + namelen + 1);
+			f->depth += 1;
+
+			if(f->depth == 1) // the root is never a device
+				break;
+
+			if(dtree_filter_prune(filter, node->name, f->depth - 1)) {
+				if(fdt_skip_node(f))
+					goto bad_fdt;
+				break;
+			}
+
+			found = node_props(f, node);
+			if(found != 0)
+				return found;
+
+			break;
+
+		case FDT_END_NODE:
+			if(f->depth == 0)
+				goto bad_fdt;
+
+			f->depth -= 1;
+			f->pos += 4;
+			break;
+
+		case FDT_PROP:
+			f->pos = fdt_prop(f, f->pos, NULL, NULL, NULL);
+			if(f->pos == 0)
+				goto bad_fdt;
+			break;
+
+		case FDT_NOP:
+			f->pos += 4;
+			break;
+
+		case FDT_END:
+			return 0;
+
+		default:
+			goto bad_fdt;
+		}
+	}
+
+bad_fdt:
+	dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+	return -1;
+}
+
+static
+void dev_fill(struct dtree_dev_t *dev, const struct fdt_node *node, void *mem)
+{
+	dev->name = node->name;
+	dev->base = fdt32(node->reg);
+	dev->high = dev->base + fdt32(node->reg + 4) - 1;
+	dev->compat = convert_compat(node->compat, node->compatlen, mem);
+}
+
+/**
+ * Enters the subnode of the given name of the node at f->pos
+ * (the first token after its FDT_BEGIN_NODE). Other subnodes
+ * are skipped. At the beginning of the structure block the
+ * root is entered by an empty name.
+ *
+ * Returns 1 when entered, 0 when not found and -1 on error.
+ */
+static
+int fdt_enter(struct dtree_fdt *f, const char *name, size_t len, struct fdt_node *node)
+{
+	while(1) {
+		const uint32_t token = fdt_token(f, f->pos);
+		ssize_t namelen;
+
+		switch(token) {
+		case FDT_BEGIN_NODE:
+			namelen = fdt_strlen(f->structs, f->struct_len, f->pos + 4);
+			if(namelen < 0)
+				return -1;
+
+			node->name = f->structs + f->pos + 4;
+			f->pos = fdt_align(f->pos + 4 + namelen + 1);
+			f->depth += 1;
+
+			if((size_t) namelen == len && !memcmp(node->name, name, len))
+				return 1;
+
+			if(fdt_skip_node(f))
+				return -1;
+			break;
+
+		case FDT_PROP:
+			f->pos = fdt_prop(f, f->pos, NULL, NULL, NULL);
+			if(f->pos == 0)
+				return -1;
+			break;
+
+		case FDT_NOP:
+			f->pos += 4;
+			break;
+
+		case FDT_END_NODE:
+		case FDT_END:
+			return 0;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+static
+struct dtree_dev_t *dev_new(struct dtree_fdt *f, const struct fdt_node *node)
+{
+	// the compat array is placed right after the dev
+	const int entries = compat_count(node->compat, node->compatlen);
+	struct dtree_dev_t *dev = malloc(sizeof(struct dtree_dev_t)
+	                                 + (entries + 1) * sizeof(char *));
+	if(dev == NULL) {
+		dtree_error_from_errno(f->impl.err);
+		return NULL;
+	}
+
+	dev_fill(dev, node, dev + 1);
+	return dev;
+}
+
+struct dtree_dev_t *dtree_fdt_next(struct dtree_impl *impl)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+	struct fdt_node node;
+
+	if(fdt_next_node(f, &node, &fdt_any) <= 0)
+		return NULL;
+
+	return dev_new(f, &node);
+}
+
+struct dtree_dev_t *dtree_fdt_find(struct dtree_impl *impl, const struct dtree_filter *filter)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+	struct fdt_node node;
+
+	// all properties are in place, only the device is allocated
+	while(fdt_next_node(f, &node, filter) > 0) {
+		const dtree_addr_t base = fdt32(node.reg);
+
+		if(dtree_filter_name(filter, node.name)
+		&& dtree_filter_compat(filter, node.compat, node.compatlen)
+		&& dtree_filter_status(filter, node.status, node.statuslen)
+		&& dtree_filter_range(filter, base, base + fdt32(node.reg + 4) - 1))
+			return dev_new(f, &node);
+	}
+
+	return NULL;
+}
+
+struct dtree_dev_t *dtree_fdt_bypath(struct dtree_impl *impl, const char *path)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+	const uint32_t pos = f->pos;
+	const uint32_t depth = f->depth;
+	struct dtree_dev_t *dev = NULL;
+	struct fdt_node node;
+	int found;
+
+	// the iterator is borrowed for the walk
+	f->pos = 0;
+	f->depth = 0;
+	found = fdt_enter(f, "", 0, &node);
+
+	for(const char *c = path; found > 0 && *c != '\0'; c += strspn(c, "/")) {
+		const size_t len = strcspn(c, "/");
+
+		found = fdt_enter(f, c, len, &node);
+		c += len;
+	}
+
+	if(found > 0 && f->depth > 1)
+		found = node_props(f, &node);
+	else if(found > 0) // the root is never a device
+		found = 0;
+
+	if(found > 0)
+		dev = dev_new(f, &node);
+	else if(found < 0 && !dtree_error_isset(f->impl.err))
+		dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+
+	f->pos = pos;
+	f->depth = depth;
+	return dev;
+}
+
+/**
+ * Builds the index of phandles by a single pass over
+ * the structure block.
+ */
+static
+int fdt_index(struct dtree_fdt *f)
+{
+	uint32_t pos = 0;
+	uint32_t node = 0; // the last FDT_BEGIN_NODE, properties precede subnodes
+	int root = 1;
+
+	while(1) {
+		const uint32_t token = fdt_token(f, pos);
+		const char *pname;
+		const char *value;
+		uint32_t vlen;
+		ssize_t namelen;
+
+		switch(token) {
+		case FDT_BEGIN_NODE:
+			namelen = fdt_strlen(f->structs, f->struct_len, pos + 4);
+			if(namelen < 0)
+				goto bad_fdt;
+
+			if(root)
+				f->root_off = pos;
+
+			root = 0;
+			node = pos;
+			pos = fdt_align(pos + 4 + namelen + 1);
+			break;
+
+		case FDT_PROP:
+			pos = fdt_prop(f, pos, &pname, &value, &vlen);
+			if(pos == 0)
+				goto bad_fdt;
+
+			if(vlen == 4 && (!strcmp(pname, "phandle") || !strcmp(pname, "linux,phandle"))
+			&& dtree_phandles_add(&f->phandles, fdt32(value), node)) {
+				dtree_errno_set(f->impl.err, ENOMEM);
+				dtree_phandles_free(&f->phandles);
+				return -1;
+			}
+			break;
+
+		case FDT_END_NODE:
+		case FDT_NOP:
+			pos += 4;
+			break;
+
+		case FDT_END:
+			f->ph_indexed = 1;
+			return 0;
+
+		default:
+			goto bad_fdt;
+		}
+	}
+
+bad_fdt:
+	dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+	dtree_phandles_free(&f->phandles);
+	return -1;
+}
+
+/**
+ * Returns the value of a single cell property of the node
+ * at f->pos (the first token after FDT_BEGIN_NODE) or
+ * UINT32_MAX when it is missing.
+ */
+static
+uint32_t node_cells(struct dtree_fdt *f, const char *cells)
+{
+	uint32_t token;
+
+	while((token = fdt_token(f, f->pos)) == FDT_PROP || token == FDT_NOP) {
+		const char *pname;
+		const char *value;
+		uint32_t vlen;
+
+		if(token == FDT_NOP) {
+			f->pos += 4;
+			continue;
+		}
+
+		f->pos = fdt_prop(f, f->pos, &pname, &value, &vlen);
+		if(f->pos == 0) {
+			dtree_error_set(f->impl.err, DTREE_EBAD_FDT);
+			break;
+		}
+
+		if(!strcmp(pname, cells))
+			return vlen == 4? fdt32(value) : UINT32_MAX;
+	}
+
+	return UINT32_MAX;
+}
+
+int dtree_fdt_byphandle(struct dtree_impl *impl, uint32_t phandle, const char *cells,
+		uint32_t *ncells, struct dtree_dev_t **dev)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+	const uint32_t pos = f->pos;
+	const uint32_t depth = f->depth;
+	struct fdt_node node;
+	uint32_t off;
+
+	*dev = NULL;
+
+	if(!f->ph_indexed && fdt_index(f))
+		return -1;
+
+	if(!dtree_phandles_get(&f->phandles, phandle, &off))
+		return 0;
+
+	// the iterator is borrowed, the name was checked by the index
+	node.name = f->structs + off + 4;
+	const uint32_t props = fdt_align(off + 4 + strlen(node.name) + 1);
+
+	f->pos = props;
+	if(off != f->root_off && node_props(f, &node) > 0)
+		*dev = dev_new(f, &node);
+
+	if(cells != NULL && !dtree_error_isset(f->impl.err)) {
+		f->pos = props;
+		*ncells = node_cells(f, cells);
+	}
+
+	f->pos = pos;
+	f->depth = depth;
+
+	if(dtree_error_isset(f->impl.err)) {
+		if(*dev != NULL)
+			dtree_fdt_dev_free(*dev);
+
+		*dev = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+size_t dtree_fdt_next_into(struct dtree_impl *impl, struct dtree_dev_t *dev, void *buf, size_t len)
+{
+	struct dtree_fdt *f = (struct dtree_fdt *) impl;
+	const uint32_t pos = f->pos;
+	const uint32_t depth = f->depth;
+	struct fdt_node node;
+	size_t need;
+
+	if(fdt_next_node(f, &node, &fdt_any) <= 0)
+		return 0;
+
+	// strings stay in the blob, only the compat array is stored
+	void *mem = dev_buf_array(buf, len, compat_count(node.compat, node.compatlen), 0, &need);
+	if(mem == NULL) {
+		f->pos = pos; // the same node again
+		f->depth = depth;
+		return need;
+	}
+
+	dev_fill(dev, &node, mem);
+	return need;
+}
+
+void dtree_fdt_dev_free(struct dtree_dev_t *dev)
+{
+	assert(dev != NULL);
+
+	// name and compat point into the blob or dev
+	dev->name   = NULL;
+	dev->compat = NULL;
+	dev->base = 0;
+	dev->high = 0;
+
+	free(dev);
+}
+
+static const struct dtree_backend fdt_backend = {
+	.close     = dtree_fdt_close,
+	.next      = dtree_fdt_next,
+	.next_into = dtree_fdt_next_into,
+	.reset     = dtree_fdt_reset,
+	.find      = dtree_fdt_find,
+	.bypath    = dtree_fdt_bypath,
+	.byphandle = dtree_fdt_byphandle,
+};
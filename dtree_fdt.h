@@ -0,0 +1,70 @@
+/**
+ * Internal flattened device tree (DTB) implementation.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ */
+
+#ifndef DTREE_FDT
+#define DTREE_FDT
+
+#include "dtree_backend.h"
+
+/**
+ * Maps the flattened device tree blob at the given path.
+ * Most common: /sys/firmware/fdt or any *.dtb file.
+ *
+ * The blob is accessed in place, names and compatible
+ * strings of devices point into the mapping.
+ *
+ * Returns a new state or NULL and sets err.
+ */
+struct dtree_impl *dtree_fdt_open(const char *fdtf, struct dtree_error *err);
+
+/**
+ * Unmaps the blob and free's all resources.
+ */
+void dtree_fdt_close(struct dtree_impl *impl);
+
+/**
+ * Traversing over the structure block.
+ */
+struct dtree_dev_t *dtree_fdt_next(struct dtree_impl *impl);
+
+/**
+ * Traversing into the caller's buffer. Strings
+ * of the device point into the blob.
+ */
+size_t dtree_fdt_next_into(struct dtree_impl *impl, struct dtree_dev_t *dev, void *buf, size_t len);
+
+/**
+ * Looks up the next device matching the filter. Pruned
+ * subtrees are skipped without parsing their properties.
+ */
+struct dtree_dev_t *dtree_fdt_find(struct dtree_impl *impl, const struct dtree_filter *filter);
+
+/**
+ * Looks up the node of the path (relative to the root). Only
+ * the nodes on the path are entered, the others are skipped
+ * without parsing. Does not affect the iteration.
+ */
+struct dtree_dev_t *dtree_fdt_bypath(struct dtree_impl *impl, const char *path);
+
+/**
+ * Looks up the node of the phandle. The index of phandles
+ * is built by the first lookup (a pass over the structure
+ * block). Does not affect the iteration.
+ */
+int dtree_fdt_byphandle(struct dtree_impl *impl, uint32_t phandle, const char *cells,
+		uint32_t *ncells, struct dtree_dev_t **dev);
+
+/**
+ * Free of dtree_dev_t returned by fdt functions.
+ */
+void dtree_fdt_dev_free(struct dtree_dev_t *dev);
+
+/**
+ * Reset of iteration over the structure block.
+ */
+int dtree_fdt_reset(struct dtree_impl *impl);
+
+#endif
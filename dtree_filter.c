@@ -0,0 +1,84 @@
+/**
+ * dtree_filter.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "dtree_filter.h"
+
+#include <string.h>
+
+int dtree_filter_prune(const struct dtree_filter *f, const char *name, unsigned depth)
+{
+	return f->prune != NULL && f->prune(name, depth, f->arg);
+}
+
+int dtree_filter_name(const struct dtree_filter *f, const char *name)
+{
+	if(f->name != NULL && strcmp(f->name, name))
+		return 0;
+
+	if(f->basename != NULL) {
+		const size_t len = strlen(f->basename);
+
+		// the unit address (if any) follows '@'
+		if(strncmp(f->basename, name, len) || (name[len] != '\0' && name[len] != '@'))
+			return 0;
+	}
+
+	return 1;
+}
+
+int dtree_filter_compat(const struct dtree_filter *f, const char *compat, size_t len)
+{
+	if(f->compat == NULL)
+		return 1;
+
+	for(size_t off = 0; off < len; off += strlen(compat + off) + 1) {
+		if(!strcmp(compat + off, f->compat))
+			return 1;
+	}
+
+	return 0;
+}
+
+int dtree_filter_status(const struct dtree_filter *f, const char *status, size_t len)
+{
+	if(!(f->flags & DTREE_FIND_OKAY) || status == NULL)
+		return 1;
+
+	// the value is terminated by '\0' (included in len)
+	return (len == sizeof("okay") && !memcmp(status, "okay", len))
+	    || (len == sizeof("ok")   && !memcmp(status, "ok", len));
+}
+
+int dtree_filter_range(const struct dtree_filter *f, dtree_addr_t base, dtree_addr_t high)
+{
+	if(!(f->flags & DTREE_FIND_RANGE))
+		return 1;
+
+	// when the high is not valid, the device occupies just the base
+	if(high < base)
+		high = base;
+
+	return base <= f->high && high >= f->base;
+}
+
+int dtree_filter_dev(const struct dtree_filter *f, const struct dtree_dev_t *dev)
+{
+	if(!dtree_filter_name(f, dtree_dev_name(dev)))
+		return 0;
+
+	if(f->compat != NULL) {
+		const char **compat = dtree_dev_compat(dev);
+		int found = 0;
+
+		for(int i = 0; compat[i] != NULL && !found; ++i)
+			found = !strcmp(compat[i], f->compat);
+
+		if(!found)
+			return 0;
+	}
+
+	return dtree_filter_range(f, dtree_dev_base(dev), dtree_dev_high(dev));
+}
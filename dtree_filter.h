@@ -0,0 +1,47 @@
+/**
+ * Internal evaluation of struct dtree_filter.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * Each condition can be tested separately so the backends
+ * can test them in the order of costs of reading them.
+ */
+
+#ifndef DTREE_FILTER
+#define DTREE_FILTER
+
+#include "dtree.h"
+#include <stddef.h>
+
+/**
+ * Tests whether the node is pruned (with its subtree).
+ */
+int dtree_filter_prune(const struct dtree_filter *f, const char *name, unsigned depth);
+
+/**
+ * Tests the name and basename.
+ */
+int dtree_filter_name(const struct dtree_filter *f, const char *name);
+
+/**
+ * Tests the compatible list as read from the tree (entries
+ * terminated by '\0', len is the length of all of them).
+ */
+int dtree_filter_compat(const struct dtree_filter *f, const char *compat, size_t len);
+
+/**
+ * Tests the status property (NULL when missing).
+ */
+int dtree_filter_status(const struct dtree_filter *f, const char *status, size_t len);
+
+/**
+ * Tests the address range of the device.
+ */
+int dtree_filter_range(const struct dtree_filter *f, dtree_addr_t base, dtree_addr_t high);
+
+/**
+ * Tests all conditions except status on a device.
+ */
+int dtree_filter_dev(const struct dtree_filter *f, const struct dtree_dev_t *dev);
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * dtree_map.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree_map.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct dtree_map_t *dtree_map_open(const char *memdev, dtree_addr_t base, size_t len,
+		struct dtree_error *err)
+{
+	struct dtree_map_t *m = NULL;
+	int fd = -1;
+
+	if(len == 0 || base + len - 1 < base) {
+		dtree_errno_set(err, EINVAL);
+		return NULL;
+	}
+
+	const long pagesize = sysconf(_SC_PAGESIZE);
+	const dtree_addr_t offset = base % (dtree_addr_t) pagesize;
+
+	m = malloc(sizeof(*m));
+	if(m == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	m->addr = base;
+	m->len = len;
+	m->pages_len = offset + len;
+
+	fd = open(memdev == NULL? DTREE_MAP_MEMDEV : memdev, O_RDWR | O_SYNC | O_CLOEXEC);
+	if(fd < 0) {
+		dtree_error_from_errno(err);
+		goto clean_and_exit;
+	}
+
+	m->pages = mmap(NULL, m->pages_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			(off_t) (base - offset));
+	if(m->pages == MAP_FAILED) {
+		dtree_error_from_errno(err);
+		goto clean_and_exit;
+	}
+
+	close(fd);
+	m->base = (unsigned char *) m->pages + offset;
+	return m;
+
+clean_and_exit:
+	if(fd >= 0)
+		close(fd);
+
+	free(m);
+	return NULL;
+}
+
+void dtree_map_free(struct dtree_map_t *m)
+{
+	if(m == NULL)
+		return;
+
+	munmap(m->pages, m->pages_len);
+	free(m);
+}
+
+/**
+ * Widest access (4, 2 or 1) aligned at the address that fits into len.
+ */
+static inline
+size_t access_width(const volatile void *p, size_t len)
+{
+	const uintptr_t addr = (uintptr_t) p;
+
+	if((addr & 3) == 0 && len >= 4)
+		return 4;
+	if((addr & 1) == 0 && len >= 2)
+		return 2;
+
+	return 1;
+}
+
+/**
+ * Copies one access of the width. The buffer
+ * need not be aligned.
+ */
+static inline
+void access_store(volatile uint8_t *dst, const uint8_t *src, size_t width)
+{
+	uint32_t w;
+	uint16_t h;
+
+	switch(width) {
+	case 4:
+		memcpy(&w, src, 4);
+		*(volatile uint32_t *) dst = w;
+		break;
+
+	case 2:
+		memcpy(&h, src, 2);
+		*(volatile uint16_t *) dst = h;
+		break;
+
+	default:
+		*dst = *src;
+		break;
+	}
+}
+
+static inline
+void access_load(uint8_t *dst, const volatile uint8_t *src, size_t width)
+{
+	uint32_t w;
+	uint16_t h;
+
+	switch(width) {
+	case 4:
+		w = *(const volatile uint32_t *) src;
+		memcpy(dst, &w, 4);
+		break;
+
+	case 2:
+		h = *(const volatile uint16_t *) src;
+		memcpy(dst, &h, 2);
+		break;
+
+	default:
+		*dst = *src;
+		break;
+	}
+}
+
+size_t dtree_map_write_block(const struct dtree_map_t *m, size_t off,
+		const void *buf, size_t len)
+{
+	volatile uint8_t *dst = (volatile uint8_t *) m->base + off;
+	const uint8_t *src = buf;
+	size_t left = len;
+
+	while(left > 0) {
+		const size_t width = access_width(dst, left);
+
+		access_store(dst, src, width);
+		dst  += width;
+		src  += width;
+		left -= width;
+	}
+
+	return len;
+}
+
+size_t dtree_map_read_block(const struct dtree_map_t *m, size_t off,
+		void *buf, size_t len)
+{
+	const volatile uint8_t *src = (const volatile uint8_t *) m->base + off;
+	uint8_t *dst = buf;
+	size_t left = len;
+
+	while(left > 0) {
+		const size_t width = access_width(src, left);
+
+		access_load(dst, src, width);
+		dst  += width;
+		src  += width;
+		left -= width;
+	}
+
+	return len;
+}
+
+size_t dtree_map_write_fifo(const struct dtree_map_t *m, size_t off,
+		const void *buf, size_t len, int width)
+{
+	volatile uint8_t *reg = (volatile uint8_t *) m->base + off;
+	const uint8_t *src = buf;
+	const size_t count = len / width;
+
+	for(size_t i = 0; i < count; ++i, src += width)
+		access_store(reg, src, width);
+
+	return count * width;
+}
+
+size_t dtree_map_read_fifo(const struct dtree_map_t *m, size_t off,
+		void *buf, size_t len, int width)
+{
+	const volatile uint8_t *reg = (const volatile uint8_t *) m->base + off;
+	uint8_t *dst = buf;
+	const size_t count = len / width;
+
+	for(size_t i = 0; i < count; ++i, dst += width)
+		access_load(dst, reg, width);
+
+	return count * width;
+}
+
+/**
+ * Hint to the CPU that it spins.
+ */
+static inline
+void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline
+uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline
+uint32_t wait_read(const struct dtree_map_t *m, size_t off, int width)
+{
+	switch(width) {
+	case 1:
+		return dtree_map_read8(m, off);
+	case 2:
+		return dtree_map_read16(m, off);
+	default:
+		return dtree_map_read32(m, off);
+	}
+}
+
+int dtree_map_wait(const struct dtree_map_t *m, size_t off, int width,
+		uint32_t mask, uint32_t value, struct dtree_wait_t *w)
+{
+	const uint64_t start = clock_ns();
+	const uint64_t timeout = (uint64_t) w->timeout_us * 1000;
+	unsigned long sleep_us = 1;
+	int timedout = 0;
+
+	w->iterations = 0;
+
+	while(1) {
+		w->last = wait_read(m, off, width);
+		w->iterations += 1;
+
+		if((w->last & mask) == value)
+			break;
+
+		w->waited_ns = clock_ns() - start;
+		if(w->waited_ns >= timeout) {
+			timedout = 1;
+			break;
+		}
+
+		if(w->iterations < w->spins || w->backoff_us == 0) {
+			cpu_relax();
+			continue;
+		}
+
+		const struct timespec ts = {
+			.tv_sec  = sleep_us / 1000000,
+			.tv_nsec = (sleep_us % 1000000) * 1000,
+		};
+		nanosleep(&ts, NULL);
+
+		if(sleep_us < w->backoff_us)
+			sleep_us = sleep_us * 2 < w->backoff_us? sleep_us * 2 : w->backoff_us;
+	}
+
+	w->waited_ns = clock_ns() - start;
+	return timedout;
+}
@@ -0,0 +1,30 @@
+/**
+ * Internal mapping of physical memory.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * The memory device is opened only to create the mapping,
+ * the window stays valid after it is closed.
+ */
+
+#ifndef DTREE_MAP
+#define DTREE_MAP
+
+#include "dtree.h"
+#include "dtree_error.h"
+
+/**
+ * Default memory device.
+ */
+#define DTREE_MAP_MEMDEV "/dev/mem"
+
+/**
+ * Maps len bytes at the physical address base of the memory
+ * device memdev (NULL means the default one).
+ *
+ * Returns a new window or NULL and sets err.
+ */
+struct dtree_map_t *dtree_map_open(const char *memdev, dtree_addr_t base, size_t len,
+		struct dtree_error *err);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * dtree_phandle.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree_phandle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline
+uint32_t ph_hash(uint32_t phandle, uint32_t size)
+{
+	// phandles are mostly small and sequential
+	return (phandle * 2654435761u) & (size - 1);
+}
+
+/**
+ * Returns the slot of the phandle or the empty slot
+ * where it should be stored.
+ */
+static
+uint32_t ph_slot(const struct dtree_phandles *t, uint32_t phandle)
+{
+	uint32_t h = ph_hash(phandle, t->size);
+
+	while(t->keys[h] != 0 && t->keys[h] != phandle)
+		h = (h + 1) & (t->size - 1);
+
+	return h;
+}
+
+static
+int ph_grow(struct dtree_phandles *t)
+{
+	struct dtree_phandles bigger = {
+		.size = t->size == 0? 16 : 2 * t->size,
+	};
+
+	bigger.keys = calloc(bigger.size, sizeof(uint32_t));
+	bigger.vals = malloc(bigger.size * sizeof(uint32_t));
+	if(bigger.keys == NULL || bigger.vals == NULL) {
+		dtree_phandles_free(&bigger);
+		return -1;
+	}
+
+	for(uint32_t i = 0; i < t->size; ++i) {
+		if(t->keys[i] == 0)
+			continue;
+
+		const uint32_t h = ph_slot(&bigger, t->keys[i]);
+		bigger.keys[h] = t->keys[i];
+		bigger.vals[h] = t->vals[i];
+	}
+
+	bigger.count = t->count;
+	dtree_phandles_free(t);
+	*t = bigger;
+	return 0;
+}
+
+int dtree_phandles_add(struct dtree_phandles *t, uint32_t phandle, uint32_t val)
+{
+	if(phandle == 0 || phandle == UINT32_MAX)
+		return 0;
+
+	// at most half full
+	if(2 * (t->count + 1) > t->size && ph_grow(t))
+		return -1;
+
+	const uint32_t h = ph_slot(t, phandle);
+	if(t->keys[h] == 0) {
+		t->keys[h] = phandle;
+		t->vals[h] = val;
+		t->count += 1;
+	}
+
+	return 0;
+}
+
+int dtree_phandles_get(const struct dtree_phandles *t, uint32_t phandle, uint32_t *val)
+{
+	if(t->size == 0 || phandle == 0)
+		return 0;
+
+	const uint32_t h = ph_slot(t, phandle);
+	if(t->keys[h] == 0)
+		return 0;
+
+	*val = t->vals[h];
+	return 1;
+}
+
+void dtree_phandles_free(struct dtree_phandles *t)
+{
+	free(t->keys);
+	free(t->vals);
+	memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,47 @@
+/**
+ * Internal index of phandles.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * Maps phandles of nodes to locations of the nodes
+ * (defined by the backend, eg. an offset into the blob).
+ * Phandles 0 and 0xFFFFFFFF are not valid.
+ */
+
+#ifndef DTREE_PHANDLE
+#define DTREE_PHANDLE
+
+#include <stdint.h>
+
+/**
+ * Open addressing hash table, zero-initialized
+ * table is empty.
+ */
+struct dtree_phandles {
+	uint32_t *keys; // 0 is an empty slot
+	uint32_t *vals;
+	uint32_t size;
+	uint32_t count;
+};
+
+/**
+ * Adds the phandle unless it is already present (the first
+ * node of a duplicate phandle is kept). Invalid phandles
+ * are ignored.
+ *
+ * Returns 0 on success and -1 when out of memory.
+ */
+int dtree_phandles_add(struct dtree_phandles *t, uint32_t phandle, uint32_t val);
+
+/**
+ * Looks up the phandle.
+ * Returns 1 when found (and stores val), otherwise 0.
+ */
+int dtree_phandles_get(const struct dtree_phandles *t, uint32_t phandle, uint32_t *val);
+
+/**
+ * Free's the table, it is empty again.
+ */
+void dtree_phandles_free(struct dtree_phandles *t);
+
+#endif
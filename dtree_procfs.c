@@ -3,369 +3,559 @@
  * Copyright (C) 2013 Jan Viktorin
  */
 
+#define _GNU_SOURCE
+
 #include "dtree.h"
 #include "dtree_error.h"
 #include "dtree_util.h"
 #include "dtree_procfs.h"
+#include "dtree_filter.h"
+#include "dtree_phandle.h"
+#include "dtree_backend.h"
+#include "dtree_snap.h"
+#include "dtree_uring.h"
 #include "stack.h"
 
 #include <errno.h>
 #include <dirent.h>
-#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
-static struct stack *g_path = NULL;
-static DIR *g_dir = NULL;
-
-static const char *NULL_ENTRY = NULL;
+#if defined(__GLIBC__)
+# if !__GLIBC_PREREQ(2, 30)
+#  define DTREE_NO_GETDENTS64
+# endif
+#else
+# define DTREE_NO_GETDENTS64
+#endif
 
+#ifdef DTREE_NO_GETDENTS64
 static
-int stack_push_fname(struct stack **path, const char *fname)
+ssize_t getdents64(int fd, void *buf, size_t len)
 {
-	return stack_push_dup(path, fname, strlen(fname) + 1);
+	return syscall(SYS_getdents64, fd, buf, len);
 }
+#endif
 
-static
-void *stack_pop_fname(struct stack **path)
-{
-	return stack_pop(path);
-}
+/**
+ * Layout of entries returned by getdents64().
+ */
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
 
 /**
- * This implementation doesn't accept a regular
- * file as rootd.
+ * Size of the buffer for getdents64().
  */
-int dtree_procfs_open(const char *rootd)
-{
-	if(rootd == NULL) {
-		dtree_error_set(EINVAL);
-		return -1;
-	}
+#define DENTS_BUFSIZE 4096
 
-	if(!stack_empty(&g_path)) {
-		dtree_error_set(EBUSY); // call close first
-		return -1;
-	}
+/**
+ * Size of the stack buffers for properties of a node
+ * (longer ones are read into the heap).
+ */
+#define PROP_BUFSIZE 256
 
-	g_dir = opendir(rootd);
-	if(g_dir == NULL) {
-		dtree_error_from_errno();
-		return -1;
-	}
+/**
+ * Directory on the path from the root to the current node.
+ * Its entries are read at once when the directory is visited,
+ * names of subdirectories are remembered in children and
+ * the traversal continues from next_child when returning
+ * from a subtree. Entries are accessed relative to its fd.
+ */
+struct level {
+	int fd;
+	int visited;
+	char *children;
+	size_t children_len;
+	size_t next_child;
+	char name[];
+};
 
-	if(stack_push_fname(&g_path, rootd)) {
-		dtree_error_from_errno();
-		closedir(g_dir);
-		g_dir = NULL;
-		return -1;
-	}
+/**
+ * Regular files of a node found by load_dir().
+ */
+struct node_files {
+	int has_reg;
+	int has_compat;
+	int has_status;
+	const char *phandle; // name of the phandle file or NULL
+};
 
-	return 0;
+/**
+ * State of an opened procfs tree. The bottom
+ * of the path is always the root directory.
+ */
+struct dtree_procfs {
+	struct dtree_impl impl;
+	struct stack *path;
+	int rootfd; // owned by the bottom level
+	int lazy;
+	struct lazy_root *lazy_root; // created by the first lazy handle
+
+	// index of phandles to paths (offsets into ph_paths),
+	// built by the first lookup
+	struct dtree_phandles phandles;
+	char *ph_paths;
+	size_t ph_paths_len;
+	int ph_indexed;
+};
+
+/**
+ * Root directory shared by a lazy tree and its handles, the
+ * last one closes it. The handles do not hold a descriptor
+ * each, a wide tree would exhaust them.
+ */
+struct lazy_root {
+	int fd;
+	unsigned refs;
+	struct dtree_error *err; // of the tree, NULL when it is closed
+};
+
+/**
+ * Device handle of a lazy tree. Its properties are read
+ * by dtree_procfs_dev_load() when a getter needs them
+ * first (dev.compat is dtree_dev_unloaded until then).
+ * It is never a single block (see dev_is_block()).
+ */
+struct lazy_dev {
+	struct dtree_dev_t dev;
+	struct dtree_dev_t *loaded;
+	struct lazy_root *root; // NULL when loaded
+	int has_compat;
+	char path[]; // relative to the root, the name is its last component
+};
+
+const char *dtree_dev_unloaded[1] = {NULL};
+
+static const struct dtree_backend procfs_backend;
+
+static
+struct level *level_new(int fd, const char *name)
+{
+	const size_t namelen = strlen(name) + 1;
+	struct level *l = malloc(sizeof(struct level) + namelen);
+	if(l == NULL)
+		return NULL;
+
+	l->fd = fd;
+	l->visited = 0;
+	l->children = NULL;
+	l->children_len = 0;
+	l->next_child = 0;
+	memcpy(l->name, name, namelen);
+
+	return l;
 }
 
-void dtree_procfs_close(void)
+static
+void level_forget_children(struct level *l)
 {
-	if(g_dir != NULL) {
-		closedir(g_dir);
-		g_dir = NULL;
-	}
+	free(l->children);
+	l->children = NULL;
+	l->children_len = 0;
+	l->next_child = 0;
+}
 
-	while(!stack_empty(&g_path)) {
-		void *d = stack_pop_fname(&g_path);
-		free(d);
-	}
+/**
+ * Closes the fd of the level and free's it.
+ */
+static
+void level_free(struct level *l)
+{
+	close(l->fd);
+	level_forget_children(l);
+	free(l);
 }
 
-int dtree_procfs_reset(void)
+static
+int stack_push_level(struct stack **path, int fd, const char *name)
 {
-	if(g_dir != NULL) {
-		closedir(g_dir);
-		g_dir = NULL;
-	}
+	struct level *l = level_new(fd, name);
+	if(l == NULL)
+		return 1;
 
-	while(stack_depth(&g_path) > 1) {
-		void *p = stack_pop_fname(&g_path);
-		free(p);
+	if(stack_push(path, l)) {
+		free(l);
+		return 1;
 	}
 
-	assert(!stack_empty(&g_path));
-	g_dir = opendir(stack_top(&g_path));
-
-	return g_dir == NULL;
+	return 0;
 }
 
-static inline
-int st_is_dir(int st_mode)
+/**
+ * Pops the top level and closes its fd.
+ */
+static
+void stack_pop_level(struct stack **path)
 {
-	return S_ISDIR(st_mode);
+	struct level *l = (struct level *) stack_pop(path);
+	if(l == NULL)
+		return;
+
+	level_free(l);
 }
 
 static inline
-int st_is_file(int st_mode)
+struct level *path_top(struct stack **path)
 {
-	return S_ISREG(st_mode);
+	assert(!stack_empty(path));
+	return (struct level *) stack_top(path);
 }
 
+/**
+ * Returns the root of the lazy handles with a new reference.
+ */
 static
-const char *file_path_from_stack(struct stack **path, const char *fname)
+struct lazy_root *lazy_root_get(struct dtree_procfs *p)
 {
-	assert(fname != NULL);
-
-	const size_t fnamelen = strlen(fname);
-	struct stack *tmp = NULL;
-	size_t plen  = 0;
+	if(p->lazy_root == NULL) {
+		struct lazy_root *r = malloc(sizeof(*r));
+		if(r == NULL)
+			return NULL;
 
-	while(!stack_empty(path)) {
-		const void *frag = stack_move(path, &tmp);
-		assert(frag != NULL);
+		// not closed with the tree, handles can outlive it
+		r->fd = fcntl(p->rootfd, F_DUPFD_CLOEXEC, 0);
+		if(r->fd == -1) {
+			free(r);
+			return NULL;
+		}
 
-		plen  += strlen((const char *) frag) + 1;
+		r->refs = 1; // of the tree
+		r->err = p->impl.err;
+		p->lazy_root = r;
 	}
 
-	char *full = malloc(plen + fnamelen + 1);
-	if(full == NULL) {
-		while(!stack_empty(&tmp))
-			stack_move(&tmp, path);
+	__atomic_add_fetch(&p->lazy_root->refs, 1, __ATOMIC_RELAXED);
+	return p->lazy_root;
+}
+
+static
+void lazy_root_put(struct lazy_root *r)
+{
+	if(__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	close(r->fd);
+	free(r);
+}
 
+/**
+ * The fd of the root directory is taken by
+ * the implementation (closed by dtree_procfs_close()).
+ */
+static
+struct dtree_impl *procfs_open_fd(int fd, struct dtree_error *err)
+{
+	struct dtree_procfs *p = calloc(1, sizeof(*p));
+	if(p == NULL) {
+		dtree_error_from_errno(err);
+		close(fd);
 		return NULL;
 	}
 
-	char *p = full;
-	while(!stack_empty(&tmp)) {
-		const void *frag  = stack_move(&tmp, path);
-		const size_t flen = strlen((const char *) frag);
+	p->impl.backend = &procfs_backend;
+	p->impl.err = err;
+	p->rootfd = fd;
 
-		memcpy(p, frag, flen);
-		p[flen] = '/';
-		p += flen + 1;
+	if(stack_push_level(&p->path, fd, "")) {
+		dtree_error_from_errno(err);
+		close(fd);
+		free(p);
+		return NULL;
 	}
 
-	assert((size_t) (p - full) == plen);
+	return &p->impl;
+}
 
-	if(fnamelen > 0) {
-		memcpy(p, fname, fnamelen);
-		p[fnamelen] = '\0';
+/**
+ * This implementation doesn't accept a regular
+ * file as rootd.
+ */
+struct dtree_impl *dtree_procfs_open(const char *rootd, struct dtree_error *err)
+{
+	if(rootd == NULL) {
+		dtree_errno_set(err, EINVAL);
+		return NULL;
 	}
-	else {
-		full[plen - 1] = '\0';
+
+	int fd = open(rootd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		return NULL;
 	}
 
-	return full;
+	return procfs_open_fd(fd, err);
 }
 
-static
-FILE *path_fopen(struct stack **path, const char *fname, const char *mode)
+struct dtree_impl *dtree_procfs_openat(int dirfd, struct dtree_error *err)
 {
-	const char *fpath = file_path_from_stack(path, fname);
-	if(fpath == NULL)
-		goto clean_and_exit;
-
-	FILE *file = fopen(fpath, mode);
-	if(file == NULL)
-		goto clean_and_exit;
-
-	free((void *) fpath);
-	return file;
+	int fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
 
-clean_and_exit:
-	dtree_error_from_errno();
-	if(fpath != NULL)
-		free((void *) fpath);
-	return NULL;
+	return procfs_open_fd(fd, err);
 }
 
-static
-int path_stat(struct stack **path, const char *fname, struct stat *st)
+void dtree_procfs_close(struct dtree_impl *impl)
 {
-	const char *fpath = file_path_from_stack(path, fname);
-	if(fpath == NULL)
-		goto clean_and_exit;
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
 
-	if(stat(fpath, st))
-		goto clean_and_exit;
+	while(!stack_empty(&p->path))
+		stack_pop_level(&p->path);
 
-	free((void *) fpath);
-	return 0;
+	// the error state can be free'd with the context
+	if(p->lazy_root != NULL) {
+		p->lazy_root->err = NULL;
+		lazy_root_put(p->lazy_root);
+	}
 
-clean_and_exit:
-	dtree_error_from_errno();
-	if(fpath != NULL)
-		free((void *) fpath);
-	return 1;
+	dtree_phandles_free(&p->phandles);
+	free(p->ph_paths);
+	free(p);
 }
 
-static
-int path_is_file(struct stack **path, const char *fname)
+int dtree_procfs_reset(struct dtree_impl *impl)
 {
-	struct stat st;
-	if(path_stat(path, fname, &st))
-		return 0;
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
 
-	return st_is_file(st.st_mode);
-}
+	while(stack_depth(&p->path) > 1)
+		stack_pop_level(&p->path);
 
-static
-int path_is_dir(struct stack **path, const char *fname)
-{
-	struct stat st;
-	if(path_stat(path, fname, &st))
-		return 0;
+	struct level *root = path_top(&p->path);
+	level_forget_children(root);
+	root->visited = 0;
 
-	return st_is_dir(st.st_mode);
+	return 0;
 }
 
 static
-DIR *opendir_on_stack(struct stack **path)
+int level_add_child(struct level *l, const char *name)
 {
-	const char *fpath = file_path_from_stack(path, "");
-	if(fpath == NULL)
-		goto clean_and_exit;
-
-	DIR *dir = opendir(fpath);
-	if(dir == NULL)
-		goto clean_and_exit;
+	const size_t namelen = strlen(name) + 1;
 
-	free((void *) fpath);
-	return dir;
+	char *bigger = realloc(l->children, l->children_len + namelen);
+	if(bigger == NULL)
+		return 1;
 
-clean_and_exit:
-	dtree_error_from_errno();
-	if(fpath != NULL)
-		free((void *) fpath);
-	return NULL;
+	memcpy(bigger + l->children_len, name, namelen);
+	l->children = bigger;
+	l->children_len += namelen;
+	return 0;
 }
 
+/**
+ * Returns d_type of the entry. The type is looked up
+ * by fstatat() only if the filesystem does not provide it.
+ */
 static
-int dir_has_file(DIR *curr, struct stack **path, const char *fname)
+unsigned char dirent_type(struct dtree_error *err, int dirfd, const struct linux_dirent64 *d)
 {
-	rewinddir(curr);
-	struct dirent *d;
-
-	while((d = readdir(curr)) != NULL) {
-		if(strcmp(d->d_name, fname))
-			continue;
-
-		if(path_is_file(path, fname))
-			return 1;
+	if(d->d_type != DT_UNKNOWN)
+		return d->d_type;
 
-		if(dtree_iserror())
-			return 0;
+	struct stat st;
+	if(fstatat(dirfd, d->d_name, &st, 0)) {
+		dtree_error_from_errno(err);
+		return DT_UNKNOWN;
 	}
 
-	return 0;
+	if(S_ISDIR(st.st_mode))
+		return DT_DIR;
+	if(S_ISREG(st.st_mode))
+		return DT_REG;
+
+	return DT_UNKNOWN;
 }
 
+/**
+ * Reads all entries of the directory at once. Collects names
+ * of subdirectories into the level and looks for regular files
+ * describing a device.
+ */
 static
-DIR *open_dir_from_dirent(struct dirent *d, struct stack **path)
+int load_dir(struct dtree_error *err, struct level *l, struct node_files *files)
 {
-	if(d == NULL)
-		return NULL;
+	char buf[DENTS_BUFSIZE];
+	ssize_t len;
 
-	if(stack_push_fname(path, d->d_name)) {
-		dtree_error_from_errno();
-		return NULL;
+	memset(files, 0, sizeof(*files));
+
+	if(lseek(l->fd, 0, SEEK_SET) == -1) {
+		dtree_error_from_errno(err);
+		return 1;
 	}
 
-	return opendir_on_stack(path);
-}
+	while((len = getdents64(l->fd, buf, sizeof(buf))) > 0) {
+		for(ssize_t off = 0; off < len; ) {
+			const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + off);
+			off += d->d_reclen;
 
-static
-DIR *go_next_dir(DIR *curr, struct stack **path)
-{
-	struct dirent *d;
+			if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
 
-	while((d = readdir(curr)) != NULL) {
-		if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
-			continue;
+			switch(dirent_type(err, l->fd, d)) {
+			case DT_DIR:
+				if(level_add_child(l, d->d_name)) {
+					dtree_error_from_errno(err);
+					return 1;
+				}
+				break;
 
-		if(path_is_dir(path, d->d_name))
-			break;
+			case DT_REG:
+				if(!strcmp(d->d_name, "reg"))
+					files->has_reg = 1;
+				else if(!strcmp(d->d_name, "compatible"))
+					files->has_compat = 1;
+				else if(!strcmp(d->d_name, "status"))
+					files->has_status = 1;
+				else if(!strcmp(d->d_name, "phandle"))
+					files->phandle = "phandle";
+				else if(!strcmp(d->d_name, "linux,phandle") && files->phandle == NULL)
+					files->phandle = "linux,phandle";
+				break;
 
-		if(dtree_iserror())
-			return NULL;
+			default:
+				if(dtree_error_isset(err))
+					return 1;
+				break;
+			}
+		}
+	}
+
+	if(len < 0) {
+		dtree_error_from_errno(err);
+		return 1;
 	}
 
-	return open_dir_from_dirent(d, path);
+	return 0;
 }
 
+/**
+ * Enters the next subdirectory of the current directory
+ * that is not pruned by the filter.
+ * Returns non-zero when a subdirectory was entered.
+ */
 static
-DIR *go_up_next_dir(struct stack **path)
+int go_next_dir(struct dtree_error *err, struct level *curr, struct stack **path,
+		const struct dtree_filter *f)
 {
-	DIR *next = NULL;
+	const char *name;
 
 	do {
-		if(stack_depth(path) == 1) // never loose the rootd
-			return NULL;
-
-		const char *dname = (const char *) stack_pop_fname(path);
-
-		DIR *dir = opendir_on_stack(path);
-		if(dir == NULL) {
-			dtree_error_from_errno();
-			free((void *) dname);
-			return NULL;
-		}
+		if(curr->next_child >= curr->children_len)
+			return 0;
 
-		struct dirent *d;
-		while((d = readdir(dir)) != NULL) {
-			if(!strcmp(d->d_name, dname))
-				break;
-		}
-		free((void *) dname);
+		name = curr->children + curr->next_child;
+		curr->next_child += strlen(name) + 1;
+	} while(dtree_filter_prune(f, name, stack_depth(path)));
 
-		next = go_next_dir(dir, path);
-		if(next == NULL && dtree_iserror()) {
-			closedir(dir);
-			return NULL;
-		}
+	int fd = openat(curr->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		return 0;
+	}
 
-		closedir(dir);
-	} while(next == NULL);
+	if(stack_push_level(path, fd, name)) {
+		dtree_error_from_errno(err);
+		close(fd);
+		return 0;
+	}
 
-	return next;
+	return 1;
 }
 
+/**
+ * Reads the whole file relative to dirfd into buf of length
+ * len when it fits, otherwise into the heap (buf can be NULL).
+ * The content is terminated by '\0' (not included in flen).
+ * Free it by prop_free().
+ */
 static
-void *file_read_and_close(FILE *file, size_t *flen)
+void *file_read_into(struct dtree_error *err, int dirfd, const char *fname,
+		void *buf, size_t len, size_t *flen)
 {
+	int fd = openat(dirfd, fname, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
 	struct stat file_stat;
-	if(fstat(fileno(file), &file_stat)) {
-		dtree_error_from_errno();
-		fclose(file);
+	if(fstat(fd, &file_stat)) {
+		dtree_error_from_errno(err);
+		close(fd);
 		return NULL;
 	}
 
 	const size_t fsize = file_stat.st_size;
 
-	void *m = malloc(fsize + 1);
+	char *m = fsize < len? buf : malloc(fsize + 1);
 	if(m == NULL) {
-		dtree_error_from_errno();
-		fclose(file);
+		dtree_error_from_errno(err);
+		close(fd);
 		return NULL;
 	}
-	
-	size_t rlen = fread(m, 1, fsize, file);
-	if(rlen < fsize) {
-		dtree_error_from_errno();
-		free(m);
-		fclose(file);
-		return NULL;
+
+	size_t rlen = 0;
+	while(rlen < fsize) {
+		ssize_t r = read(fd, m + rlen, fsize - rlen);
+		if(r <= 0) {
+			if(r == 0)
+				errno = EIO;
+
+			dtree_error_from_errno(err);
+			if(m != buf)
+				free(m);
+			close(fd);
+			return NULL;
+		}
+
+		rlen += r;
 	}
 
-	((char *) m)[fsize] = '\0';
-	fclose(file);
+	m[fsize] = '\0';
+	close(fd);
 
 	*flen = fsize;
 	return m;
 }
 
+/**
+ * Reads the whole file relative to dirfd into the heap.
+ */
+static
+void *file_read(struct dtree_error *err, int dirfd, const char *fname, size_t *flen)
+{
+	return file_read_into(err, dirfd, fname, NULL, 0, flen);
+}
+
+/**
+ * Frees the content of file_read_into() unless it is in buf.
+ */
+static inline
+void prop_free(void *m, void *buf)
+{
+	if(m != buf)
+		free(m);
+}
+
 static
 uint32_t convert_raw32(const char *s) {
 	uint32_t value = 0;
 
 	for(int i = 0; i < 4; ++i) {
-		uint32_t val = (uint32_t) s[3 - i];	
+		uint32_t val = (uint32_t) s[3 - i];
 		val &= 0xFF;
 		value += val << i * 8;
 	}
@@ -373,176 +563,684 @@ uint32_t convert_raw32(const char *s) {
 	return value;
 }
 
+/**
+ * Counts entries of the compatible list. Each '\0'
+ * is end of an entry.
+ */
 static
-int dev_parse_reg(struct dtree_dev_t *dev, struct stack **path, const char *fname)
+size_t compat_entries(const char *compat, size_t len)
 {
-	FILE *regf = path_fopen(path, fname, "r");
-	if(regf == NULL)
-		return 1;
-
-	size_t length = 0;
-	const char *content = file_read_and_close(regf, &length);
-	if(content == NULL)
-		return 2;
+	size_t entries = 0;
 
-	if(length != 8) {
-		dtree_error_clear();
-		free((void *) content);
-		return 3;
+	for(size_t i = 0; i < len; ++i) {
+		if(compat[i] == '\0')
+			entries += 1;
 	}
 
-	dev->base = convert_raw32(content);
-	dev->high = dev->base + convert_raw32(content + 4) - 1;
-
-	free((void *) content);
-	return 0;
+	return entries;
 }
 
+/**
+ * Creates the device from contents of its reg and compatible
+ * files (compat can be NULL). The device is a single block:
+ *
+ *   struct dtree_dev_t | compat pointers + NULL | name | compat strings
+ *
+ * Returns NULL when the reg is not valid (not a device) or on error.
+ */
 static
-const char **convert_compat(const char *compat, const size_t len)
+struct dtree_dev_t *dev_from_props(struct dtree_error *err, const char *name,
+		const char *reg, size_t reglen, const char *compat, size_t compatlen)
 {
-	// count entries
-	int entries = 0;
+	if(reglen != 8)
+		return NULL;
 
-	// each '\0' is end of an entry
-	for(const char *p = compat; (size_t) (p - compat) < len; ++p) {
-		if(*p == '\0')
-			entries += 1;
-	}
+	const size_t entries = compat == NULL? 0 : compat_entries(compat, compatlen);
+	const size_t namelen = strlen(name) + 1;
 
-	// alloc pointers for entries and one pointer for last NULL
-	const char **array = (const char **) malloc((entries + 1) * sizeof(char *));
-	if(array == NULL)
-		return NULL;
+	if(entries == 0)
+		compatlen = 0;
 
-	// assign pointers to point into the compat string
-	int off = 0;
+	struct dtree_dev_t *dev = malloc(sizeof(struct dtree_dev_t)
+	                                 + (entries + 1) * sizeof(char *)
+	                                 + namelen + compatlen);
+	if(dev == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
 
-	for(int i = 0; i < entries; ++i) {
-		array[i] = compat + off;
+	const char **array = (const char **) (dev + 1);
+	char *names = (char *) (array + entries + 1);
+	char *strings = names + namelen;
 
-		// find next end of entry
-		while(compat[off] != '\0')
-			off += 1;
+	memcpy(names, name, namelen);
+	if(compatlen > 0)
+		memcpy(strings, compat, compatlen);
 
-		off += 1; // skip '\0', point to the next entry
+	// assign pointers to point into the copied compat strings
+	for(size_t i = 0, off = 0; i < entries; ++i) {
+		array[i] = strings + off;
+		off += strlen(strings + off) + 1; // skip '\0', point to the next entry
 	}
 
 	array[entries] = NULL;
-	return array;
+
+	dev->name   = names;
+	dev->base   = convert_raw32(reg);
+	dev->high   = dev->base + convert_raw32(reg + 4) - 1;
+	dev->compat = array;
+
+	return dev;
 }
 
+/**
+ * Reads the device of the node. Only the device is allocated
+ * unless the properties do not fit the stack buffers.
+ */
 static
-int dev_parse_compat(struct dtree_dev_t *dev, struct stack **path, const char *fname)
+struct dtree_dev_t *dev_from_dir(struct dtree_error *err, int dirfd, const char *name, int has_compat)
 {
-	FILE *regf = path_fopen(path, fname, "r");
-	if(regf == NULL)
-		return 1;
+	char regbuf[8 + 1]; // + '\0'
+	char compatbuf[PROP_BUFSIZE];
+	size_t reglen = 0;
+	size_t compatlen = 0;
+	char *compat = NULL;
+
+	char *reg = file_read_into(err, dirfd, "reg", regbuf, sizeof(regbuf), &reglen);
+	if(reg == NULL)
+		return NULL;
 
-	size_t length = 0;
-	const char *content = file_read_and_close(regf, &length);
-	if(content == NULL)
-		return 2;
+	if(reglen == 8 && has_compat) {
+		compat = file_read_into(err, dirfd, "compatible", compatbuf, sizeof(compatbuf), &compatlen);
+		if(compat == NULL) {
+			prop_free(reg, regbuf);
+			return NULL;
+		}
+	}
 
-	dev->compat = convert_compat(content, length);
-	if(dev->compat == NULL) {
-		dtree_error_from_errno();
-		return 1;
+	struct dtree_dev_t *dev = dev_from_props(err, name, reg, reglen, compat, compatlen);
+	prop_free(compat, compatbuf);
+	prop_free(reg, regbuf);
+	return dev;
+}
+
+/**
+ * Stores the path of the top of the traversal relative to
+ * the root into buf (when not NULL). Returns its length.
+ */
+static
+size_t stack_path(struct stack **path, char *buf)
+{
+	size_t len = 0;
+
+	// the bottom level is the root itself
+	for(const struct stack *s = *path; s != NULL && s->next != NULL; s = s->next)
+		len += strlen(((const struct level *) s->data)->name) + 1;
+
+	if(len == 0 || buf == NULL)
+		return len == 0? 0 : len - 1;
+
+	size_t off = len - 1;
+	buf[off] = '\0';
+
+	for(const struct stack *s = *path; s != NULL && s->next != NULL; s = s->next) {
+		const char *name = ((const struct level *) s->data)->name;
+		const size_t namelen = strlen(name);
+
+		off -= namelen;
+		memcpy(buf + off, name, namelen);
+		if(off > 0)
+			buf[--off] = '/';
 	}
 
-	return 0;
+	return len - 1;
 }
 
+/**
+ * Creates a lazy handle of the node. Only the size of its
+ * reg is checked to find out whether it is a device. The
+ * node is given by its path of length pathlen relative to
+ * the root, NULL stands for the top of the traversal.
+ *
+ * Returns NULL when it is not a device or on error.
+ */
 static
-struct dtree_dev_t *dev_from_dir(DIR *curr, struct stack **path)
+struct dtree_dev_t *lazy_from_dir(struct dtree_procfs *p, const struct level *curr,
+		const char *path, size_t pathlen, const struct node_files *files)
 {
-	struct dtree_dev_t *dev = malloc(sizeof(struct dtree_dev_t));
-	if(dev == NULL) {
-		dtree_error_from_errno();
+	struct dtree_error *err = p->impl.err;
+	struct stat st;
+
+	if(fstatat(curr->fd, "reg", &st, 0)) {
+		dtree_error_from_errno(err);
 		return NULL;
 	}
 
-	assert(stack_depth(path) > 1); // the root is never a device
+	if(st.st_size != 8)
+		return NULL;
+
+	if(path == NULL)
+		pathlen = stack_path(&p->path, NULL);
 
-	dev->compat = &NULL_ENTRY;
-	dev->name = strdup((char *) stack_top(path));
-	if(dev->name == NULL) {
-		dtree_error_from_errno();
-		free(dev);
+	struct lazy_dev *l = malloc(sizeof(struct lazy_dev) + pathlen + 1);
+	if(l == NULL) {
+		dtree_error_from_errno(err);
 		return NULL;
 	}
 
-	struct dirent *d;
-	rewinddir(curr);
-	while((d = readdir(curr)) != NULL) {
-		if(!path_is_file(path, d->d_name))
-			continue;
+	l->root = lazy_root_get(p);
+	if(l->root == NULL) {
+		dtree_error_from_errno(err);
+		free(l);
+		return NULL;
+	}
 
-		if(!strcmp(d->d_name, "reg")) {
-			if(dev_parse_reg(dev, path, "reg"))
-				goto clean_and_exit;
-		}
-		if(!strcmp(d->d_name, "compatible")) {
-			if(dev_parse_compat(dev, path, "compatible"))
-				goto clean_and_exit;
-		}
+	if(path == NULL) {
+		stack_path(&p->path, l->path);
+	}
+	else {
+		memcpy(l->path, path, pathlen);
+		l->path[pathlen] = '\0';
 	}
 
-	return dev;
+	l->dev.name   = l->path + pathlen - strlen(curr->name);
+	l->dev.base   = 0;
+	l->dev.high   = 0;
+	l->dev.compat = dtree_dev_unloaded;
+	l->loaded     = NULL;
+	l->has_compat = files->has_compat;
 
-clean_and_exit:
-	dtree_procfs_dev_free(dev);
-	return NULL;
+	return &l->dev;
 }
 
-struct dtree_dev_t *dtree_procfs_next(void)
+/**
+ * Wraps an already loaded device into a lazy handle
+ * (devices of a lazy tree are free'd by lazy_dev_free()).
+ */
+static
+struct dtree_dev_t *lazy_from_dev(struct dtree_error *err, struct dtree_dev_t *dev)
 {
-	if(g_dir == NULL)
+	struct lazy_dev *l = malloc(sizeof(struct lazy_dev));
+	if(l == NULL) {
+		dtree_error_from_errno(err);
+		dtree_procfs_dev_free(dev);
 		return NULL;
+	}
+
+	l->dev        = *dev;
+	l->loaded     = dev;
+	l->root       = NULL;
+	l->has_compat = dev->compat[0] != NULL;
+
+	return &l->dev;
+}
+
+/**
+ * Reads the file when it exists, otherwise returns NULL
+ * without setting the error.
+ */
+static
+char *prop_read(struct dtree_error *err, int dirfd, const char *fname, int exists,
+		char *buf, size_t buflen, size_t *len)
+{
+	*len = 0;
+	return exists? file_read_into(err, dirfd, fname, buf, buflen, len) : NULL;
+}
 
+/**
+ * Tests the node by the filter from the cheapest condition:
+ * name, compatible, status and reg last. The properties
+ * read for the filter are reused by the device. The path
+ * is kept by lazy handles (see lazy_from_dir()).
+ *
+ * Returns NULL when the node does not match or on error.
+ */
+static
+struct dtree_dev_t *dev_find(struct dtree_procfs *p, const struct level *curr,
+		const char *path, size_t pathlen, const struct node_files *files,
+		const struct dtree_filter *f)
+{
+	struct dtree_error *err = p->impl.err;
 	struct dtree_dev_t *dev = NULL;
+	char regbuf[8 + 1]; // + '\0'
+	char compatbuf[PROP_BUFSIZE];
+	char statusbuf[PROP_BUFSIZE];
+	char *compat = NULL;
+	char *status = NULL;
+	char *reg = NULL;
+	size_t compatlen = 0;
+	size_t statuslen = 0;
+	size_t reglen = 0;
+
+	if(!files->has_reg || !dtree_filter_name(f, curr->name))
+		return NULL;
+
+	if(f->compat != NULL) {
+		compat = prop_read(err, curr->fd, "compatible", files->has_compat,
+				compatbuf, sizeof(compatbuf), &compatlen);
+		if(!dtree_filter_compat(f, compat, compatlen))
+			goto clean_and_exit;
+	}
 
-	while(dev == NULL && g_dir != NULL) {
-		if(dir_has_file(g_dir, &g_path, "reg")) {
-			dev = dev_from_dir(g_dir, &g_path);
+	if(f->flags & DTREE_FIND_OKAY) {
+		status = prop_read(err, curr->fd, "status", files->has_status,
+				statusbuf, sizeof(statusbuf), &statuslen);
+		if(dtree_error_isset(err) || !dtree_filter_status(f, status, statuslen))
+			goto clean_and_exit;
+	}
+
+	// nothing else to test, the lazy handle reads the rest on demand
+	if(p->lazy && compat == NULL && !(f->flags & DTREE_FIND_RANGE)) {
+		dev = lazy_from_dir(p, curr, path, pathlen, files);
+		goto clean_and_exit;
+	}
+
+	reg = file_read_into(err, curr->fd, "reg", regbuf, sizeof(regbuf), &reglen);
+	if(reg == NULL || reglen != 8)
+		goto clean_and_exit;
+
+	if(!dtree_filter_range(f, convert_raw32(reg), convert_raw32(reg) + convert_raw32(reg + 4) - 1))
+		goto clean_and_exit;
+
+	if(compat == NULL && files->has_compat) {
+		compat = file_read_into(err, curr->fd, "compatible", compatbuf, sizeof(compatbuf), &compatlen);
+		if(compat == NULL)
+			goto clean_and_exit;
+	}
 
-			if(dev == NULL && dtree_iserror())
+	dev = dev_from_props(err, curr->name, reg, reglen, compat, compatlen);
+	if(dev != NULL && p->lazy)
+		dev = lazy_from_dev(err, dev);
+
+clean_and_exit:
+	prop_free(reg, regbuf);
+	prop_free(status, statusbuf);
+	prop_free(compat, compatbuf);
+	return dev;
+}
+
+/**
+ * Depth-first traversal. Every directory is read once when
+ * it is visited first, then the traversal continues with its
+ * subdirectories. When a directory is finished its parent
+ * continues with its next subdirectory.
+ *
+ * Returns the next device matching the filter. Properties
+ * are read only as far as the filter needs them.
+ */
+static
+struct dtree_dev_t *procfs_next(struct dtree_procfs *p, const struct dtree_filter *f)
+{
+	struct dtree_error *err = p->impl.err;
+
+	while(!stack_empty(&p->path)) {
+		struct level *top = path_top(&p->path);
+
+		if(!top->visited) {
+			struct node_files files;
+			top->visited = 1;
+
+			if(load_dir(err, top, &files))
 				return NULL;
+
+			// the root is never a device
+			if(stack_depth(&p->path) > 1) {
+				struct dtree_dev_t *dev = dev_find(p, top, NULL, 0, &files, f);
+				if(dev != NULL || dtree_error_isset(err))
+					return dev;
+			}
 		}
 
-		rewinddir(g_dir);
-		DIR *dir = go_next_dir(g_dir, &g_path);
-		if(dir == NULL && dtree_iserror()) {
+		if(go_next_dir(err, top, &p->path, f))
+			continue;
+
+		if(dtree_error_isset(err))
 			return NULL;
-		}
-		
-		if(dir == NULL)
-			dir = go_up_next_dir(&g_path);
 
-		if(dir == NULL && dtree_iserror()) {
+		if(stack_depth(&p->path) == 1) // never loose the rootd
 			return NULL;
-		}
 
-		closedir(g_dir);
-		g_dir = dir;
+		stack_pop_level(&p->path);
+	}
+
+	return NULL;
+}
+
+struct dtree_dev_t *dtree_procfs_next(struct dtree_impl *impl)
+{
+	static const struct dtree_filter any;
+	return procfs_next((struct dtree_procfs *) impl, &any);
+}
+
+struct dtree_dev_t *dtree_procfs_byname(struct dtree_impl *impl, const char *name)
+{
+	const struct dtree_filter f = {.name = name};
+	return procfs_next((struct dtree_procfs *) impl, &f);
+}
+
+struct dtree_dev_t *dtree_procfs_find(struct dtree_impl *impl, const struct dtree_filter *f)
+{
+	return procfs_next((struct dtree_procfs *) impl, f);
+}
+
+/**
+ * Tests whether the regular file exists in the directory.
+ * Returns -1 on error other than a missing file.
+ */
+static
+int file_exists(struct dtree_error *err, int dirfd, const char *fname)
+{
+	struct stat st;
+
+	if(fstatat(dirfd, fname, &st, 0) == 0)
+		return S_ISREG(st.st_mode);
+
+	if(errno == ENOENT)
+		return 0;
+
+	dtree_error_from_errno(err);
+	return -1;
+}
+
+struct dtree_dev_t *dtree_procfs_bypath(struct dtree_impl *impl, const char *path)
+{
+	static const struct dtree_filter any;
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
+	struct dtree_error *err = p->impl.err;
+
+	// the last component (trailing slashes are allowed)
+	size_t len = strlen(path);
+	while(len > 0 && path[len - 1] == '/')
+		len -= 1;
+
+	size_t off = len;
+	while(off > 0 && path[off - 1] != '/')
+		off -= 1;
+
+	if(len == 0) // the root is never a device
+		return NULL;
+
+	int fd = openat(p->rootfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		if(errno != ENOENT && errno != ENOTDIR)
+			dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	char *name = strndup(path + off, len - off);
+	struct level *l = name == NULL? NULL : level_new(fd, name);
+	free(name);
+
+	if(l == NULL) {
+		dtree_error_from_errno(err);
+		close(fd);
+		return NULL;
 	}
 
+	// only the files of the node are looked up, no listing
+	struct node_files files;
+	struct dtree_dev_t *dev = NULL;
+
+	files.has_reg    = file_exists(err, fd, "reg");
+	files.has_compat = file_exists(err, fd, "compatible");
+	files.has_status = 0;
+	files.phandle    = NULL;
+
+	if(!dtree_error_isset(err))
+		dev = dev_find(p, l, path, len, &files, &any);
+
+	level_free(l);
 	return dev;
 }
 
-void dtree_procfs_dev_free(struct dtree_dev_t *dev)
+/**
+ * Appends the phandle of the node at the path to the index.
+ */
+static
+int index_add(struct dtree_procfs *p, uint32_t phandle, const char *path, size_t len)
+{
+	char *bigger = realloc(p->ph_paths, p->ph_paths_len + len + 1);
+	if(bigger == NULL)
+		return -1;
+
+	p->ph_paths = bigger;
+	memcpy(p->ph_paths + p->ph_paths_len, path, len + 1);
+
+	if(dtree_phandles_add(&p->phandles, phandle, p->ph_paths_len))
+		return -1;
+
+	p->ph_paths_len += len + 1;
+	return 0;
+}
+
+/**
+ * Indexes phandles of the directory and its subdirectories.
+ * The path of the directory (relative to the root) is given
+ * by path of length len, the buffer has PATH_MAX bytes.
+ */
+static
+int index_dir(struct dtree_procfs *p, struct level *l, char *path, size_t len)
+{
+	struct dtree_error *err = p->impl.err;
+	struct node_files files;
+
+	if(load_dir(err, l, &files))
+		return -1;
+
+	if(files.phandle != NULL) {
+		size_t flen;
+		char *phandle = file_read(err, l->fd, files.phandle, &flen);
+		if(phandle == NULL)
+			return -1;
+
+		int failed = flen == 4 && index_add(p, convert_raw32(phandle), path, len);
+		free(phandle);
+
+		if(failed) {
+			dtree_error_from_errno(err);
+			return -1;
+		}
+	}
+
+	for(size_t off = 0; off < l->children_len; off += strlen(l->children + off) + 1) {
+		const char *name = l->children + off;
+		const size_t namelen = strlen(name);
+
+		if(len + namelen + 2 > PATH_MAX) {
+			dtree_errno_set(err, ENAMETOOLONG);
+			return -1;
+		}
+
+		int fd = openat(l->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct level *child = fd == -1? NULL : level_new(fd, name);
+
+		if(child == NULL) {
+			dtree_error_from_errno(err);
+			if(fd != -1)
+				close(fd);
+			return -1;
+		}
+
+		size_t clen = len;
+		if(clen > 0)
+			path[clen++] = '/';
+
+		memcpy(path + clen, name, namelen + 1);
+
+		int failed = index_dir(p, child, path, clen + namelen);
+		level_free(child);
+		path[len] = '\0';
+
+		if(failed)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Builds the index of phandles by a single pass over
+ * the tree. The iteration is not affected.
+ */
+static
+int procfs_index(struct dtree_procfs *p)
+{
+	char path[PATH_MAX] = "";
+
+	// a new open file, the offset of the root is not shared
+	int fd = openat(p->rootfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct level *root = fd == -1? NULL : level_new(fd, "");
+
+	if(root == NULL) {
+		dtree_error_from_errno(p->impl.err);
+		if(fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	int failed = index_dir(p, root, path, 0);
+	level_free(root);
+
+	if(failed) {
+		dtree_phandles_free(&p->phandles);
+		free(p->ph_paths);
+		p->ph_paths = NULL;
+		p->ph_paths_len = 0;
+		return -1;
+	}
+
+	p->ph_indexed = 1;
+	return 0;
+}
+
+/**
+ * Reads the cells property of the node at the path.
+ * Returns UINT32_MAX when it is missing (or on error).
+ */
+static
+uint32_t node_cells(struct dtree_procfs *p, const char *path, const char *cells)
+{
+	struct dtree_error *err = p->impl.err;
+	uint32_t ncells = UINT32_MAX;
+
+	int fd = openat(p->rootfd, *path == '\0'? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		return UINT32_MAX;
+	}
+
+	if(file_exists(err, fd, cells) > 0) {
+		size_t len;
+		char *value = file_read(err, fd, cells, &len);
+
+		if(value != NULL && len == 4)
+			ncells = convert_raw32(value);
+
+		free(value);
+	}
+
+	close(fd);
+	return ncells;
+}
+
+int dtree_procfs_byphandle(struct dtree_impl *impl, uint32_t phandle, const char *cells,
+		uint32_t *ncells, struct dtree_dev_t **dev)
+{
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
+	uint32_t off;
+
+	*dev = NULL;
+
+	if(!p->ph_indexed && procfs_index(p))
+		return -1;
+
+	if(!dtree_phandles_get(&p->phandles, phandle, &off))
+		return 0;
+
+	const char *path = p->ph_paths + off;
+
+	*dev = dtree_procfs_bypath(impl, path);
+	if(cells != NULL && !dtree_error_isset(impl->err))
+		*ncells = node_cells(p, path, cells);
+
+	if(dtree_error_isset(impl->err)) {
+		if(*dev != NULL)
+			dtree_procfs_dev_free(*dev);
+
+		*dev = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+void dtree_procfs_set_lazy(struct dtree_impl *impl)
+{
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
+
+	p->lazy = 1;
+}
+
+void dtree_procfs_dev_load(struct dtree_dev_t *dev)
+{
+	static const char *no_compat = NULL;
+	struct lazy_dev *l = (struct lazy_dev *) dev;
+	struct dtree_error closed = {0, 0};
+
+	if(dev->compat != dtree_dev_unloaded)
+		return;
+
+	// errors after the tree is closed are not reported
+	struct dtree_error *err = l->root->err != NULL? l->root->err : &closed;
+
+	int fd = openat(l->root->fd, l->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		l->loaded = NULL;
+	}
+	else {
+		l->loaded = dev_from_dir(err, fd, dev->name, l->has_compat);
+		close(fd);
+	}
+
+	lazy_root_put(l->root);
+	l->root = NULL;
+
+	// on error (or when the reg has changed) the device is empty
+	if(l->loaded == NULL) {
+		dev->compat = &no_compat;
+		return;
+	}
+
+	dev->base   = l->loaded->base;
+	dev->high   = l->loaded->high;
+	dev->compat = l->loaded->compat;
+}
+
+static
+void lazy_dev_free(struct dtree_dev_t *dev)
 {
+	struct lazy_dev *l = (struct lazy_dev *) dev;
 	assert(dev != NULL);
 
-	if(dev->name != NULL)
-		free((void *) dev->name);
+	if(l->root != NULL)
+		lazy_root_put(l->root);
+	if(l->loaded != NULL)
+		dtree_procfs_dev_free(l->loaded);
 
-	assert(dev->compat != NULL);
-	if(dev->compat != &NULL_ENTRY) {
-		free((void *) dev->compat[0]);
-		free((void *) dev->compat);
+	free(l);
+}
+
+void dtree_procfs_dev_free(struct dtree_dev_t *dev)
+{
+	assert(dev != NULL);
+
+	if(!dev_is_block(dev)) {
+		lazy_dev_free(dev);
+		return;
 	}
 
+	// name and compat are parts of the same block
 	dev->name   = NULL;
 	dev->compat = NULL;
 	dev->base = 0;
@@ -550,3 +1248,580 @@ void dtree_procfs_dev_free(struct dtree_dev_t *dev)
 
 	free(dev);
 }
+
+//
+// Parallel scan
+//
+
+/**
+ * Node of the tree built by the parallel scan. Nodes are
+ * filled by workers independently, devices are collected
+ * afterwards in the order of dtree_procfs_next().
+ */
+struct scan_node {
+	struct dtree_dev_t *dev;
+	struct scan_node *children;
+	size_t nchildren;
+
+	// set while loading of the device is deferred to a batch
+	char *path;
+	int has_compat;
+};
+
+/**
+ * Directory to be scanned. The path is relative to the root
+ * so no descriptors are held by queued tasks.
+ */
+struct scan_task {
+	char *path;
+	struct scan_node *node;
+};
+
+struct scan_pool;
+
+/**
+ * Number of nodes whose properties are read by a single batch
+ * and initial sizes of buffers for reg and compatible.
+ */
+#define SCAN_BATCH      32
+#define REG_BUFSIZE     16
+#define COMPAT_BUFSIZE  256
+
+/**
+ * Every worker owns a deque of tasks. The owner takes the newest
+ * task (depth-first), idle workers steal the oldest one (usually
+ * the biggest subtree).
+ */
+struct scan_worker {
+	pthread_mutex_t lock;
+	struct scan_task *tasks;
+	size_t head;
+	size_t tail;
+	size_t cap;
+
+	pthread_t thread;
+	struct scan_pool *pool;
+	unsigned id;
+	struct dtree_error err;
+
+	// nodes whose properties are read by the ring at once
+	struct dtree_uring *ring;
+	struct scan_node *batch[SCAN_BATCH];
+	size_t nbatch;
+};
+
+struct scan_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t pending; // tasks queued or running
+	size_t pushed;  // incremented on each push, to not miss a wake up
+	int failed;
+
+	int rootfd;
+	struct scan_node root;
+	unsigned nworkers;
+	struct scan_worker *workers;
+};
+
+static
+void pool_add_pending(struct scan_pool *pool, size_t n)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->pending += n;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Wakes up idle workers after tasks were pushed.
+ */
+static
+void pool_notify(struct scan_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->pushed += 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Marks n tasks as finished (or never pushed).
+ */
+static
+void pool_finish(struct scan_pool *pool, size_t n, int failed)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->pending -= n;
+	if(failed)
+		__atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+	if(pool->pending == 0)
+		pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Pushes the task at the tail of the worker's deque.
+ * The task must be counted as pending already.
+ */
+static
+int worker_push(struct scan_worker *w, const struct scan_task *t)
+{
+	pthread_mutex_lock(&w->lock);
+
+	if(w->tail == w->cap && w->head > 0) {
+		memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(*t));
+		w->tail -= w->head;
+		w->head = 0;
+	}
+
+	if(w->tail == w->cap) {
+		const size_t cap = w->cap == 0? 64 : 2 * w->cap;
+		struct scan_task *bigger = realloc(w->tasks, cap * sizeof(*t));
+		if(bigger == NULL) {
+			pthread_mutex_unlock(&w->lock);
+			return 1;
+		}
+
+		w->tasks = bigger;
+		w->cap = cap;
+	}
+
+	w->tasks[w->tail++] = *t;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/**
+ * Takes the newest task of the worker's deque.
+ */
+static
+int worker_take(struct scan_worker *w, struct scan_task *t)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->tail > w->head) {
+		*t = w->tasks[--w->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return found;
+}
+
+/**
+ * Takes the oldest task of another worker.
+ */
+static
+int worker_steal(struct scan_worker *w, struct scan_task *t)
+{
+	struct scan_pool *pool = w->pool;
+	int found = 0;
+
+	for(unsigned k = 1; k < pool->nworkers && !found; ++k) {
+		struct scan_worker *victim = &pool->workers[(w->id + k) % pool->nworkers];
+
+		pthread_mutex_lock(&victim->lock);
+		if(victim->tail > victim->head) {
+			*t = victim->tasks[victim->head++];
+			found = 1;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return found;
+}
+
+static
+char *scan_child_path(const char *parent, const char *name)
+{
+	const size_t plen = strlen(parent);
+	const size_t nlen = strlen(name) + 1;
+
+	if(!strcmp(parent, "."))
+		return strdup(name);
+
+	char *path = malloc(plen + 1 + nlen);
+	if(path == NULL)
+		return NULL;
+
+	memcpy(path, parent, plen);
+	path[plen] = '/';
+	memcpy(path + plen + 1, name, nlen);
+	return path;
+}
+
+/**
+ * Queues subdirectories of the level as children of the node.
+ */
+static
+int scan_push_children(struct scan_worker *w, const struct scan_task *t, struct level *l)
+{
+	struct scan_pool *pool = w->pool;
+	size_t n = 0;
+
+	for(size_t off = 0; off < l->children_len; off += strlen(l->children + off) + 1)
+		n += 1;
+
+	if(n == 0)
+		return 0;
+
+	t->node->children = calloc(n, sizeof(struct scan_node));
+	if(t->node->children == NULL) {
+		dtree_error_from_errno(&w->err);
+		return 1;
+	}
+
+	t->node->nchildren = n;
+	pool_add_pending(pool, n);
+
+	size_t pushed = 0;
+	for(size_t off = 0; off < l->children_len; off += strlen(l->children + off) + 1) {
+		struct scan_task child = {
+			.path = scan_child_path(t->path, l->children + off),
+			.node = &t->node->children[pushed]
+		};
+
+		if(child.path == NULL || worker_push(w, &child)) {
+			dtree_error_from_errno(&w->err);
+			free(child.path);
+			break;
+		}
+
+		pushed += 1;
+	}
+
+	if(pushed < n)
+		pool_finish(pool, n - pushed, 1);
+	if(pushed > 0)
+		pool_notify(pool);
+
+	return pushed < n;
+}
+
+/**
+ * Finishes a request read by the ring. Files longer than
+ * the buffer are read again one by one.
+ */
+static
+int scan_read_finish(struct dtree_error *err, int rootfd, struct dtree_uring_read *req)
+{
+	if(req->result < 0) {
+		errno = -req->result;
+		dtree_error_from_errno(err);
+		return 1;
+	}
+
+	if((size_t) req->result < req->len) {
+		req->buf[req->result] = '\0';
+		return 0;
+	}
+
+	size_t flen = 0;
+	char *content = file_read(err, rootfd, req->path, &flen);
+	if(content == NULL)
+		return 1;
+
+	free(req->buf);
+	req->buf = content;
+	req->result = flen;
+	return 0;
+}
+
+static
+int scan_read_prepare(struct dtree_uring_read *req, const char *dpath, const char *fname, size_t len)
+{
+	req->path = scan_child_path(dpath, fname);
+	req->buf = malloc(len + 1);
+	req->len = len;
+	req->result = len; // not read yet
+
+	return req->path == NULL || req->buf == NULL;
+}
+
+/**
+ * Reads properties of the batched nodes by the worker's ring
+ * and creates their devices. After an error, the batch
+ * is dropped only.
+ */
+static
+void scan_flush(struct scan_worker *w)
+{
+	struct scan_pool *pool = w->pool;
+	struct dtree_error *err = &w->err;
+	struct dtree_uring_read reqs[2 * SCAN_BATCH];
+	size_t n = 0;
+
+	memset(reqs, 0, sizeof(reqs));
+
+	for(size_t i = 0; i < w->nbatch && !dtree_error_isset(err); ++i) {
+		const struct scan_node *node = w->batch[i];
+
+		if(scan_read_prepare(&reqs[n++], node->path, "reg", REG_BUFSIZE)
+		|| (node->has_compat
+		   && scan_read_prepare(&reqs[n++], node->path, "compatible", COMPAT_BUFSIZE)))
+			dtree_error_from_errno(err);
+	}
+
+	if(dtree_error_isset(err) || w->nbatch == 0
+	|| __atomic_load_n(&pool->failed, __ATOMIC_RELAXED))
+		goto clean_and_exit;
+
+	if(dtree_uring_read_files(w->ring, pool->rootfd, reqs, n)) {
+		// the ring is not usable anymore, the requests (marked
+		// as not read) are finished one by one
+		dtree_uring_free(w->ring);
+		w->ring = NULL;
+
+		for(size_t k = 0; k < n; ++k)
+			reqs[k].result = reqs[k].len;
+	}
+
+	for(size_t i = 0, k = 0; i < w->nbatch; ++i) {
+		struct scan_node *node = w->batch[i];
+		struct dtree_uring_read *reg = &reqs[k++];
+		struct dtree_uring_read *compat = node->has_compat? &reqs[k++] : NULL;
+
+		if(scan_read_finish(err, pool->rootfd, reg)
+		|| (compat != NULL && scan_read_finish(err, pool->rootfd, compat)))
+			break;
+
+		const char *name = strrchr(node->path, '/');
+		node->dev = dev_from_props(err, name == NULL? node->path : name + 1,
+				reg->buf, reg->result,
+				compat == NULL? NULL : compat->buf,
+				compat == NULL? 0 : compat->result);
+
+		if(dtree_error_isset(err))
+			break;
+	}
+
+clean_and_exit:
+	for(size_t k = 0; k < n; ++k) {
+		free((void *) reqs[k].path);
+		free(reqs[k].buf);
+	}
+
+	for(size_t i = 0; i < w->nbatch; ++i) {
+		free(w->batch[i]->path);
+		w->batch[i]->path = NULL;
+	}
+
+	w->nbatch = 0;
+
+	if(dtree_error_isset(err))
+		__atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Defers loading of the task's device to the next batch.
+ * The node takes the path of the task.
+ */
+static
+void scan_defer(struct scan_worker *w, struct scan_task *t, const struct node_files *files)
+{
+	t->node->path = t->path;
+	t->node->has_compat = files->has_compat;
+	t->path = NULL;
+
+	w->batch[w->nbatch++] = t->node;
+	if(w->nbatch == SCAN_BATCH)
+		scan_flush(w);
+}
+
+/**
+ * Queues subdirectories of the task's directory and loads
+ * its device (or defers it when the worker has a ring).
+ */
+static
+void scan_task_run(struct scan_worker *w, struct scan_task *t)
+{
+	struct scan_pool *pool = w->pool;
+	struct dtree_error *err = &w->err;
+	struct node_files files;
+	struct level *l = NULL;
+
+	if(__atomic_load_n(&pool->failed, __ATOMIC_RELAXED))
+		goto clean_and_exit;
+
+	int fd = openat(pool->rootfd, t->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		dtree_error_from_errno(err);
+		goto clean_and_exit;
+	}
+
+	const char *name = strrchr(t->path, '/');
+	l = level_new(fd, name == NULL? t->path : name + 1);
+	if(l == NULL) {
+		dtree_error_from_errno(err);
+		close(fd);
+		goto clean_and_exit;
+	}
+
+	if(load_dir(err, l, &files))
+		goto clean_and_exit;
+
+	if(scan_push_children(w, t, l))
+		goto clean_and_exit;
+
+	// the root is never a device
+	if(t->node == &pool->root || !files.has_reg)
+		goto clean_and_exit;
+
+	if(w->ring != NULL)
+		scan_defer(w, t, &files);
+	else
+		t->node->dev = dev_from_dir(err, l->fd, l->name, files.has_compat);
+
+clean_and_exit:
+	if(l != NULL)
+		level_free(l);
+
+	free(t->path);
+	pool_finish(pool, 1, dtree_error_isset(err));
+}
+
+static
+void *scan_worker_main(void *arg)
+{
+	struct scan_worker *w = (struct scan_worker *) arg;
+	struct scan_pool *pool = w->pool;
+	struct scan_task t;
+
+	while(1) {
+		pthread_mutex_lock(&pool->lock);
+		const size_t gen = pool->pushed;
+		pthread_mutex_unlock(&pool->lock);
+
+		if(worker_take(w, &t) || worker_steal(w, &t)) {
+			scan_task_run(w, &t);
+			continue;
+		}
+
+		scan_flush(w);
+
+		pthread_mutex_lock(&pool->lock);
+		while(pool->pending > 0 && pool->pushed == gen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+
+		const int done = pool->pending == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if(done)
+			return NULL;
+	}
+}
+
+/**
+ * Adds devices of the subtree into the snapshot in the order
+ * of dtree_procfs_next() and free's the subtree. After a failure
+ * the rest is free'd only.
+ */
+static
+void scan_collect(struct scan_node *node, struct dtree_impl *snap, int *failed)
+{
+	if(node->dev != NULL) {
+		if(!*failed && dtree_snap_add(snap, node->dev))
+			*failed = 1;
+
+		dtree_procfs_dev_free(node->dev);
+	}
+
+	for(size_t i = 0; i < node->nchildren; ++i)
+		scan_collect(&node->children[i], snap, failed);
+
+	free(node->children);
+	free(node->path);
+}
+
+/**
+ * Scans the whole tree by a pool of work-stealing threads.
+ * The calling thread is one of the workers.
+ */
+int dtree_procfs_scan(struct dtree_impl *impl, unsigned threads, struct dtree_impl *snap)
+{
+	struct dtree_procfs *p = (struct dtree_procfs *) impl;
+	struct scan_pool pool;
+	int failed = 0;
+
+	if(threads == 0)
+		threads = 1;
+
+	dtree_procfs_reset(impl);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.rootfd = path_top(&p->path)->fd;
+	pool.nworkers = threads;
+	pool.workers = calloc(threads, sizeof(struct scan_worker));
+	if(pool.workers == NULL) {
+		dtree_error_from_errno(impl->err);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+
+	for(unsigned i = 0; i < threads; ++i) {
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		pool.workers[i].ring = dtree_uring_new(2 * SCAN_BATCH);
+	}
+
+	struct scan_task root = {strdup("."), &pool.root};
+	if(root.path == NULL) {
+		dtree_error_from_errno(impl->err);
+		failed = 1;
+		goto clean_and_exit;
+	}
+
+	pool.pending = 1;
+	worker_push(&pool.workers[0], &root); // never fails on an empty deque
+
+	// workers that can not be started leave their (empty) deques
+	// to the others, the scan just runs on less threads
+	unsigned started = 1;
+	for(; started < threads; ++started) {
+		struct scan_worker *w = &pool.workers[started];
+		if(pthread_create(&w->thread, NULL, scan_worker_main, w))
+			break;
+	}
+
+	scan_worker_main(&pool.workers[0]);
+
+	for(unsigned i = 1; i < started; ++i)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	for(unsigned i = 0; i < threads && !failed; ++i) {
+		if(dtree_error_isset(&pool.workers[i].err)) {
+			*impl->err = pool.workers[i].err;
+			failed = 1;
+		}
+	}
+
+	scan_collect(&pool.root, snap, &failed);
+
+clean_and_exit:
+	for(unsigned i = 0; i < threads; ++i) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		dtree_uring_free(pool.workers[i].ring);
+		free(pool.workers[i].tasks);
+	}
+
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.workers);
+
+	dtree_procfs_reset(impl);
+	return failed? -1 : 0;
+}
+
+static const struct dtree_backend procfs_backend = {
+	.close     = dtree_procfs_close,
+	.next      = dtree_procfs_next,
+	.reset     = dtree_procfs_reset,
+	.byname    = dtree_procfs_byname,
+	.find      = dtree_procfs_find,
+	.bypath    = dtree_procfs_bypath,
+	.byphandle = dtree_procfs_byphandle,
+	.scan      = dtree_procfs_scan,
+};
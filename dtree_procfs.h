@@ -7,34 +7,97 @@
 #ifndef DTREE_PROC_FS
 #define DTREE_PROC_FS
 
+#include "dtree_backend.h"
+
 /**
  * Opens the /proc filesystem at the given path.
  * Most common: /proc/device-tree.
  * 
- * Initializes internal structures. Does not
- * clear error flag.
+ * Returns a new state or NULL and sets err.
+ */
+struct dtree_impl *dtree_procfs_open(const char *rootd, struct dtree_error *err);
+
+/**
+ * Opens the /proc filesystem rooted at the given
+ * directory descriptor. The descriptor is duplicated,
+ * the caller can close it.
+ *
+ * Returns a new state or NULL and sets err.
  */
-int dtree_procfs_open(const char *rootd);
+struct dtree_impl *dtree_procfs_openat(int dirfd, struct dtree_error *err);
 
 /**
  * Free's all resources.
  */
-void dtree_procfs_close(void);
+void dtree_procfs_close(struct dtree_impl *impl);
 
 /**
  * Traversing over procfs.
  */
-struct dtree_dev_t *dtree_procfs_next(void);
+struct dtree_dev_t *dtree_procfs_next(struct dtree_impl *impl);
+
+/**
+ * Looks up the next device of the given name. Properties
+ * of other nodes are not read.
+ */
+struct dtree_dev_t *dtree_procfs_byname(struct dtree_impl *impl, const char *name);
+
+/**
+ * Looks up the next device matching the filter. Properties
+ * are read only when the cheaper conditions match, pruned
+ * subtrees are not entered at all.
+ */
+struct dtree_dev_t *dtree_procfs_find(struct dtree_impl *impl, const struct dtree_filter *f);
+
+/**
+ * Opens the node of the path (relative to the root) directly
+ * without traversing the tree.
+ */
+struct dtree_dev_t *dtree_procfs_bypath(struct dtree_impl *impl, const char *path);
 
 /**
- * Free of dtree_dev_t returned by procfs functions.
+ * Looks up the node of the phandle. The index of phandles
+ * is built by the first lookup (a pass over the whole tree)
+ * and then the node is opened by its path.
+ */
+int dtree_procfs_byphandle(struct dtree_impl *impl, uint32_t phandle, const char *cells,
+		uint32_t *ncells, struct dtree_dev_t **dev);
+
+/**
+ * Switches the opened tree to return lazy handles. Only names
+ * are known when the handle is returned, the other properties
+ * are read by dtree_procfs_dev_load(). The handles share
+ * a descriptor of the root, a node is opened by its path.
+ */
+void dtree_procfs_set_lazy(struct dtree_impl *impl);
+
+/**
+ * Reads properties of a lazy handle (once). Errors are
+ * reported into the error state of the tree while it is
+ * opened, later the device is just left empty.
+ */
+void dtree_procfs_dev_load(struct dtree_dev_t *dev);
+
+/**
+ * Free of dtree_dev_t returned by procfs functions
+ * (lazy handles included).
  */
 void dtree_procfs_dev_free(struct dtree_dev_t *dev);
 
 /**
  * Reset of iteration over procfs.
  */
-int dtree_procfs_reset(void);
+int dtree_procfs_reset(struct dtree_impl *impl);
+
+/**
+ * Reads all devices into the snapshot by the given number
+ * of threads. Directories are distributed among the threads
+ * by work stealing, the devices are added in the same order
+ * as returned by dtree_procfs_next(). Resets the iteration.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_procfs_scan(struct dtree_impl *impl, unsigned threads, struct dtree_impl *snap);
 
 #endif
 
@@ -0,0 +1,227 @@
+/**
+ * dtree_shared.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree_error.h"
+#include "dtree_shared.h"
+#include "dtree_snap.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define CACHE_LINE 64
+
+/**
+ * Published snapshot.
+ */
+struct shared_version {
+	struct dtree_impl *snap;
+	struct shared_version *next; // retired list
+};
+
+/**
+ * Hazard slot of a reader. Slots are never unlinked,
+ * a free one is taken again by another reader. Each one
+ * occupies its own cache line.
+ */
+struct dtree_shared_pin {
+	struct shared_version *hazard;
+	int used;
+	struct dtree_shared_pin *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct dtree_shared {
+	struct shared_version *current;
+	struct dtree_shared_pin *pins;
+
+	// serializes writers and reclamation; a pin never waits for it,
+	// an unpin only tries it to reclaim opportunistically, so retired
+	// versions live until a later publish or unpin gets the lock
+	pthread_mutex_t lock;
+	struct shared_version *retired;
+};
+
+static
+void version_free(struct shared_version *v)
+{
+	dtree_snap_close(v->snap);
+	free(v);
+}
+
+dtree_shared_t *dtree_shared_new(void)
+{
+	struct dtree_shared *sh = calloc(1, sizeof(*sh));
+	if(sh == NULL)
+		return NULL;
+
+	if(pthread_mutex_init(&sh->lock, NULL)) {
+		free(sh);
+		return NULL;
+	}
+
+	return sh;
+}
+
+void dtree_shared_free(dtree_shared_t *sh)
+{
+	if(sh == NULL)
+		return;
+
+	while(sh->retired != NULL) {
+		struct shared_version *v = sh->retired;
+		sh->retired = v->next;
+		version_free(v);
+	}
+
+	if(sh->current != NULL)
+		version_free(sh->current);
+
+	while(sh->pins != NULL) {
+		struct dtree_shared_pin *pin = sh->pins;
+		sh->pins = pin->next;
+		free(pin);
+	}
+
+	pthread_mutex_destroy(&sh->lock);
+	free(sh);
+}
+
+static
+int is_pinned(struct dtree_shared *sh, const struct shared_version *v)
+{
+	struct dtree_shared_pin *pin = __atomic_load_n(&sh->pins, __ATOMIC_ACQUIRE);
+
+	for(; pin != NULL; pin = pin->next) {
+		if(__atomic_load_n(&pin->hazard, __ATOMIC_SEQ_CST) == v)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Frees retired versions that are not pinned.
+ * Called with the lock held.
+ */
+static
+void reclaim(struct dtree_shared *sh)
+{
+	struct shared_version **link = &sh->retired;
+
+	while(*link != NULL) {
+		struct shared_version *v = *link;
+
+		if(is_pinned(sh, v)) {
+			link = &v->next;
+			continue;
+		}
+
+		*link = v->next;
+		version_free(v);
+	}
+}
+
+/**
+ * Takes a free slot or links a new one.
+ */
+static
+struct dtree_shared_pin *pin_take(struct dtree_shared *sh)
+{
+	struct dtree_shared_pin *pin = __atomic_load_n(&sh->pins, __ATOMIC_ACQUIRE);
+
+	for(; pin != NULL; pin = pin->next) {
+		int unused = 0;
+		if(__atomic_compare_exchange_n(&pin->used, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return pin;
+	}
+
+	if(posix_memalign((void **) &pin, CACHE_LINE, sizeof(*pin)))
+		return NULL;
+
+	pin->hazard = NULL;
+	pin->used = 1;
+	pin->next = __atomic_load_n(&sh->pins, __ATOMIC_RELAXED);
+
+	while(!__atomic_compare_exchange_n(&sh->pins, &pin->next, pin, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return pin;
+}
+
+struct dtree_impl *dtree_shared_pin(struct dtree_shared *sh, struct dtree_shared_pin **pin,
+		struct dtree_error *err)
+{
+	struct shared_version *v;
+
+	*pin = pin_take(sh);
+	if(*pin == NULL) {
+		dtree_errno_set(err, ENOMEM);
+		return NULL;
+	}
+
+	// the version can not be reclaimed once it is seen
+	// as current after the hazard is set
+	do {
+		v = __atomic_load_n(&sh->current, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&(*pin)->hazard, v, __ATOMIC_SEQ_CST);
+	} while(v != __atomic_load_n(&sh->current, __ATOMIC_SEQ_CST));
+
+	struct dtree_impl *view = NULL;
+
+	if(v == NULL)
+		dtree_errno_set(err, ENOENT); // nothing published yet
+	else
+		view = dtree_snap_view(v->snap, err);
+
+	if(view == NULL) {
+		dtree_shared_unpin(sh, *pin);
+		*pin = NULL;
+	}
+
+	return view;
+}
+
+void dtree_shared_unpin(struct dtree_shared *sh, struct dtree_shared_pin *pin)
+{
+	__atomic_store_n(&pin->hazard, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&pin->used, 0, __ATOMIC_RELEASE);
+
+	// never blocks, a writer holding the lock reclaims by itself
+	if(pthread_mutex_trylock(&sh->lock) == 0) {
+		reclaim(sh);
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+int dtree_shared_current(struct dtree_shared *sh, const struct dtree_shared_pin *pin)
+{
+	return __atomic_load_n(&sh->current, __ATOMIC_ACQUIRE) == pin->hazard;
+}
+
+int dtree_shared_swap(struct dtree_shared *sh, struct dtree_impl *snap, struct dtree_error *err)
+{
+	struct shared_version *v = malloc(sizeof(*v));
+	if(v == NULL) {
+		dtree_error_from_errno(err);
+		return -1;
+	}
+
+	v->snap = snap;
+	v->next = NULL;
+
+	pthread_mutex_lock(&sh->lock);
+
+	struct shared_version *old = __atomic_exchange_n(&sh->current, v, __ATOMIC_SEQ_CST);
+	if(old != NULL) {
+		old->next = sh->retired;
+		sh->retired = old;
+	}
+
+	reclaim(sh);
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * Internal snapshot shared by threads.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * Readers pin the current version by a hazard pointer
+ * (a slot of their own, no lock and no shared counter).
+ * A writer publishes a new version by an atomic swap,
+ * the old one is reclaimed when no slot points to it.
+ */
+
+#ifndef DTREE_SHARED
+#define DTREE_SHARED
+
+#include "dtree.h"
+#include "dtree_backend.h"
+
+/**
+ * Pin of a reader (its hazard slot).
+ */
+struct dtree_shared_pin;
+
+/**
+ * Pins the current version and creates a view of it (closed
+ * by the caller before the unpin). The pin is returned in pin.
+ *
+ * Returns NULL when nothing is published (ENOENT) or on error
+ * and sets err.
+ */
+struct dtree_impl *dtree_shared_pin(struct dtree_shared *sh, struct dtree_shared_pin **pin,
+		struct dtree_error *err);
+
+/**
+ * Releases the pin. Versions that are not pinned anymore
+ * are reclaimed unless the lock of writers is held (by
+ * a writer or another unpin), then they stay until
+ * a later publish or unpin reclaims them.
+ */
+void dtree_shared_unpin(struct dtree_shared *sh, struct dtree_shared_pin *pin);
+
+/**
+ * Tests whether the pinned version is the current one.
+ */
+int dtree_shared_current(struct dtree_shared *sh, const struct dtree_shared_pin *pin);
+
+/**
+ * Publishes the finished snapshot (taken on success) as
+ * the current version.
+ *
+ * Returns 0 on success. On error sets err.
+ */
+int dtree_shared_swap(struct dtree_shared *sh, struct dtree_impl *snap, struct dtree_error *err);
+
+#endif
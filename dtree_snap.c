@@ -0,0 +1,1245 @@
+/**
+ * dtree_snap.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "dtree_error.h"
+#include "dtree_snap.h"
+#include "dtree_backend.h"
+#include "dtree_filter.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Flat representation of all devices.
+ *
+ * The i-th device is described by base[i], high[i],
+ * name[i] (offset into strtab) and compat[i], compatn[i]
+ * (index and length of its list in clist). Entries
+ * of clist are offsets into strtab.
+ */
+struct snapshot {
+	struct dtree_impl impl;
+
+	uint32_t count;
+	uint32_t cap;
+	dtree_addr_t *base;
+	dtree_addr_t *high;
+	uint32_t *name;
+	uint32_t *compat;
+	uint32_t *compatn;
+
+	uint32_t *clist;
+	uint32_t clist_len;
+	uint32_t clist_cap;
+
+	char *strtab;
+	uint32_t strtab_len;
+	uint32_t strtab_cap;
+
+	// open addressing hash table of device names,
+	// holds (index + 1) of devices, 0 is an empty slot
+	uint32_t *names;
+	uint32_t names_size;
+
+	// inverted index of compatible strings: hash table compats
+	// holds (key + 1), the key-th string is at strtab + ckey_str[key]
+	// and its devices are cpost[ckey_first[key] .. ckey_first[key + 1]]
+	uint32_t *compats;
+	uint32_t compats_size;
+	uint32_t ckeys;
+	uint32_t *ckey_str;
+	uint32_t *ckey_first;
+	uint32_t *cpost;
+	uint32_t cpost_len;
+
+	// interval index: devices sorted by address range, viewed as
+	// an implicit balanced tree (middle of each subrange is its root),
+	// rmax[k] is the highest address in the subtree rooted at k
+	uint32_t *ranges;
+	dtree_addr_t *rmax;
+
+	// iterator: index of the next device
+	uint32_t pos;
+
+	// returned devices carry copies of their strings
+	int detached;
+
+	// arrays are borrowed from another snapshot
+	int view;
+
+	// all arrays point into map when loaded by dtree_snap_map()
+	void *map;
+	size_t map_len;
+};
+
+static const struct dtree_backend snap_backend;
+
+static
+int grow(void *parray, uint32_t need, uint32_t cap, size_t esize)
+{
+	void **array = (void **) parray;
+
+	if(need <= cap)
+		return 0;
+
+	void *bigger = realloc(*array, need * esize);
+	if(bigger == NULL)
+		return 1;
+
+	*array = bigger;
+	return 0;
+}
+
+static
+uint32_t next_cap(uint32_t need, uint32_t cap)
+{
+	if(cap == 0)
+		cap = 16;
+
+	while(cap < need)
+		cap *= 2;
+
+	return cap;
+}
+
+static
+int snap_reserve_devs(struct snapshot *snap, uint32_t need)
+{
+	if(need <= snap->cap)
+		return 0;
+
+	const uint32_t cap = next_cap(need, snap->cap);
+
+	if(grow(&snap->base,    cap, snap->cap, sizeof(dtree_addr_t))
+	|| grow(&snap->high,    cap, snap->cap, sizeof(dtree_addr_t))
+	|| grow(&snap->name,    cap, snap->cap, sizeof(uint32_t))
+	|| grow(&snap->compat,  cap, snap->cap, sizeof(uint32_t))
+	|| grow(&snap->compatn, cap, snap->cap, sizeof(uint32_t)))
+		return 1;
+
+	snap->cap = cap;
+	return 0;
+}
+
+static
+int snap_add_clist(struct snapshot *snap, uint32_t stroff)
+{
+	const uint32_t need = snap->clist_len + 1;
+
+	if(need > snap->clist_cap) {
+		const uint32_t cap = next_cap(need, snap->clist_cap);
+		if(grow(&snap->clist, cap, snap->clist_cap, sizeof(uint32_t)))
+			return 1;
+
+		snap->clist_cap = cap;
+	}
+
+	snap->clist[snap->clist_len++] = stroff;
+	return 0;
+}
+
+/**
+ * Appends the string to the strtab.
+ * Returns 0 on success and its offset in off.
+ */
+static
+int snap_add_str(struct snapshot *snap, const char *s, uint32_t *off)
+{
+	const uint32_t slen = strlen(s) + 1;
+	const uint32_t need = snap->strtab_len + slen;
+
+	if(need > snap->strtab_cap) {
+		const uint32_t cap = next_cap(need, snap->strtab_cap);
+		if(grow(&snap->strtab, cap, snap->strtab_cap, 1))
+			return 1;
+
+		snap->strtab_cap = cap;
+	}
+
+	memcpy(snap->strtab + snap->strtab_len, s, slen);
+	*off = snap->strtab_len;
+	snap->strtab_len += slen;
+	return 0;
+}
+
+struct dtree_impl *dtree_snap_new(struct dtree_error *err)
+{
+	struct snapshot *snap = calloc(1, sizeof(*snap));
+	if(snap == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	snap->impl.backend = &snap_backend;
+	snap->impl.err = err;
+	return &snap->impl;
+}
+
+int dtree_snap_add(struct dtree_impl *impl, const struct dtree_dev_t *dev)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+	assert(dev != NULL);
+
+	const uint32_t i = snap->count;
+	if(snap_reserve_devs(snap, i + 1))
+		goto clean_and_exit;
+
+	snap->base[i] = dtree_dev_base(dev);
+	snap->high[i] = dtree_dev_high(dev);
+
+	if(snap_add_str(snap, dtree_dev_name(dev), &snap->name[i]))
+		goto clean_and_exit;
+
+	const char **compat = dtree_dev_compat(dev);
+	snap->compat[i]  = snap->clist_len;
+	snap->compatn[i] = 0;
+
+	for(; compat[snap->compatn[i]] != NULL; snap->compatn[i] += 1) {
+		uint32_t off;
+		if(snap_add_str(snap, compat[snap->compatn[i]], &off))
+			goto clean_and_exit;
+		if(snap_add_clist(snap, off))
+			goto clean_and_exit;
+	}
+
+	snap->count += 1;
+	return 0;
+
+clean_and_exit:
+	dtree_errno_set(snap->impl.err, ENOMEM);
+	return -1;
+}
+
+/**
+ * FNV-1a hash of the zero-terminated string.
+ */
+static
+uint32_t str_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for(; *s != '\0'; ++s) {
+		h ^= (uint8_t) *s;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static inline
+uint32_t hash_size(uint32_t entries)
+{
+	uint32_t size = 16;
+	while(size < 2 * entries)
+		size *= 2;
+
+	return size;
+}
+
+static inline
+const char *snap_name(const struct snapshot *snap, uint32_t i)
+{
+	return snap->strtab + snap->name[i];
+}
+
+/**
+ * Returns the slot in names where the name is stored
+ * or the empty slot where it should be stored.
+ */
+static
+uint32_t *snap_names_slot(const struct snapshot *snap, const char *name)
+{
+	const uint32_t mask = snap->names_size - 1;
+	uint32_t h = str_hash(name) & mask;
+
+	while(snap->names[h] != 0) {
+		if(!strcmp(snap_name(snap, snap->names[h] - 1), name))
+			break;
+
+		h = (h + 1) & mask;
+	}
+
+	return &snap->names[h];
+}
+
+/**
+ * Builds the name index. When more devices have the same
+ * name, the first one is indexed.
+ */
+static
+int snap_index_names(struct snapshot *snap)
+{
+	const uint32_t size = hash_size(snap->count);
+
+	snap->names = calloc(size, sizeof(uint32_t));
+	if(snap->names == NULL)
+		return 1;
+
+	snap->names_size = size;
+
+	for(uint32_t i = 0; i < snap->count; ++i) {
+		uint32_t *slot = snap_names_slot(snap, snap_name(snap, i));
+		if(*slot == 0)
+			*slot = i + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the slot in compats where the compatible string
+ * is stored or the empty slot where it should be stored.
+ */
+static
+uint32_t *snap_compats_slot(const struct snapshot *snap, const char *compat)
+{
+	const uint32_t mask = snap->compats_size - 1;
+	uint32_t h = str_hash(compat) & mask;
+
+	while(snap->compats[h] != 0) {
+		const uint32_t key = snap->compats[h] - 1;
+		if(!strcmp(snap->strtab + snap->ckey_str[key], compat))
+			break;
+
+		h = (h + 1) & mask;
+	}
+
+	return &snap->compats[h];
+}
+
+/**
+ * Builds the inverted index of compatible strings.
+ * Devices of each string are stored in the tree order.
+ */
+static
+int snap_index_compats(struct snapshot *snap)
+{
+	const uint32_t entries = snap->clist_len;
+
+	snap->compats_size = hash_size(entries);
+	snap->compats    = calloc(snap->compats_size, sizeof(uint32_t));
+	snap->ckey_str   = malloc((entries + 1) * sizeof(uint32_t));
+	snap->ckey_first = calloc(entries + 2, sizeof(uint32_t));
+	snap->cpost      = malloc((entries + 1) * sizeof(uint32_t));
+
+	// key of each clist entry, UINT32_MAX for duplicates inside of a device
+	uint32_t *keys = malloc((entries + 1) * sizeof(uint32_t));
+
+	if(snap->compats == NULL || snap->ckey_str == NULL
+	|| snap->ckey_first == NULL || snap->cpost == NULL || keys == NULL) {
+		free(keys);
+		return 1;
+	}
+
+	// assign keys and count devices of each key (in ckey_first[key + 1])
+	for(uint32_t i = 0; i < snap->count; ++i) {
+		for(uint32_t k = 0; k < snap->compatn[i]; ++k) {
+			const uint32_t e = snap->compat[i] + k;
+			uint32_t *slot = snap_compats_slot(snap, snap->strtab + snap->clist[e]);
+
+			if(*slot == 0) {
+				snap->ckey_str[snap->ckeys] = snap->clist[e];
+				*slot = ++snap->ckeys;
+			}
+
+			keys[e] = *slot - 1;
+			for(uint32_t j = snap->compat[i]; j < e; ++j) {
+				if(keys[j] == keys[e])
+					keys[e] = UINT32_MAX;
+			}
+
+			if(keys[e] != UINT32_MAX)
+				snap->ckey_first[keys[e] + 1] += 1;
+		}
+	}
+
+	for(uint32_t key = 0; key < snap->ckeys; ++key)
+		snap->ckey_first[key + 1] += snap->ckey_first[key];
+
+	// fill postings, ckey_first[key] is used as a cursor
+	// and shifted back afterwards
+	for(uint32_t i = 0; i < snap->count; ++i) {
+		for(uint32_t k = 0; k < snap->compatn[i]; ++k) {
+			const uint32_t key = keys[snap->compat[i] + k];
+			if(key != UINT32_MAX)
+				snap->cpost[snap->ckey_first[key]++] = i;
+		}
+	}
+
+	for(uint32_t key = snap->ckeys; key > 0; --key)
+		snap->ckey_first[key] = snap->ckey_first[key - 1];
+	snap->ckey_first[0] = 0;
+	snap->cpost_len = snap->ckey_first[snap->ckeys];
+
+	free(keys);
+	return 0;
+}
+
+/**
+ * Highest address of the i-th device. When the high
+ * is not valid, the device occupies just the base.
+ */
+static inline
+dtree_addr_t snap_high(const struct snapshot *snap, uint32_t i)
+{
+	return snap->high[i] > snap->base[i]? snap->high[i] : snap->base[i];
+}
+
+/**
+ * Sort key of a device in the interval index.
+ */
+struct range_key {
+	dtree_addr_t base;
+	dtree_addr_t high;
+	uint32_t i;
+};
+
+static
+int range_cmp(const void *a, const void *b)
+{
+	const struct range_key *x = (const struct range_key *) a;
+	const struct range_key *y = (const struct range_key *) b;
+
+	if(x->base != y->base)
+		return x->base < y->base? -1 : 1;
+	if(x->high != y->high)
+		return x->high < y->high? -1 : 1;
+
+	return x->i < y->i? -1 : (x->i > y->i);
+}
+
+static
+dtree_addr_t snap_index_rmax(struct snapshot *snap, uint32_t lo, uint32_t hi)
+{
+	const uint32_t mid = lo + (hi - lo) / 2;
+	dtree_addr_t max = snap_high(snap, snap->ranges[mid]);
+
+	if(lo < mid) {
+		const dtree_addr_t left = snap_index_rmax(snap, lo, mid);
+		max = left > max? left : max;
+	}
+	if(mid + 1 < hi) {
+		const dtree_addr_t right = snap_index_rmax(snap, mid + 1, hi);
+		max = right > max? right : max;
+	}
+
+	snap->rmax[mid] = max;
+	return max;
+}
+
+/**
+ * Builds the interval index of device address ranges.
+ */
+static
+int snap_index_ranges(struct snapshot *snap)
+{
+	snap->ranges = malloc((snap->count + 1) * sizeof(uint32_t));
+	snap->rmax = malloc((snap->count + 1) * sizeof(dtree_addr_t));
+
+	struct range_key *keys = malloc((snap->count + 1) * sizeof(struct range_key));
+
+	if(snap->ranges == NULL || snap->rmax == NULL || keys == NULL) {
+		free(keys);
+		return 1;
+	}
+
+	for(uint32_t i = 0; i < snap->count; ++i) {
+		keys[i].base = snap->base[i];
+		keys[i].high = snap_high(snap, i);
+		keys[i].i = i;
+	}
+
+	qsort(keys, snap->count, sizeof(struct range_key), range_cmp);
+
+	for(uint32_t k = 0; k < snap->count; ++k)
+		snap->ranges[k] = keys[k].i;
+
+	free(keys);
+
+	if(snap->count > 0)
+		snap_index_rmax(snap, 0, snap->count);
+
+	return 0;
+}
+
+int dtree_snap_finish(struct dtree_impl *impl)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap_index_names(snap) || snap_index_compats(snap) || snap_index_ranges(snap)) {
+		dtree_errno_set(snap->impl.err, ENOMEM);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Sections of a saved snapshot.
+ */
+enum snap_section {
+	SEC_BASE,
+	SEC_HIGH,
+	SEC_NAME,
+	SEC_COMPAT,
+	SEC_COMPATN,
+	SEC_CLIST,
+	SEC_STRTAB,
+	SEC_NAMES,
+	SEC_COMPATS,
+	SEC_CKEY_STR,
+	SEC_CKEY_FIRST,
+	SEC_CPOST,
+	SEC_RANGES,
+	SEC_RMAX,
+	SEC_COUNT
+};
+
+#define SNAP_MAGIC   0x43535444 // "DTSC", detects a foreign byte order too
+#define SNAP_VERSION 1
+
+/**
+ * Header of a saved snapshot. Sections are stored
+ * at off[] (from the start of the file, 8 B aligned).
+ */
+struct snap_header {
+	uint32_t magic;
+	uint32_t version;
+	struct dtree_snap_stamp stamp;
+
+	uint32_t count;
+	uint32_t clist_len;
+	uint32_t strtab_len;
+	uint32_t names_size;
+	uint32_t compats_size;
+	uint32_t ckeys;
+	uint32_t cpost_len;
+
+	uint32_t off[SEC_COUNT];
+	uint64_t len;
+};
+
+#define SEC(id, field, n) \
+	do { \
+		data[id] = (void **) &snap->field; \
+		len[id] = (uint64_t) (n) * sizeof(*snap->field); \
+	} while(0)
+
+/**
+ * Lists the arrays of the snapshot and their lengths
+ * (in bytes) according to its counters.
+ */
+static
+void snap_sections(struct snapshot *snap, void **data[SEC_COUNT], uint64_t len[SEC_COUNT])
+{
+	SEC(SEC_BASE,       base,       snap->count);
+	SEC(SEC_HIGH,       high,       snap->count);
+	SEC(SEC_NAME,       name,       snap->count);
+	SEC(SEC_COMPAT,     compat,     snap->count);
+	SEC(SEC_COMPATN,    compatn,    snap->count);
+	SEC(SEC_CLIST,      clist,      snap->clist_len);
+	SEC(SEC_STRTAB,     strtab,     snap->strtab_len);
+	SEC(SEC_NAMES,      names,      snap->names_size);
+	SEC(SEC_COMPATS,    compats,    snap->compats_size);
+	SEC(SEC_CKEY_STR,   ckey_str,   snap->ckeys);
+	SEC(SEC_CKEY_FIRST, ckey_first, snap->ckeys + 1);
+	SEC(SEC_CPOST,      cpost,      snap->cpost_len);
+	SEC(SEC_RANGES,     ranges,     snap->count);
+	SEC(SEC_RMAX,       rmax,       snap->count);
+}
+
+#undef SEC
+
+static inline
+uint64_t align8(uint64_t off)
+{
+	return (off + 7) & ~(uint64_t) 7;
+}
+
+static
+int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = (const char *) buf;
+
+	while(len > 0) {
+		ssize_t wlen = pwrite(fd, p, len, off);
+		if(wlen < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += wlen;
+		off += wlen;
+		len -= wlen;
+	}
+
+	return 0;
+}
+
+int dtree_snap_save(struct dtree_impl *impl, int fd, const struct dtree_snap_stamp *stamp)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+	struct snap_header h;
+	void **data[SEC_COUNT];
+	uint64_t len[SEC_COUNT];
+
+	assert(snap->names != NULL); // finished
+
+	memset(&h, 0, sizeof(h));
+	h.magic        = SNAP_MAGIC;
+	h.version      = SNAP_VERSION;
+	h.stamp        = *stamp;
+	h.count        = snap->count;
+	h.clist_len    = snap->clist_len;
+	h.strtab_len   = snap->strtab_len;
+	h.names_size   = snap->names_size;
+	h.compats_size = snap->compats_size;
+	h.ckeys        = snap->ckeys;
+	h.cpost_len    = snap->cpost_len;
+
+	snap_sections(snap, data, len);
+
+	uint64_t off = align8(sizeof(h));
+	for(int s = 0; s < SEC_COUNT; ++s) {
+		h.off[s] = off;
+		off = align8(off + len[s]);
+	}
+
+	if(off > UINT32_MAX) {
+		dtree_errno_set(snap->impl.err, EFBIG);
+		return -1;
+	}
+
+	h.len = off;
+
+	if(pwrite_all(fd, &h, sizeof(h), 0))
+		goto clean_and_exit;
+
+	for(int s = 0; s < SEC_COUNT; ++s) {
+		if(len[s] > 0 && pwrite_all(fd, *data[s], len[s], h.off[s]))
+			goto clean_and_exit;
+	}
+
+	// padding of the last section
+	if(ftruncate(fd, h.len))
+		goto clean_and_exit;
+
+	return 0;
+
+clean_and_exit:
+	dtree_error_from_errno(snap->impl.err);
+	return -1;
+}
+
+static inline
+int is_pow2(uint32_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+/**
+ * Checks the header and the bounds of all sections. Hash
+ * tables must have a free slot to terminate the probing.
+ */
+static
+int snap_header_valid(const struct snap_header *h, uint64_t flen,
+		const struct dtree_snap_stamp *stamp)
+{
+	if(h->magic != SNAP_MAGIC || h->version != SNAP_VERSION || h->len != flen)
+		return 0;
+
+	if(memcmp(&h->stamp, stamp, sizeof(*stamp)))
+		return 0;
+
+	return is_pow2(h->names_size) && h->names_size > h->count
+	    && is_pow2(h->compats_size) && h->compats_size > h->ckeys;
+}
+
+/**
+ * Checks that all indices stored in the sections point into
+ * their targets. A damaged cache must not lead out of the map.
+ */
+static
+int snap_indices_valid(const struct snapshot *snap)
+{
+	if(snap->strtab_len > 0 && snap->strtab[snap->strtab_len - 1] != '\0')
+		return 0;
+
+	for(uint32_t i = 0; i < snap->count; ++i) {
+		if(snap->name[i] >= snap->strtab_len || snap->ranges[i] >= snap->count
+		|| (uint64_t) snap->compat[i] + snap->compatn[i] > snap->clist_len)
+			return 0;
+	}
+
+	for(uint32_t k = 0; k < snap->clist_len; ++k) {
+		if(snap->clist[k] >= snap->strtab_len)
+			return 0;
+	}
+
+	for(uint32_t key = 0; key < snap->ckeys; ++key) {
+		if(snap->ckey_str[key] >= snap->strtab_len
+		|| snap->ckey_first[key] > snap->ckey_first[key + 1])
+			return 0;
+	}
+
+	if(snap->ckey_first[0] != 0 || snap->ckey_first[snap->ckeys] != snap->cpost_len)
+		return 0;
+
+	for(uint32_t k = 0; k < snap->cpost_len; ++k) {
+		if(snap->cpost[k] >= snap->count)
+			return 0;
+	}
+
+	// at most count (ckeys) slots are used, the rest terminates probing
+	uint32_t used = 0;
+	for(uint32_t h = 0; h < snap->names_size; ++h) {
+		if(snap->names[h] > snap->count || (snap->names[h] != 0 && ++used > snap->count))
+			return 0;
+	}
+
+	used = 0;
+	for(uint32_t h = 0; h < snap->compats_size; ++h) {
+		if(snap->compats[h] > snap->ckeys || (snap->compats[h] != 0 && ++used > snap->ckeys))
+			return 0;
+	}
+
+	return 1;
+}
+
+struct dtree_impl *dtree_snap_map(int fd, const struct dtree_snap_stamp *stamp,
+		struct dtree_error *err)
+{
+	struct stat st;
+	void **data[SEC_COUNT];
+	uint64_t len[SEC_COUNT];
+
+	if(fstat(fd, &st)) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	if(st.st_size < (off_t) sizeof(struct snap_header))
+		return NULL;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	const struct snap_header *h = (const struct snap_header *) map;
+	if(!snap_header_valid(h, st.st_size, stamp))
+		goto invalid;
+
+	struct snapshot *snap = calloc(1, sizeof(*snap));
+	if(snap == NULL) {
+		dtree_error_from_errno(err);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	snap->impl.backend = &snap_backend;
+	snap->impl.err     = err;
+	snap->map          = map;
+	snap->map_len      = st.st_size;
+	snap->count        = h->count;
+	snap->clist_len    = h->clist_len;
+	snap->strtab_len   = h->strtab_len;
+	snap->names_size   = h->names_size;
+	snap->compats_size = h->compats_size;
+	snap->ckeys        = h->ckeys;
+	snap->cpost_len    = h->cpost_len;
+
+	snap_sections(snap, data, len);
+
+	for(int s = 0; s < SEC_COUNT; ++s) {
+		if(h->off[s] % 8 || h->off[s] < sizeof(*h) || h->off[s] + len[s] > h->len) {
+			free(snap);
+			goto invalid;
+		}
+
+		*data[s] = (char *) map + h->off[s];
+	}
+
+	if(!snap_indices_valid(snap)) {
+		free(snap);
+		goto invalid;
+	}
+
+	return &snap->impl;
+
+invalid:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+struct dtree_impl *dtree_snap_view(const struct dtree_impl *impl, struct dtree_error *err)
+{
+	const struct snapshot *snap = (const struct snapshot *) impl;
+
+	struct snapshot *view = malloc(sizeof(*view));
+	if(view == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	*view = *snap;
+	view->impl.err = err;
+	view->pos = 0;
+	view->detached = 1;
+	view->view = 1;
+	return &view->impl;
+}
+
+int dtree_snap_owned(const struct dtree_impl *impl)
+{
+	return impl->backend == &snap_backend && !((const struct snapshot *) impl)->view;
+}
+
+void dtree_snap_close(struct dtree_impl *impl)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap->view) {
+		free(snap);
+		return;
+	}
+
+	if(snap->map != NULL) {
+		munmap(snap->map, snap->map_len);
+		free(snap);
+		return;
+	}
+
+	free(snap->names);
+	free(snap->compats);
+	free(snap->ckey_str);
+	free(snap->ckey_first);
+	free(snap->cpost);
+	free(snap->ranges);
+	free(snap->rmax);
+	free(snap->base);
+	free(snap->high);
+	free(snap->name);
+	free(snap->compat);
+	free(snap->compatn);
+	free(snap->clist);
+	free(snap->strtab);
+	free(snap);
+}
+
+int dtree_snap_reset(struct dtree_impl *impl)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	snap->pos = 0;
+	return 0;
+}
+
+void dtree_snap_set_detached(struct dtree_impl *impl)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+	snap->detached = 1;
+}
+
+/**
+ * Creates the dtree_dev_t representation of the i-th device.
+ */
+static
+struct dtree_dev_t *snap_dev(struct snapshot *snap, uint32_t i)
+{
+	const uint32_t n = snap->compatn[i];
+	size_t extra = 0;
+
+	if(snap->detached) {
+		extra = strlen(snap_name(snap, i)) + 1;
+		for(uint32_t k = 0; k < n; ++k)
+			extra += strlen(snap->strtab + snap->clist[snap->compat[i] + k]) + 1;
+	}
+
+	// the compat array (and strings when detached) is placed right after the dev
+	struct dtree_dev_t *dev = malloc(sizeof(struct dtree_dev_t)
+	                                 + (n + 1) * sizeof(char *) + extra);
+	if(dev == NULL) {
+		dtree_error_from_errno(snap->impl.err);
+		return NULL;
+	}
+
+	const char **compat = (const char **) (dev + 1);
+	for(uint32_t k = 0; k < n; ++k)
+		compat[k] = snap->strtab + snap->clist[snap->compat[i] + k];
+	compat[n] = NULL;
+
+	dev->name = snap_name(snap, i);
+
+	if(snap->detached) {
+		char *str = (char *) (compat + n + 1);
+
+		for(uint32_t k = 0; k < n; ++k) {
+			compat[k] = strcpy(str, compat[k]);
+			str += strlen(str) + 1;
+		}
+
+		dev->name = strcpy(str, dev->name);
+	}
+
+	dev->base   = snap->base[i];
+	dev->high   = snap->high[i];
+	dev->compat = compat;
+
+	return dev;
+}
+
+struct dtree_dev_t *dtree_snap_next(struct dtree_impl *impl)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap->pos >= snap->count)
+		return NULL;
+
+	struct dtree_dev_t *dev = snap_dev(snap, snap->pos);
+	if(dev != NULL)
+		snap->pos += 1;
+
+	return dev;
+}
+
+size_t dtree_snap_next_into(struct dtree_impl *impl, struct dtree_dev_t *dev, void *buf, size_t len)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+	size_t need;
+
+	if(snap->pos >= snap->count)
+		return 0;
+
+	// strings stay in the snapshot, only the compat array is stored
+	const uint32_t i = snap->pos;
+	const uint32_t n = snap->compatn[i];
+	const char **compat = dev_buf_array(buf, len, n, 0, &need);
+	if(compat == NULL)
+		return need;
+
+	for(uint32_t k = 0; k < n; ++k)
+		compat[k] = snap->strtab + snap->clist[snap->compat[i] + k];
+	compat[n] = NULL;
+
+	dev->name   = snap_name(snap, i);
+	dev->base   = snap->base[i];
+	dev->high   = snap->high[i];
+	dev->compat = compat;
+
+	snap->pos += 1;
+	return need;
+}
+
+struct dtree_dev_t *dtree_snap_byname(struct dtree_impl *impl, const char *name)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap->names == NULL)
+		return NULL;
+
+	const uint32_t *slot = snap_names_slot(snap, name);
+	if(*slot == 0)
+		return NULL;
+
+	return snap_dev(snap, *slot - 1);
+}
+
+/**
+ * Returns the key of the compatible string or UINT32_MAX.
+ */
+static
+uint32_t snap_compat_key(const struct snapshot *snap, const char *compat)
+{
+	if(snap->compats == NULL)
+		return UINT32_MAX;
+
+	const uint32_t *slot = snap_compats_slot(snap, compat);
+	return *slot == 0? UINT32_MAX : *slot - 1;
+}
+
+/**
+ * Returns the first posting of the key of a device at
+ * or after the iterator (postings are sorted).
+ */
+static
+uint32_t snap_postings_from(const struct snapshot *snap, uint32_t key)
+{
+	uint32_t lo = snap->ckey_first[key];
+	uint32_t hi = snap->ckey_first[key + 1];
+
+	while(lo < hi) {
+		const uint32_t mid = lo + (hi - lo) / 2;
+
+		if(snap->cpost[mid] < snap->pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+struct dtree_dev_t *dtree_snap_bycompat(struct dtree_impl *impl, const char *compat)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	const uint32_t key = snap_compat_key(snap, compat);
+	if(key == UINT32_MAX)
+		return NULL;
+
+	const uint32_t lo = snap_postings_from(snap, key);
+	if(lo == snap->ckey_first[key + 1]) {
+		snap->pos = snap->count;
+		return NULL;
+	}
+
+	struct dtree_dev_t *dev = snap_dev(snap, snap->cpost[lo]);
+	if(dev != NULL)
+		snap->pos = snap->cpost[lo] + 1;
+
+	return dev;
+}
+
+/**
+ * Tests the i-th device by the filter except
+ * the compatible.
+ */
+static
+int snap_match(const struct snapshot *snap, const struct dtree_filter *f, uint32_t i)
+{
+	return dtree_filter_name(f, snap_name(snap, i))
+	    && dtree_filter_range(f, snap->base[i], snap->high[i]);
+}
+
+/**
+ * Returns the i-th device and moves the iterator after it.
+ */
+static
+struct dtree_dev_t *snap_take(struct snapshot *snap, uint32_t i)
+{
+	struct dtree_dev_t *dev = snap_dev(snap, i);
+	if(dev != NULL)
+		snap->pos = i + 1;
+
+	return dev;
+}
+
+struct dtree_dev_t *dtree_snap_find(struct dtree_impl *impl, const struct dtree_filter *f)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(f->flags & DTREE_FIND_OKAY) {
+		dtree_errno_set(snap->impl.err, ENOTSUP); // status is not kept
+		return NULL;
+	}
+
+	if(f->compat == NULL) {
+		for(; snap->pos < snap->count; ++snap->pos) {
+			if(snap_match(snap, f, snap->pos))
+				return snap_take(snap, snap->pos);
+		}
+
+		return NULL;
+	}
+
+	// only devices of the compatible are candidates
+	const uint32_t key = snap_compat_key(snap, f->compat);
+
+	if(key != UINT32_MAX) {
+		for(uint32_t k = snap_postings_from(snap, key); k < snap->ckey_first[key + 1]; ++k) {
+			if(snap_match(snap, f, snap->cpost[k]))
+				return snap_take(snap, snap->cpost[k]);
+		}
+	}
+
+	snap->pos = snap->count;
+	return NULL;
+}
+
+struct dtree_dev_t **dtree_snap_bycompat_all(struct dtree_impl *impl, const char *compat)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	const uint32_t key = snap_compat_key(snap, compat);
+	if(key == UINT32_MAX)
+		return NULL;
+
+	const uint32_t first = snap->ckey_first[key];
+	const uint32_t n = snap->ckey_first[key + 1] - first;
+
+	struct dtree_dev_t **devs = malloc((n + 1) * sizeof(struct dtree_dev_t *));
+	if(devs == NULL) {
+		dtree_error_from_errno(snap->impl.err);
+		return NULL;
+	}
+
+	for(uint32_t k = 0; k < n; ++k) {
+		devs[k] = snap_dev(snap, snap->cpost[first + k]);
+
+		if(devs[k] == NULL) {
+			while(k-- > 0)
+				dtree_snap_dev_free(devs[k]);
+
+			free(devs);
+			return NULL;
+		}
+	}
+
+	devs[n] = NULL;
+	return devs;
+}
+
+/**
+ * Visits all devices overlapping [base, high] in the subtree
+ * of the interval index [lo, hi) in order of their addresses.
+ * Stops when visit returns non-zero.
+ */
+static
+int snap_overlaps(struct snapshot *snap, uint32_t lo, uint32_t hi,
+		dtree_addr_t base, dtree_addr_t high,
+		int (*visit)(struct snapshot *snap, uint32_t i, void *arg), void *arg)
+{
+	if(lo >= hi)
+		return 0;
+
+	const uint32_t mid = lo + (hi - lo) / 2;
+	const uint32_t i = snap->ranges[mid];
+
+	if(snap->rmax[mid] < base)
+		return 0; // nothing in this subtree reaches the range
+
+	if(snap_overlaps(snap, lo, mid, base, high, visit, arg))
+		return 1;
+
+	if(snap->base[i] > high)
+		return 0; // the rest starts after the range
+
+	if(snap_high(snap, i) >= base && visit(snap, i, arg))
+		return 1;
+
+	return snap_overlaps(snap, mid + 1, hi, base, high, visit, arg);
+}
+
+static
+int visit_smallest(struct snapshot *snap, uint32_t i, void *arg)
+{
+	uint32_t *best = (uint32_t *) arg;
+
+	if(*best == UINT32_MAX) {
+		*best = i;
+		return 0;
+	}
+
+	const dtree_addr_t size = snap_high(snap, i) - snap->base[i];
+	const dtree_addr_t best_size = snap_high(snap, *best) - snap->base[*best];
+
+	// prefer the smaller range, then the deeper device
+	if(size < best_size || (size == best_size && i > *best))
+		*best = i;
+
+	return 0;
+}
+
+struct dtree_dev_t *dtree_snap_byaddr(struct dtree_impl *impl, dtree_addr_t addr)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap->ranges == NULL)
+		return NULL;
+
+	uint32_t best = UINT32_MAX;
+	snap_overlaps(snap, 0, snap->count, addr, addr, visit_smallest, &best);
+
+	if(best == UINT32_MAX)
+		return NULL;
+
+	return snap_dev(snap, best);
+}
+
+struct devs_collect {
+	struct dtree_dev_t **devs;
+	uint32_t count;
+	uint32_t cap;
+};
+
+static
+int visit_collect(struct snapshot *snap, uint32_t i, void *arg)
+{
+	struct devs_collect *c = (struct devs_collect *) arg;
+
+	if(c->count + 1 >= c->cap) {
+		const uint32_t cap = next_cap(c->count + 2, c->cap);
+		if(grow(&c->devs, cap, c->cap, sizeof(struct dtree_dev_t *)))
+			goto clean_and_exit;
+
+		c->cap = cap;
+	}
+
+	c->devs[c->count] = snap_dev(snap, i);
+	if(c->devs[c->count] == NULL)
+		return 1;
+
+	c->devs[++c->count] = NULL;
+	return 0;
+
+clean_and_exit:
+	dtree_error_from_errno(snap->impl.err);
+	return 1;
+}
+
+struct dtree_dev_t **dtree_snap_byrange(struct dtree_impl *impl, dtree_addr_t base, dtree_addr_t high)
+{
+	struct snapshot *snap = (struct snapshot *) impl;
+
+	if(snap->ranges == NULL)
+		return NULL;
+
+	struct devs_collect c = {NULL, 0, 0};
+
+	if(snap_overlaps(snap, 0, snap->count, base, high, visit_collect, &c)) {
+		while(c.count-- > 0)
+			dtree_snap_dev_free(c.devs[c.count]);
+
+		free(c.devs);
+		return NULL;
+	}
+
+	return c.devs;
+}
+
+void dtree_snap_dev_free(struct dtree_dev_t *dev)
+{
+	assert(dev != NULL);
+
+	// name and compat point into the snapshot or dev
+	dev->name   = NULL;
+	dev->compat = NULL;
+	dev->base = 0;
+	dev->high = 0;
+
+	free(dev);
+}
+
+static const struct dtree_backend snap_backend = {
+	.close        = dtree_snap_close,
+	.next         = dtree_snap_next,
+	.next_into    = dtree_snap_next_into,
+	.reset        = dtree_snap_reset,
+	.byname       = dtree_snap_byname,
+	.bycompat     = dtree_snap_bycompat,
+	.bycompat_all = dtree_snap_bycompat_all,
+	.byaddr       = dtree_snap_byaddr,
+	.byrange      = dtree_snap_byrange,
+	.find         = dtree_snap_find,
+};
@@ -0,0 +1,164 @@
+/**
+ * Internal in-memory snapshot of the device tree.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * The snapshot is filled once by dtree_snap_add() (usually
+ * by draining another implementation) and then it is
+ * iterated without any I/O.
+ */
+
+#ifndef DTREE_SNAP
+#define DTREE_SNAP
+
+#include "dtree_backend.h"
+#include <stdint.h>
+
+/**
+ * Identification of the source of a saved snapshot.
+ * A saved snapshot is valid only for an equal stamp.
+ */
+struct dtree_snap_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mtime; // in ns
+	uint64_t size;
+	uint64_t hash;
+};
+
+/**
+ * Creates an empty snapshot.
+ * Returns NULL on error and sets err.
+ */
+struct dtree_impl *dtree_snap_new(struct dtree_error *err);
+
+/**
+ * Appends a copy of the device to the snapshot.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_snap_add(struct dtree_impl *impl, const struct dtree_dev_t *dev);
+
+/**
+ * Finishes the snapshot after all devices have been
+ * added. Builds the lookup indexes.
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_snap_finish(struct dtree_impl *impl);
+
+/**
+ * Makes devices returned by the snapshot independent of it,
+ * they carry copies of their strings and stay valid after
+ * the snapshot is closed. Devices of dtree_snap_next_into()
+ * still point into the snapshot.
+ */
+void dtree_snap_set_detached(struct dtree_impl *impl);
+
+/**
+ * Creates a view of the finished snapshot with its own
+ * iterator and error state. The view shares (never modifies)
+ * the data of the snapshot, it must be closed before it.
+ * Devices of the view are detached.
+ *
+ * Returns NULL on error and sets err.
+ */
+struct dtree_impl *dtree_snap_view(const struct dtree_impl *impl, struct dtree_error *err);
+
+/**
+ * Tests whether the implementation is a snapshot owning
+ * its data (not a view).
+ */
+int dtree_snap_owned(const struct dtree_impl *impl);
+
+/**
+ * Writes the finished snapshot into the file. The layout
+ * is versioned and position independent (offsets only)
+ * so it can be mapped by dtree_snap_map().
+ *
+ * Returns 0 on success. On error sets error state.
+ */
+int dtree_snap_save(struct dtree_impl *impl, int fd, const struct dtree_snap_stamp *stamp);
+
+/**
+ * Maps a snapshot saved by dtree_snap_save(). It is queried
+ * in place, nothing is copied or rebuilt.
+ *
+ * Returns NULL when the file is not a valid snapshot of an
+ * equal stamp (error state is untouched) or on error
+ * (sets error state).
+ */
+struct dtree_impl *dtree_snap_map(int fd, const struct dtree_snap_stamp *stamp,
+		struct dtree_error *err);
+
+/**
+ * Free's all resources.
+ */
+void dtree_snap_close(struct dtree_impl *impl);
+
+/**
+ * Traversing over the snapshot.
+ */
+struct dtree_dev_t *dtree_snap_next(struct dtree_impl *impl);
+
+/**
+ * Traversing over the snapshot into the caller's buffer.
+ * Strings of the device point into the snapshot.
+ */
+size_t dtree_snap_next_into(struct dtree_impl *impl, struct dtree_dev_t *dev, void *buf, size_t len);
+
+/**
+ * Looks up the first device of the given name by the index.
+ * Does not affect the iteration.
+ */
+struct dtree_dev_t *dtree_snap_byname(struct dtree_impl *impl, const char *name);
+
+/**
+ * Looks up the next device compatible with the given type
+ * by the index. Continues from the current iterator.
+ */
+struct dtree_dev_t *dtree_snap_bycompat(struct dtree_impl *impl, const char *compat);
+
+/**
+ * Looks up all devices compatible with the given type
+ * by the index. Does not affect the iteration.
+ *
+ * Returns NULL-terminated array or NULL when none is found.
+ */
+struct dtree_dev_t **dtree_snap_bycompat_all(struct dtree_impl *impl, const char *compat);
+
+/**
+ * Looks up the next device matching the filter. Only devices
+ * of the compatible (when given) are tested. The status is not
+ * kept (DTREE_FIND_OKAY fails), prune is never called.
+ */
+struct dtree_dev_t *dtree_snap_find(struct dtree_impl *impl, const struct dtree_filter *f);
+
+/**
+ * Looks up the smallest device whose address range contains
+ * the given address by the interval index. Does not affect
+ * the iteration.
+ */
+struct dtree_dev_t *dtree_snap_byaddr(struct dtree_impl *impl, dtree_addr_t addr);
+
+/**
+ * Looks up all devices overlapping the range [base, high]
+ * by the interval index. Does not affect the iteration.
+ *
+ * Returns NULL-terminated array (ordered by addresses)
+ * or NULL when none is found.
+ */
+struct dtree_dev_t **dtree_snap_byrange(struct dtree_impl *impl,
+		dtree_addr_t base, dtree_addr_t high);
+
+/**
+ * Free of dtree_dev_t returned by snapshot functions.
+ */
+void dtree_snap_dev_free(struct dtree_dev_t *dev);
+
+/**
+ * Reset of iteration over the snapshot.
+ */
+int dtree_snap_reset(struct dtree_impl *impl);
+
+#endif
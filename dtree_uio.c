@@ -0,0 +1,283 @@
+/**
+ * dtree_uio.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree_uio.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct dtree_uio {
+	int fd;       // /dev/uioN
+	int classfd;  // /sys/class/uio/uioN
+	uint32_t count;  // interrupts counted by the last wait
+	int counted;
+};
+
+/**
+ * Reads a sysfs attribute relative to dirfd. The trailing
+ * newline is removed.
+ *
+ * Returns its length or -1 (errno is set).
+ */
+static
+ssize_t attr_read(int dirfd, const char *path, char *buf, size_t len)
+{
+	const int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	ssize_t rlen = read(fd, buf, len - 1);
+	close(fd);
+
+	if(rlen < 0)
+		return -1;
+
+	if(rlen > 0 && buf[rlen - 1] == '\n')
+		rlen -= 1;
+
+	buf[rlen] = '\0';
+	return rlen;
+}
+
+static
+int attr_number(int dirfd, const char *path, unsigned long long *value)
+{
+	char buf[32];
+
+	if(attr_read(dirfd, path, buf, sizeof(buf)) <= 0)
+		return -1;
+
+	errno = 0;
+	*value = strtoull(buf, NULL, 0);
+	return errno? -1 : 0;
+}
+
+/**
+ * Name of a UIO device generated from a device tree node has
+ * no unit address (serial for serial@84000000).
+ */
+static
+int name_matches(const char *uioname, const char *name)
+{
+	const size_t len = strcspn(name, "@");
+	return !strcmp(uioname, name) || (strlen(uioname) == len && !strncmp(uioname, name, len));
+}
+
+static
+int compat_matches(int dirfd, const struct dtree_dev_t *dev)
+{
+	char buf[1024];
+
+	const ssize_t len = attr_read(dirfd, "device/of_node/compatible", buf, sizeof(buf));
+	if(len <= 0)
+		return 0;
+
+	const char **compat = dtree_dev_compat(dev);
+
+	// NUL separated list
+	for(const char *c = buf; c < buf + len; c += strlen(c) + 1) {
+		for(size_t i = 0; compat[i] != NULL; ++i) {
+			if(!strcmp(c, compat[i]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static
+int uio_matches(int dirfd, const struct dtree_dev_t *dev)
+{
+	char name[NAME_MAX + 1];
+	unsigned long long addr;
+
+	if(attr_read(dirfd, "name", name, sizeof(name)) < 0)
+		return 0;
+
+	if(!name_matches(name, dtree_dev_name(dev)) && !compat_matches(dirfd, dev))
+		return 0;
+
+	// devices of the same name differ by address
+	if(attr_number(dirfd, "maps/map0/addr", &addr) == 0)
+		return addr == dtree_dev_base(dev);
+
+	return 1;
+}
+
+struct dtree_uio *dtree_uio_find(const char *classd, const char *devd,
+		const struct dtree_dev_t *dev, struct dtree_error *err)
+{
+	struct dtree_uio *uio = NULL;
+	struct dirent *d;
+	int classfd = -1;
+
+	DIR *dir = opendir(classd == NULL? DTREE_UIO_CLASS : classd);
+	if(dir == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	while((d = readdir(dir)) != NULL) {
+		if(strncmp(d->d_name, "uio", 3))
+			continue;
+
+		classfd = openat(dirfd(dir), d->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(classfd < 0)
+			continue;
+
+		if(uio_matches(classfd, dev))
+			break;
+
+		close(classfd);
+		classfd = -1;
+	}
+
+	if(classfd < 0) {
+		dtree_errno_set(err, ENOENT);
+		goto clean_and_exit;
+	}
+
+	uio = calloc(1, sizeof(*uio));
+	if(uio == NULL) {
+		dtree_error_from_errno(err);
+		goto clean_and_exit;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", devd == NULL? DTREE_UIO_DEV : devd, d->d_name);
+
+	uio->fd = open(path, O_RDWR | O_CLOEXEC);
+	if(uio->fd < 0) {
+		dtree_error_from_errno(err);
+		free(uio);
+		uio = NULL;
+		goto clean_and_exit;
+	}
+
+	uio->classfd = classfd;
+	classfd = -1;
+
+clean_and_exit:
+	if(classfd >= 0)
+		close(classfd);
+
+	closedir(dir);
+	return uio;
+}
+
+void dtree_uio_close(dtree_uio_t *uio)
+{
+	if(uio == NULL)
+		return;
+
+	close(uio->fd);
+	close(uio->classfd);
+	free(uio);
+}
+
+int dtree_uio_fd(const dtree_uio_t *uio)
+{
+	return uio->fd;
+}
+
+struct dtree_map_t *dtree_uio_map(dtree_uio_t *uio, unsigned index)
+{
+	unsigned long long addr;
+	unsigned long long size;
+	unsigned long long offset = 0;
+	char path[64];
+
+	snprintf(path, sizeof(path), "maps/map%u/addr", index);
+	if(attr_number(uio->classfd, path, &addr))
+		return NULL;
+
+	snprintf(path, sizeof(path), "maps/map%u/size", index);
+	if(attr_number(uio->classfd, path, &size))
+		return NULL;
+
+	// offset of the region in its first page (not in older kernels)
+	snprintf(path, sizeof(path), "maps/map%u/offset", index);
+	if(attr_number(uio->classfd, path, &offset))
+		offset = 0;
+
+	struct dtree_map_t *m = malloc(sizeof(*m));
+	if(m == NULL)
+		return NULL;
+
+	m->addr = (dtree_addr_t) addr;
+	m->len = size;
+	m->pages_len = offset + size;
+	m->pages = mmap(NULL, m->pages_len, PROT_READ | PROT_WRITE, MAP_SHARED, uio->fd,
+			(off_t) index * sysconf(_SC_PAGESIZE));
+
+	if(m->pages == MAP_FAILED) {
+		free(m);
+		return NULL;
+	}
+
+	m->base = (unsigned char *) m->pages + offset;
+	return m;
+}
+
+static
+int64_t clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int dtree_uio_wait(dtree_uio_t *uio, int timeout_ms, uint32_t *events)
+{
+	const int32_t enable = 1;
+	uint32_t count;
+	int rc;
+
+	// drivers without irqcontrol keep the interrupt enabled
+	if(write(uio->fd, &enable, sizeof(enable)) < 0 && errno != EIO && errno != ENOSYS)
+		return -1;
+
+	struct pollfd pfd = {.fd = uio->fd, .events = POLLIN};
+	const int64_t deadline = clock_ms() + timeout_ms;
+	int remaining = timeout_ms;
+
+	// signals do not extend the timeout
+	while((rc = poll(&pfd, 1, remaining)) < 0 && errno == EINTR) {
+		if(timeout_ms < 0)
+			continue;
+
+		const int64_t left = deadline - clock_ms();
+		remaining = left > 0? (int) left : 0;
+	}
+
+	if(rc < 0)
+		return -1;
+	if(rc == 0)
+		return 1;
+
+	const ssize_t rlen = read(uio->fd, &count, sizeof(count));
+	if(rlen != sizeof(count)) {
+		if(rlen >= 0)
+			errno = EIO;
+		return -1;
+	}
+
+	if(events != NULL)
+		*events = uio->counted? count - uio->count : 1;
+
+	uio->count = count;
+	uio->counted = 1;
+	return 0;
+}
@@ -0,0 +1,30 @@
+/**
+ * Internal lookup of UIO devices.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * UIO devices are described in sysfs (/sys/class/uio/uioN): the name
+ * of the driver instance, the regions (maps/mapM/addr, size, offset)
+ * and the device tree node (device/of_node). The region M is mapped
+ * from /dev/uioN at the offset M * pagesize.
+ */
+
+#ifndef DTREE_UIO
+#define DTREE_UIO
+
+#include "dtree.h"
+#include "dtree_error.h"
+
+#define DTREE_UIO_CLASS "/sys/class/uio"
+#define DTREE_UIO_DEV   "/dev"
+
+/**
+ * Finds the UIO device of the device in the class directory
+ * and opens its node in devd (NULL means the default ones).
+ *
+ * Returns a new UIO device or NULL and sets err.
+ */
+struct dtree_uio *dtree_uio_find(const char *classd, const char *devd,
+		const struct dtree_dev_t *dev, struct dtree_error *err);
+
+#endif
@@ -0,0 +1,360 @@
+/**
+ * dtree_uring.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree_uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef DTREE_NO_IO_URING
+# if defined(__linux__) && defined(__has_include)
+#  if !__has_include(<linux/io_uring.h>)
+#   define DTREE_NO_IO_URING
+#  endif
+# else
+#  define DTREE_NO_IO_URING
+# endif
+#endif
+
+#ifdef DTREE_NO_IO_URING
+
+struct dtree_uring *dtree_uring_new(unsigned entries)
+{
+	(void) entries;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void dtree_uring_free(struct dtree_uring *ring)
+{
+	(void) ring;
+}
+
+int dtree_uring_read_files(struct dtree_uring *ring, int dirfd,
+		struct dtree_uring_read *reqs, size_t n)
+{
+	(void) ring;
+	(void) dirfd;
+	(void) reqs;
+	(void) n;
+	errno = ENOSYS;
+	return -1;
+}
+
+#else
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * Mapped submission and completion queues.
+ */
+struct dtree_uring {
+	int fd;
+	unsigned entries;
+
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+
+static
+int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Tests that the kernel supports all operations used here.
+ */
+static
+int uring_probe(int fd)
+{
+	static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+	const size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	int supported = 1;
+
+	if(probe == NULL)
+		return 0;
+
+	if(uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		return 0;
+	}
+
+	for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+		if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			supported = 0;
+	}
+
+	free(probe);
+	return supported;
+}
+
+static
+int uring_map(struct dtree_uring *ring, const struct io_uring_params *p)
+{
+	ring->sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if(p->features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED)
+		return 1;
+
+	ring->cq_ring = ring->sq_ring;
+	if(ring->cq_ring_len > 0) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_ring == MAP_FAILED)
+			return 1;
+	}
+
+	ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+		return 1;
+
+	char *sq = (char *) ring->sq_ring;
+	ring->sq_tail  = (unsigned *) (sq + p->sq_off.tail);
+	ring->sq_mask  = (unsigned *) (sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p->sq_off.array);
+
+	char *cq = (char *) ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p->cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+struct dtree_uring *dtree_uring_new(unsigned entries)
+{
+	struct io_uring_params p;
+	struct dtree_uring *ring = calloc(1, sizeof(*ring));
+
+	if(ring == NULL)
+		return NULL;
+
+	ring->sq_ring = MAP_FAILED;
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = uring_setup(entries, &p);
+	if(ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->entries = p.sq_entries;
+
+	if(!uring_probe(ring->fd) || uring_map(ring, &p)) {
+		dtree_uring_free(ring);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	return ring;
+}
+
+void dtree_uring_free(struct dtree_uring *ring)
+{
+	if(ring == NULL)
+		return;
+
+	if(ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	if(ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_len);
+
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * Returns the next free sqe. The caller never queues
+ * more than entries sqes between two submits.
+ */
+static
+struct io_uring_sqe *uring_sqe(struct dtree_uring *ring, unsigned queued)
+{
+	const unsigned tail = *ring->sq_tail + queued;
+	const unsigned idx = tail & *ring->sq_mask;
+
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+/**
+ * Submits queued sqes and waits for all of their completions.
+ * The res of each one is stored to results[user_data].
+ */
+static
+int uring_submit_wait(struct dtree_uring *ring, unsigned queued, int *results)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+
+	unsigned to_submit = queued;
+	unsigned done = 0;
+
+	while(done < queued) {
+		int r = uring_enter(ring->fd, to_submit, queued - done, IORING_ENTER_GETEVENTS);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		to_submit -= (unsigned) r <= to_submit? (unsigned) r : to_submit;
+
+		unsigned head = *ring->cq_head;
+		const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for(; head != tail; ++head, ++done) {
+			const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			results[cqe->user_data] = cqe->res;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/**
+ * Reads a chunk of at most ring->entries requests. Files are
+ * opened by the first submit, read by the second one and closed
+ * by the third one.
+ */
+static
+int uring_read_chunk(struct dtree_uring *ring, int dirfd,
+		struct dtree_uring_read *reqs, unsigned n)
+{
+	int fds[n];
+	int res[n];
+	unsigned queued = 0;
+
+	for(unsigned i = 0; i < n; ++i) {
+		fds[i] = -1; // not opened unless completed
+
+		struct io_uring_sqe *sqe = uring_sqe(ring, queued++);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = dirfd;
+		sqe->addr = (uintptr_t) reqs[i].path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->user_data = i;
+	}
+
+	if(uring_submit_wait(ring, queued, fds))
+		goto clean_and_exit;
+
+	queued = 0;
+	for(unsigned i = 0; i < n; ++i) {
+		reqs[i].result = fds[i];
+		if(fds[i] < 0)
+			continue;
+
+		struct io_uring_sqe *sqe = uring_sqe(ring, queued++);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fds[i];
+		sqe->addr = (uintptr_t) reqs[i].buf;
+		sqe->len = reqs[i].len;
+		sqe->off = 0;
+		sqe->user_data = i;
+	}
+
+	if(queued > 0 && uring_submit_wait(ring, queued, res))
+		goto clean_and_exit;
+
+	queued = 0;
+	for(unsigned i = 0; i < n; ++i) {
+		if(fds[i] < 0)
+			continue;
+
+		reqs[i].result = res[i];
+
+		struct io_uring_sqe *sqe = uring_sqe(ring, queued++);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fds[i];
+		sqe->user_data = i;
+	}
+
+	// when this fails, the files can be closed already,
+	// it is safer to leak them than to close twice
+	if(queued > 0 && uring_submit_wait(ring, queued, res))
+		return -1;
+
+	return 0;
+
+clean_and_exit:
+	// no close has been queued, close synchronously
+	for(unsigned i = 0; i < n; ++i) {
+		if(fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	return -1;
+}
+
+int dtree_uring_read_files(struct dtree_uring *ring, int dirfd,
+		struct dtree_uring_read *reqs, size_t n)
+{
+	for(size_t off = 0; off < n; off += ring->entries) {
+		const unsigned chunk = n - off < ring->entries? n - off : ring->entries;
+
+		if(uring_read_chunk(ring, dirfd, reqs + off, chunk))
+			return -1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * Internal batch loader of small files based on io_uring.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * Opens, reads and closes many files by a few system
+ * calls. When io_uring is not available (old kernel,
+ * forbidden by seccomp, not compiled in) dtree_uring_new()
+ * fails and the caller reads the files one by one.
+ */
+
+#ifndef DTREE_URING
+#define DTREE_URING
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct dtree_uring;
+
+/**
+ * Request to read a file relative to a directory.
+ */
+struct dtree_uring_read {
+	const char *path;
+	char *buf;
+	size_t len;
+
+	/**
+	 * Number of bytes read or -errno. When it equals
+	 * to len the file can be longer than buf.
+	 */
+	ssize_t result;
+};
+
+/**
+ * Creates a ring for batches of up to entries files.
+ * Returns NULL when io_uring is not available.
+ */
+struct dtree_uring *dtree_uring_new(unsigned entries);
+
+/**
+ * Free's the ring. Accepts NULL.
+ */
+void dtree_uring_free(struct dtree_uring *ring);
+
+/**
+ * Reads the files (from offset 0) relative to dirfd. Results
+ * are stored in the requests, failure of a single file is not
+ * an error of the whole batch.
+ *
+ * Returns 0 on success or -1 and sets errno when the ring
+ * can not be used.
+ */
+int dtree_uring_read_files(struct dtree_uring *ring, int dirfd,
+		struct dtree_uring_read *reqs, size_t n);
+
+#endif
@@ -0,0 +1,668 @@
+/**
+ * dtree_watch.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "dtree_error.h"
+#include "dtree_watch.h"
+#include "dtree_procfs.h"
+#include "dtree_snap.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define NODE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                     | IN_CLOSE_WRITE | IN_MODIFY | IN_ONLYDIR)
+#define OVL_EVENTS  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define ITEM_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ONLYDIR)
+
+#define WATCH_PROPS 0x01 // files of the node have changed
+#define WATCH_KIDS  0x02 // subdirectories of the node have changed
+#define WATCH_GONE  0x04 // the node was removed
+#define WATCH_SEEN  0x08 // found by the last listing
+
+/**
+ * Watched directory of the tree.
+ */
+struct watch_node {
+	struct watch_node *parent;
+	struct watch_node *kids;
+	struct watch_node *next;
+	struct dtree_dev_t *dev; // NULL when the node is not a device
+	int wd;
+	unsigned dirty;
+	char name[]; // empty for the root
+};
+
+struct dtree_watch {
+	struct dtree_error *err;
+	struct dtree_impl *procfs; // reads single nodes
+	struct watch_node *root;
+	char *root_path;
+	int rootfd;
+	int ifd;
+	int changed; // since the last snapshot
+
+	// overlays directory and its items
+	int ovl_wd;
+	char *ovl_path;
+	int *items;
+	size_t items_len;
+};
+
+static
+struct watch_node *node_new(struct watch_node *parent, const char *name)
+{
+	struct watch_node *n = calloc(1, sizeof(*n) + strlen(name) + 1);
+	if(n == NULL)
+		return NULL;
+
+	strcpy(n->name, name);
+	n->parent = parent;
+	n->wd = -1;
+
+	if(parent != NULL) {
+		struct watch_node **last = &parent->kids;
+		while(*last != NULL)
+			last = &(*last)->next;
+
+		*last = n;
+	}
+
+	return n;
+}
+
+/**
+ * Removes the node from its parent and free's its subtree.
+ */
+static
+void node_free(struct dtree_watch *w, struct watch_node *n)
+{
+	if(n->parent != NULL) {
+		struct watch_node **link = &n->parent->kids;
+		while(*link != n)
+			link = &(*link)->next;
+
+		*link = n->next;
+	}
+
+	while(n->kids != NULL)
+		node_free(w, n->kids);
+
+	// the watch of a removed directory is already gone
+	if(n->wd >= 0)
+		inotify_rm_watch(w->ifd, n->wd);
+	if(n->dev != NULL)
+		dtree_procfs_dev_free(n->dev);
+
+	free(n);
+}
+
+/**
+ * Writes the path of the node relative to the root.
+ * Returns its length or -1 when it does not fit.
+ */
+static
+int node_path(const struct watch_node *n, char *buf, size_t size)
+{
+	if(n->parent == NULL) {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	int len = node_path(n->parent, buf, size);
+	if(len < 0)
+		return -1;
+
+	int add = snprintf(buf + len, size - len, len > 0? "/%s" : "%s", n->name);
+	if(add < 0 || (size_t) (len + add) >= size)
+		return -1;
+
+	return len + add;
+}
+
+static
+struct watch_node *node_bywd(struct watch_node *n, int wd)
+{
+	if(n->wd == wd)
+		return n;
+
+	for(struct watch_node *kid = n->kids; kid != NULL; kid = kid->next) {
+		struct watch_node *found = node_bywd(kid, wd);
+		if(found != NULL)
+			return found;
+	}
+
+	return NULL;
+}
+
+static
+struct watch_node *node_kid(struct watch_node *n, const char *name)
+{
+	for(struct watch_node *kid = n->kids; kid != NULL; kid = kid->next) {
+		if(!(kid->dirty & WATCH_GONE) && !strcmp(kid->name, name))
+			return kid;
+	}
+
+	return NULL;
+}
+
+static
+void node_mark_all(struct watch_node *n, unsigned dirty)
+{
+	n->dirty |= dirty;
+
+	for(struct watch_node *kid = n->kids; kid != NULL; kid = kid->next)
+		node_mark_all(kid, dirty);
+}
+
+/**
+ * Starts watching the directory of the node.
+ * Returns 1 when the directory does not exist.
+ */
+static
+int node_watch(struct dtree_watch *w, struct watch_node *n)
+{
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "%s/", w->root_path);
+
+	if(len < 0 || (size_t) len >= sizeof(path)
+	|| node_path(n, path + len, sizeof(path) - len) < 0) {
+		dtree_errno_set(w->err, ENAMETOOLONG);
+		return -1;
+	}
+
+	n->wd = inotify_add_watch(w->ifd, path, NODE_EVENTS);
+	if(n->wd >= 0)
+		return 0;
+
+	if(errno == ENOENT || errno == ENOTDIR)
+		return 1;
+
+	dtree_error_from_errno(w->err);
+	return -1;
+}
+
+/**
+ * Re-reads the device of the node.
+ */
+static
+int node_read(struct dtree_watch *w, struct watch_node *n)
+{
+	char path[PATH_MAX];
+
+	if(n->dev != NULL)
+		dtree_procfs_dev_free(n->dev);
+
+	n->dev = NULL;
+
+	if(n->parent == NULL) // the root is never a device
+		return 0;
+
+	if(node_path(n, path, sizeof(path)) < 0) {
+		dtree_errno_set(w->err, ENAMETOOLONG);
+		return -1;
+	}
+
+	n->dev = dtree_procfs_bypath(w->procfs, path);
+	return dtree_error_isset(w->err)? -1 : 0;
+}
+
+static
+int node_load(struct dtree_watch *w, struct watch_node *n);
+
+/**
+ * Lists subdirectories of the node. New ones are loaded,
+ * missing (and removed) ones are free'd.
+ *
+ * Returns 1 when the node itself does not exist.
+ */
+static
+int node_sync(struct dtree_watch *w, struct watch_node *n)
+{
+	char path[PATH_MAX];
+	struct watch_node *kid;
+	struct watch_node *next;
+	int err = -1;
+
+	for(kid = n->kids; kid != NULL; kid = next) {
+		next = kid->next;
+
+		if(kid->dirty & WATCH_GONE) {
+			node_free(w, kid);
+			w->changed = 1;
+		}
+	}
+
+	if(node_path(n, path, sizeof(path)) < 0) {
+		dtree_errno_set(w->err, ENAMETOOLONG);
+		return -1;
+	}
+
+	int fd = openat(w->rootfd, n->parent == NULL? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		if(errno == ENOENT || errno == ENOTDIR)
+			return 1;
+
+		dtree_error_from_errno(w->err);
+		return -1;
+	}
+
+	DIR *d = fdopendir(fd);
+	if(d == NULL) {
+		dtree_error_from_errno(w->err);
+		close(fd);
+		return -1;
+	}
+
+	struct dirent *e;
+
+	while(errno = 0, (e = readdir(d)) != NULL) {
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+
+		if(e->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if(fstatat(fd, e->d_name, &st, 0) || !S_ISDIR(st.st_mode))
+				continue;
+		}
+		else if(e->d_type != DT_DIR) {
+			continue;
+		}
+
+		kid = node_kid(n, e->d_name);
+		if(kid != NULL) {
+			kid->dirty |= WATCH_SEEN;
+			continue;
+		}
+
+		kid = node_new(n, e->d_name);
+		if(kid == NULL) {
+			dtree_errno_set(w->err, ENOMEM);
+			goto clean_and_exit;
+		}
+
+		kid->dirty = WATCH_SEEN;
+		int gone = node_load(w, kid);
+
+		if(gone < 0)
+			goto clean_and_exit;
+		if(gone)
+			kid->dirty = 0; // removed meanwhile
+
+		w->changed = 1;
+	}
+
+	if(errno != 0) {
+		dtree_error_from_errno(w->err);
+		goto clean_and_exit;
+	}
+
+	for(kid = n->kids; kid != NULL; kid = next) {
+		next = kid->next;
+
+		if(!(kid->dirty & WATCH_SEEN)) {
+			node_free(w, kid);
+			w->changed = 1;
+		}
+		else {
+			kid->dirty &= ~WATCH_SEEN;
+		}
+	}
+
+	err = 0;
+
+clean_and_exit:
+	closedir(d);
+	return err;
+}
+
+/**
+ * Watches and reads the node and its subtree. The watch
+ * is added first so no later change is missed.
+ *
+ * Returns 1 when the node does not exist.
+ */
+static
+int node_load(struct dtree_watch *w, struct watch_node *n)
+{
+	int err = node_watch(w, n);
+	if(err)
+		return err;
+
+	if(node_read(w, n))
+		return -1;
+
+	return node_sync(w, n);
+}
+
+/**
+ * Re-reads the changed nodes of the subtree.
+ */
+static
+int node_update(struct dtree_watch *w, struct watch_node *n)
+{
+	const unsigned dirty = n->dirty;
+	n->dirty = 0;
+
+	// a removed node is free'd by its parent
+	if((dirty & WATCH_KIDS) && node_sync(w, n) < 0)
+		goto clean_and_exit;
+
+	if(dirty & WATCH_PROPS) {
+		if(node_read(w, n))
+			goto clean_and_exit;
+
+		w->changed = 1;
+	}
+
+	for(struct watch_node *kid = n->kids; kid != NULL; kid = kid->next) {
+		if(node_update(w, kid))
+			return -1;
+	}
+
+	return 0;
+
+clean_and_exit:
+	n->dirty |= dirty; // retried by the next update
+	return -1;
+}
+
+/**
+ * Watches a new item of the overlays directory, it is
+ * applied by writing into it.
+ */
+static
+int items_add(struct dtree_watch *w, const char *name)
+{
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "%s/%s", w->ovl_path, name);
+
+	if(len < 0 || (size_t) len >= sizeof(path))
+		return 0;
+
+	int wd = inotify_add_watch(w->ifd, path, ITEM_EVENTS);
+	if(wd < 0)
+		return 0; // removed meanwhile
+
+	int *bigger = realloc(w->items, (w->items_len + 1) * sizeof(int));
+	if(bigger == NULL) {
+		dtree_errno_set(w->err, ENOMEM);
+		return -1;
+	}
+
+	w->items = bigger;
+	w->items[w->items_len++] = wd;
+	return 0;
+}
+
+static
+int items_has(const struct dtree_watch *w, int wd)
+{
+	for(size_t i = 0; i < w->items_len; ++i) {
+		if(w->items[i] == wd)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Starts watching the overlays directory when it exists
+ * and the items that are already there.
+ */
+static
+int overlays_watch(struct dtree_watch *w, const char *overlays)
+{
+	w->ovl_path = strdup(overlays == NULL? DTREE_WATCH_OVERLAYS : overlays);
+	if(w->ovl_path == NULL) {
+		dtree_errno_set(w->err, ENOMEM);
+		return -1;
+	}
+
+	w->ovl_wd = inotify_add_watch(w->ifd, w->ovl_path, OVL_EVENTS);
+	if(w->ovl_wd < 0) {
+		if(errno == ENOENT || errno == ENOTDIR || errno == EACCES)
+			return 0;
+
+		dtree_error_from_errno(w->err);
+		return -1;
+	}
+
+	// the directory is watched first, no new item is missed
+	DIR *d = opendir(w->ovl_path);
+	if(d == NULL)
+		return 0; // removed meanwhile
+
+	int err = -1;
+	struct dirent *e;
+
+	// files are skipped by IN_ONLYDIR
+	while(errno = 0, (e = readdir(d)) != NULL) {
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		if(items_add(w, e->d_name))
+			goto clean_and_exit;
+	}
+
+	if(errno != 0) {
+		dtree_error_from_errno(w->err);
+		goto clean_and_exit;
+	}
+
+	err = 0;
+
+clean_and_exit:
+	closedir(d);
+	return err;
+}
+
+struct dtree_watch *dtree_watch_open(const char *rootd, int dirfd, const char *overlays,
+		struct dtree_error *err)
+{
+	struct dtree_watch *w = calloc(1, sizeof(*w));
+	if(w == NULL) {
+		dtree_error_from_errno(err);
+		return NULL;
+	}
+
+	w->err = err;
+	w->ifd = -1;
+	w->ovl_wd = -1;
+
+	if(rootd != NULL)
+		w->rootfd = open(rootd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else
+		w->rootfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+
+	if(w->rootfd == -1) {
+		dtree_error_from_errno(err);
+		free(w);
+		return NULL;
+	}
+
+	// watches need a path, a descriptor is reached through /proc
+	if(rootd != NULL)
+		w->root_path = strdup(rootd);
+	else if(asprintf(&w->root_path, "/proc/self/fd/%d", w->rootfd) < 0)
+		w->root_path = NULL;
+
+	if(w->root_path == NULL) {
+		dtree_errno_set(err, ENOMEM);
+		goto clean_and_exit;
+	}
+
+	w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(w->ifd == -1) {
+		dtree_error_from_errno(err);
+		goto clean_and_exit;
+	}
+
+	w->procfs = dtree_procfs_openat(w->rootfd, err);
+	if(w->procfs == NULL)
+		goto clean_and_exit;
+
+	w->root = node_new(NULL, "");
+	if(w->root == NULL) {
+		dtree_errno_set(err, ENOMEM);
+		goto clean_and_exit;
+	}
+
+	int gone = node_load(w, w->root);
+	if(gone > 0)
+		dtree_errno_set(err, ENOENT);
+	if(gone || overlays_watch(w, overlays))
+		goto clean_and_exit;
+
+	return w;
+
+clean_and_exit:
+	dtree_watch_close(w);
+	return NULL;
+}
+
+void dtree_watch_close(struct dtree_watch *w)
+{
+	if(w->root != NULL)
+		node_free(w, w->root);
+	if(w->procfs != NULL)
+		dtree_procfs_close(w->procfs);
+	if(w->ifd != -1)
+		close(w->ifd); // removes all watches
+
+	close(w->rootfd);
+	free(w->root_path);
+	free(w->ovl_path);
+	free(w->items);
+	free(w);
+}
+
+int dtree_watch_fd(const struct dtree_watch *w)
+{
+	return w->ifd;
+}
+
+/**
+ * Appends devices of the subtree to the snapshot.
+ */
+static
+int snapshot_add(struct dtree_impl *snap, const struct watch_node *n)
+{
+	if(n->dev != NULL && dtree_snap_add(snap, n->dev))
+		return -1;
+
+	for(const struct watch_node *kid = n->kids; kid != NULL; kid = kid->next) {
+		if(snapshot_add(snap, kid))
+			return -1;
+	}
+
+	return 0;
+}
+
+struct dtree_impl *dtree_watch_snapshot(struct dtree_watch *w)
+{
+	struct dtree_impl *snap = dtree_snap_new(w->err);
+	if(snap == NULL)
+		return NULL;
+
+	if(snapshot_add(snap, w->root) || dtree_snap_finish(snap)) {
+		dtree_snap_close(snap);
+		return NULL;
+	}
+
+	dtree_snap_set_detached(snap);
+	w->changed = 0;
+	return snap;
+}
+
+/**
+ * Marks nodes by the event.
+ * Returns 1 when the whole tree should be resynced.
+ */
+static
+int watch_event(struct dtree_watch *w, const struct inotify_event *e)
+{
+	if(e->mask & IN_Q_OVERFLOW) {
+		node_mark_all(w->root, WATCH_PROPS | WATCH_KIDS); // events were lost
+		return 0;
+	}
+
+	if(e->mask & IN_IGNORED)
+		return 0;
+
+	if(w->ovl_wd >= 0 && e->wd == w->ovl_wd) {
+		if((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO))
+		&& items_add(w, e->name))
+			return -1;
+
+		return 1;
+	}
+
+	if(items_has(w, e->wd))
+		return 1;
+
+	struct watch_node *n = node_bywd(w->root, e->wd);
+	if(n == NULL)
+		return 0; // removed already
+
+	if(!(e->mask & IN_ISDIR)) {
+		n->dirty |= WATCH_PROPS;
+		return 0;
+	}
+
+	n->dirty |= WATCH_KIDS;
+
+	if(e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		struct watch_node *kid = node_kid(n, e->name);
+		if(kid != NULL)
+			kid->dirty |= WATCH_GONE;
+	}
+
+	return 0;
+}
+
+int dtree_watch_update(struct dtree_watch *w)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int resync = 0;
+	ssize_t len;
+
+	while((len = read(w->ifd, buf, sizeof(buf))) > 0) {
+		for(char *p = buf; p < buf + len;) {
+			const struct inotify_event *e = (const struct inotify_event *) p;
+
+			int all = watch_event(w, e);
+			if(all < 0)
+				return -1;
+
+			resync |= all;
+			p += sizeof(*e) + e->len;
+		}
+	}
+
+	if(len < 0 && errno != EAGAIN && errno != EINTR) {
+		dtree_error_from_errno(w->err);
+		return -1;
+	}
+
+	// overlays do not notify about the nodes, an overlay can
+	// change properties of the known nodes as well
+	if(resync)
+		node_mark_all(w->root, WATCH_PROPS | WATCH_KIDS);
+
+	if(node_update(w, w->root))
+		return -1;
+
+	return w->changed;
+}
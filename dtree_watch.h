@@ -0,0 +1,67 @@
+/**
+ * Internal watcher of a directory tree for incremental refresh.
+ * Non-public API.
+ * Jan Viktorin <xvikto03@stud.fit.vutbr.cz>
+ *
+ * The watcher keeps the nodes of the tree with their devices
+ * and watches every directory by inotify. A refresh re-reads
+ * only the nodes reported as changed and builds a new snapshot
+ * from the kept devices, the current snapshot is not touched.
+ *
+ * Kernel trees (/proc/device-tree) do not report changes made
+ * by overlays, the overlays directory of configfs is watched
+ * instead and a change there resyncs the directories of the
+ * whole tree (only new nodes are read).
+ */
+
+#ifndef DTREE_WATCH
+#define DTREE_WATCH
+
+#include "dtree_backend.h"
+
+/**
+ * Default overlays directory of configfs.
+ */
+#define DTREE_WATCH_OVERLAYS "/sys/kernel/config/device-tree/overlays"
+
+struct dtree_watch;
+
+/**
+ * Reads the whole directory tree (rootd or dirfd when rootd
+ * is NULL) and starts watching it. The overlays directory
+ * is watched when it exists (NULL means the default one).
+ *
+ * Returns a new watcher or NULL and sets err.
+ */
+struct dtree_watch *dtree_watch_open(const char *rootd, int dirfd, const char *overlays,
+		struct dtree_error *err);
+
+/**
+ * Free's all resources.
+ */
+void dtree_watch_close(struct dtree_watch *w);
+
+/**
+ * Descriptor signalled (readable) when there are changes
+ * to refresh.
+ */
+int dtree_watch_fd(const struct dtree_watch *w);
+
+/**
+ * Builds a snapshot of the current state. Devices of the
+ * snapshot are detached (valid after it is closed).
+ *
+ * Returns NULL on error and sets error state.
+ */
+struct dtree_impl *dtree_watch_snapshot(struct dtree_watch *w);
+
+/**
+ * Reads pending changes (without blocking) and re-reads
+ * the changed nodes.
+ *
+ * Returns 1 when the tree has changed (a new snapshot should
+ * be built), 0 when not and -1 on error (sets error state).
+ */
+int dtree_watch_update(struct dtree_watch *w);
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * dtree_busio_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Runs ../busio against the testing tree. The memory device
+ * is a sparse file (-m), the offset is the physical address.
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static char g_memdev[] = "/tmp/dtree_busio_test.XXXXXX";
+static char g_script[] = "/tmp/dtree_busio_script.XXXXXX";
+static char g_out[4096];
+
+int memdev_create(void)
+{
+	int fd = mkstemp(g_memdev);
+	if(fd < 0)
+		return -1;
+
+	// above the highest device of the testing tree
+	const int err = ftruncate(fd, 0x88010000);
+	close(fd);
+	return err;
+}
+
+/**
+ * Runs busio with the arguments, stdout and stderr are
+ * collected in g_out. Returns the exit status.
+ */
+int busio(const char *args)
+{
+	char cmd[512];
+	snprintf(cmd, sizeof(cmd), "LD_LIBRARY_PATH=.. ../busio -t device-tree -m %s %s 2>&1", g_memdev, args);
+
+	FILE *p = popen(cmd, "r");
+	if(p == NULL)
+		return -1;
+
+	const size_t len = fread(g_out, 1, sizeof(g_out) - 1, p);
+	g_out[len] = '\0';
+
+	const int status = pclose(p);
+	return WIFEXITED(status)? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Runs the script by busio -s with the extra arguments.
+ */
+int script(const char *text, const char *args)
+{
+	FILE *f = fopen(g_script, "w");
+	if(f == NULL)
+		return -1;
+
+	fputs(text, f);
+	fclose(f);
+
+	char cmd[256];
+	snprintf(cmd, sizeof(cmd), "-s %s %s", g_script, args);
+	return busio(cmd);
+}
+
+void test_script_ops(void)
+{
+	test_start();
+
+	const char *text =
+		"# widths of reads\n"
+		"w serial@84000000 0x10 0xDEADBEEF\n"
+		"\n"
+		"r serial@84000000 0x10\n"
+		"r2 serial@84000000 0x12\n"
+		"r1 serial@84000000 0x13\n"
+		"w2 serial@84000000 0x10 0x1234\n"
+		"w1 serial@84000000 0x11 0x56\n"
+		"r4 serial@84000000 0x10\n";
+
+	fail_on_false(script(text, "") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0xDEADBEEF\n0x0000DEAD\n0x000000DE\n0xDEAD5634\n"), g_out);
+
+	// the default width is given by -1/-2/-4
+	fail_on_false(script("r serial@84000000 0x10\n", "-2") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0x00005634\n"), g_out);
+
+	test_end();
+}
+
+void test_script_order(void)
+{
+	test_start();
+
+	// serial@88000000 is listed before serial@84000000
+	const char *text =
+		"r serial@84000000 0x10\n"
+		"w serial@88000000 0x20 0xCAFE\n"
+		"r /plb@0/serial@88000000 0x20\n"
+		"r serial@84000000 0x10\n"
+		"r 0x88000020 0x0\n";
+
+	fail_on_false(script(text, "") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0xDEAD5634\n0x0000CAFE\n0xDEAD5634\n0x0000CAFE\n"), g_out);
+
+	test_end();
+}
+
+void test_script_poll(void)
+{
+	test_start();
+
+	const char *text =
+		"w timer@83c00000 0x4 0x81\n"
+		"p1 timer@83c00000 0x4 0x80 0x80\n"
+		"p timer@83c00000 0x4 0xFF 0x81 0\n"
+		"r timer@83c00000 0x4\n"
+		"p timer@83c00000 0x4 0x1 0x0 5\n"
+		"r timer@83c00000 0x4\n";
+
+	// stops at the timeout, the previous output is kept
+	fail_on_false(script(text, "") == 1, g_out);
+	fail_on_true(strncmp(g_out, "0x00000081\n", 11), g_out);
+	fail_on_true(strstr(g_out, ":5: Poll has timed out") == NULL, g_out);
+	fail_on_true(strstr(g_out + 11, "0x") != NULL, "Script went on after an error");
+
+	test_end();
+}
+
+void test_script_errors(void)
+{
+	test_start();
+
+	static const struct {
+		const char *text;
+		const char *error;
+	} bad[] = {
+		{"# comment\n\nr5 serial@84000000 0\n",      ":3: Invalid width of the operation"},
+		{"x serial@84000000 0\n",                    ":1: Unknown operation"},
+		{"r serial@84000000 0\nw serial@84000000 0x10\n", ":2: Invalid number of arguments"},
+		{"r serial@84000000\n",                      ":1: Invalid number of arguments"},
+		{"r nosuch 0\n",                             ":1: Can not access the device"},
+		{"r serial@84000000 0x10000\n",              ":1: Can not access the address"},
+		{"i serial@84000000\n",                      ":1: Interrupts need UIO (-u)"},
+		{"r a b c d e f g\n",                        ":1: Too many arguments"},
+	};
+
+	for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+		fail_on_false(script(bad[i].text, "") == 1, bad[i].text);
+		fail_on_true(strstr(g_out, bad[i].error) == NULL, g_out);
+	}
+
+	// stdin
+	fail_on_false(busio("-s - < /dev/null") == 0, g_out);
+	fail_on_false(busio("-s /nonexistent") == 1, "Missing script was accepted");
+
+	test_end();
+}
+
+void test_huge_range(void)
+{
+	test_start();
+
+	// plb@0 spans the whole address space, only a window is mapped
+	fail_on_false(busio("-r plb@0 -a 0x84000010") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0xDEAD5634\n"), g_out);
+
+	fail_on_false(busio("-w plb@0 -a 0x10 -d 0x600DF00D") == 0, g_out);
+	fail_on_false(busio("-r plb@0 -a 0x10") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0x600DF00D\n"), g_out);
+
+	// the window is moved by a script
+	const char *text =
+		"r plb@0 0x10\n"
+		"r plb@0 0x84000010\n"
+		"r memory@50000000 0xFFFC\n";
+
+	fail_on_false(script(text, "") == 0, g_out);
+	fail_on_true(strcmp(g_out, "0x600DF00D\n0xDEAD5634\n0x00000000\n"), g_out);
+
+	test_end();
+}
+
+void test_block_read_keeps_file(void)
+{
+	test_start();
+
+	char file[] = "/tmp/dtree_busio_block.XXXXXX";
+	const int fd = mkstemp(file);
+	fail_on_true(fd < 0, "Can not create a file");
+	fail_on_false(write(fd, "keep", 4) == 4, "Can not write the file");
+	close(fd);
+
+	char args[128];
+
+	// invalid device and out of range address
+	snprintf(args, sizeof(args), "-r nosuch -a 0 -b %s -n 0x10", file);
+	fail_on_false(busio(args) == 1, "Missing device was accepted");
+
+	snprintf(args, sizeof(args), "-r serial@84000000 -a 0xFFF8 -b %s -n 0x10", file);
+	fail_on_false(busio(args) == 1, "Read out of the device was accepted");
+
+	char data[16];
+	FILE *f = fopen(file, "r");
+	fail_on_true(f == NULL, "File was removed");
+	const size_t len = fread(data, 1, sizeof(data), f);
+	fclose(f);
+	fail_on_false(len == 4 && !memcmp(data, "keep", 4), "File was destroyed by a failed read");
+
+	snprintf(args, sizeof(args), "-r serial@84000000 -a 0x10 -b %s -n 0x4", file);
+	fail_on_false(busio(args) == 0, g_out);
+
+	f = fopen(file, "r");
+	fail_on_true(f == NULL, "File was not written");
+	uint32_t value = 0;
+	fail_on_false(fread(&value, 1, sizeof(value), f) == 4, "Short file");
+	fclose(f);
+	fail_on_false(value == 0xDEAD5634, "Invalid block read");
+
+	unlink(file);
+	test_end();
+}
+
+int main(void)
+{
+	const int fd = mkstemp(g_script);
+	if(fd < 0 || memdev_create()) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	close(fd);
+
+	test_script_ops();
+	test_script_order();
+	test_script_poll();
+	test_script_errors();
+	test_huge_range();
+	test_block_read_keeps_file();
+
+	unlink(g_script);
+	unlink(g_memdev);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * dtree_byaddr_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+
+static
+int expect_at(dtree_addr_t addr, const char *name)
+{
+	struct dtree_dev_t *dev = dtree_byaddr(addr);
+	if(dev == NULL)
+		return name != NULL;
+
+	printf("0x%08X: DEV '%s' at 0x%08X .. 0x%08X\n", addr, dtree_dev_name(dev),
+			dtree_dev_base(dev), dtree_dev_high(dev));
+
+	int differs = name == NULL || strcmp(dtree_dev_name(dev), name);
+	dtree_dev_free(dev);
+	return differs;
+}
+
+void test_byaddr(void)
+{
+	test_start();
+
+	fail_on_true(expect_at(0x84000010, "serial@84000000"), "0x84000010 is not in serial@84000000");
+	fail_on_true(expect_at(0x84000000, "serial@84000000"), "0x84000000 is not in serial@84000000");
+	fail_on_true(expect_at(0x8400FFFF, "serial@84000000"), "0x8400FFFF is not in serial@84000000");
+	fail_on_true(expect_at(0x88001234, "serial@88000000"), "0x88001234 is not in serial@88000000");
+	fail_on_true(expect_at(0x5000FFFF, "memory@50000000"), "0x5000FFFF is not in memory@50000000");
+	fail_on_true(expect_at(0x84010000, "plb@0"), "0x84010000 is not in plb@0");
+	fail_on_false(dtree_iserror() == 0, "An error occured during the lookup");
+
+	test_end();
+}
+
+void test_byrange(void)
+{
+	test_start();
+
+	const char *expect[] = {
+		"plb@0",
+		"ethernet@81000000",
+		"interrupt-controller@81800000",
+		"timer@83c00000",
+		"serial@84000000",
+		NULL
+	};
+
+	struct dtree_dev_t **devs = dtree_byrange(0x81000000, 0x84000000);
+	fail_on_true(devs == NULL, "No device found in 0x81000000..0x84000000");
+
+	int i;
+	for(i = 0; devs[i] != NULL && expect[i] != NULL; ++i) {
+		printf("DEV '%s' at 0x%08X\n", dtree_dev_name(devs[i]), dtree_dev_base(devs[i]));
+		fail_on_true(strcmp(dtree_dev_name(devs[i]), expect[i]), "Unexpected device in the range");
+	}
+
+	fail_on_false(devs[i] == NULL && expect[i] == NULL, "Unexpected number of devices in the range");
+	dtree_devs_free(devs);
+
+	fail_on_false(dtree_byrange(0x84000000, 0x81000000) == NULL, "Devices found in an inverted range");
+	test_end();
+}
+
+void test_lookups_of(const char *path, int flags)
+{
+	fprintf(stderr, "Lookups in '%s' (flags: %d)\n", path, flags);
+
+	int err = dtree_open_flags(path, flags);
+	halt_on_error(err, "Can not open testing device-tree");
+
+	test_byaddr();
+	test_byrange();
+
+	dtree_close();
+}
+
+int main(void)
+{
+	test_lookups_of("device-tree", 0);
+	test_lookups_of("device-tree", DTREE_OPEN_SNAPSHOT);
+	test_lookups_of("device-tree.dtb", 0);
+	test_lookups_of("device-tree.dtb", DTREE_OPEN_SNAPSHOT);
+}
@@ -79,6 +79,26 @@ void test_find_serial_1_00_a(void)
 	test_end();
 }
 
+void test_find_all(void)
+{
+	test_start();
+
+	struct dtree_dev_t **devs = dtree_bycompat_all("xlnx,xps-uartlite-1.01.a");
+	fail_on_true(devs == NULL, "Could not find any xlnx,xps-uartlite-1.01.a compatible component");
+
+	int count = 0;
+	for(; devs[count] != NULL; ++count)
+		printf("DEV '%s' at 0x%08X\n", dtree_dev_name(devs[count]), dtree_dev_base(devs[count]));
+
+	dtree_devs_free(devs);
+	fail_on_true(count != 2, "Expected two xlnx,xps-uartlite-1.01.a compatible components");
+
+	devs = dtree_bycompat_all("@not-implemented-device");
+	fail_on_true(devs != NULL, "Device '@not-implemented-device' was found!");
+
+	test_end();
+}
+
 int main(void)
 {
 	int err = dtree_open("device-tree");
@@ -99,6 +119,8 @@ int main(void)
 	test_find_serial_1_00_a();
 	dtree_reset();
 
+	test_find_all();
+
 	dtree_close();
 }
 
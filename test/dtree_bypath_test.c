@@ -0,0 +1,137 @@
+/**
+ * dtree_bypath_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Lookups by path must not traverse the tree. Opened
+ * files and directories are counted by wrapping openat()
+ * (-Wl,--wrap=openat).
+ */
+
+#define _GNU_SOURCE
+#define TEST_WRAP_OPENAT // counts by g_openat_hook
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+#include <sys/stat.h>
+
+static int g_opens = 0;
+
+static
+void count_opens(const char *path)
+{
+	(void) path;
+	g_opens += 1;
+}
+
+static const struct {
+	const char *path;
+	const char *name;
+	dtree_addr_t base;
+} g_devs[] = {
+	{"/memory@50000000",                        "memory@50000000",                0x50000000},
+	{"/plb@0",                                  "plb@0",                          0x00000000},
+	{"/plb@0/serial@88000000",                  "serial@88000000",                0x88000000},
+	{"plb@0/serial@84000000",                   "serial@84000000",                0x84000000},
+	{"/plb@0/timer@83c00000/",                  "timer@83c00000",                 0x83C00000},
+	{"//plb@0//interrupt-controller@81800000",  "interrupt-controller@81800000",  0x81800000},
+};
+
+void test_found(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Paths of '%s' (flags %d)\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	// the iterator is not affected
+	struct dtree_dev_t *first = dtree_ctx_next(ctx);
+	fail_on_true(first == NULL, "No device to iterate");
+
+	for(size_t i = 0; i < sizeof(g_devs) / sizeof(g_devs[0]); ++i) {
+		g_opens = 0;
+
+		struct dtree_dev_t *dev = dtree_ctx_bypath(ctx, g_devs[i].path);
+		fail_on_true(dev == NULL, g_devs[i].path);
+		fail_on_true(strcmp(dtree_dev_name(dev), g_devs[i].name), "Invalid name of the device");
+		fail_on_true(dtree_dev_base(dev) != g_devs[i].base, "Invalid base of the device");
+		// a lazy handle opens the node again by its path
+		fail_on_true(g_opens > ((flags & DTREE_OPEN_LAZY)? 4 : 3), "More than the node was opened");
+
+		dtree_ctx_dev_free(ctx, dev);
+	}
+
+	struct dtree_dev_t *second = dtree_ctx_next(ctx);
+	fail_on_true(second == NULL, "No second device to iterate");
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+
+	struct dtree_dev_t *expect = dtree_ctx_next(ctx);
+	dtree_ctx_dev_free(ctx, expect);
+	expect = dtree_ctx_next(ctx);
+	fail_on_true(expect == NULL, "No second device after reset");
+	fail_on_true(strcmp(dtree_dev_name(second), dtree_dev_name(expect)),
+			"The iterator was moved by a lookup");
+
+	dtree_ctx_dev_free(ctx, first);
+	dtree_ctx_dev_free(ctx, second);
+	dtree_ctx_dev_free(ctx, expect);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_not_found(const char *path)
+{
+	test_start();
+	fprintf(stderr, "Invalid paths of '%s'\n", path);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, 0), dtree_ctx_errstr(ctx));
+
+	static const char *missing[] = {
+		"/", "", "/xxx", "/plb@0/xxx", "/serial@84000000",
+		"/plb@0/serial@84000000/xxx", "/plb@0/serial@84000000/reg",
+	};
+
+	for(size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); ++i) {
+		fail_on_false(dtree_ctx_bypath(ctx, missing[i]) == NULL, missing[i]);
+		fail_on_true(dtree_ctx_iserror(ctx), "A missing node is an error");
+	}
+
+	// the tree can not be left
+	fail_on_false(dtree_ctx_bypath(ctx, "/plb@0/../plb@0") == NULL, "Path with '..' was accepted");
+	fail_on_false(dtree_ctx_iserror(ctx), "Path with '..' is not an error");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_snapshot(void)
+{
+	test_start();
+
+	int err = dtree_open_flags("device-tree", DTREE_OPEN_SNAPSHOT);
+	fail_on_error(err, "Can not open testing device-tree");
+
+	fail_on_false(dtree_bypath("/plb@0") == NULL, "Path found in a snapshot");
+	fail_on_false(dtree_iserror(), "Path of a snapshot is not an error");
+
+	dtree_close();
+	test_end();
+}
+
+int main(void)
+{
+	g_openat_hook = count_opens;
+
+	test_found("device-tree", 0);
+	test_found("device-tree", DTREE_OPEN_LAZY);
+	test_found("device-tree.dtb", 0);
+
+	test_not_found("device-tree");
+	test_not_found("device-tree.dtb");
+
+	test_snapshot();
+}
@@ -0,0 +1,389 @@
+/**
+ * dtree_cache_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char g_tmp[] = "/tmp/dtree_cache_XXXXXX";
+
+static
+int write_file(const char *path, const void *data, size_t len)
+{
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(data, 1, len, f);
+	return fclose(f) || wlen != len;
+}
+
+/**
+ * Reads the whole file into a buffer (free'd by caller).
+ */
+static
+char *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "r");
+	if(f == NULL)
+		return NULL;
+
+	char *data = NULL;
+	*len = 0;
+
+	for(size_t cap = 0;;) {
+		if(*len == cap) {
+			cap = cap? 2 * cap : 4096;
+			char *bigger = realloc(data, cap);
+			if(bigger == NULL)
+				break;
+			data = bigger;
+		}
+
+		size_t rlen = fread(data + *len, 1, cap - *len, f);
+		if(rlen == 0)
+			break;
+
+		*len += rlen;
+	}
+
+	fclose(f);
+	return data;
+}
+
+static
+int write_dev(const char *dpath, uint32_t base)
+{
+	char path[PATH_MAX];
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		0, 0, 0x10, 0
+	};
+
+	snprintf(path, sizeof(path), "%s/reg", dpath);
+	if(mkdir(dpath, 0755) || write_file(path, reg, sizeof(reg)))
+		return 1;
+
+	snprintf(path, sizeof(path), "%s/compatible", dpath);
+	return write_file(path, "vendor,cached", sizeof("vendor,cached"));
+}
+
+/**
+ * Lists all devices into a string, one per line.
+ */
+static
+char *list_devs(const char *path, const char *cache, int *count)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	char *list = NULL;
+	size_t len = 0;
+
+	if(ctx == NULL)
+		return NULL;
+
+	dtree_ctx_set_cache(ctx, cache);
+	if(dtree_ctx_open(ctx, path, 0)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+	*count = 0;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		fprintf(out, "%s 0x%08X 0x%08X", dtree_dev_name(dev),
+				dtree_dev_base(dev), dtree_dev_high(dev));
+
+		for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c)
+			fprintf(out, " %s", *c);
+
+		fputc('\n', out);
+		dtree_ctx_dev_free(ctx, dev);
+		*count += 1;
+	}
+
+	fclose(out);
+
+	if(dtree_ctx_iserror(ctx)) {
+		free(list);
+		list = NULL;
+	}
+
+	dtree_ctx_free(ctx);
+	return list;
+}
+
+void test_same_devices(const char *path)
+{
+	test_start();
+	fprintf(stderr, "Caching '%s'\n", path);
+
+	char cache[PATH_MAX];
+	snprintf(cache, sizeof(cache), "%s/cache", g_tmp);
+	unlink(cache);
+
+	int count;
+	char *plain = list_devs(path, NULL, &count);
+	fail_on_true(plain == NULL, "Can not list devices without cache");
+	fail_on_true(count != 8, "Unexpected number of devices");
+
+	char *cold = list_devs(path, cache, &count);
+	fail_on_true(cold == NULL, "Can not list devices when creating the cache");
+	fail_on_true(access(cache, R_OK), "The cache file was not created");
+	fail_on_true(strcmp(plain, cold), "Devices differ when creating the cache");
+
+	char *warm = list_devs(path, cache, &count);
+	fail_on_true(warm == NULL, "Can not list devices from the cache");
+	fail_on_true(strcmp(plain, warm), "Devices of the cache differ");
+
+	// indexes are queried in place
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	dtree_ctx_set_cache(ctx, cache);
+	fail_on_true(dtree_ctx_open(ctx, path, 0), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x84000010);
+	fail_on_true(dev == NULL, "Address 0x84000010 not found in the cache");
+	fail_on_false(!strcmp(dtree_dev_name(dev), "serial@84000000"), "Invalid device of 0x84000010");
+	dtree_ctx_dev_free(ctx, dev);
+
+	struct dtree_dev_t **uarts = dtree_ctx_bycompat_all(ctx, "xlnx,xps-uartlite-1.00.a");
+	fail_on_true(uarts == NULL || uarts[0] == NULL || uarts[1] == NULL || uarts[2] != NULL,
+			"Expected two xlnx,xps-uartlite-1.00.a compatible devices in the cache");
+	dtree_ctx_devs_free(ctx, uarts);
+
+	dev = dtree_ctx_byname(ctx, "timer@83c00000");
+	fail_on_true(dev == NULL, "Could not find 'timer@83c00000' in the cache");
+	dtree_ctx_dev_free(ctx, dev);
+
+	dtree_ctx_free(ctx);
+	free(plain);
+	free(cold);
+	free(warm);
+	unlink(cache);
+	test_end();
+}
+
+void test_stale_tree(void)
+{
+	test_start();
+
+	char root[PATH_MAX / 2];
+	char path[PATH_MAX];
+	char cache[PATH_MAX];
+	snprintf(root, sizeof(root), "%s/tree", g_tmp);
+	snprintf(cache, sizeof(cache), "%s/cache", g_tmp);
+	snprintf(path, sizeof(path), "%s/a@1000", root);
+
+	fail_on_true(mkdir(root, 0755) || write_dev(path, 0x1000), "Can not create the tree");
+
+	// an old mtime to not depend on the timestamp granularity
+	const struct timespec old[2] = {{1000, 0}, {1000, 0}};
+	fail_on_true(utimensat(AT_FDCWD, root, old, 0), "Can not set mtime of the tree");
+
+	int count;
+	char *list = list_devs(root, cache, &count);
+	fail_on_true(list == NULL || count != 1, "Unexpected devices when creating the cache");
+	free(list);
+
+	// a change of a device is below the root, the cache is still used
+	snprintf(path, sizeof(path), "%s/a@1000/reg", root);
+	fail_on_true(write_file(path, "\0\0\x20\0\0\0\x10\0", 8), "Can not rewrite reg");
+
+	list = list_devs(root, cache, &count);
+	fail_on_true(list == NULL || strstr(list, "0x00001000") == NULL,
+			"The cache was not used for an unchanged root");
+	free(list);
+
+	snprintf(path, sizeof(path), "%s/b@3000", root);
+	fail_on_true(write_dev(path, 0x3000), "Can not add a device");
+
+	list = list_devs(root, cache, &count);
+	fail_on_true(list == NULL || count != 2, "The stale cache was not rebuilt");
+	fail_on_true(strstr(list, "0x00002000") == NULL, "The rebuilt cache has old devices");
+	free(list);
+
+	// the rebuilt cache is valid
+	list = list_devs(root, cache, &count);
+	fail_on_true(list == NULL || count != 2, "Unexpected devices of the rebuilt cache");
+	free(list);
+
+	unlink(cache);
+	test_end();
+}
+
+void test_stale_blob(void)
+{
+	test_start();
+
+	char blob[PATH_MAX];
+	char cache[PATH_MAX];
+	snprintf(blob, sizeof(blob), "%s/tree.dtb", g_tmp);
+	snprintf(cache, sizeof(cache), "%s/cache", g_tmp);
+
+	size_t len;
+	char *data = read_file("device-tree.dtb", &len);
+	fail_on_true(data == NULL || write_file(blob, data, len), "Can not copy the blob");
+
+	int count;
+	char *list = list_devs(blob, cache, &count);
+	fail_on_true(list == NULL || count != 8, "Unexpected devices when creating the cache");
+	free(list);
+
+	// the same size and mtime granularity, just another contents
+	char *c = memmem(data, len, "xps-uartlite-1.01.a", sizeof("xps-uartlite-1.01.a"));
+	fail_on_true(c == NULL, "Can not find a compatible string in the blob");
+	c[sizeof("xps-uartlite-1.0") - 1] = '9';
+	fail_on_true(write_file(blob, data, len), "Can not rewrite the blob");
+
+	list = list_devs(blob, cache, &count);
+	fail_on_true(list == NULL || strstr(list, "xps-uartlite-1.09.a") == NULL,
+			"The stale cache of a blob was not rebuilt");
+	free(list);
+
+	free(data);
+	unlink(cache);
+	test_end();
+}
+
+void test_invalid_cache(void)
+{
+	test_start();
+
+	char cache[PATH_MAX];
+	snprintf(cache, sizeof(cache), "%s/cache", g_tmp);
+
+	static const char garbage[4096] = "DTSC garbage";
+	fail_on_true(write_file(cache, garbage, sizeof(garbage)), "Can not write the garbage");
+
+	int count;
+	char *list = list_devs("device-tree.dtb", cache, &count);
+	fail_on_true(list == NULL || count != 8, "An invalid cache was not rebuilt");
+	free(list);
+
+	// truncated cache
+	fail_on_true(truncate(cache, 256), "Can not truncate the cache");
+	list = list_devs("device-tree.dtb", cache, &count);
+	fail_on_true(list == NULL || count != 8, "A truncated cache was not rebuilt");
+	free(list);
+
+	// the cache is optional
+	list = list_devs("device-tree.dtb", "/xxx/yyy/cache", &count);
+	fail_on_true(list == NULL || count != 8, "Open fails when the cache can not be written");
+	free(list);
+
+	unlink(cache);
+	test_end();
+}
+
+/**
+ * Opens the tree with the cache and queries all its indexes.
+ */
+static
+int query_cached(const char *path, const char *cache)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	if(ctx == NULL)
+		return 1;
+
+	dtree_ctx_set_cache(ctx, cache);
+	if(dtree_ctx_open(ctx, path, 0)) {
+		dtree_ctx_free(ctx);
+		return 1;
+	}
+
+	struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x84000010);
+	if(dev != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	dev = dtree_ctx_byname(ctx, "timer@83c00000");
+	if(dev != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	struct dtree_dev_t **uarts = dtree_ctx_bycompat_all(ctx, "xlnx,xps-uartlite-1.00.a");
+	if(uarts != NULL)
+		dtree_ctx_devs_free(ctx, uarts);
+
+	dtree_ctx_free(ctx);
+	return 0;
+}
+
+void test_corrupt_cache(void)
+{
+	test_start();
+
+	char cache[PATH_MAX];
+	snprintf(cache, sizeof(cache), "%s/cache", g_tmp);
+	unlink(cache);
+
+	int count;
+	char *plain = list_devs("device-tree.dtb", NULL, &count);
+	char *list = list_devs("device-tree.dtb", cache, &count);
+	fail_on_true(plain == NULL || list == NULL, "Can not create the cache");
+	free(list);
+
+	size_t len;
+	char *good = read_file(cache, &len);
+	fail_on_true(good == NULL, "Can not read the cache");
+
+	// a valid header with indices out of their sections
+	char *bad = malloc(len);
+	fail_on_true(bad == NULL, "Out of memory");
+	memcpy(bad, good, len);
+	memset(bad + len / 2, 0xFF, len - len / 2);
+	fail_on_true(write_file(cache, bad, len), "Can not corrupt the cache");
+
+	list = list_devs("device-tree.dtb", cache, &count);
+	fail_on_true(list == NULL || count != 8, "A corrupted cache was not rebuilt");
+	fail_on_true(strcmp(plain, list), "Devices of a corrupted cache differ");
+	free(list);
+
+	size_t rlen;
+	char *rebuilt = read_file(cache, &rlen);
+	fail_on_true(rebuilt == NULL || rlen != len || memcmp(good, rebuilt, len),
+			"The corrupted cache was not rewritten");
+	free(rebuilt);
+
+	// any damaged word is either rejected or harmless
+	for(size_t off = 0; off + 4 <= len; off += 4) {
+		memcpy(bad, good, len);
+		memset(bad + off, 0xFF, 4);
+		fail_on_true(write_file(cache, bad, len), "Can not corrupt the cache");
+		fail_on_true(query_cached("device-tree.dtb", cache),
+				"Can not open the tree with a corrupted cache");
+	}
+
+	free(bad);
+	free(good);
+	free(plain);
+	unlink(cache);
+	test_end();
+}
+
+int main(void)
+{
+	if(mkdtemp(g_tmp) == NULL) {
+		test_warn("Can not create a temporary directory");
+		return 1;
+	}
+
+	test_same_devices("device-tree");
+	test_same_devices("device-tree.dtb");
+	test_stale_tree();
+	test_stale_blob();
+	test_invalid_cache();
+	test_corrupt_cache();
+
+	char cmd[PATH_MAX];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", g_tmp);
+	return system(cmd) != 0;
+}
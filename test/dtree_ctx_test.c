@@ -0,0 +1,246 @@
+/**
+ * dtree_ctx_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS  50
+
+static
+int count_devs(dtree_ctx_t *ctx)
+{
+	struct dtree_dev_t *dev;
+	int count = 0;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		dtree_ctx_dev_free(ctx, dev);
+		count += 1;
+	}
+
+	return dtree_ctx_iserror(ctx)? -1 : count;
+}
+
+void test_interleaved(const char *a_path, int a_flags, const char *b_path, int b_flags)
+{
+	test_start();
+	fprintf(stderr, "Interleaving '%s' and '%s'\n", a_path, b_path);
+
+	dtree_ctx_t *a = dtree_ctx_new();
+	dtree_ctx_t *b = dtree_ctx_new();
+	fail_on_true(a == NULL || b == NULL, "Can not allocate contexts");
+
+	fail_on_true(dtree_ctx_open(a, a_path, a_flags), dtree_ctx_errstr(a));
+	fail_on_true(dtree_ctx_open(b, b_path, b_flags), dtree_ctx_errstr(b));
+
+	struct dtree_dev_t *da;
+	struct dtree_dev_t *db;
+	const char *names[16];
+	int count = 0;
+
+	// the order of a directory and a blob can differ,
+	// compare the sets of names
+	while((da = dtree_ctx_next(a)) != NULL && count < 16) {
+		db = dtree_ctx_next(b);
+		fail_on_true(db == NULL, "The second context has ended early");
+
+		names[count++] = strdup(dtree_dev_name(da));
+		dtree_ctx_dev_free(a, da);
+		dtree_ctx_dev_free(b, db);
+	}
+
+	fail_on_false(dtree_ctx_next(b) == NULL, "The first context has ended early");
+	fail_on_true(count != 8, "Unexpected number of devices traversed");
+
+	// names are looked up by the index without moving the iterator
+	for(int i = 0; i < count; ++i) {
+		if(b_flags & DTREE_OPEN_SNAPSHOT) {
+			db = dtree_ctx_byname(b, names[i]);
+			fail_on_true(db == NULL, "A device is missing in the second context");
+			dtree_ctx_dev_free(b, db);
+		}
+
+		free((void *) names[i]);
+	}
+
+	fail_on_true(dtree_ctx_reset(b), "Can not reset the second context");
+	fail_on_true(count_devs(b) != 8, "Unexpected number of devices after reset");
+	fail_on_true(count_devs(a) != 0, "The first context was reset by the second one");
+
+	dtree_ctx_free(a);
+	dtree_ctx_free(b);
+	test_end();
+}
+
+void test_errors_isolated(void)
+{
+	test_start();
+
+	dtree_ctx_t *good = dtree_ctx_new();
+	dtree_ctx_t *bad  = dtree_ctx_new();
+	fail_on_true(good == NULL || bad == NULL, "Can not allocate contexts");
+
+	fail_on_true(dtree_ctx_open(good, "device-tree", 0), dtree_ctx_errstr(good));
+
+	fail_on_success(dtree_ctx_open(bad, "/xxx/yyy/zzz", 0),
+			"Successful when passing non-existent dir: /xxx/yyy/zzz");
+	fail_on_false(dtree_ctx_iserror(bad), "Error is not indicated by dtree_ctx_iserror()");
+	fail_on_true(dtree_ctx_iserror(good), "Error has leaked into another context");
+	fail_on_true(dtree_iserror(), "Error has leaked into the default context");
+
+	fail_on_true(count_devs(good) != 8, "Can not iterate after an error of another context");
+
+	// the failed context can be used again
+	fail_on_true(dtree_ctx_open(bad, "device-tree.dtb", 0), dtree_ctx_errstr(bad));
+	fail_on_true(count_devs(bad) != 8, "Unexpected number of devices in the reopened context");
+
+	dtree_ctx_free(good);
+	dtree_ctx_free(bad);
+	test_end();
+}
+
+void test_open_busy(void)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", 0), dtree_ctx_errstr(ctx));
+	fail_on_success(dtree_ctx_open(ctx, "device-tree", 0), "Opened the context twice");
+	fail_on_false(dtree_ctx_iserror(ctx), "Error is not indicated by dtree_ctx_iserror()");
+
+	dtree_ctx_close(ctx);
+	dtree_ctx_close(ctx);
+
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", DTREE_OPEN_SNAPSHOT), dtree_ctx_errstr(ctx));
+	fail_on_true(count_devs(ctx) != 8, "Unexpected number of devices after reopen");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_default_context(void)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", 0), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *first = dtree_next();
+	fail_on_true(first == NULL, "No device in the default context");
+	fail_on_true(count_devs(ctx) != 8, "Unexpected number of devices in the context");
+
+	struct dtree_dev_t *second = dtree_next();
+	fail_on_true(second == NULL, "The default context was moved by another context");
+	fail_on_false(strcmp(dtree_dev_name(first), dtree_dev_name(second)),
+			"The default context returned the same device twice");
+
+	dtree_dev_free(first);
+	dtree_dev_free(second);
+	dtree_ctx_free(ctx);
+	dtree_close();
+	test_end();
+}
+
+void test_free_after_close(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Devices of '%s' (flags %d)\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *dev = dtree_ctx_byname(ctx, "serial@84000000");
+	fail_on_true(dev == NULL, "No serial@84000000");
+	dtree_ctx_close(ctx);
+
+	// a lazy handle is loaded after close
+	fail_on_false(dtree_dev_base(dev) == 0x84000000, "Invalid base after close");
+	dtree_ctx_dev_free(ctx, dev);
+	dtree_ctx_free(ctx);
+
+	// the non-reentrant API
+	int err = dtree_open_flags(path, flags);
+	fail_on_error(err, "Can not open the tree");
+
+	dev = dtree_next();
+	fail_on_true(dev == NULL, "No device to iterate");
+	dtree_close();
+	dtree_dev_free(dev);
+
+	test_end();
+}
+
+static
+void *count_thread(void *arg)
+{
+	const char *path = (const char *) arg;
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	int bad = 0;
+
+	if(ctx == NULL)
+		return (void *) 1;
+
+	for(int i = 0; i < ROUNDS && !bad; ++i) {
+		if(dtree_ctx_open(ctx, path, 0)) {
+			bad = 1;
+			break;
+		}
+
+		bad = count_devs(ctx) != 8;
+		dtree_ctx_close(ctx);
+	}
+
+	dtree_ctx_free(ctx);
+	return bad? (void *) 1 : NULL;
+}
+
+void test_threads(void)
+{
+	test_start();
+
+	static const char *paths[] = {"device-tree", "device-tree.dtb"};
+	pthread_t threads[THREADS];
+
+	for(int i = 0; i < THREADS; ++i) {
+		int err = pthread_create(&threads[i], NULL, count_thread, (void *) paths[i % 2]);
+		fail_on_error(err, "Can not create a thread");
+	}
+
+	int failed = 0;
+	for(int i = 0; i < THREADS; ++i) {
+		void *ret;
+		pthread_join(threads[i], &ret);
+		failed += ret != NULL;
+	}
+
+	fail_on_true(failed, "A thread has traversed an unexpected number of devices");
+	test_end();
+}
+
+int main(void)
+{
+	test_interleaved("device-tree", 0, "device-tree.dtb", DTREE_OPEN_SNAPSHOT);
+	test_interleaved("device-tree.dtb", DTREE_OPEN_SNAPSHOT, "device-tree", 0);
+	test_interleaved("device-tree", 0, "device-tree", 0);
+	test_errors_isolated();
+	test_open_busy();
+	test_default_context();
+	test_free_after_close("device-tree", 0);
+	test_free_after_close("device-tree", DTREE_OPEN_LAZY);
+	test_free_after_close("device-tree", DTREE_OPEN_SNAPSHOT);
+	test_free_after_close("device-tree.dtb", 0);
+	test_threads();
+}
@@ -0,0 +1,98 @@
+/**
+ * dtree_fdt_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+
+void test_open_not_fdt(void)
+{
+	test_start();
+	int err = dtree_open(__FILE__);
+	fail_on_success(err, "Successful when passing " __FILE__ " as a blob");
+	fail_on_false(dtree_iserror(), "Error is not indicated by dtree_iserror()");
+	dtree_close();
+	test_end();
+}
+
+void test_all_dev(const int expect)
+{
+	test_start();
+
+	struct dtree_dev_t *curr = NULL;
+	int count = 0;
+
+	while((curr = dtree_next())) {
+		printf("DEV '%s' at 0x%08X .. 0x%08X\n", dtree_dev_name(curr),
+				dtree_dev_base(curr), dtree_dev_high(curr));
+		print_compat(curr);
+
+		dtree_dev_free(curr);
+		count += 1;
+	}
+
+	fail_on_true(dtree_iserror(), "An error occured during traversing the blob");
+	fail_on_true(count != expect, "Unexpected number of devices traversed");
+
+	test_end();
+}
+
+void test_find_serial(void)
+{
+	test_start();
+
+	struct dtree_dev_t *dev = dtree_byname("serial@88000000");
+	fail_on_true(dev == NULL, "Could not find the device 'serial@88000000'");
+
+	fail_on_false(dtree_dev_base(dev) == 0x88000000, "Invalid base of serial@88000000");
+	fail_on_false(dtree_dev_high(dev) == 0x8800FFFF, "Invalid high of serial@88000000");
+
+	const char **compat = dtree_dev_compat(dev);
+	fail_on_true(compat[0] == NULL || compat[1] == NULL, "Missing compatible entries");
+	fail_on_false(!strcmp(compat[0], "xlnx,xps-uartlite-1.01.a"), "Invalid first compatible entry");
+	fail_on_false(!strcmp(compat[1], "xlnx,xps-uartlite-1.00.a"), "Invalid second compatible entry");
+	fail_on_false(compat[2] == NULL, "Compatible entries are not terminated by NULL");
+
+	dtree_dev_free(dev);
+	test_end();
+}
+
+void test_find_compat(void)
+{
+	test_start();
+
+	struct dtree_dev_t *dev = NULL;
+	int count = 0;
+
+	while((dev = dtree_bycompat("xlnx,xps-uartlite-1.00.a")) != NULL) {
+		count += 1;
+		dtree_dev_free(dev);
+	}
+
+	fail_on_true(count != 2, "Expected two xlnx,xps-uartlite-1.00.a compatible components");
+	test_end();
+}
+
+int main(void)
+{
+	test_open_not_fdt();
+
+	int err = dtree_open("device-tree.dtb");
+	halt_on_error(err, "Can not open testing device-tree.dtb");
+
+	test_all_dev(8);
+	dtree_reset();
+
+	test_all_dev(8);
+	dtree_reset();
+
+	test_find_serial();
+	dtree_reset();
+
+	test_find_compat();
+	dtree_reset();
+
+	dtree_close();
+}
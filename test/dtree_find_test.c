@@ -0,0 +1,352 @@
+/**
+ * dtree_find_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Results of dtree_find() must equal filtering of all
+ * devices. Reads of properties and directories are counted
+ * by wrapping openat() (-Wl,--wrap=openat).
+ */
+
+#define _GNU_SOURCE
+#define TEST_WRAP_OPENAT // counts by g_openat_hook
+
+#include "dtree.h"
+#include "test.h"
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int g_props = 0;
+static int g_plb = 0;
+
+static
+void count_reads(const char *path)
+{
+	if(!strcmp(path, "reg") || !strcmp(path, "compatible") || !strcmp(path, "status"))
+		g_props += 1;
+	else if(!strcmp(path, "plb@0"))
+		g_plb += 1;
+}
+
+static
+int prune_plb(const char *name, unsigned depth, void *arg)
+{
+	unsigned *max_depth = arg;
+
+	if(depth > *max_depth)
+		*max_depth = depth;
+
+	return !strcmp(name, "plb@0");
+}
+
+/**
+ * Appends the device to the list.
+ */
+static
+void list_dev(FILE *out, const struct dtree_dev_t *dev)
+{
+	fprintf(out, "%s 0x%08X 0x%08X", dtree_dev_name(dev),
+			dtree_dev_base(dev), dtree_dev_high(dev));
+
+	for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c)
+		fprintf(out, " %s", *c);
+
+	fputc('\n', out);
+}
+
+/**
+ * Lists devices found by dtree_ctx_find() into a string.
+ */
+static
+char *list_find(const char *path, int flags, const struct dtree_filter *f)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	char *list = NULL;
+	size_t len = 0;
+
+	if(ctx == NULL || dtree_ctx_open(ctx, path, flags)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+
+	while((dev = dtree_ctx_find(ctx, f)) != NULL) {
+		list_dev(out, dev);
+		dtree_ctx_dev_free(ctx, dev);
+	}
+
+	fclose(out);
+
+	if(dtree_ctx_iserror(ctx)) {
+		free(list);
+		list = NULL;
+	}
+
+	dtree_ctx_free(ctx);
+	return list;
+}
+
+/**
+ * Tests the device by the filter the obvious way.
+ */
+static
+int dev_matches(const struct dtree_dev_t *dev, const struct dtree_filter *f)
+{
+	const char *name = dtree_dev_name(dev);
+
+	if(f->name != NULL && strcmp(name, f->name))
+		return 0;
+
+	if(f->basename != NULL) {
+		const char *at = strchr(name, '@');
+		const size_t len = at == NULL? strlen(name) : (size_t) (at - name);
+
+		if(strlen(f->basename) != len || strncmp(name, f->basename, len))
+			return 0;
+	}
+
+	if(f->compat != NULL) {
+		const char **c = dtree_dev_compat(dev);
+		while(*c != NULL && strcmp(*c, f->compat))
+			++c;
+
+		if(*c == NULL)
+			return 0;
+	}
+
+	if(f->flags & DTREE_FIND_RANGE) {
+		dtree_addr_t base = dtree_dev_base(dev);
+		dtree_addr_t high = dtree_dev_high(dev);
+
+		if(high < base)
+			high = base;
+		if(base > f->high || high < f->base)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Lists devices filtered after iteration into a string.
+ */
+static
+char *list_filtered(const char *path, const struct dtree_filter *f)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	char *list = NULL;
+	size_t len = 0;
+
+	if(ctx == NULL || dtree_ctx_open(ctx, path, 0)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		if(dev_matches(dev, f))
+			list_dev(out, dev);
+
+		dtree_ctx_dev_free(ctx, dev);
+	}
+
+	fclose(out);
+	dtree_ctx_free(ctx);
+	return list;
+}
+
+void test_same_devices(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Searching '%s' (flags %d)\n", path, flags);
+
+	const struct dtree_filter filters[] = {
+		{.name = "serial@88000000"},
+		{.basename = "serial"},
+		{.basename = "seria"},
+		{.compat = "xlnx,xps-uartlite-1.00.a"},
+		{.compat = "simple-bus", .basename = "plb"},
+		{.compat = "xxx"},
+		{.flags = DTREE_FIND_RANGE, .base = 0x81000000, .high = 0x83FFFFFF},
+		{.flags = DTREE_FIND_RANGE, .base = 0x84000010, .high = 0x84000010,
+		 .compat = "xlnx,xps-uartlite-1.01.a"},
+		{.flags = DTREE_FIND_RANGE, .base = 0x50000000, .high = 0x8FFFFFFF,
+		 .basename = "serial"},
+		{.name = NULL},
+	};
+
+	for(size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+		char *expect = list_filtered(path, &filters[i]);
+		char *found = list_find(path, flags, &filters[i]);
+
+		fail_on_true(expect == NULL || found == NULL, "Can not list devices");
+		if(strcmp(expect, found)) {
+			fprintf(stderr, "Filter %zu: expected\n%sfound\n%s", i, expect, found);
+			fail_on_true(1, "Found devices differ from filtered ones");
+		}
+
+		free(expect);
+		free(found);
+	}
+
+	test_end();
+}
+
+void test_prune(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Pruning '%s' (flags %d)\n", path, flags);
+
+	unsigned max_depth = 0;
+	const struct dtree_filter f = {.prune = prune_plb, .arg = &max_depth};
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	g_plb = 0;
+	struct dtree_dev_t *dev = dtree_ctx_find(ctx, &f);
+	fail_on_true(dev == NULL, "No device outside of plb@0");
+	fail_on_false(!strcmp(dtree_dev_name(dev), "memory@50000000"), "Unexpected device");
+	dtree_ctx_dev_free(ctx, dev);
+
+	fail_on_false(dtree_ctx_find(ctx, &f) == NULL, "Found a device of the pruned plb@0");
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_plb != 0, "The pruned plb@0 was entered");
+	fail_on_true(max_depth != 1, "Prune was called below plb@0");
+
+	// without pruning the iterator goes on from the start
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+	const struct dtree_filter timer = {.basename = "timer"};
+	dev = dtree_ctx_find(ctx, &timer);
+	fail_on_true(dev == NULL, "The timer was not found after reset");
+	dtree_ctx_dev_free(ctx, dev);
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_cheap_first(void)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", 0), dtree_ctx_errstr(ctx));
+
+	// names are tested before reading anything
+	g_props = 0;
+	const struct dtree_filter name = {.basename = "timer"};
+	struct dtree_dev_t *dev = dtree_ctx_find(ctx, &name);
+	fail_on_true(dev == NULL, "The timer was not found");
+	fail_on_true(g_props != 1, "Properties of other devices were read");
+	dtree_ctx_dev_free(ctx, dev);
+
+	// the reg is read only for compatible devices (2 of 8)
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+	g_props = 0;
+
+	const struct dtree_filter compat = {.compat = "xlnx,xps-uartlite-1.00.a"};
+	while((dev = dtree_ctx_find(ctx, &compat)) != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props != 3 + 2, "Unexpected reads of properties");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+static
+int write_file(const char *dpath, const char *fname, const void *data, size_t len)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dpath, fname);
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(data, 1, len, f);
+	return fclose(f) || wlen != len;
+}
+
+static
+int write_dev(const char *dpath, uint32_t base, const char *status)
+{
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		0, 0, 0x10, 0
+	};
+
+	if(mkdir(dpath, 0755) || write_file(dpath, "reg", reg, sizeof(reg)))
+		return 1;
+
+	if(status == NULL)
+		return 0;
+
+	return write_file(dpath, "status", status, strlen(status) + 1);
+}
+
+void test_status(void)
+{
+	test_start();
+
+	char root[] = "/tmp/dtree_find_XXXXXX";
+	char path[PATH_MAX];
+	fail_on_true(mkdtemp(root) == NULL, "Can not create a temporary directory");
+
+	static const char *status[] = {"okay", "disabled", NULL, "ok", "fail"};
+	for(int i = 0; i < 5; ++i) {
+		snprintf(path, sizeof(path), "%s/dev@%d000", root, i + 1);
+		fail_on_true(write_dev(path, (i + 1) * 0x1000, status[i]), "Can not create the tree");
+	}
+
+	const struct dtree_filter okay = {.flags = DTREE_FIND_OKAY};
+	char *list = list_find(root, 0, &okay);
+	fail_on_true(list == NULL, "Can not find okay devices");
+
+	int count = 0;
+	for(char *c = list; *c != '\0'; ++c)
+		count += *c == '\n';
+
+	fail_on_true(count != 3, "Unexpected number of okay devices");
+	fail_on_true(strstr(list, "dev@2000") || strstr(list, "dev@5000"), "Found a disabled device");
+	free(list);
+
+	// the snapshot does not know the status
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, root, DTREE_OPEN_SNAPSHOT), dtree_ctx_errstr(ctx));
+	fail_on_false(dtree_ctx_find(ctx, &okay) == NULL, "Status found in a snapshot");
+	fail_on_false(dtree_ctx_iserror(ctx), "Status of a snapshot is not an error");
+	dtree_ctx_free(ctx);
+
+	char cmd[PATH_MAX];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	fail_on_true(system(cmd), "Can not remove the tree");
+	test_end();
+}
+
+int main(void)
+{
+	g_openat_hook = count_reads;
+
+	test_same_devices("device-tree", 0);
+	test_same_devices("device-tree", DTREE_OPEN_LAZY);
+	test_same_devices("device-tree", DTREE_OPEN_SNAPSHOT);
+	test_same_devices("device-tree.dtb", 0);
+	test_same_devices("device-tree.dtb", DTREE_OPEN_SNAPSHOT);
+
+	test_prune("device-tree", 0);
+	test_prune("device-tree", DTREE_OPEN_LAZY);
+	test_prune("device-tree.dtb", 0);
+
+	test_cheap_first();
+	test_status();
+}
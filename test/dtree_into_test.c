@@ -0,0 +1,190 @@
+/**
+ * dtree_into_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Iteration into caller's buffers. Allocations
+ * of the library are counted by wrapping malloc(),
+ * calloc() and realloc() (-Wl,--wrap=...).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+
+static int g_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	g_allocs += 1;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	g_allocs += 1;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	g_allocs += 1;
+	return __real_realloc(p, size);
+}
+
+/**
+ * Lists all devices by dtree_ctx_next() into a string.
+ */
+static
+char *list_next(dtree_ctx_t *ctx)
+{
+	char list[4096] = "";
+	struct dtree_dev_t *dev;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		strcat(list, dtree_dev_name(dev));
+		for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c) {
+			strcat(list, " ");
+			strcat(list, *c);
+		}
+
+		strcat(list, "\n");
+		dtree_ctx_dev_free(ctx, dev);
+	}
+
+	return strdup(list);
+}
+
+void test_same_devices(const char *path, int flags, int expect_allocs)
+{
+	test_start();
+	fprintf(stderr, "Iterating '%s' (flags %d) into a buffer\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	char *expect = list_next(ctx);
+	fail_on_true(expect == NULL, "Can not list devices");
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+
+	char list[4096] = "";
+	void *buf[32];
+	struct dtree_dev_t dev;
+	size_t need;
+	int count = 0;
+
+	g_allocs = 0;
+
+	while((need = dtree_ctx_next_into(ctx, &dev, buf, sizeof(buf))) != 0) {
+		fail_on_true(need > sizeof(buf), "A device does not fit into 256 B");
+
+		strcat(list, dtree_dev_name(&dev));
+		for(const char **c = dtree_dev_compat(&dev); *c != NULL; ++c) {
+			strcat(list, " ");
+			strcat(list, *c);
+		}
+
+		strcat(list, "\n");
+		count += 1;
+	}
+
+	const int allocs = g_allocs;
+
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(count != 8, "Unexpected number of devices");
+	fail_on_true(strcmp(expect, list), "Devices differ from dtree_ctx_next()");
+	fail_on_true(expect_allocs == 0 && allocs != 0, "Iteration into a buffer allocates");
+
+	free(expect);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_small_buffer(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Small buffers of '%s' (flags %d)\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *first = dtree_ctx_next(ctx);
+	struct dtree_dev_t *second = dtree_ctx_next(ctx);
+	fail_on_true(first == NULL || second == NULL, "No devices to compare");
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+
+	char buf[256];
+	struct dtree_dev_t dev;
+
+	// too small, nothing is consumed
+	size_t need = dtree_ctx_next_into(ctx, &dev, buf, 1);
+	fail_on_true(need <= 1, "The required length is not reported");
+	fail_on_true(dtree_ctx_iserror(ctx), "A small buffer is an error");
+	fail_on_true(need != dtree_ctx_next_into(ctx, &dev, buf, need - 1),
+			"The required length differs on the second call");
+
+	// unaligned buffer of the exact required length
+	const size_t unaligned = dtree_ctx_next_into(ctx, &dev, buf + 1, 0);
+
+	fail_on_true(dtree_ctx_next_into(ctx, &dev, buf + 1, unaligned) != unaligned,
+			"The device does not fit into the required length");
+	fail_on_false(!strcmp(dtree_dev_name(&dev), dtree_dev_name(first)),
+			"A device was skipped after a small buffer");
+
+	// the pending device (if any) is returned by the plain iterator too
+	need = dtree_ctx_next_into(ctx, &dev, buf, 1);
+	fail_on_true(need <= 1, "The required length is not reported");
+
+	struct dtree_dev_t *curr = dtree_ctx_next(ctx);
+	fail_on_true(curr == NULL, "No device after a small buffer");
+	fail_on_false(!strcmp(dtree_dev_name(curr), dtree_dev_name(second)),
+			"dtree_ctx_next() skipped a device after a small buffer");
+
+	dtree_ctx_dev_free(ctx, curr);
+	dtree_ctx_dev_free(ctx, first);
+	dtree_ctx_dev_free(ctx, second);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_default_context(void)
+{
+	test_start();
+
+	int err = dtree_open_flags("device-tree", DTREE_OPEN_SNAPSHOT);
+	fail_on_error(err, "Can not open testing device-tree");
+
+	void *buf[32];
+	struct dtree_dev_t dev;
+	int count = 0;
+
+	while(dtree_next_into(&dev, buf, sizeof(buf)) != 0)
+		count += 1;
+
+	fail_on_true(dtree_iserror(), "Iteration has failed");
+	fail_on_true(count != 8, "Unexpected number of devices");
+
+	dtree_close();
+	test_end();
+}
+
+int main(void)
+{
+	test_same_devices("device-tree", DTREE_OPEN_SNAPSHOT, 0);
+	test_same_devices("device-tree.dtb", 0, 0);
+	test_same_devices("device-tree.dtb", DTREE_OPEN_SNAPSHOT, 0);
+	test_same_devices("device-tree", 0, -1);
+
+	test_small_buffer("device-tree", 0);
+	test_small_buffer("device-tree", DTREE_OPEN_SNAPSHOT);
+	test_small_buffer("device-tree.dtb", 0);
+
+	test_default_context();
+}
@@ -0,0 +1,285 @@
+/**
+ * dtree_lazy_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Lazy handles and name lookups must not read properties
+ * that are not needed. Reads of properties are counted
+ * by wrapping openat() (-Wl,--wrap=openat), allocations
+ * by wrapping malloc() (-Wl,--wrap=malloc).
+ */
+
+#define _GNU_SOURCE
+#define TEST_WRAP_OPENAT // counts by g_openat_hook
+
+#include "dtree.h"
+#include "test.h"
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int g_props = 0;
+static int g_mallocs = 0;
+
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	g_mallocs += 1;
+	return __real_malloc(size);
+}
+
+static
+void count_props(const char *path)
+{
+	if(!strcmp(path, "reg") || !strcmp(path, "compatible"))
+		g_props += 1;
+}
+
+static
+int count_fds(void)
+{
+	DIR *d = opendir("/proc/self/fd");
+	int count = 0;
+
+	if(d == NULL)
+		return -1;
+
+	while(readdir(d) != NULL)
+		count += 1;
+
+	closedir(d);
+	return count;
+}
+
+/**
+ * Lists all devices by getters into a string.
+ */
+static
+char *list_devs(int flags)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	char *list = NULL;
+	size_t len = 0;
+
+	if(ctx == NULL || dtree_ctx_open(ctx, "device-tree", flags)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		fprintf(out, "%s 0x%08X 0x%08X", dtree_dev_name(dev),
+				dtree_dev_base(dev), dtree_dev_high(dev));
+
+		for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c)
+			fprintf(out, " %s", *c);
+
+		fputc('\n', out);
+		dtree_ctx_dev_free(ctx, dev);
+	}
+
+	fclose(out);
+	dtree_ctx_free(ctx);
+	return list;
+}
+
+void test_same_devices(void)
+{
+	test_start();
+
+	char *eager = list_devs(0);
+	char *lazy = list_devs(DTREE_OPEN_LAZY);
+
+	fail_on_true(eager == NULL || lazy == NULL, "Can not list devices");
+	fail_on_true(strcmp(eager, lazy), "Lazy devices differ");
+
+	free(eager);
+	free(lazy);
+	test_end();
+}
+
+void test_names_only(void)
+{
+	test_start();
+
+	const int fds = count_fds();
+	int err = dtree_open_flags("device-tree", DTREE_OPEN_LAZY);
+	fail_on_error(err, "Can not open testing device-tree");
+
+	struct dtree_dev_t *devs[8];
+	struct dtree_dev_t *dev;
+	int count = 0;
+
+	g_props = 0;
+
+	while((dev = dtree_next()) != NULL && count < 8) {
+		fail_on_true(dtree_dev_name(dev) == NULL, "A device without name");
+		devs[count++] = dev;
+	}
+
+	fail_on_true(dtree_iserror(), dtree_errstr());
+	fail_on_true(count != 8, "Unexpected number of devices");
+	fail_on_true(g_props != 0, "Properties were read by a name-only scan");
+
+	// loaded once on the first use, properties are read on the stack
+	g_mallocs = 0;
+	fail_on_false(dtree_dev_base(devs[1]) == 0x88000000, "Invalid base of serial@88000000");
+	const int props = g_props;
+	fail_on_true(props == 0 || props > 2, "Unexpected reads of one device");
+	fail_on_true(g_mallocs != 1, "More than the device was allocated");
+
+	fail_on_false(dtree_dev_high(devs[1]) == 0x8800FFFF, "Invalid high of serial@88000000");
+	fail_on_true(dtree_dev_compat(devs[1])[0] == NULL, "Missing compatible entries");
+	fail_on_true(g_props != props, "Properties were read twice");
+
+	// unloaded handles hold the root until free'd
+	for(int i = 0; i < count; ++i)
+		dtree_dev_free(devs[i]);
+
+	dtree_close();
+	fail_on_true(count_fds() != fds, "Descriptors have leaked");
+	test_end();
+}
+
+void test_shared_root(void)
+{
+	test_start();
+
+	const int fds = count_fds();
+	int err = dtree_open_flags("device-tree", DTREE_OPEN_LAZY);
+	fail_on_error(err, "Can not open testing device-tree");
+
+	struct dtree_dev_t *devs[8];
+	struct dtree_dev_t *dev;
+	int count = 0;
+
+	while((dev = dtree_next()) != NULL && count < 8)
+		devs[count++] = dev;
+
+	fail_on_true(count != 8, "Unexpected number of devices");
+
+	// the tree and one root shared by the handles
+	fail_on_true(count_fds() > fds + 2, "Unloaded handles hold a descriptor each");
+
+	fail_on_false(dtree_dev_base(devs[1]) == 0x88000000, "Invalid base of serial@88000000");
+
+	for(int i = 0; i < count; ++i)
+		dtree_dev_free(devs[i]);
+
+	dtree_close();
+	fail_on_true(count_fds() != fds, "Descriptors have leaked");
+	test_end();
+}
+
+void test_load_after_free(void)
+{
+	test_start();
+
+	char tmp[] = "/tmp/dtree_lazy_XXXXXX";
+	char cmd[128];
+
+	fail_on_true(mkdtemp(tmp) == NULL, "Can not create a temporary directory");
+	snprintf(cmd, sizeof(cmd), "cp -r device-tree %s/device-tree", tmp);
+	fail_on_true(system(cmd), "Can not copy the testing tree");
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	snprintf(cmd, sizeof(cmd), "%s/device-tree", tmp);
+	fail_on_true(dtree_ctx_open(ctx, cmd, DTREE_OPEN_LAZY), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *serial = dtree_ctx_byname(ctx, "serial@88000000");
+	fail_on_true(serial == NULL, "No serial@88000000");
+	dtree_ctx_reset(ctx);
+
+	struct dtree_dev_t *timer = dtree_ctx_byname(ctx, "timer@83c00000");
+	fail_on_true(timer == NULL, "No timer@83c00000");
+
+	// the error state of the context is gone
+	dtree_ctx_free(ctx);
+
+	fail_on_false(dtree_dev_base(serial) == 0x88000000, "Invalid base loaded after free");
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s/device-tree/plb@0/timer@83c00000", tmp);
+	fail_on_true(system(cmd), "Can not remove the node");
+	fail_on_false(dtree_dev_base(timer) == 0, "Removed node was loaded");
+	fail_on_false(dtree_dev_compat(timer)[0] == NULL, "Removed node has compatible entries");
+
+	dtree_dev_free(serial);
+	dtree_dev_free(timer);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", tmp);
+	fail_on_true(system(cmd), "Can not remove the temporary directory");
+	test_end();
+}
+
+void test_caller_dev(void)
+{
+	test_start();
+
+	static const char *compat[] = {"xlnx,xps-uartlite-1.00.a", NULL};
+	struct dtree_dev_t dev;
+
+	// eg. a device built by the caller, it is never loaded
+	memset(&dev, 0, sizeof(dev));
+	fail_on_false(dtree_dev_base(&dev) == 0, "Invalid base of a zeroed device");
+	fail_on_false(dtree_dev_compat(&dev) == NULL, "Zeroed device was loaded");
+
+	// not initialized at all but the addresses
+	memset(&dev, 0xA5, sizeof(dev));
+	dev.base = 0x84000000;
+	dev.high = 0x8400FFFF;
+	fail_on_false(dtree_dev_base(&dev) == 0x84000000, "Invalid base of a garbage device");
+	fail_on_false(dtree_dev_high(&dev) == 0x8400FFFF, "Invalid high of a garbage device");
+
+	dev.name   = "serial";
+	dev.base   = 0x84000000;
+	dev.high   = 0x8400FFFF;
+	dev.compat = compat;
+	fail_on_false(dtree_dev_high(&dev) == 0x8400FFFF, "Invalid high of a built device");
+	fail_on_false(dtree_dev_compat(&dev) == compat, "Invalid compat of a built device");
+
+	test_end();
+}
+
+void test_byname(int flags)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", flags), dtree_ctx_errstr(ctx));
+
+	g_props = 0;
+
+	struct dtree_dev_t *dev = dtree_ctx_byname(ctx, "timer@83c00000");
+	fail_on_true(dev == NULL, "Could not find the device 'timer@83c00000'");
+	fail_on_true(g_props > 2, "Properties of other devices were read");
+
+	fail_on_false(dtree_dev_base(dev) == 0x83C00000, "Invalid base of timer@83c00000");
+	fail_on_true(g_props > 2, "Properties of other devices were read");
+	dtree_ctx_dev_free(ctx, dev);
+
+	dev = dtree_ctx_byname(ctx, "xxx");
+	fail_on_false(dev == NULL, "Found a non-existent device");
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props > 2, "Properties of other devices were read");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+int main(void)
+{
+	g_openat_hook = count_props;
+
+	test_same_devices();
+	test_names_only();
+	test_shared_root();
+	test_load_after_free();
+	test_caller_dev();
+	test_byname(0);
+	test_byname(DTREE_OPEN_LAZY);
+}
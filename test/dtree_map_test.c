@@ -0,0 +1,272 @@
+/**
+ * dtree_map_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Devices are mapped from a sparse file that stands
+ * for /dev/mem (the offset is the physical address).
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static char g_memdev[] = "/tmp/dtree_map_test.XXXXXX";
+
+int memdev_create(void)
+{
+	int fd = mkstemp(g_memdev);
+	if(fd < 0)
+		return -1;
+
+	// above the highest device of the testing tree
+	if(ftruncate(fd, 0x88010000)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void test_dev_map(int fd)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	struct dtree_dev_t *dev = dtree_byname("serial@84000000");
+	fail_on_true(dev == NULL, "No serial@84000000");
+
+	struct dtree_map_t *m = dtree_dev_map(dev);
+	fail_on_true(m == NULL, "Can not map serial@84000000");
+	fail_on_false(m->addr == 0x84000000, "Invalid address of the window");
+	fail_on_false(m->len == dtree_dev_high(dev) - dtree_dev_base(dev) + 1, "Invalid length of the window");
+
+	// the window outlives the device
+	dtree_dev_free(dev);
+
+	dtree_map_write32(m, 0x10, 0xDEADBEEF);
+	dtree_map_write16(m, 0x14, 0x1234);
+	dtree_map_write8(m, 0x16, 0x56);
+
+	fail_on_false(dtree_map_read32(m, 0x10) == 0xDEADBEEF, "Invalid read32");
+	fail_on_false(dtree_map_read16(m, 0x14) == 0x1234, "Invalid read16");
+	fail_on_false(dtree_map_read8(m, 0x16) == 0x56, "Invalid read8");
+
+	uint32_t value = 0;
+	fail_on_false(pread(fd, &value, sizeof(value), 0x84000010) == sizeof(value), "Can not read memdev");
+	fail_on_false(value == 0xDEADBEEF, "The write did not reach the memory device");
+
+	dtree_map_free(m);
+	dtree_close();
+	test_end();
+}
+
+void test_dev_ranges(void)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	struct dtree_dev_t *dev = dtree_byname("plb@0");
+	fail_on_true(dev == NULL, "No plb@0");
+
+	// reg of size 0, spans 0x00000000..0xFFFFFFFF
+	struct dtree_map_t *m = dtree_dev_map(dev);
+	if(sizeof(size_t) > 4) {
+		fail_on_true(m == NULL, "Can not map the whole address space");
+		fail_on_false(m->len == (size_t) UINT32_MAX + 1, "Invalid length of the whole address space");
+		dtree_map_free(m);
+	}
+
+	dtree_dev_free(dev);
+	dtree_close();
+
+	// no valid high address
+	static const char *compat[] = {NULL};
+	const struct dtree_dev_t none = {"none", 0x84000000, 0x84000000, compat};
+
+	fail_on_false(dtree_dev_map(&none) == NULL, "Device without a size was mapped");
+	fail_on_false(dtree_iserror(), "Mapping without a size is not an error");
+	test_end();
+}
+
+void test_addr_map(int fd)
+{
+	test_start();
+
+	// not aligned to a page
+	struct dtree_map_t *m = dtree_addr_map(0x83C00004, 8);
+	fail_on_true(m == NULL, "Can not map an address");
+	fail_on_false(m->len == 8, "Invalid length of the window");
+
+	dtree_map_write32(m, 4, 0xCAFEBABE);
+
+	uint32_t value = 0;
+	fail_on_false(pread(fd, &value, sizeof(value), 0x83C00008) == sizeof(value), "Can not read memdev");
+	fail_on_false(value == 0xCAFEBABE, "Write to an unaligned window went elsewhere");
+
+	dtree_map_free(m);
+
+	fail_on_false(dtree_addr_map(0x1000, 0) == NULL, "Empty window was mapped");
+	test_end();
+}
+
+void test_block(int fd)
+{
+	test_start();
+
+	unsigned char in[1031];
+	unsigned char out[sizeof(in) + 2];
+	unsigned char file[sizeof(in)];
+
+	for(size_t i = 0; i < sizeof(in); ++i)
+		in[i] = (unsigned char) (i * 7 + 3);
+
+	struct dtree_map_t *m = dtree_addr_map(0x81000000, 0x2000);
+	fail_on_true(m == NULL, "Can not map a block");
+
+	// unaligned head and tail, unaligned buffer
+	fail_on_false(dtree_map_write_block(m, 0x101, in, sizeof(in)) == sizeof(in), "Block write is short");
+	fail_on_false(pread(fd, file, sizeof(file), 0x81000101) == sizeof(file), "Can not read memdev");
+	fail_on_true(memcmp(in, file, sizeof(in)), "Written block differs");
+
+	memset(out, 0, sizeof(out));
+	fail_on_false(dtree_map_read_block(m, 0x101, out + 1, sizeof(in)) == sizeof(in), "Block read is short");
+	fail_on_true(memcmp(in, out + 1, sizeof(in)), "Read block differs");
+	fail_on_false(out[0] == 0 && out[sizeof(in) + 1] == 0, "Block read out of the buffer");
+
+	dtree_map_free(m);
+	test_end();
+}
+
+void test_fifo(int fd)
+{
+	test_start();
+
+	const uint16_t in[] = {0x1111, 0x2222, 0x3333};
+	uint16_t out[4] = {0, 0, 0, 0};
+
+	struct dtree_map_t *m = dtree_addr_map(0x81000000, 0x2000);
+	fail_on_true(m == NULL, "Can not map a fifo");
+
+	// the odd byte is not written
+	fail_on_false(dtree_map_write_fifo(m, 0x20, in, sizeof(in) + 1, 2) == sizeof(in), "Invalid length of fifo write");
+	fail_on_false(dtree_map_read16(m, 0x20) == 0x3333, "The last item is not in the register");
+	fail_on_false(dtree_map_read16(m, 0x22) == 0x0000, "Fifo write incremented the address");
+
+	fail_on_false(dtree_map_read_fifo(m, 0x20, out, sizeof(out), 2) == sizeof(out), "Invalid length of fifo read");
+	for(size_t i = 0; i < 4; ++i)
+		fail_on_false(out[i] == 0x3333, "Fifo read incremented the address");
+
+	uint16_t value = 0;
+	fail_on_false(pread(fd, &value, sizeof(value), 0x81000020) == sizeof(value), "Can not read memdev");
+	fail_on_false(value == 0x3333, "Fifo write did not reach the memory device");
+
+	dtree_map_free(m);
+	test_end();
+}
+
+static
+void *wait_setter(void *arg)
+{
+	const struct timespec ts = {0, 5 * 1000000};
+	nanosleep(&ts, NULL);
+
+	dtree_map_write32((struct dtree_map_t *) arg, 0x30, 0x00000181);
+	return NULL;
+}
+
+void test_wait(void)
+{
+	test_start();
+
+	struct dtree_map_t *m = dtree_addr_map(0x81000000, 0x2000);
+	fail_on_true(m == NULL, "Can not map a register");
+
+	dtree_map_write32(m, 0x30, 0x00000100);
+
+	struct dtree_wait_t w = {.timeout_us = 0};
+	fail_on_false(dtree_map_wait(m, 0x30, 4, 0x100, 0x100, &w) == 0, "Set bit was not matched");
+	fail_on_false(w.iterations == 1, "Matched value was read more times");
+	fail_on_false(w.last == 0x100, "Invalid last value");
+
+	w.timeout_us = 2000;
+	w.spins = 100;
+	w.backoff_us = 50;
+	fail_on_false(dtree_map_wait(m, 0x30, 2, 0x80, 0x80, &w) == 1, "Clear bit was matched");
+	fail_on_false(w.waited_ns >= 2000000, "Timed out too early");
+	fail_on_true(w.iterations <= w.spins, "No read after the spins");
+
+	pthread_t setter;
+	fail_on_true(pthread_create(&setter, NULL, wait_setter, m), "Can not start a setter");
+
+	w.timeout_us = 5000000;
+	const int timedout = dtree_map_wait(m, 0x30, 1, 0x80, 0x80, &w);
+	pthread_join(setter, NULL);
+
+	fail_on_false(timedout == 0, "Value set by the setter was not matched");
+	fail_on_false(w.last == 0x81, "Invalid last value of a byte wait");
+	fail_on_true(w.waited_ns < 1000000, "Matched before the setter");
+
+	dtree_map_free(m);
+	test_end();
+}
+
+void test_ctx_memdev(void)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	dtree_ctx_set_memdev(ctx, "/nonexistent/mem");
+	fail_on_false(dtree_ctx_addr_map(ctx, 0x84000000, 4) == NULL, "Missing memdev was mapped");
+	fail_on_false(dtree_ctx_iserror(ctx), "Missing memdev is not an error");
+
+	dtree_ctx_set_memdev(ctx, g_memdev);
+	fail_on_true(dtree_ctx_open(ctx, "device-tree.dtb", 0), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *dev = dtree_ctx_byname(ctx, "serial@84000000");
+	fail_on_true(dev == NULL, "No serial@84000000 in the blob");
+
+	struct dtree_map_t *m = dtree_ctx_dev_map(ctx, dev);
+	fail_on_true(m == NULL, "Can not map by a context");
+	fail_on_false(dtree_map_read32(m, 0x10) == 0xDEADBEEF, "Invalid value mapped by a context");
+
+	dtree_map_free(m);
+	dtree_ctx_dev_free(ctx, dev);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+int main(void)
+{
+	int fd = memdev_create();
+	if(fd < 0) {
+		perror("memdev_create");
+		return 1;
+	}
+
+	dtree_set_memdev(g_memdev);
+
+	test_dev_map(fd);
+	test_dev_ranges();
+	test_addr_map(fd);
+	test_block(fd);
+	test_fifo(fd);
+	test_wait();
+	test_ctx_memdev();
+
+	close(fd);
+	unlink(g_memdev);
+	return 0;
+}
@@ -1,5 +1,7 @@
 #include "dtree.h"
 #include "test.h"
+#include <fcntl.h>
+#include <unistd.h>
 
 void test_pass_null(void)
 {
@@ -57,6 +59,43 @@ void test_open_test_dtree(void)
 	test_end();
 }
 
+/**
+ * Opens the testing device-tree by a descriptor
+ * that is closed before the traversal.
+ */
+void test_openat_test_dtree(void)
+{
+	test_start();
+	int fd = open("device-tree", O_RDONLY);
+	halt_on_true(fd == -1, "Can not open testing device-tree directory");
+
+	int err = dtree_openat(fd);
+	close(fd);
+	fail_on_error(err, "Can not open testing device-tree by descriptor");
+
+	int count = 0;
+	struct dtree_dev_t *dev;
+	while((dev = dtree_next()) != NULL) {
+		dtree_dev_free(dev);
+		count += 1;
+	}
+
+	fail_on_true(dtree_iserror(), "An error occured during traversing the device tree");
+	fail_on_false(count == 8, "Unexpected number of devices traversed");
+
+	dtree_close();
+	test_end();
+}
+
+void test_openat_invalid(void)
+{
+	test_start();
+	int err = dtree_openat(-1);
+	fail_on_success(err, "Successful when passing an invalid descriptor");
+	fail_on_false(dtree_iserror(), "Error is not indicated by dtree_iserror()");
+	test_end();
+}
+
 /**
  * Tests whether the error flag is cleared in correct way.
  */
@@ -81,6 +120,8 @@ int main(void)
 	test_nonexistent_dir();
 	test_pass_file();
 	test_open_test_dtree();
+	test_openat_test_dtree();
+	test_openat_invalid();
 	test_pass_mostly_valid();
 	test_clear_error();
 }
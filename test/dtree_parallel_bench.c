@@ -0,0 +1,182 @@
+/**
+ * dtree_parallel_bench.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Speedup of the parallel scan (DTREE_OPEN_PARALLEL)
+ * by the number of threads. The baseline is the plain
+ * iteration (one file read after another).
+ *
+ * Usage: dtree_parallel_bench [<device-tree-dir>]
+ * Without an argument a tree of ~4000 nodes is generated
+ * in /tmp. On a real system pass /proc/device-tree.
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 5
+
+static
+int write_reg(const char *dpath, uint32_t base, uint32_t size)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/reg", dpath);
+
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		size >> 24, size >> 16, size >> 8, size
+	};
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(reg, 1, sizeof(reg), f);
+	return fclose(f) || wlen != sizeof(reg);
+}
+
+static
+int write_compat(const char *dpath)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/compatible", dpath);
+
+	static const char compat[] = "vendor,bench-1.0\0simple";
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(compat, 1, sizeof(compat), f);
+	return fclose(f) || wlen != sizeof(compat);
+}
+
+static
+int make_tree(const char *dpath, int fanout, int depth, uint32_t *next)
+{
+	if(depth == 0)
+		return 0;
+
+	for(int i = 0; i < fanout; ++i) {
+		char path[PATH_MAX];
+		const uint32_t base = (*next)++ * 0x1000;
+
+		snprintf(path, sizeof(path), "%s/dev@%x", dpath, base);
+		if(mkdir(path, 0755) || write_reg(path, base, 0x1000) || write_compat(path))
+			return 1;
+
+		if(make_tree(path, fanout, depth - 1, next))
+			return 1;
+	}
+
+	return 0;
+}
+
+static
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the best time of opening and iterating the tree
+ * or -1 on error.
+ */
+static
+double bench_open(const char *path, int flags, unsigned threads, int *count)
+{
+	double best = -1;
+
+	for(int r = 0; r < ROUNDS; ++r) {
+		dtree_ctx_t *ctx = dtree_ctx_new();
+		if(ctx == NULL)
+			return -1;
+
+		dtree_ctx_set_threads(ctx, threads);
+
+		const double start = now();
+		if(dtree_ctx_open(ctx, path, flags)) {
+			fprintf(stderr, "Open of '%s' has failed: %s\n", path, dtree_ctx_errstr(ctx));
+			dtree_ctx_free(ctx);
+			return -1;
+		}
+
+		struct dtree_dev_t *dev;
+		*count = 0;
+		while((dev = dtree_ctx_next(ctx)) != NULL) {
+			dtree_ctx_dev_free(ctx, dev);
+			*count += 1;
+		}
+
+		const double t = now() - start;
+		dtree_ctx_free(ctx);
+
+		if(best < 0 || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	char root[] = "/tmp/dtree_bench_XXXXXX";
+	const char *path = argc > 1? argv[1] : root;
+	uint32_t next = 1;
+	int count;
+
+	if(argc <= 1) {
+		// 16 + 256 + 4096 devices
+		if(mkdtemp(root) == NULL || make_tree(root, 16, 3, &next)) {
+			fprintf(stderr, "Can not generate the tree in /tmp\n");
+			return 1;
+		}
+	}
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const double serial = bench_open(path, 0, 1, &count);
+	if(serial < 0)
+		goto clean_and_exit;
+
+	printf("%s: %d devices, %ld CPUs, best of %d rounds\n", path, count, cpus, ROUNDS);
+	printf("iterate  %8.2f ms\n", serial * 1000);
+
+	const double snapshot = bench_open(path, DTREE_OPEN_SNAPSHOT, 1, &count);
+	if(snapshot >= 0)
+		printf("snapshot %8.2f ms   speedup %.2fx\n", snapshot * 1000, serial / snapshot);
+
+	for(unsigned threads = 1; threads <= 2 * cpus || threads <= 8; threads *= 2) {
+		const double t = bench_open(path, DTREE_OPEN_PARALLEL, threads, &count);
+		if(t < 0)
+			break;
+
+		printf("%2u thr   %8.2f ms   speedup %.2fx\n", threads, t * 1000, serial / t);
+	}
+
+clean_and_exit:
+	if(argc <= 1)
+		nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return serial < 0;
+}
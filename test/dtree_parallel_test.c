@@ -0,0 +1,230 @@
+/**
+ * dtree_parallel_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * The parallel scan must return the same devices
+ * in the same order as the serial traversal. Both with
+ * and without io_uring (dtree_uring_new() is wrapped
+ * by -Wl,--wrap=dtree_uring_new).
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct dtree_uring;
+
+static int g_no_uring = 0;
+
+struct dtree_uring *__real_dtree_uring_new(unsigned entries);
+
+struct dtree_uring *__wrap_dtree_uring_new(unsigned entries)
+{
+	if(g_no_uring)
+		return NULL;
+
+	return __real_dtree_uring_new(entries);
+}
+
+static
+int write_file(const char *dpath, const char *fname, const void *data, size_t len)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dpath, fname);
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(data, 1, len, f);
+	return fclose(f) || wlen != len;
+}
+
+static
+int write_dev(const char *dpath, uint32_t base, uint32_t size, int compat)
+{
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		size >> 24, size >> 16, size >> 8, size
+	};
+
+	if(write_file(dpath, "reg", reg, sizeof(reg)))
+		return 1;
+
+	if(compat % 4 == 0)
+		return 0;
+
+	// some of the lists are longer than buffers of batched reads
+	char c[1024];
+	int clen = snprintf(c, sizeof(c), "vendor,dev-%d", compat % 7) + 1;
+	for(int i = 0; compat % 7 == 5 && i < 30; ++i)
+		clen += snprintf(c + clen, sizeof(c) - clen, "vendor,long-compatible-%d", i) + 1;
+
+	memcpy(c + clen, "simple", sizeof("simple"));
+	return write_file(dpath, "compatible", c, clen + sizeof("simple"));
+}
+
+/**
+ * Creates a tree of the given fanout and depth. Every third
+ * node is not a device (has no reg).
+ */
+static
+int make_tree(const char *dpath, int fanout, int depth, uint32_t *next)
+{
+	if(depth == 0)
+		return 0;
+
+	for(int i = 0; i < fanout; ++i) {
+		char path[PATH_MAX];
+		const uint32_t base = (*next)++ * 0x100;
+
+		snprintf(path, sizeof(path), "%s/node@%x", dpath, base);
+		if(mkdir(path, 0755))
+			return 1;
+
+		if(base % 3 && write_dev(path, base, 0x100, base >> 8))
+			return 1;
+
+		if(make_tree(path, fanout, depth - 1, next))
+			return 1;
+	}
+
+	return 0;
+}
+
+static
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+/**
+ * Lists all devices into a string, one per line.
+ */
+static
+char *list_devs(const char *path, int flags, unsigned threads, int *count)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	char *list = NULL;
+	size_t len = 0;
+
+	if(ctx == NULL)
+		return NULL;
+
+	dtree_ctx_set_threads(ctx, threads);
+	if(dtree_ctx_open(ctx, path, flags)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+	*count = 0;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		fprintf(out, "%s 0x%08X 0x%08X", dtree_dev_name(dev),
+				dtree_dev_base(dev), dtree_dev_high(dev));
+
+		for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c)
+			fprintf(out, " %s", *c);
+
+		fputc('\n', out);
+		dtree_ctx_dev_free(ctx, dev);
+		*count += 1;
+	}
+
+	fclose(out);
+
+	if(dtree_ctx_iserror(ctx)) {
+		free(list);
+		list = NULL;
+	}
+
+	dtree_ctx_free(ctx);
+	return list;
+}
+
+void test_same_order(const char *path, int expect)
+{
+	test_start();
+	fprintf(stderr, "Parallel scan of '%s'\n", path);
+
+	int count;
+	char *serial = list_devs(path, 0, 0, &count);
+	fail_on_true(serial == NULL, "Serial traversal has failed");
+	fail_on_true(count != expect, "Unexpected number of devices in serial traversal");
+
+	static const unsigned threads[] = {1, 2, 3, 8, 0};
+
+	for(g_no_uring = 0; g_no_uring < 2; ++g_no_uring) {
+		char *snapshot = list_devs(path, DTREE_OPEN_SNAPSHOT, 0, &count);
+		fail_on_true(snapshot == NULL, "Snapshot load has failed");
+		fail_on_true(strcmp(serial, snapshot), "Snapshot differs from serial traversal");
+		free(snapshot);
+
+		for(size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+			char *parallel = list_devs(path, DTREE_OPEN_PARALLEL, threads[i], &count);
+			fail_on_true(parallel == NULL, "Parallel scan has failed");
+			fail_on_true(count != expect, "Unexpected number of devices in parallel scan");
+			fail_on_true(strcmp(serial, parallel), "Parallel scan differs from serial traversal");
+			free(parallel);
+		}
+	}
+
+	g_no_uring = 0;
+
+	free(serial);
+	test_end();
+}
+
+void test_generated_tree(void)
+{
+	char root[] = "/tmp/dtree_parallel_XXXXXX";
+	uint32_t next = 1;
+
+	if(mkdtemp(root) == NULL) {
+		test_warn("Can not create a temporary directory");
+		return;
+	}
+
+	// 8 + 64 + 512 nodes, every third is not a device
+	if(make_tree(root, 8, 3, &next))
+		test_warn("Can not create the generated tree");
+	else
+		test_same_order(root, 584 - 584 / 3);
+
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+void test_open_invalid(void)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	dtree_ctx_set_threads(ctx, 4);
+	fail_on_success(dtree_ctx_open(ctx, "/xxx/yyy/zzz", DTREE_OPEN_PARALLEL),
+			"Successful when passing non-existent dir: /xxx/yyy/zzz");
+	fail_on_false(dtree_ctx_iserror(ctx), "Error is not indicated by dtree_ctx_iserror()");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+int main(void)
+{
+	test_same_order("device-tree", 8);
+	test_same_order("device-tree.dtb", 8);
+	test_generated_tree();
+	test_open_invalid();
+}
@@ -0,0 +1,191 @@
+/**
+ * dtree_phandle_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Lookups by phandles. The tree must be scanned only
+ * by the first lookup. Opened directories are counted
+ * by wrapping openat() (-Wl,--wrap=openat).
+ */
+
+#define _GNU_SOURCE
+#define TEST_WRAP_OPENAT // counts by g_openat_hook
+
+#include "dtree.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int g_opens = 0;
+
+static
+void count_opens(const char *path)
+{
+	(void) path;
+	g_opens += 1;
+}
+
+/**
+ * Encodes cells as a big-endian property value.
+ */
+static
+void be32_put(unsigned char *p, const uint32_t *cells, size_t n)
+{
+	for(size_t i = 0; i < n; ++i) {
+		p[4 * i + 0] = cells[i] >> 24;
+		p[4 * i + 1] = cells[i] >> 16;
+		p[4 * i + 2] = cells[i] >> 8;
+		p[4 * i + 3] = cells[i];
+	}
+}
+
+void test_byphandle(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "Phandles of '%s' (flags %d)\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	// the iterator is not affected
+	struct dtree_dev_t *first = dtree_ctx_next(ctx);
+	fail_on_true(first == NULL, "No device to iterate");
+
+	struct dtree_dev_t *dev = dtree_ctx_byphandle(ctx, 1);
+	fail_on_true(dev == NULL, "Phandle 1 not found");
+	fail_on_true(strcmp(dtree_dev_name(dev), "interrupt-controller@81800000"),
+			"Invalid device of phandle 1");
+	fail_on_true(dtree_dev_base(dev) != 0x81800000, "Invalid base of phandle 1");
+	dtree_ctx_dev_free(ctx, dev);
+
+	// the index is built, no more scans
+	g_opens = 0;
+
+	dev = dtree_ctx_byphandle(ctx, 3);
+	fail_on_true(dev == NULL, "Phandle 3 (linux,phandle) not found");
+	fail_on_true(strcmp(dtree_dev_name(dev), "timer@83c00000"), "Invalid device of phandle 3");
+	dtree_ctx_dev_free(ctx, dev);
+	fail_on_true(g_opens > 3, "The tree was scanned again");
+
+	// the clock has no reg, it is not a device
+	fail_on_false(dtree_ctx_byphandle(ctx, 2) == NULL, "The clock is a device");
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+
+	fail_on_false(dtree_ctx_byphandle(ctx, 99) == NULL, "Found an unknown phandle");
+	fail_on_true(dtree_ctx_iserror(ctx), "An unknown phandle is an error");
+	fail_on_false(dtree_ctx_byphandle(ctx, 0) == NULL, "Found phandle 0");
+
+	struct dtree_dev_t *second = dtree_ctx_next(ctx);
+	fail_on_true(second == NULL, "No second device to iterate");
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+
+	struct dtree_dev_t *expect = dtree_ctx_next(ctx);
+	dtree_ctx_dev_free(ctx, expect);
+	expect = dtree_ctx_next(ctx);
+	fail_on_true(expect == NULL, "No second device after reset");
+	fail_on_true(strcmp(dtree_dev_name(second), dtree_dev_name(expect)),
+			"The iterator was moved by a lookup");
+
+	dtree_ctx_dev_free(ctx, first);
+	dtree_ctx_dev_free(ctx, second);
+	dtree_ctx_dev_free(ctx, expect);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_byrefs(const char *path, int flags)
+{
+	test_start();
+	fprintf(stderr, "References of '%s' (flags %d)\n", path, flags);
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(ctx, path, flags), dtree_ctx_errstr(ctx));
+
+	struct dtree_dev_t *devs[4];
+	unsigned char refs[32];
+
+	// clocks = <2 0 2 1>, the clock has #clock-cells = <1>
+	static const uint32_t clocks[] = {2, 0, 2, 1};
+	be32_put(refs, clocks, 4);
+
+	size_t n = dtree_ctx_byrefs(ctx, refs, 16, "#clock-cells", devs, 4);
+	fail_on_true(dtree_ctx_iserror(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(n != 2, "Unexpected number of clocks");
+	fail_on_false(devs[0] == NULL && devs[1] == NULL, "The clock is a device");
+
+	// interrupt-parent = <1>, no arguments
+	static const uint32_t parent[] = {1};
+	be32_put(refs, parent, 1);
+
+	n = dtree_ctx_byrefs(ctx, refs, 4, NULL, devs, 4);
+	fail_on_true(n != 1 || devs[0] == NULL, "The interrupt parent not found");
+	fail_on_true(strcmp(dtree_dev_name(devs[0]), "interrupt-controller@81800000"),
+			"Invalid interrupt parent");
+	dtree_ctx_dev_free(ctx, devs[0]);
+
+	// empty entries, counting only
+	static const uint32_t mixed[] = {0, 1, 3, 0};
+	be32_put(refs, mixed, 4);
+
+	n = dtree_ctx_byrefs(ctx, refs, 16, NULL, devs, 0);
+	fail_on_true(n != 4, "References were not counted");
+
+	n = dtree_ctx_byrefs(ctx, refs, 16, NULL, devs, 4);
+	fail_on_true(n != 4, "Unexpected number of references");
+	fail_on_false(devs[0] == NULL && devs[3] == NULL, "An empty entry is a device");
+	fail_on_true(devs[1] == NULL || devs[2] == NULL, "Missing referenced devices");
+	fail_on_true(strcmp(dtree_dev_name(devs[2]), "timer@83c00000"), "Invalid third reference");
+	dtree_ctx_dev_free(ctx, devs[1]);
+	dtree_ctx_dev_free(ctx, devs[2]);
+
+	// errors
+	n = dtree_ctx_byrefs(ctx, refs, 6, NULL, devs, 4);
+	fail_on_false(n == 0 && dtree_ctx_iserror(ctx), "Unaligned list was accepted");
+
+	static const uint32_t unknown[] = {1, 99};
+	be32_put(refs, unknown, 2);
+	n = dtree_ctx_byrefs(ctx, refs, 8, NULL, devs, 4);
+	fail_on_false(n == 0 && dtree_ctx_iserror(ctx), "Unknown phandle was accepted");
+
+	// the interrupt controller has no #clock-cells
+	n = dtree_ctx_byrefs(ctx, refs, 4, "#clock-cells", devs, 4);
+	fail_on_false(n == 0 && dtree_ctx_iserror(ctx), "Missing cells were accepted");
+
+	// the clock takes one argument
+	be32_put(refs, clocks, 1);
+	n = dtree_ctx_byrefs(ctx, refs, 4, "#clock-cells", devs, 4);
+	fail_on_false(n == 0 && dtree_ctx_iserror(ctx), "Truncated arguments were accepted");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_snapshot(void)
+{
+	test_start();
+
+	int err = dtree_open_flags("device-tree", DTREE_OPEN_SNAPSHOT);
+	fail_on_error(err, "Can not open testing device-tree");
+
+	fail_on_false(dtree_byphandle(1) == NULL, "Phandle found in a snapshot");
+	fail_on_false(dtree_iserror(), "Phandle of a snapshot is not an error");
+
+	dtree_close();
+	test_end();
+}
+
+int main(void)
+{
+	g_openat_hook = count_opens;
+
+	test_byphandle("device-tree", 0);
+	test_byphandle("device-tree", DTREE_OPEN_LAZY);
+	test_byphandle("device-tree.dtb", 0);
+
+	test_byrefs("device-tree", 0);
+	test_byrefs("device-tree.dtb", 0);
+
+	test_snapshot();
+}
@@ -0,0 +1,222 @@
+/**
+ * dtree_shared_bench.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Throughput of lookups by the number of reader threads
+ * while a writer publishes a new version every 10 ms.
+ * Readers of a shared snapshot (dtree_ctx_open_shared())
+ * are compared to one context guarded by a mutex.
+ *
+ * Usage: dtree_shared_bench [<device-tree>]
+ * The testing device-tree is used by default.
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUN_MS     300
+#define PUBLISH_MS 10
+#define BATCH      256 // lookups between refreshes
+
+static const char *g_path;
+static dtree_shared_t *g_shared;
+static dtree_ctx_t *g_locked;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_stop;
+
+static
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+void sleep_ms(long ms)
+{
+	const struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * One lookup by address and one by name.
+ */
+static
+int lookup(dtree_ctx_t *ctx, unsigned i)
+{
+	struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x84000000 + (i & 0xFFFF));
+	if(dev != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	dev = dtree_ctx_byname(ctx, "timer@83c00000");
+	if(dev != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	return dtree_ctx_iserror(ctx);
+}
+
+static
+void *shared_reader(void *arg)
+{
+	uint64_t *ops = arg;
+	dtree_ctx_t *ctx = dtree_ctx_new();
+
+	if(ctx == NULL || dtree_ctx_open_shared(ctx, g_shared)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	for(unsigned i = 0; !__atomic_load_n(&g_stop, __ATOMIC_RELAXED); ++i) {
+		if(lookup(ctx, i))
+			break;
+
+		*ops += 1;
+		if(i % BATCH == 0 && dtree_ctx_refresh(ctx))
+			break;
+	}
+
+	dtree_ctx_free(ctx);
+	return NULL;
+}
+
+static
+void *locked_reader(void *arg)
+{
+	uint64_t *ops = arg;
+
+	for(unsigned i = 0; !__atomic_load_n(&g_stop, __ATOMIC_RELAXED); ++i) {
+		pthread_mutex_lock(&g_lock);
+		int err = lookup(g_locked, i);
+		pthread_mutex_unlock(&g_lock);
+
+		if(err)
+			break;
+
+		*ops += 1;
+	}
+
+	return NULL;
+}
+
+static
+dtree_ctx_t *load(void)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+
+	if(ctx == NULL || dtree_ctx_open(ctx, g_path, DTREE_OPEN_SNAPSHOT)) {
+		fprintf(stderr, "Open of '%s' has failed: %s\n", g_path,
+				ctx == NULL? "no memory" : dtree_ctx_errstr(ctx));
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/**
+ * Publishes a new version periodically. The locked context
+ * is replaced under the lock.
+ */
+static
+void writer(int shared)
+{
+	const double end = now() + RUN_MS / 1e3;
+
+	while(now() < end) {
+		sleep_ms(PUBLISH_MS);
+
+		dtree_ctx_t *ctx = load();
+		if(ctx == NULL)
+			break;
+
+		if(shared) {
+			dtree_shared_publish(g_shared, ctx);
+			dtree_ctx_free(ctx);
+			continue;
+		}
+
+		pthread_mutex_lock(&g_lock);
+		dtree_ctx_t *old = g_locked;
+		g_locked = ctx;
+		pthread_mutex_unlock(&g_lock);
+		dtree_ctx_free(old);
+	}
+}
+
+/**
+ * Returns lookups per second of all readers.
+ */
+static
+double run(unsigned threads, int shared)
+{
+	pthread_t tids[threads];
+	uint64_t ops[threads * 8]; // a cache line per reader
+	uint64_t total = 0;
+
+	memset(ops, 0, sizeof(ops));
+	g_stop = 0;
+
+	const double start = now();
+	for(unsigned t = 0; t < threads; ++t)
+		pthread_create(&tids[t], NULL, shared? shared_reader : locked_reader, &ops[t * 8]);
+
+	writer(shared);
+	__atomic_store_n(&g_stop, 1, __ATOMIC_RELAXED);
+
+	for(unsigned t = 0; t < threads; ++t) {
+		pthread_join(tids[t], NULL);
+		total += ops[t * 8];
+	}
+
+	return total / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+	g_path = argc > 1? argv[1] : "device-tree";
+
+	g_shared = dtree_shared_new();
+	dtree_ctx_t *ctx = load();
+
+	if(g_shared == NULL || ctx == NULL || dtree_shared_publish(g_shared, ctx))
+		return 1;
+
+	dtree_ctx_free(ctx);
+	g_locked = load();
+	if(g_locked == NULL)
+		return 1;
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double shared1 = 0;
+	double locked1 = 0;
+
+	printf("%s: %ld CPUs, %d ms per run, a new version every %d ms\n",
+			g_path, cpus, RUN_MS, PUBLISH_MS);
+	printf("readers       shared          (scaling)      mutex           (scaling)\n");
+
+	for(unsigned threads = 1; threads <= cpus || threads <= 2; threads *= 2) {
+		const double shared = run(threads, 1);
+		const double locked = run(threads, 0);
+
+		if(threads == 1) {
+			shared1 = shared;
+			locked1 = locked;
+		}
+
+		printf("%2u thr   %8.2f Mlookup/s (%5.2fx)   %8.2f Mlookup/s (%5.2fx)\n", threads,
+				shared / 1e6, shared / shared1, locked / 1e6, locked / locked1);
+	}
+
+	dtree_ctx_free(g_locked);
+	dtree_shared_free(g_shared);
+	return 0;
+}
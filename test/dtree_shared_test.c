@@ -0,0 +1,250 @@
+/**
+ * dtree_shared_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Readers of a shared snapshot keep their pinned version
+ * while a writer publishes new ones.
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define READERS 4
+#define PUBLISHES 200
+
+static char g_tmp[] = "/tmp/dtree_shared_XXXXXX";
+
+static
+int write_reg(const char *dpath, uint32_t base)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/reg", dpath);
+
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		0, 0, 0x10, 0
+	};
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(reg, 1, sizeof(reg), f);
+	return fclose(f) || wlen != sizeof(reg);
+}
+
+static
+int count_devs(dtree_ctx_t *ctx)
+{
+	struct dtree_dev_t *dev;
+	int count = 0;
+
+	if(dtree_ctx_reset(ctx))
+		return -1;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		dtree_ctx_dev_free(ctx, dev);
+		count += 1;
+	}
+
+	return dtree_ctx_iserror(ctx)? -1 : count;
+}
+
+/**
+ * Loads the tree into a snapshot and publishes it.
+ */
+static
+int publish(dtree_shared_t *sh, const char *path)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	if(ctx == NULL)
+		return -1;
+
+	int err = dtree_ctx_open(ctx, path, DTREE_OPEN_SNAPSHOT)
+	       || dtree_shared_publish(sh, ctx);
+
+	dtree_ctx_free(ctx);
+	return err? -1 : 0;
+}
+
+void test_versions(void)
+{
+	test_start();
+
+	dtree_shared_t *sh = dtree_shared_new();
+	fail_on_true(sh == NULL, "Can not allocate a shared snapshot");
+
+	dtree_ctx_t *reader = dtree_ctx_new();
+	fail_on_true(reader == NULL, "Can not allocate a context");
+	fail_on_false(dtree_ctx_open_shared(reader, sh), "Opened an empty shared snapshot");
+
+	fail_on_true(publish(sh, "device-tree"), "Can not publish the tree");
+	fail_on_true(dtree_ctx_open_shared(reader, sh), dtree_ctx_errstr(reader));
+	fail_on_true(count_devs(reader) != 8, "Unexpected devices of the first version");
+
+	struct dtree_dev_t *old = dtree_ctx_byname(reader, "timer@83c00000");
+	fail_on_true(old == NULL, "No timer@83c00000");
+
+	// the second version has one device
+	fail_on_true(publish(sh, g_tmp), "Can not publish the second version");
+	fail_on_true(count_devs(reader) != 8, "The pinned version has changed");
+
+	dtree_ctx_t *late = dtree_ctx_new();
+	fail_on_true(late == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open_shared(late, sh), dtree_ctx_errstr(late));
+	fail_on_true(count_devs(late) != 1, "A new reader does not get the current version");
+
+	fail_on_true(dtree_ctx_refresh(reader), dtree_ctx_errstr(reader));
+	fail_on_true(count_devs(reader) != 1, "The refreshed reader has an old version");
+	fail_on_true(dtree_ctx_refresh(reader), "Refresh of the current version has failed");
+
+	// the first version is reclaimed, its devices are valid
+	fail_on_false(!strcmp(dtree_dev_name(old), "timer@83c00000"), "The old device was lost");
+	dtree_ctx_dev_free(reader, old);
+
+	dtree_ctx_free(reader);
+	dtree_ctx_free(late);
+	dtree_shared_free(sh);
+	test_end();
+}
+
+void test_not_snapshot(void)
+{
+	test_start();
+
+	dtree_shared_t *sh = dtree_shared_new();
+	fail_on_true(sh == NULL, "Can not allocate a shared snapshot");
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	fail_on_false(dtree_shared_publish(sh, ctx), "Published a closed context");
+
+	fail_on_true(dtree_ctx_open(ctx, "device-tree", 0), dtree_ctx_errstr(ctx));
+	fail_on_false(dtree_shared_publish(sh, ctx), "Published a directory tree");
+	fail_on_false(dtree_ctx_iserror(ctx), "A failed publish is not an error");
+	dtree_ctx_close(ctx);
+
+	// a reader can not publish its version again
+	fail_on_true(publish(sh, "device-tree.dtb"), "Can not publish the blob");
+	fail_on_true(dtree_ctx_open_shared(ctx, sh), dtree_ctx_errstr(ctx));
+	fail_on_false(dtree_shared_publish(sh, ctx), "Published a reader");
+
+	dtree_ctx_free(ctx);
+	dtree_shared_free(sh);
+	test_end();
+}
+
+struct reader_arg {
+	dtree_shared_t *sh;
+	int failed;
+	int versions;
+};
+
+static int g_stop = 0;
+
+static
+void *reader_main(void *arg)
+{
+	struct reader_arg *r = arg;
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	int last = -1;
+
+	if(ctx == NULL || dtree_ctx_open_shared(ctx, r->sh)) {
+		r->failed = 1;
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	while(!__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE)) {
+		const int count = count_devs(ctx);
+		struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x83C00000);
+
+		// either version, never a mixture
+		if((count != 8 || dev == NULL) && (count != 1 || dev != NULL)) {
+			r->failed = 1;
+			break;
+		}
+
+		if(dev != NULL)
+			dtree_ctx_dev_free(ctx, dev);
+
+		if(count != last)
+			r->versions += 1;
+
+		last = count;
+
+		if(dtree_ctx_refresh(ctx)) {
+			r->failed = 1;
+			break;
+		}
+	}
+
+	dtree_ctx_free(ctx);
+	return NULL;
+}
+
+void test_concurrent(void)
+{
+	test_start();
+
+	dtree_shared_t *sh = dtree_shared_new();
+	fail_on_true(sh == NULL, "Can not allocate a shared snapshot");
+	fail_on_true(publish(sh, "device-tree"), "Can not publish the tree");
+
+	pthread_t threads[READERS];
+	struct reader_arg args[READERS];
+
+	g_stop = 0;
+	for(int i = 0; i < READERS; ++i) {
+		args[i] = (struct reader_arg) {sh, 0, 0};
+		fail_on_true(pthread_create(&threads[i], NULL, reader_main, &args[i]),
+				"Can not start a reader");
+	}
+
+	int failed = 0;
+	for(int i = 0; i < PUBLISHES && !failed; ++i)
+		failed = publish(sh, i % 2? "device-tree.dtb" : g_tmp);
+
+	__atomic_store_n(&g_stop, 1, __ATOMIC_RELEASE);
+
+	for(int i = 0; i < READERS; ++i) {
+		pthread_join(threads[i], NULL);
+		fail_on_true(args[i].failed, "A reader has seen an invalid version");
+	}
+
+	fail_on_true(failed, "Can not publish a version");
+	dtree_shared_free(sh);
+	test_end();
+}
+
+int main(void)
+{
+	char path[PATH_MAX];
+
+	if(mkdtemp(g_tmp) == NULL) {
+		test_warn("Can not create a temporary directory");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/dev@1000", g_tmp);
+	if(mkdir(path, 0755) || write_reg(path, 0x1000)) {
+		test_warn("Can not create the tree");
+		return 1;
+	}
+
+	test_versions();
+	test_not_snapshot();
+	test_concurrent();
+
+	char cmd[PATH_MAX + 16];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", g_tmp);
+	return system(cmd) != 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * dtree_snap_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ */
+
+#include "dtree.h"
+#include "test.h"
+#include <string.h>
+
+void test_all_dev(const int expect)
+{
+	test_start();
+
+	struct dtree_dev_t *curr = NULL;
+	int count = 0;
+
+	while((curr = dtree_next())) {
+		printf("DEV '%s' at 0x%08X .. 0x%08X\n", dtree_dev_name(curr),
+				dtree_dev_base(curr), dtree_dev_high(curr));
+		print_compat(curr);
+
+		dtree_dev_free(curr);
+		count += 1;
+	}
+
+	fail_on_true(dtree_iserror(), "An error occured during traversing the snapshot");
+	fail_on_true(count != expect, "Unexpected number of devices traversed");
+
+	test_end();
+}
+
+void test_find_serial(void)
+{
+	test_start();
+
+	struct dtree_dev_t *dev = dtree_byname("serial@84000000");
+	fail_on_true(dev == NULL, "Could not find the device 'serial@84000000'");
+
+	fail_on_false(dtree_dev_base(dev) == 0x84000000, "Invalid base of serial@84000000");
+	fail_on_false(dtree_dev_high(dev) == 0x8400FFFF, "Invalid high of serial@84000000");
+
+	const char **compat = dtree_dev_compat(dev);
+	fail_on_true(compat[0] == NULL || compat[1] == NULL, "Missing compatible entries");
+	fail_on_false(!strcmp(compat[1], "xlnx,xps-uartlite-1.00.a"), "Invalid second compatible entry");
+	fail_on_false(compat[2] == NULL, "Compatible entries are not terminated by NULL");
+
+	dtree_dev_free(dev);
+	test_end();
+}
+
+void test_find_compat(void)
+{
+	test_start();
+
+	struct dtree_dev_t *dev = NULL;
+	int count = 0;
+
+	while((dev = dtree_bycompat("xlnx,xps-uartlite-1.00.a")) != NULL) {
+		count += 1;
+		dtree_dev_free(dev);
+	}
+
+	fail_on_true(count != 2, "Expected two xlnx,xps-uartlite-1.00.a compatible components");
+	test_end();
+}
+
+void test_byname_keeps_iterator(void)
+{
+	test_start();
+
+	struct dtree_dev_t *first  = dtree_next();
+	fail_on_true(first == NULL, "No device in the snapshot");
+
+	struct dtree_dev_t *timer = dtree_byname("timer@83c00000");
+	fail_on_true(timer == NULL, "Could not find the device 'timer@83c00000'");
+	fail_on_false(dtree_dev_base(timer) == 0x83C00000, "Invalid base of timer@83c00000");
+	dtree_dev_free(timer);
+
+	timer = dtree_byname("timer@83c00000");
+	fail_on_true(timer == NULL, "The device 'timer@83c00000' was not found again");
+	dtree_dev_free(timer);
+
+	fail_on_false(dtree_byname("timer") == NULL, "Device 'timer' was found!");
+	fail_on_false(dtree_byname("@not-implemented-device") == NULL,
+			"Device '@not-implemented-device' was found!");
+
+	struct dtree_dev_t *second = dtree_next();
+	fail_on_true(second == NULL, "No second device in the snapshot");
+
+	dtree_reset();
+	dtree_dev_free(dtree_next());
+	struct dtree_dev_t *expect = dtree_next();
+	fail_on_true(expect == NULL, "No second device in the snapshot after reset");
+	fail_on_true(strcmp(dtree_dev_name(second), dtree_dev_name(expect)),
+			"The iterator has been moved by dtree_byname()");
+
+	dtree_dev_free(first);
+	dtree_dev_free(second);
+	dtree_dev_free(expect);
+	test_end();
+}
+
+void test_find_all_keeps_iterator(void)
+{
+	test_start();
+
+	struct dtree_dev_t *first = dtree_next();
+	fail_on_true(first == NULL, "No device in the snapshot");
+
+	struct dtree_dev_t **devs = dtree_bycompat_all("xlnx,xps-uartlite-1.00.a");
+	fail_on_true(devs == NULL, "Could not find any xlnx,xps-uartlite-1.00.a compatible component");
+	fail_on_true(devs[0] == NULL || devs[1] == NULL || devs[2] != NULL,
+			"Expected two xlnx,xps-uartlite-1.00.a compatible components");
+	dtree_devs_free(devs);
+
+	devs = dtree_bycompat_all("simple-bus");
+	fail_on_true(devs == NULL, "Could not find any simple-bus compatible component");
+	fail_on_false(!strcmp(dtree_dev_name(devs[0]), "plb@0"), "The simple-bus is not plb@0");
+	fail_on_false(devs[1] == NULL, "Expected a single simple-bus compatible component");
+	dtree_devs_free(devs);
+
+	fail_on_false(dtree_bycompat_all("xlnx,xps") == NULL, "Partial compatible string was found!");
+
+	struct dtree_dev_t *second = dtree_next();
+	fail_on_true(second == NULL, "No second device in the snapshot");
+
+	dtree_reset();
+	dtree_dev_free(dtree_next());
+	struct dtree_dev_t *expect = dtree_next();
+	fail_on_true(expect == NULL, "No second device in the snapshot after reset");
+	fail_on_true(strcmp(dtree_dev_name(second), dtree_dev_name(expect)),
+			"The iterator has been moved by dtree_bycompat_all()");
+
+	dtree_dev_free(first);
+	dtree_dev_free(second);
+	dtree_dev_free(expect);
+	test_end();
+}
+
+void test_snapshot_of(const char *path)
+{
+	fprintf(stderr, "Snapshot of '%s'\n", path);
+
+	int err = dtree_open_flags(path, DTREE_OPEN_SNAPSHOT);
+	halt_on_error(err, "Can not open testing device-tree as a snapshot");
+
+	test_all_dev(8);
+	dtree_reset();
+
+	test_all_dev(8);
+	dtree_reset();
+
+	test_find_serial();
+	dtree_reset();
+
+	test_find_compat();
+	dtree_reset();
+
+	test_byname_keeps_iterator();
+	dtree_reset();
+
+	test_find_all_keeps_iterator();
+	dtree_reset();
+
+	dtree_close();
+}
+
+void test_open_invalid(void)
+{
+	test_start();
+	int err = dtree_open_flags("/xxx/yyy/zzz", DTREE_OPEN_SNAPSHOT);
+	fail_on_success(err, "Successful when passing non-existent dir: /xxx/yyy/zzz");
+	fail_on_false(dtree_iserror(), "Error is not indicated by dtree_iserror()");
+	test_end();
+}
+
+int main(void)
+{
+	test_open_invalid();
+	test_snapshot_of("device-tree");
+	test_snapshot_of("device-tree.dtb");
+}
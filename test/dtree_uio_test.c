@@ -0,0 +1,450 @@
+/**
+ * dtree_uio_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * UIO devices are emulated by a fake class directory and plain
+ * files as their nodes. The interrupt semantics of a node (write
+ * of an int32 enables, read of an uint32 blocks and returns the
+ * count of interrupts, poll reports POLLIN) is provided by wrapping
+ * read(), write() and poll() (-Wl,--wrap=...) over a pipe.
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int g_uio_fd = -1;
+static int g_irq[2] = {-1, -1};
+static uint32_t g_count = 0;
+static int g_arms = 0;
+
+ssize_t __real_read(int fd, void *buf, size_t len);
+ssize_t __real_write(int fd, const void *buf, size_t len);
+int __real_poll(struct pollfd *fds, nfds_t n, int timeout);
+
+ssize_t __wrap_read(int fd, void *buf, size_t len)
+{
+	if(fd != g_uio_fd)
+		return __real_read(fd, buf, len);
+
+	if(len != sizeof(uint32_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// blocks until the first interrupt, takes the pending ones
+	char c;
+	if(__real_read(g_irq[0], &c, 1) != 1)
+		return -1;
+
+	g_count += 1;
+
+	struct pollfd pfd = {.fd = g_irq[0], .events = POLLIN};
+	while(__real_poll(&pfd, 1, 0) > 0 && __real_read(g_irq[0], &c, 1) == 1)
+		g_count += 1;
+
+	memcpy(buf, &g_count, sizeof(g_count));
+	return sizeof(g_count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t len)
+{
+	if(fd != g_uio_fd)
+		return __real_write(fd, buf, len);
+
+	int32_t enable;
+	if(len != sizeof(enable)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&enable, buf, sizeof(enable));
+	g_arms += enable == 1;
+	return sizeof(enable);
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t n, int timeout)
+{
+	if(n != 1 || fds[0].fd != g_uio_fd)
+		return __real_poll(fds, n, timeout);
+
+	struct pollfd pfd = {.fd = g_irq[0], .events = fds[0].events};
+	const int rc = __real_poll(&pfd, 1, timeout);
+
+	fds[0].revents = pfd.revents;
+	return rc;
+}
+
+static
+void irq_raise(int n)
+{
+	while(n-- > 0)
+		__real_write(g_irq[1], "i", 1);
+}
+
+static char g_root[] = "/tmp/dtree_uio_test.XXXXXX";
+static char g_class[64];
+static char g_dev[64];
+
+static
+int put(const char *dir, const char *path, const void *data, size_t len)
+{
+	char full[256];
+	snprintf(full, sizeof(full), "%s/%s", dir, path);
+
+	// parent directories
+	for(char *c = full + strlen(dir) + 1; (c = strchr(c, '/')) != NULL; ++c) {
+		*c = '\0';
+		mkdir(full, 0755);
+		*c = '/';
+	}
+
+	const int fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1;
+
+	const int err = __real_write(fd, data, len) != (ssize_t) len;
+	close(fd);
+	return err;
+}
+
+#define put_str(dir, path, s) put((dir), (path), (s), strlen(s))
+
+static
+int uio_create(const char *name, const char *attrs[][2], size_t n)
+{
+	char dir[128];
+	snprintf(dir, sizeof(dir), "%s/%s", g_class, name);
+	mkdir(dir, 0755);
+
+	for(size_t i = 0; i < n; ++i) {
+		// compatible is a NUL separated list
+		const size_t len = strlen(attrs[i][1]) + !strcmp(attrs[i][0], "device/of_node/compatible");
+		if(put(dir, attrs[i][0], attrs[i][1], len))
+			return -1;
+	}
+
+	// the node (two regions)
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", g_dev, name);
+
+	const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -1;
+
+	const int err = ftruncate(fd, 2 * getpagesize());
+	close(fd);
+	return err;
+}
+
+int tree_create(void)
+{
+	static const char *uio0[][2] = {
+		{"name", "uartlite\n"},
+		{"device/of_node/compatible", "xlnx,xps-uartlite-1.00.a"},
+		{"maps/map0/addr", "0x88000000\n"},
+		{"maps/map0/size", "0x1000\n"},
+	};
+	static const char *uio1[][2] = {
+		{"name", "serial\n"},
+		{"maps/map0/addr", "0x84000000\n"},
+		{"maps/map0/size", "0x1000\n"},
+		{"maps/map0/offset", "0x0\n"},
+		{"maps/map1/addr", "0x84002010\n"},
+		{"maps/map1/size", "0x100\n"},
+		{"maps/map1/offset", "0x10\n"},
+	};
+	static const char *uio2[][2] = {
+		{"name", "serial\n"},
+		{"maps/map0/addr", "0x99000000\n"},
+		{"maps/map0/size", "0x1000\n"},
+	};
+	static const char *uio3[][2] = {
+		{"name", "timer\n"},
+	};
+
+	if(mkdtemp(g_root) == NULL)
+		return -1;
+
+	snprintf(g_class, sizeof(g_class), "%s/class", g_root);
+	snprintf(g_dev, sizeof(g_dev), "%s/dev", g_root);
+	mkdir(g_class, 0755);
+	mkdir(g_dev, 0755);
+
+	if(uio_create("uio0", uio0, sizeof(uio0) / sizeof(uio0[0]))
+	|| uio_create("uio1", uio1, sizeof(uio1) / sizeof(uio1[0]))
+	|| uio_create("uio2", uio2, sizeof(uio2) / sizeof(uio2[0]))
+	|| uio_create("uio3", uio3, sizeof(uio3) / sizeof(uio3[0])))
+		return -1;
+
+	// not a UIO device
+	put_str(g_class, "power/x", "");
+	return 0;
+}
+
+void tree_remove(void)
+{
+	char cmd[128];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", g_root);
+	if(system(cmd))
+		fprintf(stderr, "Can not remove %s\n", g_root);
+}
+
+static
+dtree_uio_t *uio_of(const char *name)
+{
+	dtree_reset();
+
+	struct dtree_dev_t *dev = dtree_byname(name);
+	if(dev == NULL)
+		return NULL;
+
+	dtree_uio_t *uio = dtree_uio_open(dev);
+	dtree_dev_free(dev);
+	return uio;
+}
+
+static
+int node_of(const dtree_uio_t *uio, char *name, size_t len)
+{
+	char link[64];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dtree_uio_fd(uio));
+
+	char path[256];
+	const ssize_t plen = readlink(link, path, sizeof(path) - 1);
+	if(plen < 0)
+		return -1;
+
+	path[plen] = '\0';
+	snprintf(name, len, "%s", strrchr(path, '/') + 1);
+	return 0;
+}
+
+void test_find(void)
+{
+	test_start();
+
+	static const struct {
+		const char *dev;
+		const char *uio;
+	} match[] = {
+		{"serial@84000000", "uio1"}, // by name and address
+		{"serial@88000000", "uio0"}, // by compatible
+		{"timer@83c00000",  "uio3"}, // by name, no regions
+	};
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	for(size_t i = 0; i < sizeof(match) / sizeof(match[0]); ++i) {
+		char name[16];
+
+		dtree_uio_t *uio = uio_of(match[i].dev);
+		fail_on_true(uio == NULL, match[i].dev);
+		fail_on_true(node_of(uio, name, sizeof(name)), "Can not get the node");
+		fail_on_true(strcmp(name, match[i].uio), match[i].dev);
+		dtree_uio_close(uio);
+	}
+
+	fail_on_false(uio_of("debug@84400000") == NULL, "Device without UIO was opened");
+	fail_on_false(dtree_iserror(), "Missing UIO is not an error");
+
+	dtree_close();
+	test_end();
+}
+
+void test_map(void)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	dtree_uio_t *uio = uio_of("serial@84000000");
+	fail_on_true(uio == NULL, "No UIO of serial@84000000");
+
+	struct dtree_map_t *m0 = dtree_uio_map(uio, 0);
+	struct dtree_map_t *m1 = dtree_uio_map(uio, 1);
+	fail_on_true(m0 == NULL || m1 == NULL, "Can not map regions");
+	fail_on_false(dtree_uio_map(uio, 2) == NULL, "Missing region was mapped");
+
+	fail_on_false(m0->addr == 0x84000000 && m0->len == 0x1000, "Invalid region 0");
+	fail_on_false(m1->addr == 0x84002010 && m1->len == 0x100, "Invalid region 1");
+
+	dtree_map_write32(m0, 0x4, 0x11223344);
+	dtree_map_write32(m1, 0x0, 0x55667788);
+
+	// regions stay mapped
+	dtree_uio_close(uio);
+
+	char path[128];
+	snprintf(path, sizeof(path), "%s/uio1", g_dev);
+
+	uint32_t value[2] = {0, 0};
+	const int fd = open(path, O_RDONLY);
+	fail_on_true(fd < 0, "Can not open the node");
+	fail_on_false(pread(fd, &value[0], 4, 0x4) == 4, "Can not read region 0");
+	fail_on_false(pread(fd, &value[1], 4, getpagesize() + 0x10) == 4, "Can not read region 1");
+	close(fd);
+
+	fail_on_false(value[0] == 0x11223344, "Region 0 maps elsewhere");
+	fail_on_false(value[1] == 0x55667788, "Region 1 does not respect the offset");
+
+	dtree_map_free(m0);
+	dtree_map_free(m1);
+	dtree_close();
+	test_end();
+}
+
+static
+void *irq_later(void *arg)
+{
+	(void) arg;
+
+	const struct timespec ts = {0, 50 * 1000000};
+	nanosleep(&ts, NULL);
+	irq_raise(1);
+	return NULL;
+}
+
+static
+uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void test_wait(void)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	dtree_uio_t *uio = uio_of("serial@84000000");
+	fail_on_true(uio == NULL, "No UIO of serial@84000000");
+
+	g_uio_fd = dtree_uio_fd(uio);
+	g_arms = 0;
+
+	uint32_t events = 0;
+	fail_on_false(dtree_uio_wait(uio, 10, &events) == 1, "Wait without an interrupt has not timed out");
+	fail_on_false(g_arms == 1, "Interrupt was not enabled");
+
+	pthread_t thread;
+	fail_on_true(pthread_create(&thread, NULL, irq_later, NULL), "Can not start a thread");
+
+	const uint64_t cpu = cpu_ns();
+	const int rc = dtree_uio_wait(uio, 5000, &events);
+	const uint64_t spent = cpu_ns() - cpu;
+	pthread_join(thread, NULL);
+
+	fail_on_false(rc == 0, "Interrupt was not received");
+	fail_on_false(events == 1, "Invalid number of events");
+	fail_on_true(spent > 20 * 1000000, "Waiting has consumed CPU");
+
+	// missed interrupts are counted
+	irq_raise(3);
+	fail_on_false(dtree_uio_wait(uio, 0, &events) == 0, "Pending interrupts were not received");
+	fail_on_false(events == 3, "Missed interrupts were not counted");
+	fail_on_false(g_arms == 3, "Interrupt was not re-armed by each wait");
+
+	g_uio_fd = -1;
+	dtree_uio_close(uio);
+	dtree_close();
+	test_end();
+}
+
+static int g_signalling = 0;
+
+static
+void on_signal(int sig)
+{
+	(void) sig;
+}
+
+static
+void *signal_often(void *arg)
+{
+	const pthread_t target = *(pthread_t *) arg;
+	const struct timespec ts = {0, 5 * 1000000};
+
+	// for much longer than the timeout of the wait
+	for(int i = 0; i < 60 && __atomic_load_n(&g_signalling, __ATOMIC_ACQUIRE); ++i) {
+		pthread_kill(target, SIGUSR1);
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+void test_wait_signals(void)
+{
+	test_start();
+
+	int err = dtree_open("device-tree");
+	fail_on_error(err, "Can not open testing device-tree");
+
+	dtree_uio_t *uio = uio_of("serial@84000000");
+	fail_on_true(uio == NULL, "No UIO of serial@84000000");
+	g_uio_fd = dtree_uio_fd(uio);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	pthread_t self = pthread_self();
+	pthread_t thread;
+
+	__atomic_store_n(&g_signalling, 1, __ATOMIC_RELEASE);
+	fail_on_true(pthread_create(&thread, NULL, signal_often, &self), "Can not start a thread");
+
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const int rc = dtree_uio_wait(uio, 50, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	__atomic_store_n(&g_signalling, 0, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	const long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	fail_on_false(rc == 1, "Wait interrupted by signals has not timed out");
+	fail_on_true(ms > 200, "Signals have extended the timeout");
+
+	g_uio_fd = -1;
+	dtree_uio_close(uio);
+	dtree_close();
+	test_end();
+}
+
+int main(void)
+{
+	if(pipe(g_irq) || tree_create()) {
+		perror("tree_create");
+		return 1;
+	}
+
+	dtree_set_uio(g_class, g_dev);
+
+	test_find();
+	test_map();
+	test_wait();
+	test_wait_signals();
+
+	tree_remove();
+	return 0;
+}
@@ -0,0 +1,367 @@
+/**
+ * dtree_watch_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Incremental refresh of a watched copy of the testing
+ * tree. Reads of properties are counted by wrapping
+ * openat() (-Wl,--wrap=openat).
+ */
+
+#define _GNU_SOURCE
+#define TEST_WRAP_OPENAT // counts by g_openat_hook
+
+#include "dtree.h"
+#include "test.h"
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static char g_tmp[] = "/tmp/dtree_watch_XXXXXX";
+static char g_tree[PATH_MAX / 2];
+static char g_overlays[PATH_MAX / 2];
+static int g_props = 0;
+
+static
+void count_props(const char *path)
+{
+	if(!strcmp(path, "reg") || !strcmp(path, "compatible"))
+		g_props += 1;
+}
+
+static
+int write_file(const char *dpath, const char *fname, const void *data, size_t len)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dpath, fname);
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(data, 1, len, f);
+	return fclose(f) || wlen != len;
+}
+
+static
+int write_reg(const char *dpath, uint32_t base)
+{
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		0, 0, 0x10, 0
+	};
+
+	return write_file(dpath, "reg", reg, sizeof(reg));
+}
+
+/**
+ * Lists all devices into a string, one per line.
+ */
+static
+char *list_devs(dtree_ctx_t *ctx, int *count)
+{
+	char *list = NULL;
+	size_t len = 0;
+
+	FILE *out = open_memstream(&list, &len);
+	struct dtree_dev_t *dev;
+	*count = 0;
+
+	while((dev = dtree_ctx_next(ctx)) != NULL) {
+		fprintf(out, "%s 0x%08X 0x%08X", dtree_dev_name(dev),
+				dtree_dev_base(dev), dtree_dev_high(dev));
+
+		for(const char **c = dtree_dev_compat(dev); *c != NULL; ++c)
+			fprintf(out, " %s", *c);
+
+		fputc('\n', out);
+		dtree_ctx_dev_free(ctx, dev);
+		*count += 1;
+	}
+
+	fclose(out);
+	return list;
+}
+
+static
+int is_signalled(dtree_ctx_t *ctx)
+{
+	struct pollfd pfd = {.fd = dtree_ctx_refresh_fd(ctx), .events = POLLIN};
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static
+dtree_ctx_t *open_watched(void)
+{
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	if(ctx == NULL)
+		return NULL;
+
+	dtree_ctx_set_overlays(ctx, g_overlays);
+
+	if(dtree_ctx_open(ctx, g_tree, DTREE_OPEN_WATCH)) {
+		dtree_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void test_same_devices(void)
+{
+	test_start();
+
+	dtree_ctx_t *snap = dtree_ctx_new();
+	fail_on_true(snap == NULL, "Can not allocate a context");
+	fail_on_true(dtree_ctx_open(snap, g_tree, DTREE_OPEN_SNAPSHOT), dtree_ctx_errstr(snap));
+
+	dtree_ctx_t *ctx = open_watched();
+	fail_on_true(ctx == NULL, "Can not watch the tree");
+	fail_on_true(is_signalled(ctx), "Signalled without a change");
+
+	int count;
+	int expect_count;
+	char *expect = list_devs(snap, &expect_count);
+	char *list = list_devs(ctx, &count);
+
+	fail_on_true(expect == NULL || list == NULL, "Can not list devices");
+	fail_on_true(count != 8 || count != expect_count, "Unexpected number of devices");
+	fail_on_true(strcmp(expect, list), "Watched devices differ from a snapshot");
+
+	// no change, the same version
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+
+	free(expect);
+	free(list);
+	dtree_ctx_free(snap);
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_changed_node(void)
+{
+	test_start();
+
+	char path[PATH_MAX];
+	dtree_ctx_t *ctx = open_watched();
+	fail_on_true(ctx == NULL, "Can not watch the tree");
+
+	struct dtree_dev_t *old = dtree_ctx_byname(ctx, "timer@83c00000");
+	fail_on_true(old == NULL, "No timer@83c00000");
+
+	snprintf(path, sizeof(path), "%s/plb@0/timer@83c00000", g_tree);
+	fail_on_true(write_reg(path, 0x83D00000), "Can not rewrite reg");
+	fail_on_false(is_signalled(ctx), "Not signalled after a change");
+
+	// served by the old version until refreshed
+	struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x83C00000);
+	fail_on_true(dev == NULL, "The old version is not served");
+	dtree_ctx_dev_free(ctx, dev);
+
+	g_props = 0;
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props > 2, "Other nodes were read again");
+	fail_on_true(is_signalled(ctx), "Signalled after the refresh");
+
+	dev = dtree_ctx_byaddr(ctx, 0x83D00000);
+	fail_on_true(dev == NULL, "The changed reg was not refreshed");
+	fail_on_false(!strcmp(dtree_dev_name(dev), "timer@83c00000"), "Invalid device of the new reg");
+	dtree_ctx_dev_free(ctx, dev);
+
+	// plb@0 spans everything
+	dev = dtree_ctx_byaddr(ctx, 0x83C00000);
+	fail_on_false(dev == NULL || strcmp(dtree_dev_name(dev), "timer@83c00000"),
+			"The old reg is still found");
+	if(dev != NULL)
+		dtree_ctx_dev_free(ctx, dev);
+
+	// devices of the old version are still valid
+	fail_on_false(!strcmp(dtree_dev_name(old), "timer@83c00000"), "The old device was lost");
+	fail_on_false(dtree_dev_base(old) == 0x83C00000, "The old device was changed");
+	dtree_ctx_dev_free(ctx, old);
+
+	fail_on_true(write_reg(path, 0x83C00000), "Can not restore reg");
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_added_removed(void)
+{
+	test_start();
+
+	char path[PATH_MAX];
+	char cmd[PATH_MAX + 16];
+	dtree_ctx_t *ctx = open_watched();
+	fail_on_true(ctx == NULL, "Can not watch the tree");
+
+	snprintf(path, sizeof(path), "%s/plb@0/gpio@85000000", g_tree);
+	fail_on_true(mkdir(path, 0755) || write_reg(path, 0x85000000)
+			|| write_file(path, "compatible", "xlnx,gpio", sizeof("xlnx,gpio")),
+			"Can not add a node");
+
+	// a subtree of the new node
+	snprintf(path, sizeof(path), "%s/plb@0/gpio@85000000/port@85000100", g_tree);
+	fail_on_true(mkdir(path, 0755) || write_reg(path, 0x85000100), "Can not add a subnode");
+
+	g_props = 0;
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props > 4, "Other nodes were read again");
+
+	struct dtree_dev_t *dev = dtree_ctx_byname(ctx, "port@85000100");
+	fail_on_true(dev == NULL, "The new subnode was not found");
+	dtree_ctx_dev_free(ctx, dev);
+
+	dev = dtree_ctx_bycompat(ctx, "xlnx,gpio");
+	fail_on_true(dev == NULL, "The new node was not found");
+	dtree_ctx_dev_free(ctx, dev);
+
+	int count;
+	fail_on_true(dtree_ctx_reset(ctx), "Can not reset");
+	free(list_devs(ctx, &count));
+	fail_on_true(count != 10, "Unexpected number of devices after adding");
+
+	// the new node is watched too
+	fail_on_true(write_reg(path, 0x85000200), "Can not rewrite reg of the subnode");
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+
+	dev = dtree_ctx_byname(ctx, "port@85000100");
+	fail_on_true(dev == NULL || dtree_dev_base(dev) != 0x85000200, "The subnode was not refreshed");
+	dtree_ctx_dev_free(ctx, dev);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s/plb@0/gpio@85000000", g_tree);
+	fail_on_true(system(cmd), "Can not remove the node");
+
+	g_props = 0;
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props != 0, "Nodes were read after a removal");
+	fail_on_false(dtree_ctx_byname(ctx, "port@85000100") == NULL, "The removed subnode was found");
+
+	free(list_devs(ctx, &count));
+	fail_on_true(count != 8, "Unexpected number of devices after removal");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_overlays(void)
+{
+	test_start();
+
+	char path[PATH_MAX];
+	dtree_ctx_t *ctx = open_watched();
+	fail_on_true(ctx == NULL, "Can not watch the tree");
+
+	snprintf(path, sizeof(path), "%s/ov0", g_overlays);
+	fail_on_true(mkdir(path, 0755), "Can not create an overlay");
+	fail_on_false(is_signalled(ctx), "Not signalled by a new overlay");
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+
+	// applying the overlay lists the tree and reads all nodes again
+	snprintf(path, sizeof(path), "%s/plb@0/spi@86000000", g_tree);
+	fail_on_true(mkdir(path, 0755) || write_reg(path, 0x86000000), "Can not add a node");
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+
+	snprintf(path, sizeof(path), "%s/ov0", g_overlays);
+	fail_on_true(write_file(path, "path", "/dev/null", sizeof("/dev/null")), "Can not apply the overlay");
+	fail_on_false(is_signalled(ctx), "Not signalled by an applied overlay");
+
+	g_props = 0;
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props <= 2, "Known nodes were not read by an overlay");
+
+	struct dtree_dev_t *dev = dtree_ctx_byaddr(ctx, 0x86000000);
+	fail_on_true(dev == NULL, "The node of the overlay was not found");
+	dtree_ctx_dev_free(ctx, dev);
+
+	snprintf(path, sizeof(path), "%s/plb@0/spi@86000000", g_tree);
+	char cmd[PATH_MAX + 16];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+	fail_on_true(system(cmd), "Can not remove the node");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_overlays_existing(void)
+{
+	test_start();
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/ov1", g_overlays);
+	fail_on_true(mkdir(path, 0755), "Can not create an overlay");
+
+	dtree_ctx_t *ctx = open_watched();
+	fail_on_true(ctx == NULL, "Can not watch the tree");
+	fail_on_true(is_signalled(ctx), "Signalled without a change");
+
+	// the item was created before open
+	fail_on_true(write_file(path, "path", "/dev/null", sizeof("/dev/null")), "Can not apply the overlay");
+	fail_on_false(is_signalled(ctx), "Not signalled by an existing overlay");
+
+	g_props = 0;
+	fail_on_true(dtree_ctx_refresh(ctx), dtree_ctx_errstr(ctx));
+	fail_on_true(g_props == 0, "Known nodes were not read by an overlay");
+
+	dtree_ctx_free(ctx);
+	test_end();
+}
+
+void test_not_watched(void)
+{
+	test_start();
+
+	dtree_ctx_t *ctx = dtree_ctx_new();
+	fail_on_true(ctx == NULL, "Can not allocate a context");
+
+	fail_on_true(dtree_ctx_refresh_fd(ctx) != -1, "A closed context has a descriptor");
+	fail_on_false(dtree_ctx_refresh(ctx), "A closed context was refreshed");
+
+	fail_on_true(dtree_ctx_open(ctx, g_tree, DTREE_OPEN_SNAPSHOT), dtree_ctx_errstr(ctx));
+	fail_on_false(dtree_ctx_refresh(ctx), "A snapshot was refreshed");
+	dtree_ctx_close(ctx);
+
+	fail_on_false(dtree_ctx_open(ctx, "device-tree.dtb", DTREE_OPEN_WATCH), "A blob is watched");
+	dtree_ctx_free(ctx);
+
+	// the non-reentrant API
+	int err = dtree_open_flags(g_tree, DTREE_OPEN_WATCH);
+	fail_on_error(err, "Can not watch the tree");
+	fail_on_true(dtree_refresh_fd() < 0, "No descriptor to wait for");
+	fail_on_true(dtree_refresh(), dtree_errstr());
+	dtree_close();
+
+	test_end();
+}
+
+int main(void)
+{
+	g_openat_hook = count_props;
+
+	if(mkdtemp(g_tmp) == NULL) {
+		test_warn("Can not create a temporary directory");
+		return 1;
+	}
+
+	char cmd[2 * PATH_MAX];
+	snprintf(g_tree, sizeof(g_tree), "%s/device-tree", g_tmp);
+	snprintf(g_overlays, sizeof(g_overlays), "%s/overlays", g_tmp);
+	snprintf(cmd, sizeof(cmd), "cp -r device-tree %s && mkdir %s", g_tree, g_overlays);
+
+	if(system(cmd)) {
+		test_warn("Can not copy the testing tree");
+		return 1;
+	}
+
+	test_same_devices();
+	test_changed_node();
+	test_added_removed();
+	test_overlays();
+	test_overlays_existing();
+	test_not_watched();
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", g_tmp);
+	return system(cmd) != 0;
+}
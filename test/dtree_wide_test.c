@@ -0,0 +1,161 @@
+/**
+ * dtree_wide_test.c
+ * Copyright (C) 2013 Jan Viktorin
+ *
+ * Scaling of the traversal over a bus with thousands
+ * of children. Directory entries read by the library
+ * are counted by wrapping getdents64()
+ * (-Wl,--wrap=getdents64).
+ */
+
+#define _GNU_SOURCE
+
+#include "dtree.h"
+#include "test.h"
+#include <dirent.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static unsigned long g_readdir = 0;
+
+/**
+ * Layout of entries returned by getdents64().
+ */
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+ssize_t __real_getdents64(int fd, void *buf, size_t len);
+
+ssize_t __wrap_getdents64(int fd, void *buf, size_t len)
+{
+	ssize_t rlen = __real_getdents64(fd, buf, len);
+
+	for(ssize_t off = 0; off < rlen; g_readdir += 1)
+		off += ((struct linux_dirent64 *) ((char *) buf + off))->d_reclen;
+
+	return rlen;
+}
+
+static
+int write_reg(const char *dpath, uint32_t base, uint32_t size)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/reg", dpath);
+
+	const unsigned char reg[8] = {
+		base >> 24, base >> 16, base >> 8, base,
+		size >> 24, size >> 16, size >> 8, size
+	};
+
+	FILE *f = fopen(path, "w");
+	if(f == NULL)
+		return 1;
+
+	size_t wlen = fwrite(reg, 1, sizeof(reg), f);
+	return fclose(f) || wlen != sizeof(reg);
+}
+
+/**
+ * Creates root/bus@0 with the given number of devices.
+ */
+static
+int make_wide_tree(const char *root, int children)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/bus@0", root);
+	if(mkdir(path, 0755) || write_reg(path, 0, 0))
+		return 1;
+
+	for(int i = 0; i < children; ++i) {
+		const uint32_t base = 0x80000000 + i * 0x1000;
+
+		snprintf(path, sizeof(path), "%s/bus@0/dev@%x", root, base);
+		if(mkdir(path, 0755) || write_reg(path, base, 0x1000))
+			return 1;
+	}
+
+	return 0;
+}
+
+static
+int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+/**
+ * Traverses a tree of the given width.
+ * Returns number of directory entries read per device.
+ */
+static
+double traverse_wide(int children)
+{
+	char root[] = "/tmp/dtree_wide_XXXXXX";
+	double per_dev = -1;
+
+	if(mkdtemp(root) == NULL)
+		return -1;
+
+	if(make_wide_tree(root, children))
+		goto clean_and_exit;
+
+	if(dtree_open(root))
+		goto clean_and_exit;
+
+	g_readdir = 0;
+	const clock_t start = clock();
+	struct dtree_dev_t *dev;
+	int count = 0;
+
+	while((dev = dtree_next()) != NULL) {
+		dtree_dev_free(dev);
+		count += 1;
+	}
+
+	const clock_t end = clock();
+	if(!dtree_iserror() && count == children + 1) {
+		per_dev = (double) g_readdir / count;
+		printf("%d children: %lu entries read (%.2f per device), %.3f s\n",
+			children, g_readdir, per_dev, (double) (end - start) / CLOCKS_PER_SEC);
+	}
+
+	dtree_close();
+
+clean_and_exit:
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return per_dev;
+}
+
+void test_linear_scaling(void)
+{
+	test_start();
+
+	const double narrow = traverse_wide(1000);
+	fail_on_true(narrow < 0, "Traversal of 1000 children has failed");
+
+	const double wide = traverse_wide(4000);
+	fail_on_true(wide < 0, "Traversal of 4000 children has failed");
+
+	// constant number of entries per device regardless of the width
+	fail_on_true(wide > narrow * 1.25, "Cost per device grows with the number of siblings");
+
+	test_end();
+}
+
+int main(void)
+{
+	test_linear_scaling();
+}
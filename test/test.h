@@ -56,6 +56,36 @@ void _test_warn(const char *func, const char *file, int lineno, const char *desc
 	if((t) != 0) {test_warn((msg));}
 #define warn_on_false(f, msg)     warn_on_true(!(f), (msg))
 
+#ifdef TEST_WRAP_OPENAT
+#include <fcntl.h>
+#include <stdarg.h>
+
+/**
+ * Called by every openat() of the test (linked with
+ * -Wl,--wrap=openat), eg. to count reads of files.
+ */
+static void (*g_openat_hook)(const char *path);
+
+int __real_openat(int dirfd, const char *path, int flags, ...);
+
+int __wrap_openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if(flags & O_CREAT) {
+		va_list arg;
+		va_start(arg, flags);
+		mode = va_arg(arg, mode_t);
+		va_end(arg);
+	}
+
+	if(g_openat_hook != NULL)
+		g_openat_hook(path);
+
+	return __real_openat(dirfd, path, flags, mode);
+}
+#endif
+
 static inline
 void print_compat(struct dtree_dev_t *dev)
 {